@@ -335,7 +335,7 @@ LUA_API int lua_compare (lua_State *L, int index1, int index2, int op) {
 
 
 LUA_API size_t lua_stringtonumber (lua_State *L, const char *s) {
-  size_t sz = luaO_str2num(s, L->top);
+  size_t sz = luaO_str2num(L, s, L->top);
   if (sz != 0)
     api_incr_top(L);
   return sz;
@@ -465,8 +465,10 @@ LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
 
 LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
   lua_lock(L);
-  setivalue(L->top, n);
+  setivalue(L, L->top, n);
   api_incr_top(L);
+  if (isbigint(L->top - 1))  /* value needed a box? */
+    luaC_checkGC(L);
   lua_unlock(L);
 }
 
@@ -564,6 +566,7 @@ LUA_API void lua_pushboolean (lua_State *L, int b) {
 
 LUA_API void lua_pushlightuserdata (lua_State *L, void *p) {
   lua_lock(L);
+  api_check(L, lightudfits(p), "light userdata address too large");
   setpvalue(L->top, p);
   api_incr_top(L);
   lua_unlock(L);
@@ -635,7 +638,7 @@ LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
     api_incr_top(L);
   }
   else {
-    setivalue(L->top, n);
+    setivalue(L, L->top, n);
     api_incr_top(L);
     luaV_finishget(L, t, L->top - 1, L->top - 1, slot);
   }
@@ -684,7 +687,7 @@ LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
 LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
   Table *t;
   lua_lock(L);
-  t = luaH_new(L);
+  t = luaH_newinline(L, nrec);
   sethvalue(L, L->top, t);
   api_incr_top(L);
   if (narray > 0 || nrec > 0)
@@ -789,7 +792,7 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   if (luaV_fastset(L, t, n, slot, luaH_getint, L->top - 1))
     L->top--;  /* pop value */
   else {
-    setivalue(L->top, n);
+    setivalue(L, L->top, n);
     api_incr_top(L);
     luaV_finishset(L, t, L->top - 1, L->top - 2, slot);
     L->top -= 2;  /* pop value and key */
@@ -800,15 +803,14 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
 
 LUA_API void lua_rawset (lua_State *L, int idx) {
   StkId o;
-  TValue *slot;
+  Table *t;
   lua_lock(L);
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
-  slot = luaH_set(L, hvalue(o), L->top - 2);
-  setobj2t(L, slot, L->top - 1);
-  invalidateTMcache(hvalue(o));
-  luaC_barrierback(L, hvalue(o), L->top-1);
+  t = hvalue(o);
+  luaH_finishset(L, t, L->top - 2, luaH_get(t, L->top - 2), L->top - 1);
+  invalidateTMcache(t);
   L->top -= 2;
   lua_unlock(L);
 }
@@ -837,7 +839,7 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   setpvalue(&k, cast(void *, p));
   slot = luaH_set(L, hvalue(o), &k);
   setobj2t(L, slot, L->top - 1);
-  luaC_barrierback(L, hvalue(o), L->top - 1);
+  luaC_barrierslot(L, hvalue(o), slot, L->top - 1);
   L->top--;
   lua_unlock(L);
 }
@@ -1079,25 +1081,61 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         luaC_checkGC(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
-      if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
+      /* end of cycle? (each generational step is a whole collection) */
+      if (debt > 0 && (g->gckind == KGC_GEN || g->gcstate == GCSpause))
         res = 1;  /* signal it */
       break;
     }
     case LUA_GCSETPAUSE: {
       res = g->gcpause;
       g->gcpause = data;
+      luaC_setpacer(L, 0, 0);  /* back to manual pacing */
       break;
     }
     case LUA_GCSETSTEPMUL: {
       res = g->gcstepmul;
       if (data < 40) data = 40;  /* avoid ridiculous low values (and 0) */
       g->gcstepmul = data;
+      luaC_setpacer(L, 0, 0);  /* back to manual pacing */
       break;
     }
     case LUA_GCISRUNNING: {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCGEN: case LUA_GCINC: {
+      res = (g->gckind == KGC_GEN) ? LUA_GCGEN : LUA_GCINC;  /* old mode */
+      luaC_changemode(L, (what == LUA_GCGEN) ? KGC_GEN : KGC_INC);
+      break;
+    }
+    case LUA_GCSETMINORMUL: {
+      res = g->genminormul;
+      if (data < 1) data = 1;  /* minor collections need some growth */
+      g->genminormul = data;
+      break;
+    }
+    case LUA_GCSETMAJORMUL: {
+      res = g->genmajormul;
+      g->genmajormul = data;
+      break;
+    }
+    case LUA_GCSTEPTIME: {
+      res = g->gcsteptime;
+      if (data < 0) data = 0;  /* no limit */
+      g->gcsteptime = data;
+      break;
+    }
+    case LUA_GCAUTOHEAP: case LUA_GCAUTOCPU: {
+      res = g->gcpacer.target;
+      if (what == LUA_GCAUTOCPU && data > 99)
+        data = 99;  /* leave some time for the program */
+      luaC_setpacer(L, (data > 0) ? what : 0, data);
+      break;
+    }
+    case LUA_GCFREEZE: {
+      luaC_freeze(L);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1105,6 +1143,51 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 }
 
 
+/* convert a time in microseconds to seconds */
+#define tosecs(t)	(cast_num(t) / 1e6)
+
+LUA_API void lua_gcstats (lua_State *L, lua_GCStats *s) {
+  const GCStats *gs;
+  int i;
+  lua_lock(L);
+  gs = &G(L)->gcstats;
+  s->cycles = gs->cycles;
+  s->minors = gs->minors;
+  s->steps = gs->steps;
+  s->finalizers = gs->finalizers;
+  s->marked = gs->lastmarked;
+  s->swept = gs->lastswept;
+  s->propagate = tosecs(gs->time[0]);
+  s->atomic = tosecs(gs->time[1]);
+  s->sweep = tosecs(gs->time[2]);
+  s->callfin = tosecs(gs->time[3]);
+  s->maxstep = tosecs(gs->maxstep);
+  s->maxpause = tosecs(gs->maxpause);
+  for (i = 0; i < LUA_GCHISTSIZE; i++) {
+    s->stephist[i] = gs->stephist[i];
+    s->pausehist[i] = gs->pausehist[i];
+  }
+  lua_unlock(L);
+}
+
+
+LUA_API int lua_openregion (lua_State *L) {
+  int res;
+  lua_lock(L);
+  res = luaC_openregion(L);
+  lua_unlock(L);
+  return res;
+}
+
+
+LUA_API void lua_closeregion (lua_State *L) {
+  lua_lock(L);
+  api_check(L, G(L)->gcregions > 0, "no open region");
+  luaC_closeregion(L);
+  lua_unlock(L);
+}
+
+
 
 /*
 ** miscellaneous functions
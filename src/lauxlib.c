@@ -1005,6 +1005,8 @@ LUALIB_API const char *luaL_gsub (lua_State *L, const char *s, const char *p,
 }
 
 
+#if !defined(LUA_USE_SLABALLOC)
+
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
   (void)ud; (void)osize;  /* not used */
   if (nsize == 0) {
@@ -1015,6 +1017,8 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     return realloc(ptr, nsize);
 }
 
+#endif
+
 
 static int panic (lua_State *L) {
   lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n",
@@ -1023,10 +1027,264 @@ static int panic (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Slab allocator
+** =======================================================
+*/
+
+/*
+** Blocks up to SLABMAXBLOCK bytes come from slabs: chunks of about
+** SLABSIZE bytes cut in blocks of a single size class (a multiple of
+** SLABGRAIN). Lua always gives the size of a block when it frees or
+** resizes it, so blocks need no header. The free blocks of each class
+** form a list, linked through their first word. Larger blocks come from
+** 'realloc'. After a full collection, Lua calls the allocator with
+** 'osize' LUA_ALLOCTRIM; then the slabs with no block in use go back to
+** the system. The heap itself goes away with the last block of the
+** state (its main block).
+*/
+
+#if !defined(SLABSIZE)
+#define SLABSIZE	(16 * 1024)
+#endif
+
+#define SLABGRAIN	16
+#define SLABMAXBLOCK	256
+#define NSLABCLASSES	(SLABMAXBLOCK / SLABGRAIN)
+
+/* size class of a block with 'sz' (> 0) bytes, and size of class 'c' */
+#define slabclass(sz)	(((sz) - 1) / SLABGRAIN)
+#define classsize(c)	(((c) + 1) * SLABGRAIN)
+
+#define slabsmall(sz)	((sz) <= SLABMAXBLOCK)
+
+#define nextblock(b)	(*(void **)(b))
+
+typedef union Slab {
+  size_t nfree;  /* number of free blocks (while trimming) */
+  lua_Number n; double u; void *s; lua_Integer i; long l;  /* alignment */
+} Slab;
+
+#define slabblocks(s)	((char *)((s) + 1))
+
+typedef struct SlabClass {
+  void *avail;  /* list of free blocks */
+  Slab **slabs;  /* all slabs of this class */
+  size_t nslabs;  /* number of slabs */
+  size_t size;  /* size of array 'slabs' */
+} SlabClass;
+
+typedef struct SlabHeap {
+  SlabClass c[NSLABCLASSES];
+  size_t nblocks;  /* number of blocks in use */
+} SlabHeap;
+
+
+static int newslab (SlabClass *sc, size_t size) {
+  size_t n = SLABSIZE / size;  /* number of blocks in a slab */
+  Slab *s;
+  char *b;
+  if (sc->nslabs == sc->size) {  /* grow array of slabs */
+    size_t newsize = (sc->size == 0) ? 4 : 2 * sc->size;
+    Slab **v = (Slab **)realloc(sc->slabs, newsize * sizeof(Slab *));
+    if (v == NULL)
+      return 0;
+    sc->slabs = v;
+    sc->size = newsize;
+  }
+  s = (Slab *)malloc(sizeof(Slab) + n * size);
+  if (s == NULL)
+    return 0;
+  sc->slabs[sc->nslabs++] = s;
+  for (b = slabblocks(s) + n * size; b > slabblocks(s); ) {
+    b -= size;  /* link blocks in order, so that first one is on top */
+    nextblock(b) = sc->avail;
+    sc->avail = b;
+  }
+  return 1;
+}
+
+
+static void *slabget (SlabHeap *h, size_t sz) {
+  SlabClass *sc = &h->c[slabclass(sz)];
+  void *b;
+  if (sc->avail == NULL && !newslab(sc, classsize(slabclass(sz))))
+    return NULL;
+  b = sc->avail;
+  sc->avail = nextblock(b);
+  return b;
+}
+
+
+static void slabput (SlabHeap *h, void *b, size_t sz) {
+  SlabClass *sc = &h->c[slabclass(sz)];
+  nextblock(b) = sc->avail;
+  sc->avail = b;
+}
+
+
+static int cmpslab (const void *a, const void *b) {
+  const char *sa = (const char *)*(Slab *const *)a;
+  const char *sb = (const char *)*(Slab *const *)b;
+  return (sa < sb) ? -1 : (sa > sb);
+}
+
+
+/*
+** Find the slab (in a sorted array) that contains block 'b', whose
+** blocks take 'len' bytes.
+*/
+static Slab *findslab (SlabClass *sc, const char *b, size_t len) {
+  size_t lo = 0, hi = sc->nslabs;
+  while (lo < hi) {  /* find first slab starting after 'b' */
+    size_t m = lo + (hi - lo) / 2;
+    if (slabblocks(sc->slabs[m]) <= b) lo = m + 1;
+    else hi = m;
+  }
+  if (lo > 0 && b < slabblocks(sc->slabs[lo - 1]) + len)
+    return sc->slabs[lo - 1];
+  return NULL;  /* 'b' is not in a slab */
+}
+
+
+/*
+** Free the slabs of a class that have all their blocks free. The free
+** list may also have blocks that are not in any slab (see 'slabrealloc');
+** they go back to the system too.
+*/
+static void trimclass (SlabClass *sc, size_t size) {
+  size_t n = SLABSIZE / size;  /* number of blocks in a slab */
+  size_t i, j;
+  void *b = sc->avail;
+  void *keep = NULL;
+  qsort(sc->slabs, sc->nslabs, sizeof(Slab *), cmpslab);
+  for (i = 0; i < sc->nslabs; i++)
+    sc->slabs[i]->nfree = 0;
+  while (b != NULL) {  /* count free blocks of each slab */
+    void *next = nextblock(b);
+    Slab *s = findslab(sc, (char *)b, n * size);
+    if (s == NULL)
+      free(b);
+    else {
+      s->nfree++;
+      nextblock(b) = keep;
+      keep = b;
+    }
+    b = next;
+  }
+  sc->avail = NULL;
+  while ((b = keep) != NULL) {  /* rebuild free list without empty slabs */
+    keep = nextblock(b);
+    if (findslab(sc, (char *)b, n * size)->nfree < n) {
+      nextblock(b) = sc->avail;
+      sc->avail = b;
+    }
+  }
+  for (i = j = 0; i < sc->nslabs; i++) {  /* free empty slabs */
+    if (sc->slabs[i]->nfree == n)
+      free(sc->slabs[i]);
+    else
+      sc->slabs[j++] = sc->slabs[i];
+  }
+  sc->nslabs = j;
+}
+
+
+static void freeheap (SlabHeap *h) {
+  int c;
+  for (c = 0; c < NSLABCLASSES; c++) {
+    trimclass(&h->c[c], classsize(c));  /* all slabs are empty */
+    free(h->c[c].slabs);
+  }
+  free(h);
+}
+
+
+static void *slabrealloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  SlabHeap *h = (SlabHeap *)ud;
+  void *b;
+  if (ptr == NULL) {  /* new block? ('osize' is its kind) */
+    if (nsize == 0) {
+      if (osize == LUA_ALLOCTRIM) {  /* end of a full collection? */
+        int c;
+        for (c = 0; c < NSLABCLASSES; c++)
+          trimclass(&h->c[c], classsize(c));
+      }
+      return NULL;
+    }
+    b = slabsmall(nsize) ? slabget(h, nsize) : malloc(nsize);
+    if (b != NULL)
+      h->nblocks++;
+    return b;
+  }
+  else if (nsize == 0) {  /* free block */
+    if (slabsmall(osize))
+      slabput(h, ptr, osize);
+    else
+      free(ptr);
+    if (--h->nblocks == 0)  /* state is closed? */
+      freeheap(h);
+    return NULL;
+  }
+  else if (!slabsmall(osize) && !slabsmall(nsize))
+    return realloc(ptr, nsize);
+  else if (slabsmall(osize) && slabsmall(nsize) &&
+           slabclass(osize) == slabclass(nsize))
+    return ptr;  /* block already has the right size */
+  b = slabsmall(nsize) ? slabget(h, nsize) : malloc(nsize);
+  if (b == NULL) {  /* no memory for a new slab? */
+    size_t csize;
+    if (nsize > osize)
+      return NULL;
+    /* Lua assumes that shrinking a block never fails; keep the block
+       out of the slabs (the free list takes it back when it is freed,
+       and then gives it for any size of its class) */
+    csize = classsize(slabclass(nsize));
+    if (!slabsmall(osize))
+      return realloc(ptr, csize);
+    else if ((b = malloc(csize)) == NULL)
+      return NULL;
+  }
+  memcpy(b, ptr, (osize < nsize) ? osize : nsize);
+  if (slabsmall(osize))
+    slabput(h, ptr, osize);
+  else
+    free(ptr);
+  return b;
+}
+
+
+LUALIB_API lua_State *luaL_newslabstate (void) {
+  SlabHeap *h = (SlabHeap *)malloc(sizeof(SlabHeap));
+  lua_State *L;
+  int c;
+  if (h == NULL)
+    return NULL;
+  for (c = 0; c < NSLABCLASSES; c++) {
+    h->c[c].avail = NULL;
+    h->c[c].slabs = NULL;
+    h->c[c].nslabs = h->c[c].size = 0;
+  }
+  h->nblocks = 1;  /* keep the heap while creating the state */
+  L = lua_newstate(slabrealloc, h);
+  if (--h->nblocks == 0)  /* state was not created? */
+    freeheap(h);
+  if (L) lua_atpanic(L, &panic);
+  return L;
+}
+
+/* }====================================================== */
+
+
 LUALIB_API lua_State *luaL_newstate (void) {
+#if defined(LUA_USE_SLABALLOC)
+  return luaL_newslabstate();
+#else
   lua_State *L = lua_newstate(l_alloc, NULL);
   if (L) lua_atpanic(L, &panic);
   return L;
+#endif
 }
 
 
@@ -170,16 +170,117 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+/*
+** Change the collector mode, setting its two parameters when given
+** (zero keeps a parameter), and push the name of the previous mode.
+*/
+static int changegcmode (lua_State *L, int mode, int p1, int p2) {
+  int ex1 = (int)luaL_optinteger(L, 2, 0);
+  int ex2 = (int)luaL_optinteger(L, 3, 0);
+  if (ex1 != 0) lua_gc(L, p1, ex1);
+  if (ex2 != 0) lua_gc(L, p2, ex2);
+  lua_pushstring(L, (lua_gc(L, mode, 0) == LUA_GCGEN) ? "generational"
+                                                      : "incremental");
+  return 1;
+}
+
+
+/* options "stats" and "region" are not 'lua_gc' options */
+#define GCSTATS		(-1)
+#define GCREGION	(-2)
+
+
+static void setcount (lua_State *L, const char *k, size_t v) {
+  lua_pushinteger(L, (lua_Integer)v);
+  lua_setfield(L, -2, k);
+}
+
+
+static void settime (lua_State *L, const char *k, lua_Number v) {
+  lua_pushnumber(L, v);
+  lua_setfield(L, -2, k);
+}
+
+
+static void sethist (lua_State *L, const char *k, const size_t *h) {
+  int i;
+  lua_createtable(L, LUA_GCHISTSIZE, 0);
+  for (i = 0; i < LUA_GCHISTSIZE; i++) {
+    lua_pushinteger(L, (lua_Integer)h[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, k);
+}
+
+
+static int gcstats (lua_State *L) {
+  lua_GCStats s;
+  lua_gcstats(L, &s);
+  lua_createtable(L, 0, 14);
+  setcount(L, "cycles", s.cycles);
+  setcount(L, "minors", s.minors);
+  setcount(L, "steps", s.steps);
+  setcount(L, "finalizers", s.finalizers);
+  setcount(L, "marked", s.marked);
+  setcount(L, "swept", s.swept);
+  settime(L, "propagate", s.propagate);
+  settime(L, "atomic", s.atomic);
+  settime(L, "sweep", s.sweep);
+  settime(L, "callfin", s.callfin);
+  settime(L, "maxstep", s.maxstep);
+  settime(L, "maxpause", s.maxpause);
+  sethist(L, "stephist", s.stephist);
+  sethist(L, "pausehist", s.pausehist);
+  return 1;
+}
+
+
+/*
+** collectgarbage("region", f, ...): call 'f' inside a region (see
+** 'lua_openregion'), closing it even if 'f' raises an error
+*/
+static int gcregion (lua_State *L) {
+  int status;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if (!lua_openregion(L))
+    return luaL_error(L, "regions need the generational mode");
+  status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+  lua_closeregion(L);  /* results (or error) are on the stack */
+  if (status != LUA_OK)
+    return lua_error(L);  /* propagate error */
+  return lua_gettop(L) - 1;  /* return all results */
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "generational", "incremental", "setsteptime",
+    "stats", "auto", "region", "freeze", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC, LUA_GCSTEPTIME, GCSTATS,
+    LUA_GCAUTOHEAP, GCREGION, LUA_GCFREEZE};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
-  int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int ex, res;
+  if (o == GCSTATS)
+    return gcstats(L);
+  else if (o == GCREGION)
+    return gcregion(L);
+  else if (o == LUA_GCAUTOHEAP) {  /* option "auto" */
+    static const char *const kinds[] = {"heap", "cpu", NULL};
+    int kind = luaL_checkoption(L, 3, "heap", kinds);
+    ex = (int)luaL_optinteger(L, 2, 0);
+    res = lua_gc(L, (kind == 0) ? LUA_GCAUTOHEAP : LUA_GCAUTOCPU, ex);
+    lua_pushinteger(L, res);
+    return 1;
+  }
+  else if (o == LUA_GCGEN)
+    return changegcmode(L, o, LUA_GCSETMINORMUL, LUA_GCSETMAJORMUL);
+  else if (o == LUA_GCINC)
+    return changegcmode(L, o, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL);
+  ex = (int)luaL_optinteger(L, 2, 0);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
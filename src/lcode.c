@@ -40,12 +40,12 @@
 ** If expression is a numeric constant, fills 'v' with its value
 ** and returns 1. Otherwise, returns 0.
 */
-static int tonumeral(const expdesc *e, TValue *v) {
+static int tonumeral(FuncState *fs, const expdesc *e, TValue *v) {
   if (hasjumps(e))
     return 0;  /* not a numeral */
   switch (e->k) {
     case VKINT:
-      if (v) setivalue(v, e->u.ival);
+      if (v) setivalue(fs->ls->L, v, e->u.ival);
       return 1;
     case VKFLT:
       if (v) setfltvalue(v, e->u.nval);
@@ -442,7 +442,7 @@ static int addk (FuncState *fs, TValue *key, TValue *v) {
   k = fs->nk;
   /* numerical value does not need GC barrier;
      table has no metatable, so it does not need to invalidate cache */
-  setivalue(idx, k);
+  setivalue(L, idx, k);
   luaM_growvector(L, f->k, k, f->sizek, TValue, MAXARG_Ax, "constants");
   while (oldsize < f->sizek) setnilvalue(&f->k[oldsize++]);
   setobj(L, &f->k[k], v);
@@ -471,7 +471,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 int luaK_intK (FuncState *fs, lua_Integer n) {
   TValue k, o;
   setpvalue(&k, cast(void*, cast(size_t, n)));
-  setivalue(&o, n);
+  setivalue(fs->ls->L, &o, n);
   return addk(fs, &k, &o);
 }
 
@@ -550,6 +550,22 @@ void luaK_setoneret (FuncState *fs, expdesc *e) {
 }
 
 
+/*
+** Code 'R(t)[RK(idx)]' for a table in a register. Short-string and
+** small non-negative integer constant keys go as immediate operands.
+*/
+static int codegettable (FuncState *fs, int t, int idx) {
+  if (ISK(idx)) {
+    TValue *key = &fs->f->k[INDEXK(idx)];
+    if (ttisshrstring(key))
+      return luaK_codeABC(fs, OP_GETFIELD, 0, t, INDEXK(idx));
+    else if (ttisinteger(key) && l_castS2U(ivalue(key)) <= MAXARG_C)
+      return luaK_codeABC(fs, OP_GETINT, 0, t, cast_int(ivalue(key)));
+  }
+  return luaK_codeABC(fs, OP_GETTABLE, 0, t, idx);
+}
+
+
 /*
 ** Ensure that expression 'e' is not a variable.
 */
@@ -565,17 +581,16 @@ void luaK_dischargevars (FuncState *fs, expdesc *e) {
       break;
     }
     case VINDEXED: {
-      OpCode op;
       freereg(fs, e->u.ind.idx);
       if (e->u.ind.vt == VLOCAL) {  /* is 't' in a register? */
         freereg(fs, e->u.ind.t);
-        op = OP_GETTABLE;
+        e->u.info = codegettable(fs, e->u.ind.t, e->u.ind.idx);
       }
       else {
-        lua_assert(e->u.ind.vt == VUPVAL);
-        op = OP_GETTABUP;  /* 't' is in an upvalue */
+        lua_assert(e->u.ind.vt == VUPVAL);  /* 't' is in an upvalue */
+        e->u.info = luaK_codeABC(fs, OP_GETTABUP, 0, e->u.ind.t,
+                                                     e->u.ind.idx);
       }
-      e->u.info = luaK_codeABC(fs, op, 0, e->u.ind.t, e->u.ind.idx);
       e->k = VRELOCABLE;
       break;
     }
@@ -978,7 +993,8 @@ static int validop (int op, TValue *v1, TValue *v2) {
 static int constfolding (FuncState *fs, int op, expdesc *e1,
                                                 const expdesc *e2) {
   TValue v1, v2, res;
-  if (!tonumeral(e1, &v1) || !tonumeral(e2, &v2) || !validop(op, &v1, &v2))
+  if (!tonumeral(fs, e1, &v1) || !tonumeral(fs, e2, &v2) ||
+      !validop(op, &v1, &v2))
     return 0;  /* non-numeric operands or not safe to fold */
   luaO_arith(fs->ls->L, op, &v1, &v2, &res);  /* does operation */
   if (ttisinteger(&res)) {
@@ -1030,6 +1046,44 @@ static void codebinexpval (FuncState *fs, OpCode op,
 }
 
 
+/*
+** Whether 'e' is an integer constant that fits in an 'sC' operand
+*/
+static int isSCint (const expdesc *e) {
+  return (e->k == VKINT && !hasjumps(e) &&
+          l_castS2U(e->u.ival) + MAXARG_sC <= MAXARG_C);
+}
+
+
+/*
+** Emit code for 'e1 + e2', where 'e1' is in a register and 'e2' is an
+** integer constant that fits in an 'sC' operand.
+*/
+static void codeaddi (FuncState *fs, expdesc *e1, expdesc *e2, int line) {
+  int r = e1->u.info;
+  freeexp(fs, e1);
+  e1->u.info = luaK_codeABC(fs, OP_ADDI, 0, r,
+                            cast_int(e2->u.ival) + MAXARG_sC);
+  e1->k = VRELOCABLE;
+  luaK_fixline(fs, line);
+}
+
+
+/*
+** Emit code for an equality test. A comparison with a constant cannot
+** call metamethods (constants are neither tables nor userdata), so
+** its operands can be swapped to use OP_EQK.
+*/
+static int codeeq (FuncState *fs, int cond, int rk1, int rk2) {
+  if (ISK(rk1) && !ISK(rk2))
+    return condjump(fs, OP_EQK, cond, rk2, INDEXK(rk1));
+  else if (!ISK(rk1) && ISK(rk2))
+    return condjump(fs, OP_EQK, cond, rk1, INDEXK(rk2));
+  else
+    return condjump(fs, OP_EQ, cond, rk1, rk2);
+}
+
+
 /*
 ** Emit code for comparisons.
 ** 'e1' was already put in R/K form by 'luaK_infix'.
@@ -1040,8 +1094,12 @@ static void codecomp (FuncState *fs, BinOpr opr, expdesc *e1, expdesc *e2) {
   int rk2 = luaK_exp2RK(fs, e2);
   freeexps(fs, e1, e2);
   switch (opr) {
+    case OPR_EQ: {
+      e1->u.info = codeeq(fs, 1, rk1, rk2);
+      break;
+    }
     case OPR_NE: {  /* '(a ~= b)' ==> 'not (a == b)' */
-      e1->u.info = condjump(fs, OP_EQ, 0, rk1, rk2);
+      e1->u.info = codeeq(fs, 0, rk1, rk2);
       break;
     }
     case OPR_GT: case OPR_GE: {
@@ -1050,7 +1108,7 @@ static void codecomp (FuncState *fs, BinOpr opr, expdesc *e1, expdesc *e2) {
       e1->u.info = condjump(fs, op, 1, rk2, rk1);  /* invert operands */
       break;
     }
-    default: {  /* '==', '<', '<=' use their own opcodes */
+    default: {  /* '<' and '<=' use their own opcodes */
       OpCode op = cast(OpCode, (opr - OPR_EQ) + OP_EQ);
       e1->u.info = condjump(fs, op, 1, rk1, rk2);
       break;
@@ -1102,7 +1160,7 @@ void luaK_infix (FuncState *fs, BinOpr op, expdesc *v) {
     case OPR_MOD: case OPR_POW:
     case OPR_BAND: case OPR_BOR: case OPR_BXOR:
     case OPR_SHL: case OPR_SHR: {
-      if (!tonumeral(v, NULL))
+      if (!tonumeral(fs, v, NULL))
         luaK_exp2RK(fs, v);
       /* else keep numeral, which may be folded with 2nd operand */
       break;
@@ -1157,7 +1215,11 @@ void luaK_posfix (FuncState *fs, BinOpr op,
     case OPR_IDIV: case OPR_MOD: case OPR_POW:
     case OPR_BAND: case OPR_BOR: case OPR_BXOR:
     case OPR_SHL: case OPR_SHR: {
-      if (!constfolding(fs, op + LUA_OPADD, e1, e2))
+      if (constfolding(fs, op + LUA_OPADD, e1, e2))
+        break;  /* done by folding */
+      else if (op == OPR_ADD && e1->k == VNONRELOC && isSCint(e2))
+        codeaddi(fs, e1, e2, line);  /* 'e2' goes as an immediate */
+      else
         codebinexpval(fs, cast(OpCode, op + OP_ADD), e1, e2, line);
       break;
     }
@@ -1179,6 +1241,15 @@ void luaK_fixline (FuncState *fs, int line) {
 }
 
 
+/*
+** Final pass over the code of a function, after all jumps are fixed:
+** rewrite common instruction pairs into superinstructions.
+*/
+void luaK_finish (FuncState *fs) {
+  luaP_fuse(fs->f->code, fs->pc);
+}
+
+
 /*
 ** Emit a SETLIST instruction.
 ** 'base' is register that keeps table;
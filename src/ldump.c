@@ -15,6 +15,7 @@
 #include "lua.h"
 
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lundump.h"
 
@@ -87,9 +88,20 @@ static void DumpString (const TString *s, DumpState *D) {
 }
 
 
+/*
+** Superinstructions and quickened instructions are dumped as their
+** basic opcodes; 'luaU_undump' fuses them again. (Instructions with
+** immediate operands have no official equivalent, so binary chunks
+** use their own format; see 'LUAC_FORMAT'.)
+*/
 static void DumpCode (const Proto *f, DumpState *D) {
+  int i;
   DumpInt(f->sizecode, D);
-  DumpVector(f->code, f->sizecode, D);
+  for (i = 0; i < f->sizecode; i++) {
+    Instruction inst = f->code[i];
+    SET_OPCODE(inst, luaP_basicop(GET_OPCODE(inst)));
+    DumpVar(inst, D);
+  }
 }
 
 
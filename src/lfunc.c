@@ -16,6 +16,7 @@
 
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -104,6 +105,12 @@ Proto *luaF_newproto (lua_State *L) {
   f->p = NULL;
   f->sizep = 0;
   f->code = NULL;
+  f->icache = NULL;
+#if defined(LUA_USE_JIT)
+  f->jit = NULL;
+  f->traces = NULL;
+  f->jitcount = LUAI_JITHOT;
+#endif
   f->cache = NULL;
   f->sizecode = 0;
   f->lineinfo = NULL;
@@ -124,15 +131,31 @@ Proto *luaF_newproto (lua_State *L) {
 
 void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->code, f->sizecode);
+  luaM_freearray(L, f->icache, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+#if defined(LUA_USE_JIT)
+  luaJ_free(L, f);
+#endif
   luaM_free(L, f);
 }
 
 
+/*
+** Create the inline caches of prototype 'f' (see 'luaH_getcached'). Its
+** code must already have its final size.
+*/
+void luaF_newicache (lua_State *L, Proto *f) {
+  int i;
+  f->icache = luaM_newvector(L, f->sizecode, unsigned int);
+  for (i = 0; i < f->sizecode; i++)
+    f->icache[i] = 0;
+}
+
+
 /*
 ** Look for n-th local variable at line 'line' in function 'func'.
 ** Returns NULL if not found.
@@ -11,6 +11,13 @@
 
 
 #include <string.h>
+#include <time.h>
+
+#if defined(LUA_USE_GCTHREAD)
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
 
 #include "lua.h"
 
@@ -67,8 +74,10 @@
 #define makewhite(g,x)	\
  (x->marked = cast_byte((x->marked & maskcolors) | luaC_white(g)))
 
-#define white2gray(x)	resetbits(x->marked, WHITEBITS)
-#define black2gray(x)	resetbit(x->marked, BLACKBIT)
+/* mask to erase all GC bits (colors and age) */
+#define maskgcbits	(maskcolors & ~AGEBITS)
+
+#define white2gray(x)	setmarked(x, getmarked(x) & ~WHITEBITS)
 
 
 #define valiswhite(x)   (iscollectable(x) && iswhite(gcvalue(x)))
@@ -94,6 +103,85 @@
 static void reallymarkobject (global_State *g, GCObject *o);
 
 
+#if defined(LUA_USE_GCTHREAD)
+
+/* collector threads that traverse objects ('g->gcworker') */
+#define GCWMARKER	1	/* the idle-time marker */
+#define GCWPARALLEL	2	/* a worker in a parallel mark */
+
+#define gcworker(g)	((g)->gcworker)
+
+/*
+** turn a white object gray. In a parallel mark, several workers may
+** try to mark the same object; the atomic operation gives it to only
+** one of them. (The other bits of 'marked' are changed only by that
+** owner, and the others only test the white bits, which do not change
+** anymore. As this operation does not change an object that is not
+** white, the owner may change those bits with a load and a store; see
+** 'getmarked'.)
+*/
+#define claimgray(g,o)  ((g)->gcworker == GCWPARALLEL ? \
+	(__atomic_fetch_and(&(o)->marked, cast_byte(~WHITEBITS), \
+	                    __ATOMIC_RELAXED) & WHITEBITS) != 0 : \
+	(white2gray(o), 1))
+
+/* mark open upvalue 'uv' as touched (workers may share it) */
+#define touchupval(uv)	\
+	__atomic_store_n(&(uv)->u.open.touched, 1, __ATOMIC_RELAXED)
+
+/* state of the idle-time marker (see 'Idle-Time Mark') */
+typedef struct GCThread {
+  pthread_mutex_t lock;  /* protects the fields below */
+  pthread_cond_t wake;  /* signals a new cycle, a free core (or the end) */
+  pthread_cond_t free;  /* signals that the marker left the core */
+  pthread_t thread;
+  global_State *g;
+  int incore;  /* true while the program is inside the core */
+  int marking;  /* true while the marker is inside the core */
+  int nwaiting;  /* number of threads waiting to enter the core */
+  int waiting;  /* true when the marker waits for a free core */
+  int stop;  /* true when the marker must finish */
+} GCThread;
+
+
+/* maximum number of gray lists waiting for an idle worker */
+#define MAXSHARED	64
+
+/* a worker of a parallel mark (see 'Parallel Mark') */
+typedef struct GCWorker {
+  global_State g;  /* private copy of the global state */
+  struct GCPool *pool;
+  pthread_t thread;
+} GCWorker;
+
+typedef struct GCPool {
+  pthread_mutex_t lock;
+  pthread_cond_t start;  /* signals a new mark (or the end) */
+  pthread_cond_t work;  /* signals a shared list (or the end of a mark) */
+  pthread_cond_t done;  /* signals that all workers finished a mark */
+  int nworkers;  /* number of workers, including the program */
+  int mark;  /* counts the marks done by the pool */
+  int running;  /* threads still working in current mark */
+  int nidle;  /* workers waiting for a shared list */
+  int markdone;  /* true when there are no gray objects left */
+  int stop;  /* true when the threads must finish */
+  int nshared;  /* number of lists in 'shared' */
+  GCObject *shared[MAXSHARED];  /* gray lists given away by workers */
+  GCWorker *w;  /* workers ('w[0]' is the program) */
+} GCPool;
+
+static void stopmarker (global_State *g);
+static void stoppool (global_State *g);
+
+#else
+
+#define gcworker(g)	0
+#define claimgray(g,o)	(white2gray(o), 1)
+#define touchupval(uv)	((uv)->u.open.touched = 1)
+
+#endif
+
+
 /*
 ** {======================================================
 ** Generic functions
@@ -113,6 +201,25 @@ static void reallymarkobject (global_State *g, GCObject *o);
 #define linkgclist(o,p)	((o)->gclist = (p), (p) = obj2gco(o))
 
 
+/* pointer to the 'gclist' field of a gray object */
+static GCObject **getgclist (GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: return &gco2t(o)->gclist;
+    case LUA_TLCL: return &gco2lcl(o)->gclist;
+    case LUA_TCCL: return &gco2ccl(o)->gclist;
+    case LUA_TTHREAD: return &gco2th(o)->gclist;
+    case LUA_TPROTO: return &gco2p(o)->gclist;
+    default: lua_assert(0); return NULL;
+  }
+}
+
+
+/*
+** link gray object 'o' (of any type with a 'gclist') into list 'p'
+*/
+#define linkobjgclist(o,p)	(*getgclist(o) = (p), (p) = (o))
+
+
 /*
 ** If key is not marked, mark its entry as dead. This allows key to be
 ** collected, but keeps its entry in the table.  A dead node is needed
@@ -132,31 +239,58 @@ static void removeentry (Node *n) {
 /*
 ** tells whether a key or value can be cleared from a weak
 ** table. Non-collectable objects are never removed from weak
-** tables. Strings behave as 'values', so are never removed too. for
-** other objects: if really collected, cannot keep them; for objects
-** being finalized, keep them in keys, but not in values
+** tables. Strings (and boxed integers) behave as 'values', so are never
+** removed too. for other objects: if really collected, cannot keep them;
+** for objects being finalized, keep them in keys, but not in values
 */
 static int iscleared (global_State *g, const TValue *o) {
   if (!iscollectable(o)) return 0;
-  else if (ttisstring(o)) {
-    markobject(g, tsvalue(o));  /* strings are 'values', so are never weak */
+  else if (ttisstring(o) || isbigint(o)) {
+    markobject(g, gcvalue(o));  /* they are 'values', so are never weak */
     return 0;
   }
   else return iswhite(gcvalue(o));
 }
 
 
+/*
+** A frozen object (see 'luaC_freeze') got a reference to an object that
+** is not frozen: from now on, the collector visits it in every cycle,
+** as a root. Like a thread, it stays gray, so that no other barrier
+** stops on it. (Its entry in 'thawed' was reserved when it was frozen.)
+** While marking, it goes to 'grayagain' to be visited in the atomic
+** phase; a userdata has no gray list, so 'atomic' marks its references.
+*/
+static void thaw (global_State *g, GCObject *o) {
+  lua_assert(isfrozen(o) && isblack(o) && g->nthawed < g->sizethawed);
+  black2gray(o);
+  g->thawed[g->nthawed++] = o;
+  if (keepinvariant(g) && o->tt != LUA_TUSERDATA)
+    linkobjgclist(o, g->grayagain);
+}
+
+
 /*
 ** barrier that moves collector forward, that is, mark the white object
 ** being pointed by a black object. (If in sweep phase, clear the black
 ** object to white [sweep it] to avoid other barrier calls for this
-** same object.)
+** same object.) In generational mode, an object pointed by an old one
+** becomes old too. A frozen object is thawed instead.
 */
 void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
   global_State *g = G(L);
+  if (isfrozen(o)) {
+    thaw(g, o);
+    return;
+  }
   lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
-  if (keepinvariant(g))  /* must keep invariant? */
+  if (keepinvariant(g)) {  /* must keep invariant? */
     reallymarkobject(g, v);  /* restore invariant */
+    if (isold(o)) {
+      lua_assert(!isold(v));  /* white object could not be old */
+      setage(v, G_OLD0);  /* restore generational invariant */
+    }
+  }
   else {  /* sweep phase */
     lua_assert(issweepphase(g));
     makewhite(g, o);  /* mark main obj. as white to avoid other barriers */
@@ -164,15 +298,68 @@ void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
 }
 
 
+/*
+** Index of the card with 'slot' in table 't', or -1 if 't' has no
+** cards or 'slot' is not in its array or hash parts.
+*/
+static int cardof (Table *t, const TValue *slot) {
+  const char *p = cast(const char *, slot);
+  size_t i;
+  if (t->cards == NULL || slot == NULL)
+    return -1;
+  if (p >= cast(const char *, t->array) &&
+      p < cast(const char *, t->array + t->sizearray))
+    i = cast(size_t, slot - t->array);
+  else if (p >= cast(const char *, t->node) &&
+           p < cast(const char *, t->node + allocsizenode(t)))
+    i = t->sizearray + cast(size_t, p - cast(const char *, t->node)) /
+                       sizeof(Node);
+  else
+    return -1;  /* shaped part */
+  i /= CARDSIZE;
+  return (i < t->cards->n) ? cast_int(i) : -1;
+}
+
+
 /*
 ** barrier that moves collector backward, that is, mark the black object
-** pointing to a white object as gray again.
+** pointing to a white object as gray again. In generational mode, the
+** (old) table is also touched, so that the next minor collections visit
+** it. (A table touched in the previous cycle is still in 'grayagain'.)
+** In incremental mode, a big table stays black and only gets the card
+** of 'slot' dirty; the table goes to 'grayagain' (once), and the atomic
+** phase traverses only its dirty cards. When the slot is not known, a
+** table already there just turns gray, to be fully traversed. A frozen
+** table is thawed instead.
 */
-void luaC_barrierback_ (lua_State *L, Table *t) {
+void luaC_barrierback_ (lua_State *L, Table *t, const TValue *slot) {
   global_State *g = G(L);
+  if (isfrozen(t)) {
+    thaw(g, obj2gco(t));
+    return;
+  }
   lua_assert(isblack(t) && !isdead(g, t));
+  lua_assert((g->gckind == KGC_GEN) == (isold(t) && getage(t) != G_TOUCHED1));
+  if (t->cards != NULL && g->gckind == KGC_INC && keepinvariant(g)) {
+    int c = cardof(t, slot);
+    if (c >= 0) {  /* a slot in a card? */
+      t->cards->dirty[c] = 1;
+      if (!t->cards->listed) {  /* not in 'grayagain' yet? */
+        t->cards->listed = 1;
+        linkgclist(t, g->grayagain);
+      }
+      return;  /* table stays black */
+    }
+    else if (t->cards->listed) {  /* already in 'grayagain'? */
+      black2gray(t);  /* traverse it all */
+      return;
+    }
+  }
   black2gray(t);  /* make table gray (again) */
-  linkgclist(t, g->grayagain);
+  if (getage(t) != G_TOUCHED2)  /* not already in 'grayagain'? */
+    linkgclist(t, g->grayagain);
+  if (isold(t))  /* generational mode? */
+    setage(t, G_TOUCHED1);  /* touched in current cycle */
 }
 
 
@@ -180,14 +367,18 @@ void luaC_barrierback_ (lua_State *L, Table *t) {
 ** barrier for assignments to closed upvalues. Because upvalues are
 ** shared among closures, it is impossible to know the color of all
 ** closures pointing to it. So, we assume that the object being assigned
-** must be marked.
+** must be marked. For the same reason, in generational mode we assume
+** that some of those closures are old, and so the object becomes old.
 */
 void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
   global_State *g = G(L);
   GCObject *o = gcvalue(uv->v);
   lua_assert(!upisopen(uv));  /* ensured by macro luaC_upvalbarrier */
-  if (keepinvariant(g))
+  if (keepinvariant(g)) {
     markobject(g, o);
+    if (g->gckind == KGC_GEN && !isold(o))
+      setage(o, G_OLD0);
+  }
 }
 
 
@@ -195,6 +386,7 @@ void luaC_fix (lua_State *L, GCObject *o) {
   global_State *g = G(L);
   lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
   white2gray(o);  /* they will be gray forever */
+  setage(o, G_OLD);  /* and old forever */
   g->allgc = o->next;  /* remove object from 'allgc' list */
   o->next = g->fixedgc;  /* link it to 'fixedgc' list */
   g->fixedgc = o;
@@ -227,14 +419,130 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 
 
 /*
-** mark an object. Userdata, strings, and closed upvalues are visited
-** and turned black here. Other objects are marked gray and added
+** Index of the pending entries of ephemeron tables (entries with a
+** white key and a white value), by key. It exists only during the
+** ephemeron convergence. When one of these keys is marked,
+** 'reallymarkobject' moves its entries to the 'ready' list, and the
+** convergence marks their values; so, each entry is visited a bounded
+** number of times, no matter how the tables depend on each other. The
+** index is outside the accounting of the collector (it is freed before
+** the atomic phase ends); if it cannot grow, the convergence falls back
+** to traversing all ephemeron tables until nothing changes.
+*/
+
+typedef struct EphEntry {
+  Node *n;  /* pending entry */
+  int next;  /* next entry in the same bucket (or in 'ready') */
+} EphEntry;
+
+typedef struct EphIndex {
+  EphEntry *e;  /* pending entries */
+  int *bucket;  /* first entry of each bucket (-1 if none) */
+  int size;  /* size of 'e' and of 'bucket' (a power of 2) */
+  int n;  /* number of entries in 'e' */
+  int ready;  /* list of entries whose keys were marked */
+  int failed;  /* true if some entry was not indexed */
+} EphIndex;
+
+
+#define MINEPHINDEX	64
+
+#define ephbucket(o,size)	lmod(point2uint(o) >> 4, size)
+
+#define ephkey(e)	gcvalue(gkey((e)->n))
+
+
+static int growephindex (global_State *g, EphIndex *ei) {
+  int size = (ei->size == 0) ? MINEPHINDEX : ei->size * 2;
+  int *bucket;
+  EphEntry *e;
+  int i;
+  if (size > MAX_INT / 2)
+    return 0;
+  bucket = cast(int *, (*g->frealloc)(g->ud, NULL, 0, size * sizeof(int)));
+  if (bucket == NULL)
+    return 0;
+  e = cast(EphEntry *, (*g->frealloc)(g->ud, ei->e, ei->size * sizeof(EphEntry),
+                                       size * sizeof(EphEntry)));
+  if (e == NULL) {
+    (*g->frealloc)(g->ud, bucket, size * sizeof(int), 0);
+    return 0;
+  }
+  for (i = 0; i < size; i++)
+    bucket[i] = -1;
+  for (i = 0; i < ei->size; i++) {  /* re-insert entries still pending */
+    int k = ei->bucket[i];
+    while (k >= 0) {
+      int next = e[k].next;
+      int b = ephbucket(ephkey(&e[k]), size);
+      e[k].next = bucket[b];
+      bucket[b] = k;
+      k = next;
+    }
+  }
+  if (ei->size > 0)
+    (*g->frealloc)(g->ud, ei->bucket, ei->size * sizeof(int), 0);
+  ei->e = e;
+  ei->bucket = bucket;
+  ei->size = size;
+  return 1;
+}
+
+
+/*
+** Entry 'n' of an ephemeron table must be marked when its key is.
+*/
+static void addpending (global_State *g, Node *n) {
+  EphIndex *ei = g->ephindex;
+  int k, b;
+  if (ei->n == ei->size && (ei->failed || !growephindex(g, ei))) {
+    ei->failed = 1;  /* convergence will have to check all tables */
+    return;
+  }
+  k = ei->n++;
+  b = ephbucket(gcvalue(gkey(n)), ei->size);
+  ei->e[k].n = n;
+  ei->e[k].next = ei->bucket[b];
+  ei->bucket[b] = k;
+}
+
+
+/*
+** Object 'o' is being marked: move the entries with key 'o' to the
+** 'ready' list.
+*/
+static void markedkey (EphIndex *ei, GCObject *o) {
+  int *p;
+  if (ei->size == 0)
+    return;
+  p = &ei->bucket[ephbucket(o, ei->size)];
+  while (*p >= 0) {
+    EphEntry *e = &ei->e[*p];
+    if (ephkey(e) == o) {
+      int k = *p;
+      *p = e->next;  /* remove entry from its bucket */
+      e->next = ei->ready;  /* and link it to 'ready' */
+      ei->ready = k;
+    }
+    else
+      p = &e->next;
+  }
+}
+
+
+/*
+** mark an object. Userdata, strings, boxed integers, shapes, and closed
+** upvalues are visited and turned black here. Other objects are marked gray and added
 ** to appropriate list to be visited (and turned black) later. (Open
-** upvalues are already linked in 'headuv' list.)
+** upvalues are already linked in 'headuv' list.) Shapes never change
+** after created, so they do not need to be revisited.
 */
 static void reallymarkobject (global_State *g, GCObject *o) {
  reentry:
-  white2gray(o);
+  if (!claimgray(g, o))
+    return;  /* another worker got it */
+  if (g->ephindex != NULL)  /* converging ephemerons? */
+    markedkey(g->ephindex, o);
   switch (o->tt) {
     case LUA_TSHRSTR: {
       gray2black(o);
@@ -246,6 +554,13 @@ static void reallymarkobject (global_State *g, GCObject *o) {
       g->GCmemtrav += sizelstring(gco2ts(o)->u.lnglen);
       break;
     }
+#if defined(LUA_NANBOXING)
+    case LUA_TNUMINT: {
+      gray2black(o);
+      g->GCmemtrav += sizeof(BoxedInt);
+      break;
+    }
+#endif
     case LUA_TUSERDATA: {
       TValue uvalue;
       markobjectN(g, gco2u(o)->metatable);  /* mark its metatable */
@@ -258,6 +573,19 @@ static void reallymarkobject (global_State *g, GCObject *o) {
       }
       break;
     }
+    case LUA_TSHAPE: {
+      Shape *s = gco2sh(o);
+      int i;
+      gray2black(o);
+      g->GCmemtrav += sizeshape(s->nkeys);
+      for (i = 0; i < s->nkeys; i++)  /* mark its keys */
+        markobject(g, s->keys[i]);
+      if (s->parent != NULL && iswhite(s->parent)) {  /* mark its parent */
+        o = obj2gco(s->parent);
+        goto reentry;
+      }
+      break;
+    }
     case LUA_TLCL: {
       linkgclist(gco2lcl(o), g->gray);
       break;
@@ -307,7 +635,10 @@ static void markbeingfnz (global_State *g) {
 ** Mark all values stored in marked open upvalues from non-marked threads.
 ** (Values from marked threads were already marked when traversing the
 ** thread.) Remove from the list threads that no longer have upvalues and
-** not-marked threads.
+** not-marked threads. In generational mode, old closures are not
+** traversed, so all these values are kept; moreover, they become old,
+** because the upvalues will be closed (with no barrier) if the thread is
+** collected now.
 */
 static void remarkupvals (global_State *g) {
   lua_State *thread;
@@ -321,10 +652,15 @@ static void remarkupvals (global_State *g) {
       *p = thread->twups;  /* remove thread from the list */
       thread->twups = thread;  /* mark that it is out of list */
       for (uv = thread->openupval; uv != NULL; uv = uv->u.open.next) {
-        if (uv->u.open.touched) {
-          markvalue(g, uv->v);  /* remark upvalue's value */
-          uv->u.open.touched = 0;
+        if (g->gckind == KGC_GEN && iscollectable(uv->v)) {
+          GCObject *o = gcvalue(uv->v);
+          markobject(g, o);
+          if (!isold(o))
+            setage(o, G_OLD0);
         }
+        else if (uv->u.open.touched)
+          markvalue(g, uv->v);  /* remark upvalue's value */
+        uv->u.open.touched = 0;
       }
     }
   }
@@ -332,15 +668,44 @@ static void remarkupvals (global_State *g) {
 
 
 /*
-** mark root set and reset all gray lists, to start a new collection
+** Visit the thawed objects (see 'thaw'), which are roots. Objects with a
+** gray list are linked into list 'l' (if given), to be traversed; the
+** references of userdata are marked at once.
 */
-static void restartcollection (global_State *g) {
+static void markthawed (global_State *g, GCObject **l) {
+  int i;
+  for (i = 0; i < g->nthawed; i++) {
+    GCObject *o = g->thawed[i];
+    lua_assert(isfrozen(o) && isgray(o));
+    if (o->tt == LUA_TUSERDATA) {
+      Udata *u = gco2u(o);
+      TValue uvalue;
+      markobjectN(g, u->metatable);
+      getuservalue(g->mainthread, u, &uvalue);
+      markvalue(g, &uvalue);
+    }
+    else if (l != NULL)
+      linkobjgclist(o, *l);
+  }
+}
+
+
+static void cleargraylists (global_State *g) {
   g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = NULL;
+}
+
+
+/*
+** mark root set and reset all gray lists, to start a new collection
+*/
+static void restartcollection (global_State *g) {
+  cleargraylists(g);
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
   markmt(g);
   markbeingfnz(g);  /* mark any finalizing object left from previous cycle */
+  markthawed(g, &g->gray);
 }
 
 /* }====================================================== */
@@ -352,32 +717,53 @@ static void restartcollection (global_State *g) {
 ** =======================================================
 */
 
+/*
+** In generational mode, a table touched in this cycle may still point to
+** young objects, so it goes back to 'grayagain' to be visited in the next
+** cycle too; a table touched in the previous cycle becomes regular old.
+*/
+static void genlink (global_State *g, Table *h) {
+  lua_assert(isblack(h));
+  if (getage(h) == G_TOUCHED1) {  /* touched in this cycle? */
+    black2gray(h);
+    linkgclist(h, g->grayagain);  /* link it back in 'grayagain' */
+  }
+  else if (getage(h) == G_TOUCHED2)
+    changeage(h, G_TOUCHED2, G_OLD);  /* advance age */
+}
+
+
 /*
 ** Traverse a table with weak values and link it to proper list. During
 ** propagate phase, keep it in 'grayagain' list, to be revisited in the
 ** atomic phase. In the atomic phase, if table has any white value,
-** put it in 'weak' list, to be cleared.
+** put it in 'weak' list, to be cleared; otherwise, keep it in
+** 'grayagain' too, so that a generational collection can find it.
 */
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
-  /* if there is array part, assume it may have white values (it is not
-     worth traversing it now just to check) */
-  int hasclears = (h->sizearray > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      if (!hasclears && iscleared(g, gval(n)))  /* is there a white value? */
-        hasclears = 1;  /* table will have to be cleared */
+  Table *p;
+  /* if there is array part (or a shaped part), assume it may have white
+     values (it is not worth traversing it now just to check) */
+  int hasclears = (tvarraysize(h) > 0 ||
+                   (h->shape != NULL && h->shape->nkeys > 0));
+  for (p = h; p != NULL; p = oldpart(p)) {  /* traverse hash parts */
+    Node *n, *limit = gnodelast(p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        markvalue(g, gkey(n));  /* mark key */
+        if (!hasclears && iscleared(g, gval(n)))  /* a white value? */
+          hasclears = 1;  /* table will have to be cleared */
+      }
     }
   }
-  if (g->gcstate == GCSpropagate)
-    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
-  else if (hasclears)
+  if (g->gcstate == GCSinsideatomic && hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
+  else
+    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
 }
 
 
@@ -395,28 +781,41 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
+  Table *p;
   unsigned int i;
-  /* traverse array part */
-  for (i = 0; i < h->sizearray; i++) {
+  /* traverse array part (a homogeneous one has no objects) */
+  for (i = 0; i < tvarraysize(h); i++) {
     if (valiswhite(&h->array[i])) {
       marked = 1;
       reallymarkobject(g, gcvalue(&h->array[i]));
     }
   }
-  /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
-      hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
-        hasww = 1;  /* white-white entry */
+  if (h->shape != NULL) {  /* traverse shaped part (strings are strong) */
+    for (i = 0; i < h->shape->nkeys; i++) {
+      if (valiswhite(&h->svals[i])) {
+        marked = 1;
+        reallymarkobject(g, gcvalue(&h->svals[i]));
+      }
     }
-    else if (valiswhite(gval(n))) {  /* value not marked yet? */
-      marked = 1;
-      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+  }
+  for (p = h; p != NULL; p = oldpart(p)) {  /* traverse hash parts */
+    Node *n, *limit = gnodelast(p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
+        hasclears = 1;  /* table must be cleared */
+        if (valiswhite(gval(n))) {  /* value not marked yet? */
+          hasww = 1;  /* white-white entry */
+          if (g->ephindex != NULL)  /* converging? */
+            addpending(g, n);  /* mark value when key is marked */
+        }
+      }
+      else if (valiswhite(gval(n))) {  /* value not marked yet? */
+        marked = 1;
+        reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+      }
     }
   }
   /* link table into proper list */
@@ -426,32 +825,52 @@ static int traverseephemeron (global_State *g, Table *h) {
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else
+    linkgclist(h, g->grayagain);  /* keep it gray (see 'traverseweakvalue') */
   return marked;
 }
 
 
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Table *p;
   unsigned int i;
-  for (i = 0; i < h->sizearray; i++)  /* traverse array part */
+  for (i = 0; i < tvarraysize(h); i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      markvalue(g, gval(n));  /* mark value */
+  if (h->shape != NULL) {  /* traverse shaped part */
+    for (i = 0; i < h->shape->nkeys; i++)
+      markvalue(g, &h->svals[i]);
+  }
+  for (p = h; p != NULL; p = oldpart(p)) {  /* traverse hash parts */
+    Node *n, *limit = gnodelast(p);
+    for (n = gnode(p, 0); n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        markvalue(g, gkey(n));  /* mark key */
+        markvalue(g, gval(n));  /* mark value */
+      }
     }
   }
+  genlink(g, h);
+}
+
+
+static void clearcards (Table *h) {
+  Cards *c = h->cards;
+  memset(c->dirty, 0, c->n);
+  c->listed = 0;
 }
 
 
 static lu_mem traversetable (global_State *g, Table *h) {
   const char *weakkey, *weakvalue;
   const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  if (cardlisted(h))  /* traversing all its cards? */
+    clearcards(h);
   markobjectN(g, h->metatable);
+  markobjectN(g, h->shape);  /* shape keeps all keys of a shaped part */
   if (mode && ttisstring(mode) &&  /* is there a weak mode? */
       ((weakkey = strchr(svalue(mode), 'k')),
        (weakvalue = strchr(svalue(mode), 'v')),
@@ -466,8 +885,51 @@ static lu_mem traversetable (global_State *g, Table *h) {
   }
   else  /* not weak */
     traversestrongtable(g, h);
-  return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, allocsizenode(h));
+  return sizetable(h->sizeinline) + sizeof(TValue) * h->sizearray +
+                         sizeof(Node) * cast(size_t, allocsizenode(h)) +
+                         ((h->shape && !isinline(h)) ?
+                            sizeof(TValue) * h->shape->size : 0) +
+                         ((h->rehash) ? sizeof(Node) * h->rehash->left : 0);
+}
+
+
+/*
+** Traverse only the dirty cards of a black table (see
+** 'luaC_barrierback_'). A table that may have become weak since its
+** last traversal is traversed again as a whole.
+*/
+static lu_mem traversecards (global_State *g, Table *h) {
+  Cards *c = h->cards;
+  unsigned int asize = h->sizearray;
+  unsigned int size = asize + allocsizenode(h);
+  unsigned int i, j, n = 0;
+  if (gfasttm(g, h->metatable, TM_MODE) != NULL)  /* maybe weak? */
+    return traversetable(g, h);
+  c->listed = 0;
+  for (i = 0; i < c->n; i++) {
+    if (c->dirty[i]) {
+      unsigned int limit = (i + 1) * CARDSIZE;
+      c->dirty[i] = 0;
+      if (limit > size) limit = size;
+      for (j = i * CARDSIZE; j < limit; j++, n++) {
+        if (j < asize) {  /* array part? */
+          if (h->atype == 0)  /* not homogeneous? */
+            markvalue(g, &h->array[j]);
+        }
+        else {  /* hash part */
+          Node *nd = gnode(h, j - asize);
+          checkdeadkey(nd);
+          if (ttisnil(gval(nd)))  /* entry is empty? */
+            removeentry(nd);  /* remove it */
+          else {
+            markvalue(g, gkey(nd));
+            markvalue(g, gval(nd));
+          }
+        }
+      }
+    }
+  }
+  return sizeof(Table) + sizeof(Node) * n;
 }
 
 
@@ -490,6 +952,7 @@ static int traverseproto (global_State *g, Proto *f) {
   for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
     markobjectN(g, f->locvars[i].varname);
   return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
+                         sizeof(unsigned int) * f->sizecode +
                          sizeof(Proto *) * f->sizep +
                          sizeof(TValue) * f->sizek +
                          sizeof(int) * f->sizelineinfo +
@@ -518,7 +981,7 @@ static lu_mem traverseLclosure (global_State *g, LClosure *cl) {
     UpVal *uv = cl->upvals[i];
     if (uv != NULL) {
       if (upisopen(uv) && g->gcstate != GCSinsideatomic)
-        uv->u.open.touched = 1;  /* can be marked in 'remarkupvals' */
+        touchupval(uv);  /* can be marked in 'remarkupvals' */
       else
         markvalue(g, uv->v);
     }
@@ -545,21 +1008,27 @@ static lu_mem traversethread (global_State *g, lua_State *th) {
       g->twups = th;
     }
   }
-  else if (g->gckind != KGC_EMERGENCY)
-    luaD_shrinkstack(th); /* do not change stack in emergency cycle */
+  else if (!g->gcemergency && !gcworker(g))
+    luaD_shrinkstack(th); /* only the program can change its stacks */
   return (sizeof(lua_State) + sizeof(TValue) * th->stacksize +
           sizeof(CallInfo) * th->nci);
 }
 
 
 /*
-** traverse one gray object, turning it to black (except for threads,
-** which are always gray).
+** traverse one gray object, turning it to black (except for threads
+** and thawed objects, which are always gray).
 */
 static void propagatemark (global_State *g) {
   lu_mem size;
   GCObject *o = g->gray;
-  lua_assert(isgray(o));
+  if (isblack(o) && o->tt == LUA_TTABLE && cardlisted(gco2t(o))) {
+    Table *h = gco2t(o);  /* a black table with dirty cards */
+    g->gray = h->gclist;  /* remove from 'gray' list */
+    g->GCmemtrav += traversecards(g, h);
+    return;
+  }
+  lua_assert(isgray(o) || getage(o) == G_TOUCHED2);
   gray2black(o);
   switch (o->tt) {
     case LUA_TTABLE: {
@@ -596,6 +1065,10 @@ static void propagatemark (global_State *g) {
     }
     default: lua_assert(0); return;
   }
+  if (isfrozen(o) && isblack(o)) {  /* a thawed object? */
+    black2gray(o);  /* it stays gray, like a thread */
+    linkobjgclist(o, g->grayagain);
+  }
   g->GCmemtrav += size;
 }
 
@@ -605,21 +1078,56 @@ static void propagateall (global_State *g) {
 }
 
 
+/*
+** Traverse all ephemeron tables, indexing their pending entries, and
+** then propagate marks until no key of a pending entry is marked
+** anymore. (Ephemeron tables found during the propagation index their
+** entries when traversed.)
+*/
 static void convergeephemerons (global_State *g) {
-  int changed;
-  do {
-    GCObject *w;
-    GCObject *next = g->ephemeron;  /* get ephemeron list */
-    g->ephemeron = NULL;  /* tables may return to this list when traversed */
-    changed = 0;
-    while ((w = next) != NULL) {
-      next = gco2t(w)->gclist;
-      if (traverseephemeron(g, gco2t(w))) {  /* traverse marked some value? */
-        propagateall(g);  /* propagate changes */
-        changed = 1;  /* will have to revisit all ephemeron tables */
+  EphIndex ei;
+  GCObject *w;
+  GCObject *next = g->ephemeron;  /* get ephemeron list */
+  g->ephemeron = NULL;  /* tables may return to this list when traversed */
+  ei.e = NULL; ei.bucket = NULL;
+  ei.size = ei.n = 0;
+  ei.ready = -1;
+  ei.failed = 0;
+  g->ephindex = &ei;
+  while ((w = next) != NULL) {
+    next = gco2t(w)->gclist;
+    traverseephemeron(g, gco2t(w));
+  }
+  for (;;) {
+    propagateall(g);
+    if (ei.ready < 0)  /* no more keys marked? */
+      break;
+    do {  /* mark values of entries whose keys were marked */
+      EphEntry *e = &ei.e[ei.ready];
+      ei.ready = e->next;
+      markvalue(g, gval(e->n));
+    } while (ei.ready >= 0);
+  }
+  g->ephindex = NULL;
+  if (ei.size > 0) {
+    (*g->frealloc)(g->ud, ei.e, ei.size * sizeof(EphEntry), 0);
+    (*g->frealloc)(g->ud, ei.bucket, ei.size * sizeof(int), 0);
+  }
+  if (ei.failed) {  /* index is incomplete? */
+    int changed;
+    do {  /* revisit all ephemeron tables until nothing changes */
+      next = g->ephemeron;
+      g->ephemeron = NULL;
+      changed = 0;
+      while ((w = next) != NULL) {
+        next = gco2t(w)->gclist;
+        if (traverseephemeron(g, gco2t(w))) {  /* marked some value? */
+          propagateall(g);  /* propagate changes */
+          changed = 1;  /* will have to revisit all ephemeron tables */
+        }
       }
-    }
-  } while (changed);
+    } while (changed);
+  }
 }
 
 /* }====================================================== */
@@ -638,14 +1146,16 @@ static void convergeephemerons (global_State *g) {
 */
 static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
-    Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
-        setnilvalue(gval(n));  /* remove value ... */
+    Table *p;
+    for (p = gco2t(l); p != NULL; p = oldpart(p)) {
+      Node *n, *limit = gnodelast(p);
+      for (n = gnode(p, 0); n < limit; n++) {
+        if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
+          setnilvalue(gval(n));  /* remove value ... */
+        }
+        if (ttisnil(gval(n)))  /* is entry empty? */
+          removeentry(n);  /* remove entry from table */
       }
-      if (ttisnil(gval(n)))  /* is entry empty? */
-        removeentry(n);  /* remove entry from table */
     }
   }
 }
@@ -658,17 +1168,27 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
 static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
+    Table *p;
     unsigned int i;
-    for (i = 0; i < h->sizearray; i++) {
+    for (i = 0; i < tvarraysize(h); i++) {
       TValue *o = &h->array[i];
       if (iscleared(g, o))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
-        setnilvalue(gval(n));  /* remove value ... */
-        removeentry(n);  /* and remove entry from table */
+    if (h->shape != NULL) {
+      for (i = 0; i < h->shape->nkeys; i++) {
+        TValue *o = &h->svals[i];
+        if (iscleared(g, o))  /* value was collected? */
+          setnilvalue(o);  /* remove value (its key stays in the shape) */
+      }
+    }
+    for (p = h; p != NULL; p = oldpart(p)) {
+      Node *n, *limit = gnodelast(p);
+      for (n = gnode(p, 0); n < limit; n++) {
+        if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
+          setnilvalue(gval(n));  /* remove value ... */
+          removeentry(n);  /* and remove entry from table */
+        }
       }
     }
   }
@@ -706,6 +1226,14 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     }
     case LUA_TTABLE: luaH_free(L, gco2t(o)); break;
+    case LUA_TSHAPE: {
+      global_State *g = G(L);
+      luaH_unlinkshape(gco2sh(o));
+      /* tables not swept yet may still use it; free it after the sweep */
+      o->next = g->deadshapes;
+      g->deadshapes = o;
+      break;
+    }
     case LUA_TTHREAD: luaE_freethread(L, gco2th(o)); break;
     case LUA_TUSERDATA: luaM_freemem(L, o, sizeudata(gco2u(o))); break;
     case LUA_TSHRSTR:
@@ -716,15 +1244,46 @@ static void freeobj (lua_State *L, GCObject *o) {
       luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
       break;
     }
+#if defined(LUA_NANBOXING)
+    case LUA_TNUMINT: luaM_freemem(L, o, sizeof(BoxedInt)); break;
+#endif
     default: lua_assert(0);
   }
 }
 
 
+/*
+** free shapes found dead by the last sweep
+*/
+static void freedeadshapes (lua_State *L) {
+  global_State *g = G(L);
+  l_mem olddebt = g->GCdebt;
+  while (g->deadshapes != NULL) {
+    GCObject *o = g->deadshapes;
+    g->deadshapes = o->next;
+    luaM_freemem(L, o, sizeshape(gco2sh(o)->nkeys));
+  }
+  g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+  g->gcstats.swept += olddebt - g->GCdebt;
+}
+
+
 #define sweepwholelist(L,p)	sweeplist(L,p,MAX_LUMEM)
 static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count);
 
 
+/*
+** An emergency collection runs inside an allocation, maybe while a boxed
+** integer is held only by a C variable (see 'luaO_setbigint'); so it
+** keeps dead boxes, which the next regular cycle frees.
+*/
+#if defined(LUA_NANBOXING)
+#define keepbox(g,o)	((g)->gcemergency && (o)->tt == LUA_TNUMINT)
+#else
+#define keepbox(g,o)	0
+#endif
+
+
 /*
 ** sweep at most 'count' elements from a list of GCObjects erasing dead
 ** objects, where a dead object is one marked with the old (non current)
@@ -739,12 +1298,12 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
   while (*p != NULL && count-- > 0) {
     GCObject *curr = *p;
     int marked = curr->marked;
-    if (isdeadm(ow, marked)) {  /* is 'curr' dead? */
+    if (isdeadm(ow, marked) && !keepbox(g, curr)) {  /* is 'curr' dead? */
       *p = curr->next;  /* remove 'curr' from list */
       freeobj(L, curr);  /* erase 'curr' */
     }
     else {  /* change mark to 'white' */
-      curr->marked = cast_byte((marked & maskcolors) | white);
+      curr->marked = cast_byte((marked & maskgcbits) | white);
       p = &curr->next;  /* go to next element */
     }
   }
@@ -776,7 +1335,7 @@ static GCObject **sweeptolive (lua_State *L, GCObject **p) {
 ** If possible, shrink string table
 */
 static void checkSizes (lua_State *L, global_State *g) {
-  if (g->gckind != KGC_EMERGENCY) {
+  if (!g->gcemergency) {
     l_mem olddebt = g->GCdebt;
     if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
       luaS_resize(L, g->strt.size / 2);  /* shrink it a little */
@@ -794,6 +1353,8 @@ static GCObject *udata2finalize (global_State *g) {
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
   if (issweepphase(g))
     makewhite(g, o);  /* "sweep" object */
+  else if (getage(o) == G_OLD1)
+    g->firstold1 = o;  /* it is the first OLD1 object in the list */
   return o;
 }
 
@@ -820,6 +1381,7 @@ static void GCTM (lua_State *L, int propagateerrors) {
     setobj2s(L, L->top + 1, &v);  /* ... and its argument */
     L->top += 2;  /* and (next line) call the finalizer */
     L->ci->callstatus |= CIST_FIN;  /* will run a finalizer */
+    g->gcstats.finalizers++;
     status = luaD_pcall(L, dothecall, NULL, savestack(L, L->top - 2), 0);
     L->ci->callstatus &= ~CIST_FIN;  /* not running a finalizer anymore */
     L->allowhook = oldah;  /* restore hooks */
@@ -875,17 +1437,21 @@ static GCObject **findlast (GCObject **p) {
 
 /*
 ** move all unreachable objects (or 'all' objects) that need
-** finalization from list 'finobj' to list 'tobefnz' (to be finalized)
+** finalization from list 'finobj' to list 'tobefnz' (to be finalized).
+** (Old objects cannot be unreachable in a minor collection, so it stops
+** at 'finobjold1', which is NULL in incremental mode.)
 */
 static void separatetobefnz (global_State *g, int all) {
   GCObject *curr;
   GCObject **p = &g->finobj;
   GCObject **lastnext = findlast(&g->tobefnz);
-  while ((curr = *p) != NULL) {  /* traverse all finalizable objects */
+  while ((curr = *p) != g->finobjold1) {  /* traverse finalizable objects */
     lua_assert(tofinalize(curr));
     if (!(iswhite(curr) || all))  /* not being collected? */
       p = &curr->next;  /* don't bother with it */
     else {
+      if (curr == g->finobjsur)  /* removing 'finobjsur'? */
+        g->finobjsur = curr->next;  /* correct it */
       *p = curr->next;  /* remove 'curr' from 'finobj' list */
       curr->next = *lastnext;  /* link at the end of 'tobefnz' list */
       *lastnext = curr;
@@ -895,6 +1461,27 @@ static void separatetobefnz (global_State *g, int all) {
 }
 
 
+/*
+** If pointer 'p' points to 'o', move it to the next element.
+*/
+static void checkpointer (GCObject **p, GCObject *o) {
+  if (o == *p)
+    *p = o->next;
+}
+
+
+/*
+** Correct pointers to objects inside 'allgc' list when
+** object 'o' is being removed from the list.
+*/
+static void correctpointers (global_State *g, GCObject *o) {
+  checkpointer(&g->survival, o);
+  checkpointer(&g->old1, o);
+  checkpointer(&g->reallyold, o);
+  checkpointer(&g->firstold1, o);
+}
+
+
 /*
 ** if object 'o' has a finalizer, remove it from 'allgc' list (must
 ** search the list to find it) and link it in 'finobj' list.
@@ -904,6 +1491,8 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
   if (tofinalize(o) ||                 /* obj. is already marked... */
       gfasttm(g, mt, TM_GC) == NULL)   /* or has no finalizer? */
     return;  /* nothing to be done */
+  else if (isfrozen(o))  /* immortal object? */
+    l_setbit(o->marked, FINALIZEDBIT);  /* finalize it when closing state */
   else {  /* move 'o' to 'finobj' list */
     GCObject **p;
     if (issweepphase(g)) {
@@ -911,6 +1500,8 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
       if (g->sweepgc == &o->next)  /* should not remove 'sweepgc' object */
         g->sweepgc = sweeptolive(L, g->sweepgc);  /* change 'sweepgc' */
     }
+    else
+      correctpointers(g, o);
     /* search for pointer pointing to 'o' */
     for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
     *p = o->next;  /* remove 'o' from 'allgc' list */
@@ -926,86 +1517,1306 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 
 /*
 ** {======================================================
-** GC control
+** Statistics
 ** =======================================================
 */
 
+/*
+** A monotonic clock, in microseconds, for statistics and steps with a
+** time limit. The collector reads it only a few times in each step (at
+** its start and end, and when the collector changes state), so the
+** statistics are cheap enough to be always on.
+*/
+#if defined(LUA_USE_POSIX) && defined(CLOCK_MONOTONIC)
+static l_mem gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(l_mem, ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+#else
+static l_mem gcclock (void) {  /* ISO C only has processor time */
+  return cast(l_mem, clock() * (1000000.0 / CLOCKS_PER_SEC));
+}
+#endif
+
 
 /*
-** Set a reasonable "time" to wait before starting a new GC cycle; cycle
-** will start when memory use hits threshold. (Division by 'estimate'
-** should be OK: it cannot be zero (because Lua cannot even start with
-** less than PAUSEADJ bytes).
+** Add duration 'd' to histogram 'h': bucket 'i' gets durations with
+** 'i' significant bits (that is, below 2^i microseconds).
 */
-static void setpause (global_State *g) {
-  l_mem threshold, debt;
-  l_mem estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
-  lua_assert(estimate > 0);
-  threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
-            ? estimate * g->gcpause  /* no overflow */
-            : MAX_LMEM;  /* overflow; truncate to maximum */
-  debt = gettotalbytes(g) - threshold;
-  luaE_setdebt(g, debt);
+static void addhist (lu_mem *h, l_mem d) {
+  int i = 0;
+  while (d > 0 && i < LUA_GCHISTSIZE - 1) {
+    d >>= 1;
+    i++;
+  }
+  h[i]++;
 }
 
 
 /*
-** Enter first sweep phase.
-** The call to 'sweeplist' tries to make pointer point to an object
-** inside the list (instead of to the header), so that the real sweep do
-** not need to skip objects created between "now" and the start of the
-** real sweep.
+** Charge the time since 't' to the phase of state 'st'. Returns the
+** current time.
 */
-static void entersweep (lua_State *L) {
-  global_State *g = G(L);
-  g->gcstate = GCSswpallgc;
-  lua_assert(g->sweepgc == NULL);
-  g->sweepgc = sweeplist(L, &g->allgc, 1);
+static l_mem chargetime (global_State *g, int st, l_mem t) {
+  l_mem now = gcclock();
+  int phase;
+  switch (st) {
+    case GCSpause: case GCSpropagate: phase = 0; break;
+    case GCSatomic: case GCSinsideatomic: phase = 1; break;
+    case GCScallfin: phase = 3; break;
+    default: phase = 2; break;  /* sweep states */
+  }
+  g->gcstats.time[phase] += now - t;
+  return now;
 }
 
 
-void luaC_freeallobjects (lua_State *L) {
-  global_State *g = G(L);
-  separatetobefnz(g, 1);  /* separate all objects with finalizers */
-  lua_assert(g->finobj == NULL);
-  callallpendingfinalizers(L);
-  lua_assert(g->tobefnz == NULL);
-  g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
-  g->gckind = KGC_NORMAL;
-  sweepwholelist(L, &g->finobj);
-  sweepwholelist(L, &g->allgc);
-  sweepwholelist(L, &g->fixedgc);  /* collect fixed objects */
-  lua_assert(g->strt.nuse == 0);
+static void addpause (global_State *g, l_mem d) {
+  GCStats *s = &g->gcstats;
+  addhist(s->pausehist, d);
+  if (d > s->maxpause) s->maxpause = d;
 }
 
 
-static l_mem atomic (lua_State *L) {
+static void addstep (global_State *g, l_mem d) {
+  GCStats *s = &g->gcstats;
+  s->steps++;
+  addhist(s->stephist, d);
+  if (d > s->maxstep) s->maxstep = d;
+}
+
+
+/*
+** Finish the counts of a cycle (or of a minor collection)
+*/
+static void endcycle (global_State *g, int minor) {
+  GCStats *s = &g->gcstats;
+  if (minor) s->minors++;
+  else s->cycles++;
+  s->lastmarked = s->marked;
+  s->lastswept = s->swept;
+  s->marked = s->swept = 0;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Generational Collector
+** =======================================================
+*/
+
+static void setpause (global_State *g);
+static l_mem atomic (lua_State *L);
+
+
+/*
+** Sweep a list of objects, deleting dead ones and turning
+** the non dead to old (without changing their colors).
+*/
+static void sweep2old (lua_State *L, GCObject **p) {
+  GCObject *curr;
   global_State *g = G(L);
-  l_mem work;
-  GCObject *origweak, *origall;
-  GCObject *grayagain = g->grayagain;  /* save original list */
-  lua_assert(g->ephemeron == NULL && g->weak == NULL);
-  lua_assert(!iswhite(g->mainthread));
-  g->gcstate = GCSinsideatomic;
-  g->GCmemtrav = 0;  /* start counting work */
-  markobject(g, L);  /* mark running thread */
-  /* registry and global metatables may be changed by API */
-  markvalue(g, &g->l_registry);
-  markmt(g);  /* mark global metatables */
-  /* remark occasional upvalues of (maybe) dead threads */
-  remarkupvals(g);
-  propagateall(g);  /* propagate changes */
-  work = g->GCmemtrav;  /* stop counting (do not recount 'grayagain') */
-  g->gray = grayagain;
-  propagateall(g);  /* traverse 'grayagain' list */
-  g->GCmemtrav = 0;  /* restart counting */
-  convergeephemerons(g);
+  while ((curr = *p) != NULL) {
+    if (iswhite(curr) && !keepbox(g, curr)) {  /* is 'curr' dead? */
+      lua_assert(isdead(g, curr));
+      *p = curr->next;  /* remove 'curr' from list */
+      freeobj(L, curr);  /* erase 'curr' */
+    }
+    else {  /* all surviving objects become old */
+      white2gray(curr);  /* (only a kept box can be white) */
+      setage(curr, G_OLD);
+      if (curr->tt == LUA_TTHREAD) {  /* threads must be watched */
+        lua_State *th = gco2th(curr);
+        linkgclist(th, g->grayagain);  /* insert into 'grayagain' list */
+      }
+      else  /* everything else is black */
+        gray2black(curr);
+      p = &curr->next;  /* go to next element */
+    }
+  }
+}
+
+
+/*
+** Sweep for generational mode. Delete dead objects. (Because the
+** collection is not incremental, there are no "new white" objects
+** during the sweep. So, any white object must be dead.) For
+** non-dead objects, advance their ages and clear the color of
+** new objects. (Old objects keep their colors.)
+** The ages of G_TOUCHED1 and G_TOUCHED2 objects cannot be advanced
+** here, because these old-generation objects are usually not swept
+** here. They will all be advanced in 'correctgraylist'. That function
+** will also remove objects turned white here from any gray list.
+*/
+static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
+                            GCObject *limit, GCObject **pfirstold1) {
+  static const lu_byte nextage[] = {
+    G_SURVIVAL,  /* from G_NEW */
+    G_OLD1,      /* from G_SURVIVAL */
+    G_OLD1,      /* from G_OLD0 */
+    G_OLD,       /* from G_OLD1 */
+    G_OLD,       /* from G_OLD (do not change) */
+    G_TOUCHED1,  /* from G_TOUCHED1 (do not change) */
+    G_TOUCHED2   /* from G_TOUCHED2 (do not change) */
+  };
+  int white = luaC_white(g);
+  GCObject *curr;
+  while ((curr = *p) != limit) {
+    if (iswhite(curr)) {  /* is 'curr' dead? */
+      lua_assert(!isold(curr) && isdead(g, curr));
+      *p = curr->next;  /* remove 'curr' from list */
+      freeobj(L, curr);  /* erase 'curr' */
+    }
+    else {  /* correct mark and age */
+      if (getage(curr) == G_NEW) {  /* new objects go back to white */
+        int marked = curr->marked & maskgcbits;  /* erase GC bits */
+        curr->marked = cast_byte(marked | (G_SURVIVAL << AGESHIFT) | white);
+      }
+      else {  /* all other objects will be old, and so keep their color */
+        setage(curr, nextage[getage(curr)]);
+        if (getage(curr) == G_OLD1 && *pfirstold1 == NULL)
+          *pfirstold1 = curr;  /* first OLD1 object in the list */
+      }
+      p = &curr->next;  /* go to next element */
+    }
+  }
+  return p;
+}
+
+
+/*
+** Traverse a list making all its elements white and clearing their
+** age.
+*/
+static void whitelist (global_State *g, GCObject *p) {
+  int white = luaC_white(g);
+  for (; p != NULL; p = p->next)
+    p->marked = cast_byte((p->marked & maskgcbits) | white);
+}
+
+
+/*
+** Correct a list of gray objects. Return pointer to where rest of the
+** list should be linked.
+** Because this correction is done after sweeping, young objects might
+** be turned white and still be in the list. They are only removed.
+** 'TOUCHED1' objects are advanced to 'TOUCHED2' and remain on the list;
+** Non-white threads and thawed objects also remain on the list;
+** 'TOUCHED2' objects become regular old; they and anything else are
+** removed from the list.
+*/
+static GCObject **correctgraylist (GCObject **p) {
+  GCObject *curr;
+  while ((curr = *p) != NULL) {
+    GCObject **next = getgclist(curr);
+    if (iswhite(curr))
+      *p = *next;  /* remove all white objects */
+    else if (getage(curr) == G_TOUCHED1) {  /* touched in this cycle? */
+      lua_assert(isgray(curr));
+      gray2black(curr);  /* make it black, for next barrier */
+      changeage(curr, G_TOUCHED1, G_TOUCHED2);
+      p = next;  /* keep it in the list and go to next element */
+    }
+    else if (curr->tt == LUA_TTHREAD || isfrozen(curr)) {
+      lua_assert(isgray(curr));
+      p = next;  /* keep non-white threads (and thawed objects) on the list */
+    }
+    else {  /* everything else is removed */
+      lua_assert(isold(curr));  /* young objects should be white here */
+      if (getage(curr) == G_TOUCHED2)  /* advance from TOUCHED2... */
+        changeage(curr, G_TOUCHED2, G_OLD);  /* ... to OLD */
+      gray2black(curr);  /* make object black (to be removed) */
+      *p = *next;
+    }
+  }
+  return p;
+}
+
+
+/*
+** Correct all gray lists, coalescing them into 'grayagain'.
+*/
+static void correctgraylists (global_State *g) {
+  GCObject **list = correctgraylist(&g->grayagain);
+  *list = g->weak; g->weak = NULL;
+  list = correctgraylist(list);
+  *list = g->allweak; g->allweak = NULL;
+  list = correctgraylist(list);
+  *list = g->ephemeron; g->ephemeron = NULL;
+  correctgraylist(list);
+}
+
+
+/*
+** Mark black 'OLD1' objects when starting a new young collection.
+** Gray objects are already in some gray list, and so will be visited
+** in the atomic step.
+*/
+static void markold (global_State *g, GCObject *from, GCObject *to) {
+  GCObject *p;
+  for (p = from; p != to; p = p->next) {
+    if (getage(p) == G_OLD1) {
+      lua_assert(!iswhite(p));
+      changeage(p, G_OLD1, G_OLD);  /* now they are old */
+      if (isblack(p)) {
+        black2gray(p);
+        reallymarkobject(g, p);
+      }
+    }
+  }
+}
+
+
+/*
+** Finish a young-generation collection.
+*/
+static void finishgencycle (lua_State *L, global_State *g) {
+  correctgraylists(g);
+  freedeadshapes(L);
+  checkSizes(L, g);
+  g->gcstate = GCSpropagate;  /* skip restart */
+  if (!g->gcemergency)
+    callallpendingfinalizers(L);
+}
+
+
+/*
+** Mark phase of a young collection: mark 'OLD1' objects and then do
+** the atomic step.
+*/
+static void youngmark (lua_State *L, global_State *g) {
+  lua_assert(g->gcstate == GCSpropagate);
+  if (g->firstold1) {  /* are there regular OLD1 objects? */
+    markold(g, g->firstold1, g->reallyold);  /* mark them */
+    g->firstold1 = NULL;  /* no more OLD1 objects (for now) */
+  }
+  markold(g, g->finobj, g->finobjrold);
+  markold(g, g->tobefnz, NULL);
+  g->gcstats.marked += atomic(L);
+}
+
+
+/*
+** Does a young collection. First, mark 'OLD1' objects. Then does the
+** atomic step. Then, sweep all lists and advance pointers. Finally,
+** finish the collection. (For the statistics, all but the finalizers
+** is an atomic pause.)
+*/
+static void youngcollection (lua_State *L, global_State *g) {
+  GCObject **psurvival;  /* to point to first non-dead survival object */
+  GCObject *dummy;  /* dummy out parameter to 'sweepgen' */
+  l_mem t = gcclock();
+  lu_mem before;
+  youngmark(L, g);
+
+  /* sweep nursery and get a pointer to its last live element */
+  g->gcstate = GCSswpallgc;
+  before = gettotalbytes(g);
+  psurvival = sweepgen(L, g, &g->allgc, g->survival, &g->firstold1);
+  /* sweep 'survival' */
+  sweepgen(L, g, psurvival, g->old1, &g->firstold1);
+  g->reallyold = g->old1;
+  g->old1 = *psurvival;  /* 'survival' survivals are old now */
+  g->survival = g->allgc;  /* all news are survivals */
+
+  /* repeat for 'finobj' lists */
+  dummy = NULL;  /* no 'firstold1' optimization for 'finobj' lists */
+  psurvival = sweepgen(L, g, &g->finobj, g->finobjsur, &dummy);
+  /* sweep 'survival' */
+  sweepgen(L, g, psurvival, g->finobjold1, &dummy);
+  g->finobjrold = g->finobjold1;
+  g->finobjold1 = *psurvival;  /* 'survival' survivals are old now */
+  g->finobjsur = g->finobj;  /* all news are survivals */
+
+  sweepgen(L, g, &g->tobefnz, NULL, &dummy);
+  g->gcstats.swept += before - gettotalbytes(g);
+  addpause(g, chargetime(g, GCSatomic, t) - t);
+  t = gcclock();
+  finishgencycle(L, g);
+  chargetime(g, GCScallfin, t);
+  endcycle(g, 1);
+}
+
+
+/*
+** Sweep the young part of a list (up to 'limit') after a young mark,
+** deleting dead objects and turning all survivors old. Threads stay
+** gray (and in 'grayagain'); everything else becomes black, and
+** 'correctgraylists' removes it from any gray list.
+*/
+static void sweepyoung2old (lua_State *L, GCObject **p, GCObject *limit) {
+  GCObject *curr;
+  while ((curr = *p) != limit) {
+    if (iswhite(curr)) {  /* is 'curr' dead? */
+      lua_assert(!isold(curr) && isdead(G(L), curr));
+      *p = curr->next;  /* remove 'curr' from list */
+      freeobj(L, curr);  /* erase 'curr' */
+    }
+    else {
+      setage(curr, G_OLD);
+      if (curr->tt != LUA_TTHREAD)
+        gray2black(curr);
+      p = &curr->next;  /* go to next element */
+    }
+  }
+}
+
+
+/*
+** Does a young collection that turns all survivors old at once, for
+** the end of a region (see 'luaC_closeregion').
+*/
+static void regioncollection (lua_State *L, global_State *g) {
+  l_mem t = gcclock();
+  lu_mem before;
+  youngmark(L, g);
+  g->gcstate = GCSswpallgc;
+  before = gettotalbytes(g);
+  sweepyoung2old(L, &g->allgc, g->reallyold);
+  g->reallyold = g->old1 = g->survival = g->allgc;  /* all are old now */
+  sweepyoung2old(L, &g->finobj, g->finobjrold);
+  g->finobjrold = g->finobjold1 = g->finobjsur = g->finobj;
+  sweepyoung2old(L, &g->tobefnz, NULL);
+  g->gcstats.swept += before - gettotalbytes(g);
+  addpause(g, chargetime(g, GCSatomic, t) - t);
+  t = gcclock();
+  finishgencycle(L, g);
+  chargetime(g, GCScallfin, t);
+  endcycle(g, 1);
+}
+
+
+/*
+** Clears all gray lists, sweeps objects, and prepare sublists to enter
+** generational mode. The sweeps remove dead objects and turn all
+** surviving objects to old. Threads go back to 'grayagain' (including
+** the main thread, which is in no list), and so do thawed objects;
+** everything else is turned black (not in any gray list).
+*/
+static void atomic2gen (lua_State *L, global_State *g) {
+  l_mem t = gcclock();
+  lu_mem before = gettotalbytes(g);
+  cleargraylists(g);
+  setage(g->mainthread, G_OLD);
+  linkgclist(g->mainthread, g->grayagain);
+  markthawed(g, &g->grayagain);  /* thawed objects are watched too */
+  /* sweep all elements making them old */
+  g->gcstate = GCSswpallgc;
+  sweep2old(L, &g->allgc);
+  /* everything alive now is old */
+  g->reallyold = g->old1 = g->survival = g->allgc;
+  g->firstold1 = NULL;  /* there are no OLD1 objects anywhere */
+
+  /* repeat for 'finobj' lists */
+  sweep2old(L, &g->finobj);
+  g->finobjrold = g->finobjold1 = g->finobjsur = g->finobj;
+
+  sweep2old(L, &g->tobefnz);
+  g->gcstats.swept += before - gettotalbytes(g);
+  t = chargetime(g, GCSswpallgc, t);
+
+  g->gckind = KGC_GEN;
+  g->GCestimate = gettotalbytes(g);  /* base for memory control */
+  finishgencycle(L, g);
+  chargetime(g, GCScallfin, t);
+  endcycle(g, 0);
+}
+
+
+/*
+** Set debt for the next minor collection, which will happen when
+** memory grows 'genminormul'%.
+*/
+static void setminordebt (global_State *g) {
+  luaE_setdebt(g, -(cast(l_mem, (gettotalbytes(g) / 100)) * g->genminormul));
+}
+
+
+/*
+** Enter generational mode. Must go until the end of an atomic cycle
+** to ensure that all objects are correctly marked and weak tables
+** are cleared. Then, turn all objects into old and finishes the
+** collection.
+*/
+static void entergen (lua_State *L, global_State *g) {
+  l_mem t;
+  luaC_runtilstate(L, bitmask(GCSpause));  /* prepare to start a new cycle */
+  luaC_runtilstate(L, bitmask(GCSpropagate));  /* start new cycle */
+  t = gcclock();
+  g->GCmemtrav = 0;
+  propagateall(g);
+  g->gcstats.marked += g->GCmemtrav;
+  g->gcstats.marked += atomic(L);
+  addpause(g, chargetime(g, GCSatomic, t) - t);
+  atomic2gen(L, g);
+  setminordebt(g);  /* set debt assuming next cycle will be minor */
+}
+
+
+/*
+** Enter incremental mode. Turn all objects white, make all
+** intermediate lists point to NULL (to avoid invalid pointers),
+** and go to the pause state.
+*/
+static void enterinc (global_State *g) {
+  makewhite(g, g->mainthread);
+  setage(g->mainthread, G_NEW);
+  whitelist(g, g->allgc);
+  g->reallyold = g->old1 = g->survival = g->firstold1 = NULL;
+  whitelist(g, g->finobj);
+  whitelist(g, g->tobefnz);
+  g->finobjrold = g->finobjold1 = g->finobjsur = NULL;
+  g->gcstate = GCSpause;
+  g->gckind = KGC_INC;
+}
+
+
+/*
+** Change collector mode to 'newmode'.
+*/
+void luaC_changemode (lua_State *L, int newmode) {
+  global_State *g = G(L);
+  if (newmode != g->gckind) {
+    if (newmode == KGC_GEN)  /* entering generational mode? */
+      entergen(L, g);
+    else
+      enterinc(g);  /* entering incremental mode */
+  }
+}
+
+
+/*
+** Does a full collection in generational mode.
+*/
+static void fullgen (lua_State *L, global_State *g) {
+  enterinc(g);
+  entergen(L, g);
+}
+
+
+/*
+** Does a generational "step": usually a minor collection, setting the
+** debt to do another one when memory grows 'genminormul'% larger. But
+** when memory has grown 'genmajormul'% since the last major collection
+** (as kept in 'GCestimate'), does a major collection instead. ('GCdebt
+** <= 0' means an explicit step with size zero, which is always minor.)
+*/
+static void genstep (lua_State *L, global_State *g) {
+  lu_mem majorbase = g->GCestimate;  /* memory after last major collection */
+  lu_mem majorinc = (majorbase / 100) * g->genmajormul;
+  if (g->GCdebt > 0 && gettotalbytes(g) > majorbase + majorinc)
+    fullgen(L, g);  /* do a major collection */
+  else {  /* regular case; do a minor collection */
+    youngcollection(L, g);
+    setminordebt(g);
+    g->GCestimate = majorbase;  /* preserve base value */
+  }
+}
+
+
+/*
+** Regions. A region is a scope whose new objects are expected to die
+** together when it ends (e.g., the objects of a request). Objects
+** cannot move (the API hands out pointers to them), so the objects of
+** a region are simply young objects, and closing the (outermost) region
+** does a young collection that frees the dead ones and turns all the
+** survivors (the objects that escaped) old at once, instead of letting
+** them age through the survival stages. Regions need the generational
+** mode; they cannot be opened in the incremental mode (changing modes
+** here would drop the settings of the incremental mode, and entering the
+** generational mode does a full collection). Returns whether the region
+** was opened.
+*/
+int luaC_openregion (lua_State *L) {
+  global_State *g = G(L);
+  if (g->gckind != KGC_GEN)
+    return 0;
+  g->gcregions++;
+  return 1;
+}
+
+
+void luaC_closeregion (lua_State *L) {
+  global_State *g = G(L);
+  lua_assert(g->gcregions > 0);
+  if (--g->gcregions == 0 && g->gckind == KGC_GEN) {
+    lu_mem majorbase = g->GCestimate;  /* memory after last major */
+    regioncollection(L, g);
+    setminordebt(g);
+    g->GCestimate = majorbase;  /* preserve base value */
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Idle-Time Mark
+** =======================================================
+*/
+
+#if defined(LUA_USE_GCTHREAD)
+
+/*
+** The marker is a thread that does the propagate phase of the
+** incremental collector while the host is idle, that is, while the
+** program runs outside the Lua core (inside C functions, or in the
+** host between API calls). It does not run concurrently with Lua code:
+** the core is a critical section, which the program enters with
+** 'lua_lock' and leaves with 'lua_unlock' ('incore'), and the marker
+** enters only while the program is out of it ('marking'). So, marking
+** only interleaves with the program where the program may leave the
+** core anyway, and the usual barriers keep the invariant. A program
+** that spends its time running Lua code gets no help from the marker;
+** its steps do the work as usual. The marker sleeps on 'wake' until
+** there is a cycle to mark and the core is free; 'lua_unlock' wakes it
+** when it is waiting. It gives the core back after each chunk of work
+** when the program wants it ('nwaiting'). The marker only traverses
+** objects; it never allocates or frees memory, and the atomic phase
+** and the sweep stay with the program. The marker is created in the
+** first cycle (and only if its resources can be allocated); it lives
+** outside the Lua allocator.
+*/
+
+
+/* amount of work the marker does each time it holds the core */
+#define MARKCHUNK	(10 * GCSTEPSIZE)
+
+
+/* can the marker do some work? */
+#define canmark(g)  \
+	((g)->gcrunning && (g)->gckind == KGC_INC && \
+	 (g)->gcstate == GCSpropagate && (g)->gray != NULL)
+
+
+void luaC_lockcore (lua_State *L) {
+  GCThread *gt = G(L)->gcthread;
+  if (gt != NULL) {
+    pthread_mutex_lock(&gt->lock);
+    if (gt->marking) {  /* marker inside the core? */
+      gt->nwaiting++;
+      do {
+        pthread_cond_wait(&gt->free, &gt->lock);
+      } while (gt->marking);
+      gt->nwaiting--;
+    }
+    gt->incore = 1;
+    pthread_mutex_unlock(&gt->lock);
+  }
+}
+
+
+void luaC_unlockcore (lua_State *L) {
+  GCThread *gt = G(L)->gcthread;
+  if (gt != NULL) {
+    pthread_mutex_lock(&gt->lock);
+    gt->incore = 0;
+    if (gt->waiting)  /* marker waiting for a free core? */
+      pthread_cond_signal(&gt->wake);
+    pthread_mutex_unlock(&gt->lock);
+  }
+}
+
+
+/*
+** Traverse gray objects until doing 'MARKCHUNK' units of work or
+** emptying the gray list, as 'singlestep' would do.
+*/
+static void markchunk (global_State *g) {
+  lu_mem work = 0;
+  g->gcworker = GCWMARKER;
+  do {
+    g->GCmemtrav = 0;
+    propagatemark(g);
+    work += g->GCmemtrav;
+  } while (g->gray != NULL && work < MARKCHUNK);
+  g->gcstats.marked += work;
+  if (g->gray == NULL)  /* no more gray objects? */
+    g->gcstate = GCSatomic;  /* program will do the atomic phase */
+  g->gcworker = 0;
+}
+
+
+/*
+** Wait (holding 'gt->lock') until the marker can enter the core to
+** mark or must finish. The marker looks at the collector only while
+** the program is out of the core; while it is in, the marker waits for
+** 'lua_unlock'. With nothing to mark, it waits for a new cycle.
+*/
+static void waitcore (GCThread *gt) {
+  while (!gt->stop) {
+    if (!gt->incore && gt->nwaiting == 0) {  /* core free? */
+      if (canmark(gt->g))
+        break;
+      gt->waiting = 0;  /* wait for a new cycle */
+    }
+    else
+      gt->waiting = 1;  /* wait for the program to leave the core */
+    pthread_cond_wait(&gt->wake, &gt->lock);
+  }
+  gt->waiting = 0;
+}
+
+
+static void *markerthread (void *ud) {
+  GCThread *gt = cast(GCThread *, ud);
+  pthread_mutex_lock(&gt->lock);
+  for (;;) {
+    waitcore(gt);
+    if (gt->stop)
+      break;
+    gt->marking = 1;  /* enter the core */
+    pthread_mutex_unlock(&gt->lock);
+    markchunk(gt->g);
+    pthread_mutex_lock(&gt->lock);
+    gt->marking = 0;  /* leave the core */
+    if (gt->nwaiting > 0)  /* program waiting for it? */
+      pthread_cond_broadcast(&gt->free);
+  }
+  pthread_mutex_unlock(&gt->lock);
+  return NULL;
+}
+
+
+/*
+** Create the marker. The program is inside the core. If anything
+** fails, the collector simply works without a marker (and tries
+** again in the next cycle).
+*/
+static void startmarker (global_State *g) {
+  GCThread *gt = cast(GCThread *, malloc(sizeof(GCThread)));
+  if (gt == NULL)
+    return;
+  gt->g = g;
+  gt->incore = 1;
+  gt->marking = gt->nwaiting = gt->waiting = gt->stop = 0;
+  pthread_mutex_init(&gt->lock, NULL);
+  pthread_cond_init(&gt->wake, NULL);
+  pthread_cond_init(&gt->free, NULL);
+  if (pthread_create(&gt->thread, NULL, markerthread, gt) != 0) {
+    pthread_cond_destroy(&gt->free);
+    pthread_cond_destroy(&gt->wake);
+    pthread_mutex_destroy(&gt->lock);
+    free(gt);
+  }
+  else
+    g->gcthread = gt;
+}
+
+
+/*
+** Called when a new cycle enters the propagate phase.
+*/
+static void wakemarker (global_State *g) {
+  GCThread *gt = g->gcthread;
+  if (gt == NULL)
+    startmarker(g);
+  else {
+    pthread_mutex_lock(&gt->lock);
+    pthread_cond_signal(&gt->wake);
+    pthread_mutex_unlock(&gt->lock);
+  }
+}
+
+
+/*
+** Finish the marker (called from inside the core when closing the
+** state). From here on, 'lua_lock' and 'lua_unlock' do nothing.
+*/
+static void stopmarker (global_State *g) {
+  GCThread *gt = g->gcthread;
+  if (gt != NULL) {
+    g->gcthread = NULL;
+    pthread_mutex_lock(&gt->lock);
+    gt->stop = 1;
+    pthread_cond_signal(&gt->wake);
+    pthread_mutex_unlock(&gt->lock);
+    pthread_join(gt->thread, NULL);
+    pthread_cond_destroy(&gt->free);
+    pthread_cond_destroy(&gt->wake);
+    pthread_mutex_destroy(&gt->lock);
+    free(gt);
+  }
+}
+
+#endif
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Parallel Mark
+** =======================================================
+*/
+
+#if defined(LUA_USE_GCTHREAD)
+
+/*
+** A full collection in incremental mode does its propagate phase with
+** a pool of threads when the heap is large enough to pay for it. The
+** program stays inside the core meanwhile, so nothing else changes
+** the objects. Each worker traverses objects with a private copy of
+** the global state, whose gray lists (and 'GCmemtrav') belong only to
+** that worker; all other fields are only read. 'claimgray' ensures
+** that each object is traversed by only one worker. A busy worker
+** gives the rest of its gray list away when other workers are idle;
+** the mark ends when all workers are idle with no lists to share.
+** Then the program joins the workers' lists ('grayagain' and weak
+** tables) into its own and goes on with the atomic phase as usual.
+** The sweep stays with the program, as it frees objects through the
+** allocator, which does not need to be thread safe.
+*/
+
+
+/* minimum heap size (in bytes) for a parallel mark */
+#if !defined(LUAI_GCPARMIN)
+#define LUAI_GCPARMIN	(8 * 1024 * 1024)
+#endif
+
+/* number of workers in a parallel mark (default: one per processor) */
+#if !defined(LUAI_GCWORKERS)
+#define LUAI_GCWORKERS	cast_int(sysconf(_SC_NPROCESSORS_ONLN))
+#endif
+
+/* maximum number of workers */
+#define MAXWORKERS	64
+
+
+/*
+** Give the rest of the gray list of 'g' (all but its first object) to
+** idle workers, if there is room for it in the pool.
+*/
+static void sharegray (GCPool *pool, global_State *g) {
+  GCObject **next = getgclist(g->gray);
+  pthread_mutex_lock(&pool->lock);
+  if (*next != NULL && pool->nshared < MAXSHARED) {
+    pool->shared[pool->nshared++] = *next;
+    *next = NULL;
+    pthread_cond_signal(&pool->work);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+** Get a shared gray list for 'g', waiting while other workers are busy
+** (and so may share something). Return false when the mark is over.
+*/
+static int getgray (GCPool *pool, global_State *g) {
+  int res = 0;
+  pthread_mutex_lock(&pool->lock);
+  __atomic_add_fetch(&pool->nidle, 1, __ATOMIC_RELAXED);
+  while (pool->nshared == 0 && !pool->markdone) {
+    if (pool->nidle == pool->nworkers) {  /* all workers idle? */
+      pool->markdone = 1;  /* nobody can produce more gray objects */
+      pthread_cond_broadcast(&pool->work);
+    }
+    else
+      pthread_cond_wait(&pool->work, &pool->lock);
+  }
+  if (pool->nshared > 0) {
+    g->gray = pool->shared[--pool->nshared];
+    __atomic_sub_fetch(&pool->nidle, 1, __ATOMIC_RELAXED);
+    res = 1;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return res;
+}
+
+
+/*
+** Traverse gray objects until there are none left in the whole pool.
+*/
+static void markwork (GCPool *pool, global_State *g) {
+  do {
+    while (g->gray != NULL) {
+      propagatemark(g);
+      if (g->gray != NULL &&
+          __atomic_load_n(&pool->nidle, __ATOMIC_RELAXED) > 0)
+        sharegray(pool, g);  /* feed idle workers */
+    }
+  } while (getgray(pool, g));
+}
+
+
+static void *workerthread (void *ud) {
+  GCWorker *w = cast(GCWorker *, ud);
+  GCPool *pool = w->pool;
+  int mark = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->mark == mark)
+      pthread_cond_wait(&pool->start, &pool->lock);  /* wait for a mark */
+    if (pool->stop)
+      break;
+    mark = pool->mark;
+    pthread_mutex_unlock(&pool->lock);
+    markwork(pool, &w->g);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+
+/*
+** Create the pool, with as many threads as it can get (up to
+** 'LUAI_GCWORKERS'). The program is worker 0, so it needs no thread.
+** The pool lives outside the Lua allocator.
+*/
+static GCPool *newpool (void) {
+  int n = LUAI_GCWORKERS;
+  GCPool *pool = cast(GCPool *, malloc(sizeof(GCPool)));
+  if (n > MAXWORKERS) n = MAXWORKERS;
+  else if (n < 1) n = 1;
+  if (pool == NULL)
+    return NULL;
+  pool->w = cast(GCWorker *, malloc(n * sizeof(GCWorker)));
+  if (pool->w == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->mark = pool->running = pool->nidle = 0;
+  pool->markdone = pool->stop = pool->nshared = 0;
+  pool->w[0].pool = pool;
+  for (pool->nworkers = 1; pool->nworkers < n; pool->nworkers++) {
+    GCWorker *w = &pool->w[pool->nworkers];
+    w->pool = pool;
+    if (pthread_create(&w->thread, NULL, workerthread, w) != 0)
+      break;  /* go with the threads it already has */
+  }
+  return pool;
+}
+
+
+/* move all objects from gray list 'l' to gray list 'p' */
+static void joingclist (GCObject **p, GCObject *l) {
+  while (l != NULL) {
+    GCObject **next = getgclist(l);
+    GCObject *o = l;
+    l = *next;
+    *next = *p;
+    *p = o;
+  }
+}
+
+
+/*
+** Do the whole propagate phase with the pool, if there is one (and it
+** has more than one worker).
+*/
+static void parallelmark (global_State *g) {
+  GCPool *pool = g->gcpool;
+  int i;
+  lua_assert(g->gcstate == GCSpropagate && !g->gcemergency);
+  if (pool == NULL)
+    pool = g->gcpool = newpool();
+  if (pool == NULL || pool->nworkers < 2)
+    return;  /* program will do the mark alone */
+  for (i = 0; i < pool->nworkers; i++) {
+    global_State *wg = &pool->w[i].g;
+    *wg = *g;
+    wg->gray = wg->grayagain = NULL;
+    wg->weak = wg->allweak = wg->ephemeron = NULL;
+    wg->GCmemtrav = 0;
+    wg->gcworker = GCWPARALLEL;
+  }
+  pool->w[0].g.gray = g->gray;  /* program starts with all gray objects */
+  g->gray = NULL;
+  pthread_mutex_lock(&pool->lock);
+  pool->mark++;
+  pool->running = pool->nworkers - 1;
+  pool->nidle = pool->nshared = pool->markdone = 0;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  markwork(pool, &pool->w[0].g);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0)  /* wait for the other workers */
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nworkers; i++) {  /* collect their results */
+    global_State *wg = &pool->w[i].g;
+    lua_assert(wg->gray == NULL);
+    g->GCmemtrav += wg->GCmemtrav;
+    g->gcstats.marked += wg->GCmemtrav;
+    joingclist(&g->grayagain, wg->grayagain);
+    joingclist(&g->weak, wg->weak);
+    joingclist(&g->allweak, wg->allweak);
+    joingclist(&g->ephemeron, wg->ephemeron);
+  }
+  g->gcstate = GCSatomic;  /* propagate phase is done */
+}
+
+
+static void stoppool (global_State *g) {
+  GCPool *pool = g->gcpool;
+  if (pool != NULL) {
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->nworkers; i++)
+      pthread_join(pool->w[i].thread, NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->w);
+    free(pool);
+    g->gcpool = NULL;
+  }
+}
+
+#endif
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Automatic pacing
+** =======================================================
+*/
+
+/* limits for the parameters chosen by the pacer */
+#define MINAUTOPAUSE	100
+#define MAXAUTOPAUSE	1000
+#define MINAUTOMUL	40
+#define MAXAUTOMUL	4000
+
+/* a new sample weighs one half in a smoothed measure */
+#define smooth(m,s)	((m) = ((m) == 0) ? (s) : ((m) + (s)) / 2)
+
+
+static l_mem totalgctime (global_State *g) {
+  const l_mem *t = g->gcstats.time;
+  return t[0] + t[1] + t[2] + t[3];
+}
+
+
+/*
+** Start the automatic pacing with a target of kind 'kind' (or stop it,
+** if 'kind' is 0). Its first measures start now.
+*/
+void luaC_setpacer (lua_State *L, int kind, int target) {
+  global_State *g = G(L);
+  GCPacer *p = &g->gcpacer;
+  p->kind = cast_byte(kind);
+  p->target = (kind != 0) ? target : 0;
+  p->time = gcclock();
+  p->gctime = totalgctime(g);
+  p->bytes = gettotalbytes(g);
+  p->cyclework = p->work = 0;
+  p->cost = p->rate = 0;
+}
+
+
+/*
+** Choose 'gcpause' and 'gcstepmul' for the next cycle, from what was
+** measured in the cycles so far: the work of a cycle, its collector
+** time, and how fast the program allocates. First, compute the 'room'
+** the program may allocate until the end of the next cycle: for a heap
+** target, 'target'% of the live data (the survivors of the last cycle,
+** in 'GCestimate'); for a CPU target, what the program allocates in
+** the time that makes the collector time 'target'% of the total. Half
+** of that room goes to the cycle itself, which sets 'stepmul' (the work
+** done per byte allocated); the rest goes to the pause.
+*/
+static void autopace (global_State *g) {
+  GCPacer *p = &g->gcpacer;
+  l_mem now = gcclock();
+  l_mem gctime = totalgctime(g);
+  l_mem cost = gctime - p->gctime;  /* collector time since last cycle */
+  l_mem progtime = (now - p->time) - cost;  /* program time */
+  l_mem total = gettotalbytes(g);
+  l_mem alloc = total + g->gcstats.lastswept - p->bytes;
+  l_mem live = g->GCestimate;
+  l_mem room, mul, pause;
+  if (p->cyclework > 0)  /* cycle done (at least partly) by steps? */
+    smooth(p->work, p->cyclework);
+  smooth(p->cost, cost);
+  if (progtime > 0 && alloc > 0)
+    smooth(p->rate, alloc / (progtime / 1000 + 1));
+  p->cyclework = 0;
+  p->time = now;
+  p->gctime = gctime;
+  p->bytes = total;
+  if (p->kind == LUA_GCAUTOHEAP)
+    room = (live / 100) * p->target;
+  else {  /* CPU target */
+    l_mem ptime = (p->cost / p->target) * (100 - p->target);
+    room = p->rate * (ptime / 1000 + 1);
+  }
+  mul = (p->work == 0) ? g->gcstepmul
+                       : cast(l_mem, p->work) / (room / 2 / STEPMULADJ + 1);
+  if (mul < MINAUTOMUL) mul = MINAUTOMUL;
+  else if (mul > MAXAUTOMUL) mul = MAXAUTOMUL;
+  room -= cast(l_mem, p->work) / mul * STEPMULADJ;  /* room for the pause */
+  pause = PAUSEADJ + ((room > 0) ? room / (live / PAUSEADJ + 1) : 0);
+  if (pause > MAXAUTOPAUSE) pause = MAXAUTOPAUSE;
+  g->gcstepmul = cast_int(mul);
+  g->gcpause = cast_int(pause);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Frozen objects
+** =======================================================
+*/
+
+/*
+** 'luaC_freeze' moves all objects alive at the end of a marking to list
+** 'frozengc', where they stay until the state is closed: the collector
+** neither marks nor sweeps them anymore. Frozen objects have their own
+** age and are black, so no marking enters them; as long as a frozen
+** object only points to frozen objects, nothing it refers to can die.
+** So, the barriers also stop on a frozen object that gets a reference
+** to an object that is not frozen, and thaw it (see 'thaw'): it stays
+** frozen, but becomes a gray root that every cycle visits again, like
+** a thread. Objects changed without barriers (threads and Lua closures
+** with upvalues) and weak tables (which must be cleared) are thawed at
+** once. A frozen object with a finalizer is finalized only when the
+** state closes.
+*/
+
+
+/* can object 'o' be thawed? */
+#define canthaw(o)  \
+	((o)->tt == LUA_TTABLE || (o)->tt == LUA_TUSERDATA || \
+	 (o)->tt == LUA_TCCL || (o)->tt == LUA_TTHREAD || \
+	 ((o)->tt == LUA_TLCL && gco2lcl(o)->nupvalues > 0))
+
+
+static int countthawable (GCObject *o) {
+  int n = 0;
+  for (; o != NULL; o = o->next) {
+    if (canthaw(o))
+      n++;
+  }
+  return n;
+}
+
+
+/*
+** Freeze all marked objects in list 'p'. (Called by 'atomic' before
+** separating the objects to be finalized, so that no object that is
+** being resurrected gets frozen.)
+*/
+static void freezelist (global_State *g, GCObject **p) {
+  GCObject *curr;
+  lua_assert(g->gckind == KGC_INC);
+  while ((curr = *p) != NULL) {
+    if (iswhite(curr))  /* not marked? */
+      p = &curr->next;  /* leave it to the sweep */
+    else {
+      *p = curr->next;  /* remove 'curr' from list */
+      curr->next = g->frozengc;  /* link it in 'frozengc' list */
+      g->frozengc = curr;
+      setage(curr, G_FROZEN);
+      if (isgray(curr) ||  /* thread or weak table? */
+          (curr->tt == LUA_TLCL && gco2lcl(curr)->nupvalues > 0)) {
+        lua_assert(canthaw(curr) && g->nthawed < g->sizethawed);
+        black2gray(curr);
+        g->thawed[g->nthawed++] = curr;  /* thaw it at once */
+      }
+    }
+  }
+}
+
+
+/*
+** Freeze all objects alive now, with a whole cycle in incremental mode
+** whose atomic phase freezes what it marked. Objects that any frozen
+** object may come to need in 'thawed' are counted before, with no
+** pending finalizers (which could create new objects or keep garbage
+** alive).
+*/
+void luaC_freeze (lua_State *L) {
+  global_State *g = G(L);
+  int oldkind = g->gckind;
+  int size = g->sizethawed;
+  luaC_changemode(L, KGC_INC);
+  luaC_runtilstate(L, bitmask(GCSpause));  /* finish any pending cycle */
+  do {
+    int n;
+    callallpendingfinalizers(L);
+    n = size + countthawable(g->allgc) + countthawable(g->finobj);
+    luaM_reallocvector(L, g->thawed, g->sizethawed, n, GCObject *);
+    g->sizethawed = n;
+  } while (g->tobefnz != NULL);  /* an emergency collection found some? */
+  g->gcfreezing = 1;
+  luaC_runtilstate(L, bitmask(GCSswpallgc));  /* mark and freeze */
+  g->gcfreezing = 0;
+  luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
+  setpause(g);
+  luaC_changemode(L, oldkind);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** GC control
+** =======================================================
+*/
+
+
+/*
+** Set a reasonable "time" to wait before starting a new GC cycle; cycle
+** will start when memory use hits threshold. (Division by 'estimate'
+** should be OK: it cannot be zero (because Lua cannot even start with
+** less than PAUSEADJ bytes).
+*/
+static void setpause (global_State *g) {
+  l_mem threshold, debt;
+  l_mem estimate;
+  if (g->gcpacer.kind != 0)  /* automatic pacing? */
+    autopace(g);
+  estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
+  lua_assert(estimate > 0);
+  threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
+            ? estimate * g->gcpause  /* no overflow */
+            : MAX_LMEM;  /* overflow; truncate to maximum */
+  debt = gettotalbytes(g) - threshold;
+  luaE_setdebt(g, debt);
+  g->gcbacklog = 0;  /* next cycle starts with no pending work */
+}
+
+
+/*
+** Enter first sweep phase.
+** The call to 'sweeplist' tries to make pointer point to an object
+** inside the list (instead of to the header), so that the real sweep do
+** not need to skip objects created between "now" and the start of the
+** real sweep.
+*/
+static void entersweep (lua_State *L) {
+  global_State *g = G(L);
+  g->gcstate = GCSswpallgc;
+  lua_assert(g->sweepgc == NULL);
+  g->sweepgc = sweeplist(L, &g->allgc, 1);
+}
+
+
+/*
+** Clear the cards of the tables in list 'l', which is being dropped
+*/
+static void clearlisted (GCObject *l) {
+  for (; l != NULL; l = *getgclist(l)) {
+    if (l->tt == LUA_TTABLE && cardlisted(gco2t(l)))
+      clearcards(gco2t(l));
+  }
+}
+
+
+/*
+** Give all frozen objects back to the regular lists (when closing the
+** state), to be finalized and freed as any other object. A marking in
+** course may have thawed objects in its gray lists, so it is dropped.
+*/
+static void unfreeze (lua_State *L) {
+  global_State *g = G(L);
+  if (g->frozengc != NULL && keepinvariant(g)) {
+    clearlisted(g->grayagain);
+    entersweep(L);
+  }
+  while (g->frozengc != NULL) {
+    GCObject *o = g->frozengc;
+    g->frozengc = o->next;
+    makewhite(g, o);
+    setage(o, G_NEW);
+    if (tofinalize(o)) {
+      o->next = g->finobj;
+      g->finobj = o;
+    }
+    else {
+      o->next = g->allgc;
+      g->allgc = o;
+    }
+  }
+  luaM_freearray(L, g->thawed, g->sizethawed);
+  g->thawed = NULL;
+  g->nthawed = g->sizethawed = 0;
+}
+
+
+void luaC_freeallobjects (lua_State *L) {
+  global_State *g = G(L);
+#if defined(LUA_USE_GCTHREAD)
+  stopmarker(g);
+  stoppool(g);
+#endif
+  luaC_changemode(L, KGC_INC);
+  unfreeze(L);
+  separatetobefnz(g, 1);  /* separate all objects with finalizers */
+  lua_assert(g->finobj == NULL);
+  callallpendingfinalizers(L);
+  lua_assert(g->tobefnz == NULL);
+  g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
+  g->gcemergency = 0;
+  sweepwholelist(L, &g->finobj);
+  sweepwholelist(L, &g->allgc);
+  sweepwholelist(L, &g->fixedgc);  /* collect fixed objects */
+  freedeadshapes(L);
+  lua_assert(g->strt.nuse == 0);
+}
+
+
+static l_mem atomic (lua_State *L) {
+  global_State *g = G(L);
+  l_mem work;
+  GCObject *origweak, *origall;
+  GCObject *grayagain = g->grayagain;  /* save original list */
+  g->grayagain = NULL;
+  lua_assert(g->ephemeron == NULL && g->weak == NULL);
+  lua_assert(!iswhite(g->mainthread));
+  g->gcstate = GCSinsideatomic;
+  g->GCmemtrav = 0;  /* start counting work */
+  markobject(g, L);  /* mark running thread */
+  /* registry and global metatables may be changed by API */
+  markvalue(g, &g->l_registry);
+  markmt(g);  /* mark global metatables */
+  markthawed(g, NULL);  /* userdata may be changed too */
+  /* remark occasional upvalues of (maybe) dead threads */
+  remarkupvals(g);
+  propagateall(g);  /* propagate changes */
+  work = g->GCmemtrav;  /* stop counting (do not recount 'grayagain') */
+  g->gray = grayagain;
+  propagateall(g);  /* traverse 'grayagain' list */
+  g->GCmemtrav = 0;  /* restart counting */
+  convergeephemerons(g);
   /* at this point, all strongly accessible objects are marked. */
   /* Clear values from weak tables, before checking finalizers */
   clearvalues(g, g->weak, NULL);
   clearvalues(g, g->allweak, NULL);
   origweak = g->weak; origall = g->allweak;
   work += g->GCmemtrav;  /* stop counting (objects being finalized) */
+  if (g->gcfreezing) {  /* freezing everything alive? */
+    freezelist(g, &g->allgc);
+    freezelist(g, &g->finobj);
+  }
   separatetobefnz(g, 0);  /* separate objects to be finalized */
   g->gcfinnum = 1;  /* there may be objects to be finalized */
   markbeingfnz(g);  /* mark objects that will be finalized */
@@ -1032,6 +2843,7 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
     l_mem olddebt = g->GCdebt;
     g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+    g->gcstats.swept += olddebt - g->GCdebt;
     if (g->sweepgc)  /* is there still something to sweep? */
       return (GCSWEEPMAX * GCSWEEPCOST);
   }
@@ -1049,6 +2861,9 @@ static lu_mem singlestep (lua_State *L) {
       g->GCmemtrav = g->strt.size * sizeof(GCObject*);
       restartcollection(g);
       g->gcstate = GCSpropagate;
+#if defined(LUA_USE_GCTHREAD)
+      wakemarker(g);
+#endif
       return g->GCmemtrav;
     }
     case GCSpropagate: {
@@ -1057,12 +2872,14 @@ static lu_mem singlestep (lua_State *L) {
       propagatemark(g);
        if (g->gray == NULL)  /* no more gray objects? */
         g->gcstate = GCSatomic;  /* finish propagate phase */
+      g->gcstats.marked += g->GCmemtrav;
       return g->GCmemtrav;  /* memory traversed in this step */
     }
     case GCSatomic: {
       lu_mem work;
       propagateall(g);  /* make sure gray list is empty */
       work = atomic(L);  /* work is what was traversed by 'atomic' */
+      g->gcstats.marked += work;
       entersweep(L);
       g->GCestimate = gettotalbytes(g);  /* first estimate */;
       return work;
@@ -1078,17 +2895,19 @@ static lu_mem singlestep (lua_State *L) {
     }
     case GCSswpend: {  /* finish sweeps */
       makewhite(g, g->mainthread);  /* sweep main thread */
+      freedeadshapes(L);
       checkSizes(L, g);
       g->gcstate = GCScallfin;
       return 0;
     }
     case GCScallfin: {  /* call remaining finalizers */
-      if (g->tobefnz && g->gckind != KGC_EMERGENCY) {
+      if (g->tobefnz && !g->gcemergency) {
         int n = runafewfinalizers(L);
         return (n * GCFINALIZECOST);
       }
       else {  /* emergency mode or no more finalizers */
         g->gcstate = GCSpause;  /* finish collection */
+        endcycle(g, 0);
         return 0;
       }
     }
@@ -1097,14 +2916,33 @@ static lu_mem singlestep (lua_State *L) {
 }
 
 
+/*
+** Performs a single step, and charges the time since '*t' to its phase
+** when the collector changes state.
+*/
+static lu_mem timedstep (lua_State *L, l_mem *t) {
+  global_State *g = G(L);
+  int st = g->gcstate;
+  lu_mem work = singlestep(L);
+  if (g->gcstate != st) {  /* changed state? */
+    l_mem start = *t;
+    *t = chargetime(g, st, start);
+    if (st == GCSatomic)  /* was it the atomic step? */
+      addpause(g, *t - start);
+  }
+  return work;
+}
+
+
 /*
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
 */
 void luaC_runtilstate (lua_State *L, int statesmask) {
   global_State *g = G(L);
+  l_mem t = gcclock();
   while (!testbit(statesmask, g->gcstate))
-    singlestep(L);
+    timedstep(L, &t);
 }
 
 
@@ -1124,56 +2962,146 @@ static l_mem getdebt (global_State *g) {
 }
 
 /*
-** performs a basic GC step when collector is running
+** Bytes of allocation behind 'maxbacklog' before the first atomic phase
+** of a state, when there is no estimate of its heap yet
 */
-void luaC_step (lua_State *L) {
-  global_State *g = G(L);
-  l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
-  if (!g->gcrunning) {  /* not running? */
-    luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
-    return;
-  }
+#define MINBACKLOG	(cast(l_mem, 100) * GCSTEPSIZE)
+
+/*
+** Minimum room (as a percentage of the heap estimate) that 'maxbacklog'
+** gives to steps behind their work, for pauses that leave less than
+** that (or none, with a pause of 100% or less)
+*/
+#define MINBACKLOGROOM	25
+
+/*
+** Work owed by steps that ran out of time past which a step ignores
+** its time limit: the work for what the program may allocate during a
+** pause (see 'setpause').
+*/
+static l_mem maxbacklog (global_State *g) {
+  l_mem estimate = g->GCestimate / PAUSEADJ;
+  int room = g->gcpause - PAUSEADJ;
+  l_mem work;
+  if (room < MINBACKLOGROOM)  /* pause too short? */
+    room = MINBACKLOGROOM;
+  if (estimate == 0)  /* no estimate yet? */
+    work = MINBACKLOG;
+  else
+    work = (room < MAX_LMEM / estimate)  /* overflow? */
+         ? estimate * room : MAX_LMEM;
+  work = (work / STEPMULADJ) + 1;  /* convert bytes to 'work units' */
+  return (work < MAX_LMEM / g->gcstepmul) ? work * g->gcstepmul : MAX_LMEM;
+}
+
+
+/*
+** performs a basic incremental step. With a time limit ('gcsteptime'),
+** the step also stops when its time is over (checked between single
+** steps); the work still owed goes to 'gcbacklog', to be added to the
+** next step, which comes after a small allocation. So, while it is
+** behind, the collector runs shorter and more frequent steps, and
+** still finishes its cycles at the pace set by 'gcstepmul'. When
+** single steps take longer than the limit allows, or big blocks come
+** between steps, the backlog grows with each step; once it is more
+** than 'maxbacklog', a step runs without a time limit to pay it, so
+** that the heap cannot grow without bound.
+*/
+static void incstep (lua_State *L, global_State *g) {
+  l_mem debt = getdebt(g) + g->gcbacklog;  /* GC deficit (be paid now) */
+  l_mem t = gcclock();
+  l_mem limit = (g->gcsteptime > 0 && g->gcbacklog <= maxbacklog(g))
+              ? t + g->gcsteptime : 0;
+  g->gcbacklog = 0;
   do {  /* repeat until pause or enough "credit" (negative debt) */
-    lu_mem work = singlestep(L);  /* perform one single step */
+    lu_mem work = timedstep(L, &t);  /* perform one single step */
     debt -= work;
-  } while (debt > -GCSTEPSIZE && g->gcstate != GCSpause);
+    g->gcpacer.cyclework += work;
+  } while (debt > -GCSTEPSIZE && g->gcstate != GCSpause &&
+           (limit == 0 || gcclock() < limit));
+  t = chargetime(g, g->gcstate, t);  /* charge the rest of the step */
   if (g->gcstate == GCSpause)
     setpause(g);  /* pause until next cycle */
   else {
-    debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
-    luaE_setdebt(g, debt);
-    runafewfinalizers(L);
+    if (debt > 0) {  /* out of time? */
+      g->gcbacklog = debt;  /* keep the rest for the next step */
+      luaE_setdebt(g, -GCSTEPSIZE);  /* which comes soon */
+    }
+    else {
+      debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
+      luaE_setdebt(g, debt);
+    }
+    if (runafewfinalizers(L) > 0)
+      chargetime(g, GCScallfin, t);
   }
 }
 
 
 /*
-** Performs a full GC cycle; if 'isemergency', set a flag to avoid
-** some operations which could change the interpreter state in some
-** unexpected ways (running finalizers and shrinking some structures).
-** Before running the collection, check 'keepinvariant'; if it is true,
-** there may be some objects marked as black, so the collector has
-** to sweep all objects to turn them back to white (as white has not
-** changed, nothing will be collected).
+** performs a basic GC step when collector is running
 */
-void luaC_fullgc (lua_State *L, int isemergency) {
+void luaC_step (lua_State *L) {
   global_State *g = G(L);
-  lua_assert(g->gckind == KGC_NORMAL);
-  if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
+  if (!g->gcrunning)  /* not running? */
+    luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
+  else {
+    l_mem t = gcclock();
+    if (g->gckind == KGC_GEN)
+      genstep(L, g);
+    else
+      incstep(L, g);
+    addstep(g, gcclock() - t);
+  }
+}
+
+
+/*
+** Performs a full incremental cycle. Before running the collection,
+** check 'keepinvariant'; if it is true, there may be some objects
+** marked as black, so the collector has to sweep all objects to turn
+** them back to white (as white has not changed, nothing will be
+** collected).
+*/
+static void fullinc (lua_State *L, global_State *g) {
   if (keepinvariant(g)) {  /* black objects? */
+    clearlisted(g->grayagain);  /* current cycle will not finish */
     entersweep(L); /* sweep everything to turn them back to white */
   }
   /* finish any pending sweep phase to start a new cycle */
   luaC_runtilstate(L, bitmask(GCSpause));
   luaC_runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
+#if defined(LUA_USE_GCTHREAD)
+  if (!g->gcemergency && gettotalbytes(g) >= LUAI_GCPARMIN) {
+    l_mem t = gcclock();
+    parallelmark(g);
+    chargetime(g, GCSpropagate, t);
+  }
+#endif
   luaC_runtilstate(L, bitmask(GCScallfin));  /* run up to finalizers */
   /* estimate must be correct after a full GC cycle */
   lua_assert(g->GCestimate == gettotalbytes(g));
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
-  g->gckind = KGC_NORMAL;
   setpause(g);
 }
 
+
+/*
+** Performs a full GC cycle; if 'isemergency', set a flag to avoid
+** some operations which could change the interpreter state in some
+** unexpected ways (running finalizers and shrinking some structures).
+*/
+void luaC_fullgc (lua_State *L, int isemergency) {
+  global_State *g = G(L);
+  lua_assert(!g->gcemergency);
+  g->gcemergency = isemergency;  /* set flag */
+  if (g->gckind == KGC_INC)
+    fullinc(L, g);
+  else
+    fullgen(L, g);
+  g->gcemergency = 0;
+  (*g->frealloc)(g->ud, NULL, LUA_ALLOCTRIM, 0);  /* allocator may trim */
+}
+
 /* }====================================================== */
 
 
@@ -22,6 +22,12 @@
 ** allweak, ephemeron) so that it can be visited again before finishing
 ** the collection cycle. These lists have no meaning when the invariant
 ** is not being enforced (e.g., sweep phase).
+**
+** In generational mode, objects also have an age (see below). A minor
+** collection visits only young objects and old objects that were
+** changed since the last collection; so, besides the tri-color
+** invariant, an old black object cannot point to a young one. (Barriers
+** either make the young object old or keep the old one in 'grayagain'.)
 */
 
 
@@ -33,6 +39,22 @@
 #endif
 
 
+/*
+** Card marking: tables with at least CARDMIN slots (in their array and
+** hash parts) get cards of CARDSIZE slots, so that a barrier on a black
+** table only dirties the card of the slot written.
+*/
+#if !defined(CARDSIZE)
+#define CARDSIZE	128
+#endif
+
+#define CARDMIN		(8 * CARDSIZE)
+
+/* table is in 'grayagain' for its cards (if still black, only its
+   dirty cards need a traversal) */
+#define cardlisted(t)	((t)->cards != NULL && (t)->cards->listed)
+
+
 /*
 ** Possible states of the Garbage Collector
 */
@@ -79,28 +101,81 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+/* bits 4-6 keep the age of the object (generational mode) */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
 
 
-#define iswhite(x)      testbits((x)->marked, WHITEBITS)
-#define isblack(x)      testbit((x)->marked, BLACKBIT)
+/*
+** Access to the colors in 'marked' while an object may be marked. In a
+** parallel mark (see 'lgc.c'), workers test and change the colors of
+** objects that other workers may be marking, so these accesses are
+** atomic then. (Relaxed loads and stores cost as much as plain ones.)
+*/
+#if defined(LUA_USE_GCTHREAD)
+#define getmarked(x)	__atomic_load_n(&(x)->marked, __ATOMIC_RELAXED)
+#define setmarked(x,m)	\
+	__atomic_store_n(&(x)->marked, cast_byte(m), __ATOMIC_RELAXED)
+#else
+#define getmarked(x)	((x)->marked)
+#define setmarked(x,m)	((x)->marked = cast_byte(m))
+#endif
+
+
+#define iswhite(x)      testbits(getmarked(x), WHITEBITS)
+#define isblack(x)      testbit(getmarked(x), BLACKBIT)
 #define isgray(x)  /* neither white nor black */  \
-	(!testbits((x)->marked, WHITEBITS | bitmask(BLACKBIT)))
+	(!testbits(getmarked(x), WHITEBITS | bitmask(BLACKBIT)))
 
-#define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
+#define tofinalize(x)	testbit(getmarked(x), FINALIZEDBIT)
 
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	(!(((m) ^ WHITEBITS) & (ow)))
-#define isdead(g,v)	isdeadm(otherwhite(g), (v)->marked)
+#define isdead(g,v)	isdeadm(otherwhite(g), getmarked(v))
 
 #define changewhite(x)	((x)->marked ^= WHITEBITS)
-#define gray2black(x)	l_setbit((x)->marked, BLACKBIT)
+#define gray2black(x)	setmarked(x, getmarked(x) | bitmask(BLACKBIT))
+#define black2gray(x)	setmarked(x, getmarked(x) & ~bitmask(BLACKBIT))
 
 #define luaC_white(g)	cast(lu_byte, (g)->currentwhite & WHITEBITS)
 
 
+/*
+** Object ages in generational mode. Objects are created new; they
+** become survivals if they survive a (minor) collection, and then old
+** after surviving a second one. A forward barrier makes a young object
+** old at once (OLD0); it then waits another cycle (OLD1) before being
+** really old, because it may still point to young objects. A backward
+** barrier makes an old object touched, so that it is visited in the
+** next two collections. In incremental mode, all objects are new,
+** except fixed ones (which are always old). Frozen objects (see
+** 'luaC_freeze') keep an age of their own in both modes.
+*/
+#define G_NEW		0	/* created in current cycle */
+#define G_SURVIVAL	1	/* created in previous cycle */
+#define G_OLD0		2	/* marked old by frw. barrier in this cycle */
+#define G_OLD1		3	/* first full cycle as old */
+#define G_OLD		4	/* really old object (not to be visited) */
+#define G_TOUCHED1	5	/* old object touched this cycle */
+#define G_TOUCHED2	6	/* old object touched in previous cycle */
+#define G_FROZEN	7	/* immortal object (not to be marked or swept) */
+
+#define AGESHIFT	4
+#define AGEBITS		(7 << AGESHIFT)  /* all age bits */
+
+#define getage(o)	((getmarked(o) & AGEBITS) >> AGESHIFT)
+#define setage(o,a)  ((o)->marked = \
+	cast_byte(((o)->marked & ~AGEBITS) | ((a) << AGESHIFT)))
+#define isold(o)	(getage(o) > G_SURVIVAL)
+
+#define isfrozen(o)	(getage(o) == G_FROZEN)
+
+#define changeage(o,f,t)  \
+	check_exp(getage(o) == (f), \
+	          (o)->marked ^= cast_byte(((f)^(t)) << AGESHIFT))
+
+
 /*
 ** Does one step of collection when debt becomes positive. 'pre'/'pos'
 ** allows some adjustments to be done only when needed. macro
@@ -115,16 +190,28 @@
 #define luaC_checkGC(L)		luaC_condGC(L,(void)0,(void)0)
 
 
+/*
+** A black object cannot point to a white one; a frozen black object
+** cannot point to any object that is not frozen (see 'luaC_freeze').
+*/
+#define needbarrier(p,o)  \
+	(isblack(p) && (iswhite(o) || (isfrozen(p) && !isfrozen(o))))
+
 #define luaC_barrier(L,p,v) (  \
-	(iscollectable(v) && isblack(p) && iswhite(gcvalue(v))) ?  \
+	(iscollectable(v) && needbarrier(p, gcvalue(v))) ?  \
 	luaC_barrier_(L,obj2gco(p),gcvalue(v)) : cast_void(0))
 
 #define luaC_barrierback(L,p,v) (  \
-	(iscollectable(v) && isblack(p) && iswhite(gcvalue(v))) ? \
-	luaC_barrierback_(L,p) : cast_void(0))
+	(iscollectable(v) && needbarrier(p, gcvalue(v))) ? \
+	luaC_barrierback_(L,p,NULL) : cast_void(0))
+
+/* barrier for value 'v' stored in slot 's' of table 'p' */
+#define luaC_barrierslot(L,p,s,v) (  \
+	(iscollectable(v) && needbarrier(p, gcvalue(v))) ? \
+	luaC_barrierback_(L,p,s) : cast_void(0))
 
 #define luaC_objbarrier(L,p,o) (  \
-	(isblack(p) && iswhite(o)) ? \
+	needbarrier(p, o) ? \
 	luaC_barrier_(L,obj2gco(p),obj2gco(o)) : cast_void(0))
 
 #define luaC_upvalbarrier(L,uv) ( \
@@ -138,10 +225,16 @@ LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
-LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *o);
+LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *t,
+                                  const TValue *slot);
 LUAI_FUNC void luaC_upvalbarrier_ (lua_State *L, UpVal *uv);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_upvdeccount (lua_State *L, UpVal *uv);
+LUAI_FUNC void luaC_changemode (lua_State *L, int newmode);
+LUAI_FUNC int luaC_openregion (lua_State *L);
+LUAI_FUNC void luaC_closeregion (lua_State *L);
+LUAI_FUNC void luaC_freeze (lua_State *L);
+LUAI_FUNC void luaC_setpacer (lua_State *L, int kind, int target);
 
 
 #endif
@@ -0,0 +1,2244 @@
+/*
+** $Id: ljit.c $
+** Baseline JIT compiler for x86-64
+** See Copyright Notice in lua.h
+*/
+
+#define ljit_c
+#define LUA_CORE
+
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  /* for 'MAP_ANONYMOUS' */
+#endif
+
+#include "lprefix.h"
+
+
+#include "lua.h"
+
+#if defined(LUA_USE_JIT)
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "ljit.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "ltable.h"
+#include "ltm.h"
+#include "lvm.h"
+
+
+/*
+** The compiler translates each instruction of a hot function into a
+** fixed sequence of machine code, in two simple passes (the first one
+** only computes the address of each instruction) and without any
+** register allocation: Lua registers live in the Lua stack, as in the
+** interpreter. Moves, constants, jumps, tests, loops, and the
+** integer/float cases of the most common arithmetic and comparisons
+** are generated inline; other cases call helpers below that do what
+** 'luaV_execute' does for that instruction, so semantics, errors, and
+** metamethods are the same as in the interpreter.
+**
+** Other instructions (returns, tail calls, closures, varargs, etc.)
+** are not compiled: the code sets 'savedpc' to them and returns to the
+** interpreter, which executes that instruction and then re-enters the
+** compiled code (see 'jitenter' in 'lvm.c'). Calls to C functions run
+** from compiled code; for a call to a Lua function, compiled code
+** creates the new frame and returns to the interpreter, which runs the
+** called function (compiled or not) without nesting C calls. As every
+** instruction has its own entry point, a function can switch to its
+** compiled code in the middle of a loop, and the interpreter can take
+** over at any point; compiled code does that whenever a line or count
+** hook is on, checking for them after each call to a helper and at
+** each backward jump.
+**
+** Compiled code keeps 'L' in rbx, 'ci' in r12, 'base' in r13, and the
+** running closure in r15. These are callee-saved registers, so they
+** survive calls to helpers; 'base' is reloaded after each call, as the
+** stack may have been reallocated. Errors are raised by the helpers
+** with 'longjmp', which needs no unwinding information for the
+** compiled frames.
+**
+** On top of that, loops that keep running in compiled code get traces
+** (see 'luaJ_record'): the interpreter records the path taken by one
+** iteration of the loop, with the types of the values it sees, and
+** that path is compiled as straight-line code specialized for those
+** types, with guards that leave the trace (back to the compiled code
+** of the function) whenever a type or a branch differs.
+*/
+
+
+/* maximum size of the code for one instruction */
+#define MAXINSTSIZE	384
+
+/* size of the entry and exit routines */
+#define MAXENTRYSIZE	64
+
+
+/* x86-64 registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define RL	RBX	/* lua_State *L */
+#define RCI	R12	/* CallInfo *ci */
+#define RBASE	R13	/* StkId base */
+#define RCL	R15	/* LClosure *cl */
+
+
+/* x86-64 opcodes used here ('r' is the ModRM register operand) */
+#define X_MOVRM		0x8b	/* mov r, r/m */
+#define X_MOVMR		0x89	/* mov r/m, r */
+#define X_ADDMR		0x01	/* add r/m, r */
+#define X_ADD		0x03	/* add r, r/m */
+#define X_SUB		0x2b	/* sub r, r/m */
+#define X_IMUL		0x0faf	/* imul r, r/m */
+#define X_CMP		0x3b	/* cmp r, r/m */
+#define X_XOR		0x31	/* xor r/m, r */
+#define X_TEST		0x85	/* test r/m, r */
+#define X_MOVI		0xc7	/* mov r/m, imm32 (r = 0) */
+#define X_CMPI		0x81	/* cmp r/m, imm32 (r = 7) */
+#define X_TESTI		0xf7	/* test r/m, imm32 (r = 0) */
+#define X_MOVUPS	0x0f10	/* movups xmm, m (or movsd with 0xf2) */
+#define X_MOVUPSM	0x0f11	/* movups m, xmm (or movsd with 0xf2) */
+#define X_ADDSD		0x0f58	/* (with 0xf2) */
+#define X_MULSD		0x0f59	/* (with 0xf2) */
+#define X_SUBSD		0x0f5c	/* (with 0xf2) */
+#define X_DIVSD		0x0f5e	/* (with 0xf2) */
+#define X_CVTSI2SD	0x0f2a	/* (with 0xf2) */
+#define X_UCOMISD	0x0f2e	/* (with 0x66) */
+#define X_LEA		0x8d	/* lea r, m */
+#define X_CMPI8		0x83	/* cmp r/m, imm8 (r = 7) */
+#define X_IDIV		0xf7	/* idiv r/m (r = 7) */
+#define X_DEC		0xff	/* dec r/m (r = 1) */
+#define X_CMPMR		0x39	/* cmp r/m, r */
+#define X_MOVZXB	0x0fb6	/* movzx r, byte r/m */
+#define X_SHLI		0xc1	/* shl r/m, imm8 (r = 4) */
+#define X_TESTBI	0xf6	/* test byte r/m, imm8 (r = 0) */
+#define X_CMPBI		0x80	/* cmp byte r/m, imm8 (r = 7) */
+#define X_ADDI8		0x83	/* add r/m, imm8 (r = 0) */
+#define X_ADDI		0x81	/* add r/m, imm32 (r = 0) */
+#define X_AND		0x23	/* and r, r/m */
+#define X_OR		0x0b	/* or r, r/m */
+#define X_XORRM		0x33	/* xor r, r/m */
+
+#define P_SD		0xf2	/* prefix for scalar double operations */
+#define P_PD		0x66	/* prefix for packed double operations */
+
+/* condition codes */
+#define CC_AE	0x3
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_BE	0x6
+#define CC_A	0x7
+#define CC_NS	0x9
+#define CC_L	0xc
+#define CC_LE	0xe
+#define CC_G	0xf
+#define JMP	(-1)	/* unconditional jump */
+
+
+/* offsets of fields used by compiled code */
+#define O_SAVEDPC	cast_int(offsetof(CallInfo, u.l.savedpc))
+#define O_BASE		cast_int(offsetof(CallInfo, u.l.base))
+#define O_FUNC		cast_int(offsetof(CallInfo, func))
+#define O_HOOKMASK	cast_int(offsetof(lua_State, hookmask))
+#define O_UPVALS	cast_int(offsetof(LClosure, upvals))
+#define O_UPV		cast_int(offsetof(UpVal, v))
+#define O_TT		cast_int(offsetof(TValue, tt_))
+#define O_MARKED	cast_int(offsetof(Table, marked))
+#define O_LSIZENODE	cast_int(offsetof(Table, lsizenode))
+#define O_NODE		cast_int(offsetof(Table, node))
+#define O_SHAPE		cast_int(offsetof(Table, shape))
+#define O_SVALS		cast_int(offsetof(Table, svals))
+#define O_NKEYS		cast_int(offsetof(Shape, nkeys))
+#define O_KEYS		cast_int(offsetof(Shape, keys))
+#define O_NODEKEY	cast_int(offsetof(Node, i_key))
+#define O_SIZEARRAY	cast_int(offsetof(Table, sizearray))
+#define O_ARRAY		cast_int(offsetof(Table, array))
+#define O_ATYPE		cast_int(offsetof(Table, atype))
+#define O_SHRLEN	cast_int(offsetof(TString, shrlen))
+#define O_LNGLEN	cast_int(offsetof(TString, u.lnglen))
+#define TVSIZE		cast_int(sizeof(TValue))
+
+
+typedef void (*JitEntry) (lua_State *L, CallInfo *ci, const lu_byte *target);
+
+
+/* maximum number of instructions in a trace */
+#define MAXTRACE	100
+
+/* maximum number of side exits in a trace */
+#define MAXEXITS	(8 * MAXTRACE)
+
+/* maximum size of the code for a side exit */
+#define MAXEXITSIZE	32
+
+/* no type observed */
+#define NOTYPE		0xff
+
+
+/* an instruction recorded for a trace */
+typedef struct TraceIns {
+  int pc;
+  lu_byte ta, tb, tc;  /* observed type tags of R(A), RK(B), and RK(C) */
+  lu_byte aux;  /* array-part hit for tables; positive step for loops */
+} TraceIns;
+
+
+/*
+** State of a recording. While 'G(L)->jitrec' is set, the interpreter
+** calls 'luaJ_record' before each instruction it runs.
+*/
+typedef struct JitRecorder {
+  lua_State *L;  /* thread running the loop */
+  CallInfo *ci;  /* frame running the loop */
+  Proto *p;
+  int start;  /* first instruction of the loop body */
+  int tail;  /* last instruction of the trace */
+  int loop;  /* instruction closing the loop */
+  int n;  /* number of recorded instructions */
+  int foreign;  /* number of instructions seen from other frames */
+  TraceIns ins[MAXTRACE];
+} JitRecorder;
+
+
+/* machine code for a loop, in its own block of executable memory */
+typedef struct JitTrace {
+  struct JitTrace *next;  /* other traces of the same function */
+  size_t size;  /* size of the whole block */
+  int loop;  /* instruction closing the loop */
+  lu_byte *mcode;  /* entry point */
+} JitTrace;
+
+
+/* a pending side exit of a trace */
+typedef struct TraceExit {
+  int j;  /* jump to the exit */
+  int pc;  /* instruction where the function goes on */
+} TraceExit;
+
+
+typedef struct JitState {
+  Proto *p;
+  lu_byte *code;  /* machine code being generated */
+  unsigned int *label;  /* offset in 'code' of each instruction */
+  int n;  /* current size of 'code' */
+  int pc;  /* instruction being compiled */
+  int epilogue;  /* offset of the exit routine */
+  /* fields used only when compiling traces */
+  JitCode *jc;  /* compiled code of the function */
+  int *rtype;  /* known type tag of each register (or -1); NULL if none */
+  TraceExit *exits;  /* pending side exits */
+  int nexits;  /* number of pending side exits */
+  int fail;  /* true if the trace cannot be compiled */
+} JitState;
+
+
+/* a memory operand '[b + d]' */
+typedef struct Loc {
+  int b;
+  int d;
+} Loc;
+
+
+/* list of pending forward jumps to a common target */
+typedef struct JumpList {
+  int n;
+  int j[8];
+} JumpList;
+
+
+
+/*
+** {======================================================
+** Machine-code emission
+** =======================================================
+*/
+
+static void b1 (JitState *J, int b) {
+  J->code[J->n++] = cast(lu_byte, b);
+}
+
+
+static void b4 (JitState *J, int d) {
+  unsigned int u = cast(unsigned int, d);
+  int i;
+  for (i = 0; i < 4; i++, u >>= 8)
+    b1(J, u & 0xff);
+}
+
+
+static void b8 (JitState *J, size_t q) {
+  int i;
+  for (i = 0; i < 8; i++, q >>= 8)
+    b1(J, cast_int(q & 0xff));
+}
+
+
+/* REX prefix, if needed ('w' for 64-bit operands) */
+static void rex (JitState *J, int w, int r, int b) {
+  int x = 0x40 | (w << 3) | ((r & 8) >> 1) | ((b & 8) >> 3);
+  if (x != 0x40) b1(J, x);
+}
+
+
+static void opcode (JitState *J, int op) {
+  if (op > 0xff) b1(J, op >> 8);
+  b1(J, op & 0xff);
+}
+
+
+/* instruction 'op' with register 'r' and memory operand '[b + d]' */
+static void opm (JitState *J, int pfx, int w, int op, int r, Loc m) {
+  if (pfx) b1(J, pfx);
+  rex(J, w, r, m.b);
+  opcode(J, op);
+  b1(J, 0x80 | ((r & 7) << 3) | (m.b & 7));  /* mod = 10 (disp32) */
+  if ((m.b & 7) == RSP) b1(J, 0x24);  /* SIB for rsp and r12 */
+  b4(J, m.d);
+}
+
+
+/* instruction 'op' with register 'r' and memory operand '[b + x*8 + d]' */
+static void opmx (JitState *J, int w, int op, int r, int b, int x, int d) {
+  int rx = 0x40 | (w << 3) | ((r & 8) >> 1) | ((x & 8) >> 2) | ((b & 8) >> 3);
+  if (rx != 0x40) b1(J, rx);
+  opcode(J, op);
+  b1(J, 0x80 | ((r & 7) << 3) | RSP);  /* mod = 10; SIB follows */
+  b1(J, 0xc0 | ((x & 7) << 3) | (b & 7));  /* scale 8 */
+  b4(J, d);
+}
+
+
+/* instruction 'op' with register operands 'r' and 'b' */
+static void opr (JitState *J, int w, int op, int r, int b) {
+  rex(J, w, r, b);
+  opcode(J, op);
+  b1(J, 0xc0 | ((r & 7) << 3) | (b & 7));
+}
+
+
+/* instruction 'op' with memory operand 'm' and 32-bit immediate */
+static void opmi (JitState *J, int w, int op, int r, Loc m, int imm) {
+  opm(J, 0, w, op, r, m);
+  b4(J, imm);
+}
+
+
+/* mov r, imm64 */
+static void movi64 (JitState *J, int r, size_t v) {
+  rex(J, 1, 0, r);
+  b1(J, 0xb8 + (r & 7));
+  b8(J, v);
+}
+
+
+static Loc loc (int b, int d) {
+  Loc m;
+  m.b = b; m.d = d;
+  return m;
+}
+
+
+/* memory operand for field at offset 'd' of value 'v' */
+static Loc field (Loc v, int d) {
+  return loc(v.b, v.d + d);
+}
+
+
+/* register 'r' of the function */
+static Loc reg (int r) {
+  return loc(RBASE, r * TVSIZE);
+}
+
+
+/*
+** Operand RK(x). Constants are addressed through register 'scratch',
+** as they may be too far from 'base' for a 32-bit displacement.
+*/
+static Loc rk (JitState *J, int x, int scratch) {
+  if (ISK(x)) {
+    movi64(J, scratch, cast(size_t, J->p->k + INDEXK(x)));
+    return loc(scratch, 0);
+  }
+  else return reg(x);
+}
+
+
+/*
+** type tag of operand RK(x) if known at compile time (a constant, or a
+** register whose type is known in a trace), or -1
+*/
+static int rktype (JitState *J, int x) {
+  if (ISK(x)) return rttype(J->p->k + INDEXK(x));
+  else return (J->rtype != NULL) ? J->rtype[x] : -1;
+}
+
+
+/*
+** Instruction 'i' as the compiler sees it: superinstructions and
+** quickened instructions become their basic opcodes, and OP_GETFIELD
+** and OP_EQK become OP_GETTABLE and OP_EQ with constant RK(C) (see
+** notes in 'lopcodes.h').
+*/
+static Instruction basicinst (Instruction i) {
+  OpCode op = luaP_basicop(GET_OPCODE(i));
+  if (op == OP_GETFIELD || op == OP_EQK) {
+    SETARG_C(i, RKASK(GETARG_C(i)));
+    op = (op == OP_GETFIELD) ? OP_GETTABLE : OP_EQ;
+  }
+  SET_OPCODE(i, op);
+  return i;
+}
+
+
+/* whether a value of known type 't' (or -1) may be of type 'tt' */
+#define maybetype(t,tt)	((t) < 0 || (t) == (tt))
+
+/* whether a value of known type 't' (or -1) may be a number */
+#define maybenum(t)	((t) < 0 || (t) == LUA_TNUMINT || (t) == LUA_TNUMFLT)
+
+
+/* jump (conditional, unless 'cc' is JMP) to offset 'target' */
+static void jumpto (JitState *J, int cc, int target) {
+  if (cc == JMP) b1(J, 0xe9);
+  else { b1(J, 0x0f); b1(J, 0x80 + cc); }
+  b4(J, target - (J->n + 4));
+}
+
+
+/* jump to the code of instruction 'pc' */
+static void jumppc (JitState *J, int cc, int pc) {
+  jumpto(J, cc, J->label[pc]);
+}
+
+
+/* forward jump to a target still unknown */
+static int jumpfwd (JitState *J, int cc) {
+  jumpto(J, cc, J->n);
+  return J->n;
+}
+
+
+/* fix forward jump 'j' to jump to the current position */
+static void here (JitState *J, int j) {
+  int d = J->n - j;
+  int i;
+  for (i = 0; i < 4; i++, d >>= 8)
+    J->code[j - 4 + i] = cast(lu_byte, d & 0xff);
+}
+
+
+static void addjump (JumpList *l, int j) {
+  lua_assert(l->n < 8);
+  l->j[l->n++] = j;
+}
+
+
+static void herelist (JitState *J, JumpList *l) {
+  int i;
+  for (i = 0; i < l->n; i++)
+    here(J, l->j[i]);
+}
+
+
+/* copy a whole TValue */
+static void copyvalue (JitState *J, Loc to, Loc from) {
+  opm(J, 0, 0, X_MOVUPS, 0, from);
+  opm(J, 0, 0, X_MOVUPSM, 0, to);
+}
+
+
+/* set the type tag of value 'v' */
+static void settag (JitState *J, Loc v, int tt) {
+  opmi(J, 0, X_MOVI, 0, field(v, O_TT), tt);
+}
+
+
+/* compare the type tag of value 'v' with 'tt' */
+static void cmptag (JitState *J, Loc v, int tt) {
+  opmi(J, 0, X_CMPI, 7, field(v, O_TT), tt);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Helpers: compiled code calls them with the same 'i' that
+** 'luaV_execute' would see (in the form given by 'basicinst') and with
+** 'savedpc' already pointing to the next instruction, as in the
+** interpreter
+** =======================================================
+*/
+
+#define RK(x)	(ISK(x) ? k + INDEXK(x) : base + (x))
+
+/* inline cache of the current instruction */
+#define icache(cl,ci)	((cl)->p->icache + pcRel((ci)->u.l.savedpc, (cl)->p))
+
+#define geticache(t,key)	luaH_getcached(t, tsvalue(key), c)
+
+#define checkGC(L,c)  \
+	{ luaC_condGC(L, L->top = (c), L->top = ci->top); \
+	  luai_threadyield(L); }
+
+
+static void jit_arith (lua_State *L, CallInfo *ci, Instruction i) {
+  TValue *k = clLvalue(ci->func)->p->k;
+  StkId base = ci->u.l.base;
+  OpCode op = GET_OPCODE(i);
+  TValue *rb = RK(GETARG_B(i));
+  if (op == OP_ADDI) {
+    TValue rc;
+    setivalue(L, &rc, GETARG_sC(i));
+    luaO_arith(L, LUA_OPADD, rb, &rc, base + GETARG_A(i));
+  }
+  else {
+    TValue *rc = (op == OP_UNM || op == OP_BNOT) ? rb : RK(GETARG_C(i));
+    luaO_arith(L, op - OP_ADD + LUA_OPADD, rb, rc, base + GETARG_A(i));
+  }
+}
+
+
+static int jit_compare (lua_State *L, CallInfo *ci, Instruction i) {
+  TValue *k = clLvalue(ci->func)->p->k;
+  StkId base = ci->u.l.base;
+  TValue *rb = RK(GETARG_B(i));
+  TValue *rc = RK(GETARG_C(i));
+  switch (GET_OPCODE(i)) {
+    case OP_EQ: return luaV_equalobj(L, rb, rc);
+    case OP_LT: return luaV_lessthan(L, rb, rc);
+    default: lua_assert(GET_OPCODE(i) == OP_LE);
+      return luaV_lessequal(L, rb, rc);
+  }
+}
+
+
+static void jit_gettable (lua_State *L, CallInfo *ci, Instruction i) {
+  LClosure *cl = clLvalue(ci->func);
+  TValue *k = cl->p->k;
+  StkId base = ci->u.l.base;
+  StkId ra = base + GETARG_A(i);
+  TValue *rc = RK(GETARG_C(i));
+  unsigned int *c = icache(cl, ci);
+  const TValue *t;
+  const TValue *slot;
+  if (GET_OPCODE(i) == OP_GETINT) {
+    TValue key;
+    t = base + GETARG_B(i);
+    setivalue(L, &key, GETARG_C(i));
+    if (luaV_fastget(L, t, ivalue(&key), slot, luaH_getint))
+      { setobj2s(L, ra, slot); }
+    else
+      luaV_finishget(L, t, &key, ra, slot);
+    return;
+  }
+  if (GET_OPCODE(i) == OP_GETTABUP)
+    t = cl->upvals[GETARG_B(i)]->v;
+  else {
+    t = base + GETARG_B(i);
+    if (GET_OPCODE(i) == OP_SELF)
+      setobjs2s(L, ra + 1, t);
+  }
+  if (ttisshrstring(rc) ? luaV_fastget(L, t, rc, slot, geticache)
+                        : luaV_fastget(L, t, rc, slot, luaH_get))
+    { setobj2s(L, ra, slot); }
+  else
+    luaV_finishgeticache(L, t, rc, ra, slot, c);
+}
+
+
+static void jit_settable (lua_State *L, CallInfo *ci, Instruction i) {
+  LClosure *cl = clLvalue(ci->func);
+  TValue *k = cl->p->k;
+  StkId base = ci->u.l.base;
+  TValue *rb = RK(GETARG_B(i));
+  TValue *rc = RK(GETARG_C(i));
+  unsigned int *c = icache(cl, ci);
+  TValue *t = (GET_OPCODE(i) == OP_SETTABUP) ? cl->upvals[GETARG_A(i)]->v
+                                             : base + GETARG_A(i);
+  const TValue *slot;
+  if (!(ttisshrstring(rb) ? luaV_fastset(L, t, rb, slot, geticache, rc)
+                          : luaV_fastset(L, t, rb, slot, luaH_get, rc)))
+    luaV_finishset(L, t, rb, rc, slot);
+}
+
+
+static void jit_setupval (lua_State *L, CallInfo *ci, Instruction i) {
+  UpVal *uv = clLvalue(ci->func)->upvals[GETARG_B(i)];
+  setobj(L, uv->v, ci->u.l.base + GETARG_A(i));
+  luaC_upvalbarrier(L, uv);
+}
+
+
+static void jit_newtable (lua_State *L, CallInfo *ci, Instruction i) {
+  int b = luaO_fb2int(GETARG_B(i));
+  int c = luaO_fb2int(GETARG_C(i));
+  StkId ra = ci->u.l.base + GETARG_A(i);
+  Table *t = luaH_newinline(L, c);
+  sethvalue(L, ra, t);
+  if (b != 0 || c != 0)
+    luaH_resize(L, t, b, c);
+  checkGC(L, ra + 1);
+}
+
+
+static void jit_len (lua_State *L, CallInfo *ci, Instruction i) {
+  StkId base = ci->u.l.base;
+  luaV_objlen(L, base + GETARG_A(i), base + GETARG_B(i));
+}
+
+
+static void jit_concat (lua_State *L, CallInfo *ci, Instruction i) {
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  StkId ra, rb;
+  L->top = ci->u.l.base + c + 1;  /* mark the end of concat operands */
+  luaV_concat(L, c - b + 1);
+  ra = ci->u.l.base + GETARG_A(i);  /* 'luaV_concat' may move the stack */
+  rb = ci->u.l.base + b;
+  setobjs2s(L, ra, rb);
+  checkGC(L, (ra >= rb ? ra + 1 : rb));
+  L->top = ci->top;  /* restore top */
+}
+
+
+/*
+** Call a function. Return true if it is a Lua function, which is left
+** to the interpreter (with its frame already created).
+*/
+static int jit_call (lua_State *L, CallInfo *ci, Instruction i) {
+  StkId ra = ci->u.l.base + GETARG_A(i);
+  int b = GETARG_B(i);
+  int nresults = GETARG_C(i) - 1;
+  if (b != 0) L->top = ra + b;  /* else previous instruction set top */
+  if (luaD_precall(L, ra, nresults)) {  /* C function? */
+    if (nresults >= 0)
+      L->top = ci->top;  /* adjust results */
+    return 0;
+  }
+  return 1;
+}
+
+
+static void jit_tforcall (lua_State *L, CallInfo *ci, Instruction i) {
+  StkId ra = ci->u.l.base + GETARG_A(i);
+  StkId cb = ra + 3;  /* call base */
+  setobjs2s(L, cb + 2, ra + 2);
+  setobjs2s(L, cb + 1, ra + 1);
+  setobjs2s(L, cb, ra);
+  L->top = cb + 3;  /* func. + 2 args (state and index) */
+  luaD_call(L, cb, GETARG_C(i));
+  L->top = ci->top;
+}
+
+
+/* closing of upvalues by a jump */
+static void jit_close (lua_State *L, CallInfo *ci, Instruction i) {
+  luaF_close(L, ci->u.l.base + GETARG_A(i) - 1);
+}
+
+
+/* floating 'for' loop; return true to jump back */
+static int jit_forloop (lua_State *L, CallInfo *ci, Instruction i) {
+  StkId ra = ci->u.l.base + GETARG_A(i);
+  lua_Number step = fltvalue(ra + 2);
+  lua_Number idx = luai_numadd(L, fltvalue(ra), step);
+  lua_Number limit = fltvalue(ra + 1);
+  UNUSED(L);
+  if (luai_numlt(0, step) ? luai_numle(idx, limit)
+                          : luai_numle(limit, idx)) {
+    chgfltvalue(ra, idx);  /* update internal index... */
+    setfltvalue(ra + 3, idx);  /* ...and external index */
+    return 1;
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Code generation
+** =======================================================
+*/
+
+/* leave compiled code, to resume the interpreter at instruction 'pc' */
+static void exitto (JitState *J, int pc) {
+  movi64(J, RAX, cast(size_t, J->p->code + pc));
+  opm(J, 0, 1, X_MOVMR, RAX, loc(RCI, O_SAVEDPC));
+  jumpto(J, JMP, J->epilogue);
+}
+
+
+/* leave compiled code at instruction 'pc' if a line/count hook is on */
+static void checkhook (JitState *J, int pc) {
+  int j;
+  opmi(J, 0, X_TESTI, 0, loc(RL, O_HOOKMASK), LUA_MASKLINE | LUA_MASKCOUNT);
+  j = jumpfwd(J, CC_E);
+  exitto(J, pc);
+  here(J, j);
+}
+
+
+/* backward jump to instruction 'pc' */
+static void jumpback (JitState *J, int pc) {
+  checkhook(J, pc);
+  jumppc(J, JMP, pc);
+}
+
+
+/* call helper 'f' for instruction 'i'; its result goes to eax */
+static void callhelper (JitState *J, size_t f, Instruction i) {
+  movi64(J, RAX, cast(size_t, J->p->code + J->pc + 1));
+  opm(J, 0, 1, X_MOVMR, RAX, loc(RCI, O_SAVEDPC));  /* savedpc = pc + 1 */
+  opr(J, 1, X_MOVMR, RL, RDI);  /* 1st argument: L */
+  opr(J, 1, X_MOVMR, RCI, RSI);  /* 2nd argument: ci */
+  b1(J, 0xba); b4(J, cast_int(i));  /* 3rd argument (edx): i */
+  movi64(J, RAX, f);
+  b1(J, 0xff); b1(J, 0xd0);  /* call rax */
+  opm(J, 0, 1, X_MOVRM, RBASE, loc(RCI, O_BASE));  /* reload base */
+}
+
+#define helper(J,f,i)	callhelper(J, cast(size_t, f), i)
+
+
+/* call a helper that works like a plain instruction */
+static void callplain (JitState *J, size_t f, Instruction i) {
+  callhelper(J, f, i);
+  checkhook(J, J->pc + 1);
+}
+
+#define plain(J,f,i)	callplain(J, cast(size_t, f), i)
+
+
+static const lu_byte *jit_hotloop (lua_State *L, CallInfo *ci,
+                                   Instruction i);
+
+/*
+** Backward jump to instruction 'pc' closing a loop: count the
+** iteration in the inline cache of the current instruction and, when
+** the loop gets hot, let 'jit_hotloop' choose where to go on.
+*/
+static void loopback (JitState *J, Instruction i, int pc) {
+  int cold, go;
+  movi64(J, RAX, cast(size_t, J->p->icache + J->pc));
+  opm(J, 0, 0, X_ADDI8, 0, loc(RAX, 0)); b1(J, 1);
+  opmi(J, 0, X_CMPI, 7, loc(RAX, 0), LUAI_TRACEHOT);
+  cold = jumpfwd(J, CC_NE);
+  helper(J, jit_hotloop, i);
+  opr(J, 1, X_TEST, RAX, RAX);
+  go = jumpfwd(J, CC_E);
+  b1(J, 0xff); b1(J, 0xe0);  /* jmp rax */
+  here(J, cold);
+  here(J, go);
+  jumpback(J, pc);
+}
+
+
+/* exit routine: undo the entry routine and return to 'luaJ_run' */
+static void exitroutine (JitState *J) {
+  J->epilogue = J->n;
+  b1(J, 0x48); b1(J, 0x83); b1(J, 0xc4); b1(J, 0x08);  /* add rsp, 8 */
+  b1(J, 0x41); b1(J, 0x5f);  /* pop r15 */
+  b1(J, 0x41); b1(J, 0x5e);  /* pop r14 */
+  b1(J, 0x41); b1(J, 0x5d);  /* pop r13 */
+  b1(J, 0x41); b1(J, 0x5c);  /* pop r12 */
+  b1(J, 0x5b);  /* pop rbx */
+  b1(J, 0x5d);  /* pop rbp */
+  b1(J, 0xc3);  /* ret */
+}
+
+
+/*
+** Entry routine, called as 'entry(L, ci, target)': save callee-saved
+** registers, set up the fixed registers, and jump to 'target'. The
+** exit routine follows it.
+*/
+static void entryexit (JitState *J) {
+  b1(J, 0x55);  /* push rbp */
+  b1(J, 0x53);  /* push rbx */
+  b1(J, 0x41); b1(J, 0x54);  /* push r12 */
+  b1(J, 0x41); b1(J, 0x55);  /* push r13 */
+  b1(J, 0x41); b1(J, 0x56);  /* push r14 */
+  b1(J, 0x41); b1(J, 0x57);  /* push r15 */
+  b1(J, 0x48); b1(J, 0x83); b1(J, 0xec); b1(J, 0x08);  /* sub rsp, 8 */
+  opr(J, 1, X_MOVMR, RDI, RL);
+  opr(J, 1, X_MOVMR, RSI, RCI);
+  opm(J, 0, 1, X_MOVRM, RBASE, loc(RCI, O_BASE));
+  opm(J, 0, 1, X_MOVRM, RAX, loc(RCI, O_FUNC));
+  opm(J, 0, 1, X_MOVRM, RCL, loc(RAX, 0));  /* closure from 'ci->func' */
+  b1(J, 0xff); b1(J, 0xe2);  /* jmp rdx */
+  exitroutine(J);
+  lua_assert(J->n <= MAXENTRYSIZE);
+}
+
+
+/* jump to instruction 'pc' if value 'v' is false ('cond' = 0) or true */
+static void jumptruth (JitState *J, Loc v, int cond, int pc) {
+  int j;
+  cmptag(J, v, LUA_TNIL);
+  if (cond) j = jumpfwd(J, CC_E);
+  else jumppc(J, CC_E, pc);
+  cmptag(J, v, LUA_TBOOLEAN);
+  if (cond) jumppc(J, CC_NE, pc);
+  else j = jumpfwd(J, CC_NE);
+  opmi(J, 0, X_CMPI, 7, v, 0);  /* boolean value */
+  jumppc(J, cond ? CC_NE : CC_E, pc);
+  here(J, j);
+}
+
+
+/* jump to 'l' if value 'v' (of known type 't' or -1) is not of type 'tt' */
+static void guardtag (JitState *J, Loc v, int t, int tt, JumpList *l) {
+  if (t < 0) {
+    cmptag(J, v, tt);
+    addjump(l, jumpfwd(J, CC_NE));
+  }
+}
+
+
+/* load number 'v' (of known type 't' or -1) as a float into 'xmm' */
+static void loadnum (JitState *J, int xmm, Loc v, int t, JumpList *notnum) {
+  if (t == LUA_TNUMFLT)
+    opm(J, P_SD, 0, X_MOVUPS, xmm, v);
+  else if (t == LUA_TNUMINT)
+    opm(J, P_SD, 1, X_CVTSI2SD, xmm, v);
+  else {
+    int notflt, done;
+    cmptag(J, v, LUA_TNUMFLT);
+    notflt = jumpfwd(J, CC_NE);
+    opm(J, P_SD, 0, X_MOVUPS, xmm, v);
+    done = jumpfwd(J, JMP);
+    here(J, notflt);
+    cmptag(J, v, LUA_TNUMINT);
+    addjump(notnum, jumpfwd(J, CC_NE));
+    opm(J, P_SD, 1, X_CVTSI2SD, xmm, v);
+    here(J, done);
+  }
+}
+
+
+/*
+** Integer '%' and '//' (see 'luaV_mod' and 'luaV_div'); divisors 0
+** and -1 go to 'slow'.
+*/
+static void intdiv (JitState *J, OpCode op, Loc ra, Loc rb, Loc rc,
+                    JumpList *slow) {
+  int exact, done;
+  opm(J, 0, 1, X_MOVRM, RCX, rc);
+  opm(J, 0, 1, X_LEA, RDX, loc(RCX, 1));
+  opr(J, 1, X_CMPI8, 7, RDX); b1(J, 1);  /* cmp rdx, 1 */
+  addjump(slow, jumpfwd(J, CC_BE));  /* (unsigned) divisor + 1 <= 1? */
+  opm(J, 0, 1, X_MOVRM, RAX, rb);
+  b1(J, 0x48); b1(J, 0x99);  /* cqo */
+  opr(J, 1, X_IDIV, 7, RCX);  /* rax = quotient; rdx = remainder */
+  opr(J, 1, X_TEST, RDX, RDX);
+  exact = jumpfwd(J, CC_E);
+  opm(J, 0, 1, X_MOVRM, RSI, rb);
+  opr(J, 1, X_XOR, RCX, RSI);
+  done = jumpfwd(J, CC_NS);  /* operands with the same sign? */
+  if (op == OP_MOD)
+    opr(J, 1, X_ADDMR, RCX, RDX);  /* correct remainder */
+  else
+    opr(J, 1, X_DEC, 1, RAX);  /* correct quotient */
+  here(J, exact);
+  here(J, done);
+  opm(J, 0, 1, X_MOVMR, op == OP_MOD ? RDX : RAX, ra);
+}
+
+
+/* x86-64 opcode for integer operation 'op' */
+static int intopcode (OpCode op) {
+  switch (op) {
+    case OP_ADD: return X_ADD;
+    case OP_SUB: return X_SUB;
+    case OP_MUL: return X_IMUL;
+    case OP_BAND: return X_AND;
+    case OP_BOR: return X_OR;
+    default: lua_assert(op == OP_BXOR); return X_XORRM;
+  }
+}
+
+
+/*
+** Arithmetic: inline code for integers (except for '/') and for
+** floats (only for '+', '-', '*', and '/', converting integers as
+** needed); the helper handles everything else.
+*/
+static void arith (JitState *J, Instruction i) {
+  OpCode op = GET_OPCODE(i);
+  int fltop = (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV);
+  int tb = rktype(J, GETARG_B(i));
+  int tc = rktype(J, GETARG_C(i));
+  Loc ra = reg(GETARG_A(i));
+  Loc rb = rk(J, GETARG_B(i), R8);
+  Loc rc = rk(J, GETARG_C(i), R9);
+  JumpList done = {0, {0}};
+  JumpList slow = {0, {0}};
+  if (op != OP_DIV && maybetype(tb, LUA_TNUMINT) &&
+                      maybetype(tc, LUA_TNUMINT)) {
+    JumpList notint = {0, {0}};
+    guardtag(J, rb, tb, LUA_TNUMINT, &notint);
+    guardtag(J, rc, tc, LUA_TNUMINT, &notint);
+    if (op == OP_MOD || op == OP_IDIV)
+      intdiv(J, op, ra, rb, rc, &slow);
+    else {
+      opm(J, 0, 1, X_MOVRM, RAX, rb);
+      opm(J, 0, 1, intopcode(op), RAX, rc);
+      opm(J, 0, 1, X_MOVMR, RAX, ra);
+    }
+    settag(J, ra, LUA_TNUMINT);
+    addjump(&done, jumpfwd(J, JMP));
+    herelist(J, &notint);
+  }
+  if (fltop && maybenum(tb) && maybenum(tc)) {
+    JumpList notnum = {0, {0}};
+    loadnum(J, 0, rb, tb, &notnum);
+    loadnum(J, 1, rc, tc, &notnum);
+    b1(J, P_SD);
+    opr(J, 0, op == OP_ADD ? X_ADDSD : op == OP_SUB ? X_SUBSD
+            : op == OP_MUL ? X_MULSD : X_DIVSD, 0, 1);  /* xmm0 op= xmm1 */
+    opm(J, P_SD, 0, X_MOVUPSM, 0, ra);
+    settag(J, ra, LUA_TNUMFLT);
+    addjump(&done, jumpfwd(J, JMP));
+    herelist(J, &notnum);
+  }
+  herelist(J, &slow);
+  plain(J, jit_arith, i);
+  herelist(J, &done);
+}
+
+
+/* OP_ADDI: like 'arith' for '+', with an immediate integer operand */
+static void addi (JitState *J, Instruction i) {
+  int tb = rktype(J, GETARG_B(i));
+  int ic = GETARG_sC(i);
+  Loc ra = reg(GETARG_A(i));
+  Loc rb = reg(GETARG_B(i));
+  JumpList done = {0, {0}};
+  JumpList notnum = {0, {0}};
+  if (maybetype(tb, LUA_TNUMINT)) {
+    JumpList notint = {0, {0}};
+    guardtag(J, rb, tb, LUA_TNUMINT, &notint);
+    opm(J, 0, 1, X_MOVRM, RAX, rb);
+    opr(J, 1, X_ADDI, 0, RAX); b4(J, ic);
+    opm(J, 0, 1, X_MOVMR, RAX, ra);
+    settag(J, ra, LUA_TNUMINT);
+    addjump(&done, jumpfwd(J, JMP));
+    herelist(J, &notint);
+  }
+  if (maybenum(tb)) {
+    loadnum(J, 0, rb, tb, &notnum);
+    movi64(J, RAX, l_castS2U(ic));
+    b1(J, P_SD);
+    opr(J, 1, X_CVTSI2SD, 1, RAX);  /* xmm1 = (float)ic */
+    b1(J, P_SD);
+    opr(J, 0, X_ADDSD, 0, 1);  /* xmm0 += xmm1 */
+    opm(J, P_SD, 0, X_MOVUPSM, 0, ra);
+    settag(J, ra, LUA_TNUMFLT);
+    addjump(&done, jumpfwd(J, JMP));
+  }
+  herelist(J, &notnum);
+  plain(J, jit_arith, i);
+  herelist(J, &done);
+}
+
+
+/*
+** OP_EQ, OP_LT, and OP_LE: inline code for two integers and, for
+** order, two floats. The following jump (at pc + 1) is compiled as a
+** regular instruction.
+*/
+static void compare (JitState *J, Instruction i, int icc, int fcc) {
+  int tb = rktype(J, GETARG_B(i));
+  int tc = rktype(J, GETARG_C(i));
+  int a = GETARG_A(i);
+  Loc rb = rk(J, GETARG_B(i), R8);
+  Loc rc = rk(J, GETARG_C(i), R9);
+  if (maybetype(tb, LUA_TNUMINT) && maybetype(tc, LUA_TNUMINT)) {
+    JumpList notint = {0, {0}};
+    guardtag(J, rb, tb, LUA_TNUMINT, &notint);
+    guardtag(J, rc, tc, LUA_TNUMINT, &notint);
+    opm(J, 0, 1, X_MOVRM, RAX, rb);
+    opm(J, 0, 1, X_CMP, RAX, rc);
+    jumppc(J, a ? icc : icc ^ 1, J->pc + 1);  /* condition is 'a'? */
+    jumppc(J, JMP, J->pc + 2);  /* else skip the jump */
+    herelist(J, &notint);
+  }
+  if (fcc >= 0 && maybetype(tb, LUA_TNUMFLT) && maybetype(tc, LUA_TNUMFLT)) {
+    JumpList notflt = {0, {0}};
+    guardtag(J, rb, tb, LUA_TNUMFLT, &notflt);
+    guardtag(J, rc, tc, LUA_TNUMFLT, &notflt);
+    /* compare 'rc' with 'rb', so that unordered (NaN) means false */
+    opm(J, P_SD, 0, X_MOVUPS, 0, rc);
+    opm(J, P_PD, 0, X_UCOMISD, 0, rb);
+    jumppc(J, a ? fcc : fcc ^ 1, J->pc + 1);
+    jumppc(J, JMP, J->pc + 2);
+    herelist(J, &notflt);
+  }
+  helper(J, jit_compare, i);
+  b1(J, 0x3d); b4(J, a);  /* cmp eax, a */
+  jumppc(J, CC_E, J->pc + 1);
+  jumppc(J, JMP, J->pc + 2);
+}
+
+
+/*
+** Inline version of 'luaH_getcached' for table 't' and short-string
+** constant 'key', for hits in the inline cache of the current
+** instruction: leave the table in rax and its slot for 'key' in rsi.
+** Misses (and non-table values) jump to 'slow'.
+*/
+static void cachedslot (JitState *J, Loc t, TString *key, JumpList *slow) {
+  int hash, done;
+  cmptag(J, t, ctb(LUA_TTABLE));
+  addjump(slow, jumpfwd(J, CC_NE));
+  opm(J, 0, 1, X_MOVRM, RAX, t);
+  movi64(J, RDX, cast(size_t, J->p->icache + J->pc));
+  opm(J, 0, 0, X_MOVRM, RDX, loc(RDX, 0));  /* edx = cached index */
+  movi64(J, RSI, cast(size_t, key));
+  opm(J, 0, 1, X_MOVRM, RCX, loc(RAX, O_SHAPE));
+  opr(J, 1, X_TEST, RCX, RCX);
+  hash = jumpfwd(J, CC_E);
+  /* shaped table */
+  opm(J, 0, 0, X_MOVZXB, RDI, loc(RCX, O_NKEYS));
+  opr(J, 0, X_CMP, RDX, RDI);
+  addjump(slow, jumpfwd(J, CC_AE));  /* index >= nkeys? */
+  opmx(J, 1, X_CMPMR, RSI, RCX, RDX, O_KEYS);
+  addjump(slow, jumpfwd(J, CC_NE));  /* keys[index] != key? */
+  opr(J, 1, X_SHLI, 4, RDX); b1(J, 4);  /* index * sizeof(TValue) */
+  lua_assert(TVSIZE == 16);
+  opm(J, 0, 1, X_MOVRM, RSI, loc(RAX, O_SVALS));
+  opr(J, 1, X_ADDMR, RDX, RSI);
+  done = jumpfwd(J, JMP);
+  here(J, hash);  /* hash part */
+  opm(J, 0, 0, X_MOVZXB, RCX, loc(RAX, O_LSIZENODE));
+  b1(J, 0xbf); b4(J, 1);  /* mov edi, 1 */
+  b1(J, 0xd3); b1(J, 0xe7);  /* shl edi, cl */
+  opr(J, 0, X_CMP, RDX, RDI);
+  addjump(slow, jumpfwd(J, CC_AE));  /* index >= sizenode? */
+  opr(J, 1, X_SHLI, 4, RDX); b1(J, 5);  /* index * sizeof(Node) */
+  lua_assert(sizeof(Node) == 32);
+  opm(J, 0, 1, X_ADD, RDX, loc(RAX, O_NODE));
+  opm(J, 0, 1, X_CMPMR, RSI, loc(RDX, O_NODEKEY));
+  addjump(slow, jumpfwd(J, CC_NE));  /* key value is not 'key'? */
+  cmptag(J, loc(RDX, O_NODEKEY), ctb(LUA_TSHRSTR));
+  addjump(slow, jumpfwd(J, CC_NE));  /* (value could be a non-string) */
+  opr(J, 1, X_MOVMR, RDX, RSI);  /* slot is the node value */
+  here(J, done);
+}
+
+
+/* short-string constant used as key by operand RK(x), or NULL */
+static TString *shrkey (JitState *J, int x) {
+  TValue *k = J->p->k + INDEXK(x);
+  return (ISK(x) && ttisshrstring(k)) ? tsvalue(k) : NULL;
+}
+
+
+/*
+** OP_GETTABUP, OP_GETTABLE, and OP_SELF: inline code for short-string
+** constant keys present in the table through the inline cache
+*/
+static void gettable (JitState *J, Instruction i) {
+  TString *key = shrkey(J, GETARG_C(i));
+  Loc ra = reg(GETARG_A(i));
+  Loc t;
+  JumpList slow = {0, {0}};
+  int done;
+  if (GET_OPCODE(i) == OP_GETTABUP) {
+    opm(J, 0, 1, X_MOVRM, R8,
+            loc(RCL, O_UPVALS + GETARG_B(i) * cast_int(sizeof(UpVal *))));
+    opm(J, 0, 1, X_MOVRM, R8, loc(R8, O_UPV));
+    t = loc(R8, 0);
+  }
+  else {
+    t = reg(GETARG_B(i));
+    if (GET_OPCODE(i) == OP_SELF)
+      copyvalue(J, field(ra, TVSIZE), t);
+  }
+  if (key == NULL) {
+    plain(J, jit_gettable, i);
+    return;
+  }
+  cachedslot(J, t, key, &slow);
+  cmptag(J, loc(RSI, 0), LUA_TNIL);
+  addjump(&slow, jumpfwd(J, CC_E));  /* absent key may need '__index' */
+  copyvalue(J, ra, loc(RSI, 0));
+  done = jumpfwd(J, JMP);
+  herelist(J, &slow);
+  plain(J, jit_gettable, i);
+  here(J, done);
+}
+
+
+/*
+** OP_GETINT for a key C > 0 present in the array part of the table;
+** anything else jumps to 'miss'
+*/
+static void getint (JitState *J, Instruction i, JumpList *miss) {
+  int c = GETARG_C(i);
+  Loc t = reg(GETARG_B(i));
+  Loc slot = loc(RCX, (c - 1) * TVSIZE);
+  lua_assert(c > 0);
+  guardtag(J, t, rktype(J, GETARG_B(i)), ctb(LUA_TTABLE), miss);
+  opm(J, 0, 1, X_MOVRM, RAX, t);
+  opmi(J, 0, X_CMPI, 7, loc(RAX, O_SIZEARRAY), c - 1);
+  addjump(miss, jumpfwd(J, CC_BE));  /* (unsigned) sizearray <= c - 1? */
+  opm(J, 0, 1, X_MOVRM, RCX, loc(RAX, O_ARRAY));
+  cmptag(J, slot, LUA_TNIL);
+  addjump(miss, jumpfwd(J, CC_E));  /* absent key may need '__index' */
+  copyvalue(J, reg(GETARG_A(i)), slot);
+}
+
+
+/*
+** OP_SETTABUP and OP_SETTABLE: inline code for short-string constant
+** keys present in the table through the inline cache, when no barrier
+** is needed
+*/
+static void settable (JitState *J, Instruction i) {
+  TString *key = shrkey(J, GETARG_B(i));
+  Loc t;
+  Loc rc;
+  JumpList slow = {0, {0}};
+  int done, nobarrier;
+  if (key == NULL) {
+    plain(J, jit_settable, i);
+    return;
+  }
+  if (GET_OPCODE(i) == OP_SETTABUP) {
+    opm(J, 0, 1, X_MOVRM, R8,
+            loc(RCL, O_UPVALS + GETARG_A(i) * cast_int(sizeof(UpVal *))));
+    opm(J, 0, 1, X_MOVRM, R8, loc(R8, O_UPV));
+    t = loc(R8, 0);
+  }
+  else t = reg(GETARG_A(i));
+  cachedslot(J, t, key, &slow);
+  cmptag(J, loc(RSI, 0), LUA_TNIL);
+  addjump(&slow, jumpfwd(J, CC_E));  /* absent key may need '__newindex' */
+  rc = rk(J, GETARG_C(i), R9);
+  opmi(J, 0, X_TESTI, 0, field(rc, O_TT), BIT_ISCOLLECTABLE);
+  nobarrier = jumpfwd(J, CC_E);
+  opm(J, 0, 0, X_TESTBI, 0, loc(RAX, O_MARKED)); b1(J, bitmask(BLACKBIT));
+  addjump(&slow, jumpfwd(J, CC_NE));  /* black table: needs a barrier */
+  here(J, nobarrier);
+  copyvalue(J, loc(RSI, 0), rc);
+  done = jumpfwd(J, JMP);
+  herelist(J, &slow);
+  plain(J, jit_settable, i);
+  here(J, done);
+}
+
+
+static void forloop (JitState *J, Instruction i) {
+  Loc ra = reg(GETARG_A(i));
+  int target = J->pc + 1 + GETARG_sBx(i);
+  JumpList out = {0, {0}};
+  int notint, neg, cont, back;
+  cmptag(J, ra, LUA_TNUMINT);
+  notint = jumpfwd(J, CC_NE);
+  opm(J, 0, 1, X_MOVRM, RAX, ra);  /* index */
+  opm(J, 0, 1, X_MOVRM, RCX, field(ra, 2 * TVSIZE));  /* step */
+  opr(J, 1, X_ADDMR, RCX, RAX);
+  opr(J, 1, X_TEST, RCX, RCX);
+  neg = jumpfwd(J, CC_LE);
+  opm(J, 0, 1, X_CMP, RAX, field(ra, TVSIZE));  /* compare with limit */
+  addjump(&out, jumpfwd(J, CC_G));
+  cont = jumpfwd(J, JMP);
+  here(J, neg);
+  opm(J, 0, 1, X_CMP, RAX, field(ra, TVSIZE));
+  addjump(&out, jumpfwd(J, CC_L));
+  here(J, cont);
+  opm(J, 0, 1, X_MOVMR, RAX, ra);  /* update internal index... */
+  opm(J, 0, 1, X_MOVMR, RAX, field(ra, 3 * TVSIZE));  /* ...and external */
+  settag(J, field(ra, 3 * TVSIZE), LUA_TNUMINT);
+  back = J->n;
+  loopback(J, i, target);
+  here(J, notint);  /* floating loop */
+  helper(J, jit_forloop, i);
+  opr(J, 0, X_TEST, RAX, RAX);
+  addjump(&out, jumpfwd(J, CC_E));
+  jumpto(J, JMP, back);
+  herelist(J, &out);
+}
+
+
+/*
+** Generate code for the instruction at 'J->pc'. Return false if the
+** instruction is left to the interpreter.
+*/
+static int compileinst (JitState *J, Instruction i) {
+  int pc = J->pc;
+  Loc ra = reg(GETARG_A(i));
+  i = basicinst(i);
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: {
+      copyvalue(J, ra, reg(GETARG_B(i)));
+      break;
+    }
+    case OP_LOADK: {
+      movi64(J, RCX, cast(size_t, J->p->k + GETARG_Bx(i)));
+      copyvalue(J, ra, loc(RCX, 0));
+      break;
+    }
+    case OP_LOADBOOL: {
+      opmi(J, 0, X_MOVI, 0, ra, GETARG_B(i));
+      settag(J, ra, LUA_TBOOLEAN);
+      if (GETARG_C(i)) jumppc(J, JMP, pc + 2);  /* skip next instruction */
+      break;
+    }
+    case OP_LOADNIL: {
+      int b = GETARG_B(i);
+      if (b >= 16) goto leave;  /* too much code */
+      do {
+        settag(J, ra, LUA_TNIL);
+        ra.d += TVSIZE;
+      } while (b--);
+      break;
+    }
+    case OP_GETUPVAL: {
+      opm(J, 0, 1, X_MOVRM, RAX,
+              loc(RCL, O_UPVALS + GETARG_B(i) * cast_int(sizeof(UpVal *))));
+      opm(J, 0, 1, X_MOVRM, RAX, loc(RAX, O_UPV));
+      copyvalue(J, ra, loc(RAX, 0));
+      break;
+    }
+    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF: {
+      gettable(J, i);
+      break;
+    }
+    case OP_GETINT: {
+      JumpList slow = {0, {0}};
+      int done;
+      if (GETARG_C(i) == 0 ||
+          !maybetype(rktype(J, GETARG_B(i)), ctb(LUA_TTABLE))) {
+        plain(J, jit_gettable, i);  /* never in the array part */
+        break;
+      }
+      getint(J, i, &slow);
+      done = jumpfwd(J, JMP);
+      herelist(J, &slow);
+      plain(J, jit_gettable, i);
+      here(J, done);
+      break;
+    }
+    case OP_SETTABUP: case OP_SETTABLE: {
+      settable(J, i);
+      break;
+    }
+    case OP_SETUPVAL: {
+      plain(J, jit_setupval, i);
+      break;
+    }
+    case OP_NEWTABLE: {
+      plain(J, jit_newtable, i);
+      break;
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+    case OP_MOD: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR: {
+      arith(J, i);
+      break;
+    }
+    case OP_ADDI: {
+      addi(J, i);
+      break;
+    }
+    case OP_POW: case OP_SHL: case OP_SHR: case OP_UNM: case OP_BNOT: {
+      plain(J, jit_arith, i);
+      break;
+    }
+    case OP_NOT: {
+      Loc rb = reg(GETARG_B(i));
+      int j1, j2, j3;
+      b1(J, 0xb8); b4(J, 1);  /* mov eax, 1 (assume 'rb' is false) */
+      cmptag(J, rb, LUA_TNIL);
+      j1 = jumpfwd(J, CC_E);
+      cmptag(J, rb, LUA_TBOOLEAN);
+      j2 = jumpfwd(J, CC_NE);
+      opmi(J, 0, X_CMPI, 7, rb, 0);
+      j3 = jumpfwd(J, CC_E);
+      here(J, j2);
+      opr(J, 0, X_XOR, RAX, RAX);  /* 'rb' is true */
+      here(J, j1); here(J, j3);
+      opm(J, 0, 0, X_MOVMR, RAX, ra);
+      settag(J, ra, LUA_TBOOLEAN);
+      break;
+    }
+    case OP_LEN: {
+      plain(J, jit_len, i);
+      break;
+    }
+    case OP_CONCAT: {
+      plain(J, jit_concat, i);
+      break;
+    }
+    case OP_JMP: {
+      int target = pc + 1 + GETARG_sBx(i);
+      if (GETARG_A(i) != 0)
+        helper(J, jit_close, i);
+      if (target <= pc) jumpback(J, target);
+      else jumppc(J, JMP, target);
+      break;
+    }
+    case OP_EQ: compare(J, i, CC_E, -1); break;
+    case OP_LT: compare(J, i, CC_L, CC_A); break;
+    case OP_LE: compare(J, i, CC_LE, CC_AE); break;
+    case OP_TEST: {  /* if not (R(A) <=> C) then pc++ */
+      jumptruth(J, ra, GETARG_C(i) == 0, pc + 2);
+      jumppc(J, JMP, pc + 1);
+      break;
+    }
+    case OP_TESTSET: {  /* if (R(B) <=> C) then R(A) := R(B) else pc++ */
+      Loc rb = reg(GETARG_B(i));
+      jumptruth(J, rb, GETARG_C(i) == 0, pc + 2);
+      copyvalue(J, ra, rb);
+      jumppc(J, JMP, pc + 1);
+      break;
+    }
+    case OP_CALL: {
+      helper(J, jit_call, i);
+      opr(J, 0, X_TEST, RAX, RAX);
+      jumpto(J, CC_NE, J->epilogue);  /* Lua function? leave it */
+      checkhook(J, pc + 1);
+      break;
+    }
+    case OP_FORLOOP: {
+      forloop(J, i);
+      break;
+    }
+    case OP_TFORCALL: {  /* next instruction is OP_TFORLOOP */
+      plain(J, jit_tforcall, i);
+      break;
+    }
+    case OP_TFORLOOP: {
+      int j;
+      cmptag(J, field(ra, TVSIZE), LUA_TNIL);
+      j = jumpfwd(J, CC_E);
+      copyvalue(J, ra, field(ra, TVSIZE));
+      loopback(J, i, pc + 1 + GETARG_sBx(i));
+      here(J, j);
+      break;
+    }
+    default: leave: {  /* calls, returns, closures, etc. */
+      exitto(J, pc);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Generate the code for the whole function. Return the size of the
+** generated code. Offsets of instructions compiled by the interpreter
+** go to 'addr' (if not NULL) as 0.
+*/
+static int compile (JitState *J, unsigned int *addr) {
+  Proto *p = J->p;
+  J->n = 0;
+  entryexit(J);
+  for (J->pc = 0; J->pc < p->sizecode; J->pc++) {
+    int compiled;
+    J->label[J->pc] = J->n;
+    compiled = compileinst(J, p->code[J->pc]);
+    lua_assert(J->n - cast_int(J->label[J->pc]) <= MAXINSTSIZE);
+    if (addr) addr[J->pc] = compiled ? J->label[J->pc] : 0;
+  }
+  return J->n;
+}
+
+
+#define alignup(n,a)	(((n) + (a) - 1) & ~((a) - 1))
+
+
+/*
+** Compile function 'p'. The block of memory holding the code is
+** allocated with room for the largest possible code (plus the labels
+** of the first pass, after it); the unused part is released at the
+** end. If anything fails, the function just keeps being interpreted.
+*/
+void luaJ_compile (lua_State *L, Proto *p) {
+  size_t page = cast(size_t, sysconf(_SC_PAGESIZE));
+  size_t hsize = alignup(offsetof(JitCode, addr) +
+                         p->sizecode * sizeof(unsigned int), 16);
+  size_t csize = MAXENTRYSIZE + cast(size_t, p->sizecode) * MAXINSTSIZE;
+  size_t size = alignup(hsize + csize + p->sizecode * sizeof(unsigned int),
+                        page);
+  size_t used;
+  JitState J;
+  JitCode *jc;
+  UNUSED(L);
+  p->jitcount = 0;  /* do not count it anymore */
+  jc = cast(JitCode *, mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (jc == MAP_FAILED)
+    return;  /* not enough memory; keep interpreting the function */
+  jc->mcode = cast(lu_byte *, jc) + hsize;
+  J.p = p;
+  J.code = jc->mcode;
+  J.label = cast(unsigned int *, jc->mcode + csize);
+  J.jc = jc;
+  J.rtype = NULL;
+  J.exits = NULL;
+  J.nexits = J.fail = 0;
+  compile(&J, NULL);  /* first pass: compute labels */
+  used = alignup(hsize + compile(&J, jc->addr), page);  /* final code */
+  jc->epilogue = J.epilogue;
+  if (used < size)  /* release unused memory */
+    munmap(cast(lu_byte *, jc) + used, size - used);
+  jc->size = used;
+  if (mprotect(jc, used, PROT_READ | PROT_EXEC) != 0) {
+    munmap(jc, used);
+    return;
+  }
+  p->jit = jc;
+}
+
+
+/*
+** Run the compiled code of the function running in 'ci', starting at
+** offset 'addr', until it reaches an instruction for the interpreter.
+*/
+void luaJ_run (lua_State *L, CallInfo *ci, unsigned int addr) {
+  JitCode *jc = clLvalue(ci->func)->p->jit;
+  JitEntry entry = cast(JitEntry, cast(void *, jc->mcode));
+  entry(L, ci, jc->mcode + addr);
+}
+
+
+void luaJ_free (lua_State *L, Proto *p) {
+  global_State *g = G(L);
+  JitTrace *tr = p->traces;
+  if (g->jitrec != NULL && g->jitrec->p == p) {  /* recording it? */
+    (*g->frealloc)(g->ud, g->jitrec, sizeof(JitRecorder), 0);
+    g->jitrec = NULL;
+  }
+  while (tr != NULL) {
+    JitTrace *next = tr->next;
+    munmap(tr, tr->size);
+    tr = next;
+  }
+  if (p->jit != NULL)
+    munmap(p->jit, p->jit->size);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Traces
+** =======================================================
+*/
+
+/*
+** A loop is traced when its closing instruction (OP_FORLOOP or
+** OP_TFORLOOP) has jumped back LUAI_TRACEHOT times in compiled code,
+** counted in its inline cache (which these instructions do not use
+** otherwise). 'jit_hotloop' then starts a recording and the next
+** iteration runs in the interpreter, which records each instruction
+** of our frame with the types of its operands (see 'observe'). When
+** the recording reaches the end of the loop body, it is compiled:
+** instructions that the interpreter skipped are not in the trace, and
+** conditional jumps become guards. Compiled traces are entered from
+** the code of the closing instruction, which keeps its counter at
+** LUAI_TRACEHOT - 1 for that; loops that cannot be traced get
+** LUAI_TRACEHOT, so that their counter never hits it again.
+**
+** Values stay in the Lua stack, so a side exit only has to jump to
+** the compiled code of the instruction where the function goes on (or
+** to the interpreter). A trace keeps the type of each register that
+** it already checked or computed, to avoid further checks; it forgets
+** them after running any code that could change them behind its back
+** (calls, metamethods, finalizers, etc.).
+*/
+
+/* instructions seen from other frames before giving up a recording */
+#define MAXFOREIGN	1000
+
+#define isnumtag(t)	((t) == LUA_TNUMINT || (t) == LUA_TNUMFLT)
+
+
+/* leave the trace if condition 'cc' holds, going on at instruction 'pc' */
+static void exitif (JitState *J, int cc, int pc) {
+  if (J->nexits == MAXEXITS)
+    J->fail = 1;
+  else {
+    J->exits[J->nexits].pc = pc;
+    J->exits[J->nexits++].j = jumpfwd(J, cc);
+  }
+}
+
+
+/*
+** Code for the side exits: go on in the compiled code of the function
+** (or in the interpreter, for instructions without compiled code).
+** Exits to the same instruction share their code.
+*/
+static void exitstubs (JitState *J) {
+  int e, f;
+  for (e = 0; e < J->nexits; e++) {
+    int pc = J->exits[e].pc;
+    unsigned int addr;
+    if (pc < 0) continue;  /* already done */
+    for (f = e; f < J->nexits; f++) {
+      if (J->exits[f].pc == pc) {
+        here(J, J->exits[f].j);
+        J->exits[f].pc = -1;
+      }
+    }
+    addr = luaJ_addr(J->jc, pc);
+    if (addr != 0) {
+      movi64(J, RAX, cast(size_t, J->jc->mcode + addr));
+      b1(J, 0xff); b1(J, 0xe0);  /* jmp rax */
+    }
+    else exitto(J, pc);
+  }
+}
+
+
+/* leave the trace through all jumps in 'l', going on at instruction 'pc' */
+static void exitlist (JitState *J, JumpList *l, int pc) {
+  int k;
+  for (k = 0; k < l->n; k++) {
+    if (J->nexits == MAXEXITS)
+      J->fail = 1;
+    else {
+      J->exits[J->nexits].pc = pc;
+      J->exits[J->nexits++].j = l->j[k];
+    }
+  }
+}
+
+
+/* forget the types of all registers */
+static void forget (JitState *J) {
+  int r;
+  for (r = 0; r < J->p->maxstacksize; r++)
+    J->rtype[r] = -1;
+}
+
+
+/* make sure that RK(x) has type 'tt', checking it if needed */
+static void need (JitState *J, int x, int tt) {
+  int t = rktype(J, x);
+  if (t < 0) {
+    cmptag(J, reg(x), tt);
+    exitif(J, CC_NE, J->pc);
+    J->rtype[x] = tt;
+  }
+  else if (t != tt)  /* trace would always leave here? */
+    J->fail = 1;
+}
+
+
+/* whether 'next' may follow instruction 'pc' */
+static int follows (const Proto *p, int pc, int next) {
+  Instruction i = basicinst(p->code[pc]);
+  switch (GET_OPCODE(i)) {
+    case OP_LOADBOOL:
+      return (next == pc + 1 + (GETARG_C(i) != 0));
+    case OP_JMP:
+      return (next == pc + 1 + GETARG_sBx(i));
+    case OP_EQ: case OP_LT: case OP_LE: case OP_TEST: case OP_TESTSET:
+      return (next == pc + 2 || next == pc + 2 + GETARG_sBx(p->code[pc + 1]));
+    default:
+      return (next == pc + 1);
+  }
+}
+
+
+/*
+** Whether arithmetic 'op' on numbers of types 'tb' and 'tc' cannot
+** call metamethods (or yield anything but numbers); if so, return the
+** type of its result.
+*/
+static int arithtype (OpCode op, int tb, int tc) {
+  switch (op) {
+    case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+      return (tb == LUA_TNUMINT && tc == LUA_TNUMINT) ? LUA_TNUMINT : -1;
+    case OP_BNOT:
+      return (tb == LUA_TNUMINT) ? LUA_TNUMINT : -1;
+    case OP_UNM:
+      return isnumtag(tb) ? tb : -1;
+    default:
+      if (!isnumtag(tb) || !isnumtag(tc)) return -1;
+      else if (op == OP_DIV || op == OP_POW) return LUA_TNUMFLT;
+      else return (tb == LUA_TNUMINT && tc == LUA_TNUMINT) ? LUA_TNUMINT
+                                                            : LUA_TNUMFLT;
+  }
+}
+
+
+/*
+** Slot of integer 'key' in the array part of table 't': leave it in
+** rcx, with the table in rax. Keys out of the array part leave the
+** trace.
+*/
+static void arrayslot (JitState *J, Loc t, Loc key) {
+  opm(J, 0, 1, X_MOVRM, RAX, t);
+  opm(J, 0, 1, X_MOVRM, RCX, key);
+  opr(J, 1, X_DEC, 1, RCX);
+  opm(J, 0, 0, X_MOVRM, RDX, loc(RAX, O_SIZEARRAY));
+  opr(J, 1, X_CMP, RCX, RDX);
+  exitif(J, CC_AE, J->pc);  /* (unsigned) key - 1 >= sizearray? */
+  opr(J, 1, X_SHLI, 4, RCX); b1(J, 4);  /* index * sizeof(TValue) */
+  opm(J, 0, 1, X_ADD, RCX, loc(RAX, O_ARRAY));
+}
+
+
+/*
+** Slot of integer 'key' in the array part of table 't', homogeneous
+** with 'tt': leave it in rcx, with the table in rax. Empty slots and other
+** array parts leave the trace.
+*/
+static void homoslot (JitState *J, Loc t, Loc key, int tt) {
+  arrayslot(J, t, key);
+  opm(J, 0, 0, X_CMPBI, 7, loc(RAX, O_ATYPE)); b1(J, tt);
+  exitif(J, CC_NE, J->pc);  /* not homogeneous with 'tt'? */
+  cmptag(J, loc(RCX, 0), LUA_TNIL);
+  exitif(J, CC_E, J->pc);  /* empty slot? */
+}
+
+
+/* OP_GETTABLE for a key in the array part */
+static void arrayget (JitState *J, Instruction i) {
+  need(J, GETARG_B(i), ctb(LUA_TTABLE));
+  need(J, GETARG_C(i), LUA_TNUMINT);
+  arrayslot(J, reg(GETARG_B(i)), rk(J, GETARG_C(i), R9));
+  cmptag(J, loc(RCX, 0), LUA_TNIL);
+  exitif(J, CC_E, J->pc);  /* absent key may need '__index' */
+  copyvalue(J, reg(GETARG_A(i)), loc(RCX, 0));
+  J->rtype[GETARG_A(i)] = -1;
+}
+
+
+/* OP_SETTABLE for a key in the array part */
+static void arrayset (JitState *J, Instruction i) {
+  int tc = rktype(J, GETARG_C(i));
+  Loc rc;
+  need(J, GETARG_A(i), ctb(LUA_TTABLE));
+  need(J, GETARG_B(i), LUA_TNUMINT);
+  rc = rk(J, GETARG_C(i), R8);
+  arrayslot(J, reg(GETARG_A(i)), rk(J, GETARG_B(i), R9));
+  opm(J, 0, 0, X_CMPBI, 7, loc(RAX, O_ATYPE)); b1(J, 0);
+  exitif(J, CC_NE, J->pc);  /* homogeneous array part? */
+  cmptag(J, loc(RCX, 0), LUA_TNIL);
+  exitif(J, CC_E, J->pc);  /* absent key may need '__newindex' */
+  if (tc < 0 || (tc & BIT_ISCOLLECTABLE)) {  /* may need a barrier? */
+    int nobarrier = -1;
+    if (tc < 0) {
+      opmi(J, 0, X_TESTI, 0, field(rc, O_TT), BIT_ISCOLLECTABLE);
+      nobarrier = jumpfwd(J, CC_E);
+    }
+    opm(J, 0, 0, X_TESTBI, 0, loc(RAX, O_MARKED)); b1(J, bitmask(BLACKBIT));
+    exitif(J, CC_NE, J->pc);  /* black table: needs a barrier */
+    if (nobarrier >= 0) here(J, nobarrier);
+  }
+  copyvalue(J, loc(RCX, 0), rc);
+}
+
+
+/* OP_GETTABLE for a key in an array part homogeneous with 'tt' */
+static void homoget (JitState *J, Instruction i, int tt) {
+  Loc ra = reg(GETARG_A(i));
+  need(J, GETARG_B(i), ctb(LUA_TTABLE));
+  need(J, GETARG_C(i), LUA_TNUMINT);
+  homoslot(J, reg(GETARG_B(i)), rk(J, GETARG_C(i), R9), tt);
+  opm(J, 0, 1, X_MOVRM, RDX, loc(RCX, 0));
+  opm(J, 0, 1, X_MOVMR, RDX, ra);
+  settag(J, ra, tt);
+  J->rtype[GETARG_A(i)] = tt;
+}
+
+
+/*
+** OP_SETTABLE for a key in an array part homogeneous with 'tt', with a
+** value of that type (numbers need no barrier)
+*/
+static void homoset (JitState *J, Instruction i, int tt) {
+  Loc rc;
+  need(J, GETARG_A(i), ctb(LUA_TTABLE));
+  need(J, GETARG_B(i), LUA_TNUMINT);
+  need(J, GETARG_C(i), tt);
+  rc = rk(J, GETARG_C(i), R8);
+  homoslot(J, reg(GETARG_A(i)), rk(J, GETARG_B(i), R9), tt);
+  opm(J, 0, 1, X_MOVRM, RDX, rc);
+  opm(J, 0, 1, X_MOVMR, RDX, loc(RCX, 0));  /* (the tag stays) */
+}
+
+
+/* the jump after the test at 'J->pc' is taken: close upvalues if needed */
+static void takejump (JitState *J) {
+  Instruction jmp = J->p->code[J->pc + 1];
+  if (GETARG_A(jmp) != 0) {
+    J->pc++;
+    helper(J, jit_close, jmp);
+    J->pc--;
+  }
+}
+
+
+/*
+** OP_EQ, OP_LT, and OP_LE: leave the trace if the comparison does not
+** go as recorded ('next' is the instruction recorded after it)
+*/
+static void tracecompare (JitState *J, Instruction i, const TraceIns *ti,
+                          int next) {
+  OpCode op = GET_OPCODE(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  int pc = J->pc;
+  int cc;  /* condition for a true comparison */
+  if ((ti->tb == LUA_TNUMINT && ti->tc == LUA_TNUMINT) ||
+      (op == OP_EQ && ti->tb == ctb(LUA_TSHRSTR) &&
+                      ti->tc == ctb(LUA_TSHRSTR))) {
+    need(J, b, ti->tb);
+    need(J, c, ti->tc);
+    opm(J, 0, 1, X_MOVRM, RAX, rk(J, b, R8));
+    opm(J, 0, 1, X_CMP, RAX, rk(J, c, R9));
+    cc = (op == OP_EQ) ? CC_E : (op == OP_LT) ? CC_L : CC_LE;
+  }
+  else if (op != OP_EQ && ti->tb == LUA_TNUMFLT && ti->tc == LUA_TNUMFLT) {
+    need(J, b, LUA_TNUMFLT);
+    need(J, c, LUA_TNUMFLT);
+    opm(J, P_SD, 0, X_MOVUPS, 0, rk(J, c, R9));
+    opm(J, P_PD, 0, X_UCOMISD, 0, rk(J, b, R8));
+    cc = (op == OP_LT) ? CC_A : CC_AE;
+  }
+  else {
+    helper(J, jit_compare, i);
+    forget(J);
+    b1(J, 0x3d); b4(J, 1);  /* cmp eax, 1 */
+    cc = CC_E;
+  }
+  if (next == pc + 2)  /* skipped the jump? */
+    exitif(J, GETARG_A(i) ? cc : cc ^ 1, pc + 1);
+  else {
+    exitif(J, GETARG_A(i) ? cc ^ 1 : cc, pc + 2);
+    takejump(J);
+  }
+}
+
+
+/*
+** OP_TEST and OP_TESTSET on register 'x' of observed type 't': leave
+** the trace if the test does not go as recorded
+*/
+static void tracetest (JitState *J, Instruction i, int x, int t, int next) {
+  int pc = J->pc;
+  int skip = (next == pc + 2);  /* recorded skipping the jump? */
+  int c = GETARG_C(i);
+  if (t == NOTYPE) {
+    J->fail = 1;
+    return;
+  }
+  need(J, x, t);
+  if (t == LUA_TBOOLEAN) {
+    int cc = c ? CC_E : CC_NE;  /* condition to skip the jump */
+    opmi(J, 0, X_CMPI, 7, reg(x), 0);
+    if (skip) exitif(J, cc ^ 1, pc + 1);
+    else exitif(J, cc, pc + 2);
+  }
+  else if ((c ? t == LUA_TNIL : t != LUA_TNIL) != skip)
+    J->fail = 1;  /* trace would always leave here */
+}
+
+
+/*
+** Last instruction of a trace (OP_FORLOOP, or OP_TFORCALL followed by
+** OP_TFORLOOP), closing the loop: go back to the start of the trace at
+** offset 'start'. A hook leaves the trace at the start of the loop.
+*/
+static void traceloop (JitState *J, const TraceIns *ti, int loopstart,
+                       int start) {
+  Instruction i = J->p->code[ti->pc];
+  Loc ra = reg(GETARG_A(i));
+  if (GET_OPCODE(i) == OP_FORLOOP) {
+    if (ti->ta == LUA_TNUMINT) {
+      need(J, GETARG_A(i), LUA_TNUMINT);
+      opm(J, 0, 1, X_MOVRM, RAX, ra);  /* index */
+      opm(J, 0, 1, X_MOVRM, RCX, field(ra, 2 * TVSIZE));  /* step */
+      opr(J, 1, X_TEST, RCX, RCX);
+      exitif(J, ti->aux ? CC_LE : CC_G, J->pc);  /* other sign? */
+      opr(J, 1, X_ADDMR, RCX, RAX);
+      opm(J, 0, 1, X_CMP, RAX, field(ra, TVSIZE));  /* compare with limit */
+      exitif(J, ti->aux ? CC_G : CC_L, J->pc + 1);
+      opm(J, 0, 1, X_MOVMR, RAX, ra);  /* update internal index... */
+      opm(J, 0, 1, X_MOVMR, RAX, field(ra, 3 * TVSIZE));  /* ...and external */
+      settag(J, field(ra, 3 * TVSIZE), LUA_TNUMINT);
+    }
+    else if (ti->ta == LUA_TNUMFLT) {
+      need(J, GETARG_A(i), LUA_TNUMFLT);
+      helper(J, jit_forloop, i);
+      opr(J, 0, X_TEST, RAX, RAX);
+      exitif(J, CC_E, J->pc + 1);
+    }
+    else J->fail = 1;
+  }
+  else {
+    lua_assert(GET_OPCODE(i) == OP_TFORCALL);
+    compileinst(J, i);
+    forget(J);
+    i = J->p->code[++J->pc];  /* OP_TFORLOOP */
+    ra = reg(GETARG_A(i));
+    cmptag(J, field(ra, TVSIZE), LUA_TNIL);
+    exitif(J, CC_E, J->pc + 1);
+    copyvalue(J, ra, field(ra, TVSIZE));
+  }
+  checkhook(J, loopstart);
+  jumpto(J, JMP, start);
+}
+
+
+/*
+** Generate code for recorded instruction 'ti' of a trace; 'next' is
+** the instruction recorded after it.
+*/
+static void traceinst (JitState *J, const TraceIns *ti, int next) {
+  Instruction i = basicinst(J->p->code[J->pc]);
+  int a = GETARG_A(i);
+  OpCode op = GET_OPCODE(i);
+  switch (op) {
+    case OP_MOVE: {
+      copyvalue(J, reg(a), reg(GETARG_B(i)));
+      J->rtype[a] = J->rtype[GETARG_B(i)];
+      break;
+    }
+    case OP_LOADK: {
+      compileinst(J, i);
+      J->rtype[a] = rttype(J->p->k + GETARG_Bx(i));
+      break;
+    }
+    case OP_LOADBOOL: {  /* a skipped instruction is not in the trace */
+      opmi(J, 0, X_MOVI, 0, reg(a), GETARG_B(i));
+      settag(J, reg(a), LUA_TBOOLEAN);
+      J->rtype[a] = LUA_TBOOLEAN;
+      break;
+    }
+    case OP_LOADNIL: {
+      int b;
+      compileinst(J, i);
+      for (b = 0; b <= GETARG_B(i); b++)
+        J->rtype[a + b] = LUA_TNIL;
+      break;
+    }
+    case OP_GETUPVAL: {
+      compileinst(J, i);
+      J->rtype[a] = -1;
+      break;
+    }
+    case OP_SETUPVAL: {  /* its helper only does a barrier */
+      compileinst(J, i);
+      break;
+    }
+    case OP_GETTABLE: {
+      if (!ti->aux) goto generic;
+      else if (ti->aux == 1) arrayget(J, i);
+      else homoget(J, i, ti->aux);
+      break;
+    }
+    case OP_GETINT: {
+      JumpList miss = {0, {0}};
+      if (ti->aux != 1) goto generic;
+      need(J, GETARG_B(i), ctb(LUA_TTABLE));
+      getint(J, i, &miss);
+      exitlist(J, &miss, J->pc);
+      J->rtype[a] = -1;
+      break;
+    }
+    case OP_SETTABLE: {
+      if (!ti->aux) goto generic;
+      else if (ti->aux == 1) arrayset(J, i);
+      else homoset(J, i, ti->aux);
+      break;
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+    case OP_POW: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR: case OP_UNM: case OP_BNOT: {
+      int unary = (op == OP_UNM || op == OP_BNOT);
+      int t = arithtype(op, ti->tb, unary ? ti->tb : ti->tc);
+      if (t < 0) goto generic;
+      need(J, GETARG_B(i), ti->tb);
+      if (!unary) need(J, GETARG_C(i), ti->tc);
+      compileinst(J, i);
+      J->rtype[a] = t;
+      break;
+    }
+    case OP_ADDI: {
+      int t = arithtype(OP_ADD, ti->tb, LUA_TNUMINT);
+      if (t < 0) goto generic;
+      need(J, GETARG_B(i), ti->tb);
+      compileinst(J, i);
+      J->rtype[a] = t;
+      break;
+    }
+    case OP_NOT: {
+      compileinst(J, i);
+      J->rtype[a] = LUA_TBOOLEAN;
+      break;
+    }
+    case OP_LEN: {
+      if (ti->tb == ctb(LUA_TSHRSTR) || ti->tb == ctb(LUA_TLNGSTR)) {
+        need(J, GETARG_B(i), ti->tb);
+        opm(J, 0, 1, X_MOVRM, RAX, reg(GETARG_B(i)));
+        if (ti->tb == ctb(LUA_TSHRSTR))
+          opm(J, 0, 0, X_MOVZXB, RAX, loc(RAX, O_SHRLEN));
+        else
+          opm(J, 0, 1, X_MOVRM, RAX, loc(RAX, O_LNGLEN));
+        opm(J, 0, 1, X_MOVMR, RAX, reg(a));
+        settag(J, reg(a), LUA_TNUMINT);
+        J->rtype[a] = LUA_TNUMINT;
+      }
+      else goto generic;
+      break;
+    }
+    case OP_JMP: {  /* the jump itself is in the order of the trace */
+      if (a != 0)
+        helper(J, jit_close, i);
+      break;
+    }
+    case OP_EQ: case OP_LT: case OP_LE: {
+      tracecompare(J, i, ti, next);
+      break;
+    }
+    case OP_TEST: {
+      tracetest(J, i, a, ti->ta, next);
+      if (next != J->pc + 2) takejump(J);
+      break;
+    }
+    case OP_TESTSET: {
+      int b = GETARG_B(i);
+      tracetest(J, i, b, ti->tb, next);
+      if (next != J->pc + 2) {
+        copyvalue(J, reg(a), reg(b));
+        J->rtype[a] = J->rtype[b];
+        takejump(J);
+      }
+      break;
+    }
+    default: generic: {  /* code that may run calls or metamethods */
+      if (!compileinst(J, i))
+        J->fail = 1;
+      forget(J);
+      break;
+    }
+  }
+}
+
+
+/*
+** Generate the code for the trace recorded in 'R', after its exit
+** routine. Return the offset of its entry point.
+*/
+static int compiletrace (JitState *J, JitRecorder *R) {
+  int start, k;
+  J->n = 0;
+  exitroutine(J);
+  start = J->n;
+  forget(J);
+  for (k = 0; k < R->n && !J->fail; k++) {
+    const TraceIns *ti = &R->ins[k];
+    int n = J->n;
+    J->pc = ti->pc;
+    if (k == R->n - 1)
+      traceloop(J, ti, R->start, start);
+    else if (!follows(J->p, ti->pc, R->ins[k + 1].pc))
+      J->fail = 1;
+    else
+      traceinst(J, ti, R->ins[k + 1].pc);
+    lua_assert(J->n - n <= MAXINSTSIZE);
+    UNUSED(n);
+  }
+  exitstubs(J);
+  return start;
+}
+
+
+/*
+** Compile the trace recorded in 'R' and add it to its function.
+** Return false if that is not possible.
+*/
+static int newtrace (JitRecorder *R) {
+  Proto *p = R->p;
+  size_t page = cast(size_t, sysconf(_SC_PAGESIZE));
+  size_t hsize = alignup(sizeof(JitTrace), 16);
+  size_t size = alignup(hsize + MAXENTRYSIZE + R->n * MAXINSTSIZE +
+                        MAXEXITS * MAXEXITSIZE, page);
+  size_t used;
+  int rtype[MAXARG_A + 1];
+  TraceExit exits[MAXEXITS];
+  int start;
+  JitState J;
+  JitTrace *tr = cast(JitTrace *, mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (tr == MAP_FAILED)
+    return 0;
+  J.p = p;
+  J.code = cast(lu_byte *, tr) + hsize;
+  J.label = NULL;  /* traces do not jump to other instructions */
+  J.jc = p->jit;
+  J.rtype = rtype;
+  J.exits = exits;
+  J.nexits = J.fail = 0;
+  start = compiletrace(&J, R);
+  lua_assert(hsize + J.n <= size);
+  if (J.fail) {
+    munmap(tr, size);
+    return 0;
+  }
+  used = alignup(hsize + J.n, page);
+  if (used < size)  /* release unused memory */
+    munmap(cast(lu_byte *, tr) + used, size - used);
+  tr->next = p->traces;
+  tr->size = used;
+  tr->loop = R->loop;
+  tr->mcode = J.code + start;
+  if (mprotect(tr, used, PROT_READ | PROT_EXEC) != 0) {
+    munmap(tr, used);
+    return 0;
+  }
+  p->traces = tr;
+  return 1;
+}
+
+
+/*
+** Stop the current recording, compiling it if it is complete ('done').
+** Loops whose trace cannot be compiled are not traced again.
+*/
+static void stoprecord (lua_State *L, int done) {
+  global_State *g = G(L);
+  JitRecorder *R = g->jitrec;
+  R->p->icache[R->loop] = (done && newtrace(R)) ? LUAI_TRACEHOT - 1
+                                                : LUAI_TRACEHOT;
+  g->jitrec = NULL;
+  (*g->frealloc)(g->ud, R, sizeof(JitRecorder), 0);
+}
+
+
+/*
+** Called by compiled code when the loop closed by instruction 'i' gets
+** hot. Return the entry point of its trace; or else start recording
+** one and return the exit routine, to run the loop body in the
+** interpreter; or return NULL to just go on.
+*/
+static const lu_byte *jit_hotloop (lua_State *L, CallInfo *ci,
+                                   Instruction i) {
+  global_State *g = G(L);
+  Proto *p = clLvalue(ci->func)->p;
+  int loop = pcRel(ci->u.l.savedpc, p);
+  JitTrace *tr;
+  JitRecorder *R;
+  for (tr = p->traces; tr != NULL; tr = tr->next) {
+    if (tr->loop == loop) {
+      p->icache[loop] = LUAI_TRACEHOT - 1;  /* come back next time */
+      return tr->mcode;
+    }
+  }
+  if (g->jitrec != NULL)  /* another recording did not finish? */
+    stoprecord(L, 0);
+  R = cast(JitRecorder *, (*g->frealloc)(g->ud, NULL, 0,
+                                         sizeof(JitRecorder)));
+  if (R == NULL)
+    return NULL;  /* not enough memory; do not trace this loop */
+  R->L = L;
+  R->ci = ci;
+  R->p = p;
+  R->loop = loop;
+  R->start = loop + 1 + GETARG_sBx(i);
+  R->tail = (GET_OPCODE(i) == OP_FORLOOP) ? loop : loop - 1;
+  R->n = R->foreign = 0;
+  g->jitrec = R;
+  ci->u.l.savedpc = p->code + R->start;
+  return p->jit->mcode + p->jit->epilogue;
+}
+
+
+static lu_byte tagof (const TValue *o) {
+  return (o != NULL) ? cast_byte(rttype(o)) : NOTYPE;
+}
+
+
+/* value of RK(x) for an argument of mode 'mode', or NULL */
+static const TValue *operand (const Proto *p, StkId base, int x,
+                              enum OpArgMask mode) {
+  if (mode == OpArgK && ISK(x))
+    return p->k + INDEXK(x);
+  else if ((mode == OpArgR || mode == OpArgK) && x < p->maxstacksize)
+    return base + x;
+  else
+    return NULL;
+}
+
+
+/*
+** Whether 't[key]' is a present value in the array part of table 't':
+** 1 for a regular array part, the type of the values for a homogeneous
+** part with numbers, and 0 otherwise
+*/
+static int arrayhit (const TValue *t, const TValue *key) {
+  if (t == NULL || key == NULL || !ttistable(t) || !ttisinteger(key))
+    return 0;
+  else {
+    Table *h = hvalue(t);
+    lua_Unsigned idx = l_castS2U(ivalue(key)) - 1u;
+    if (idx >= h->sizearray || ttisnil(&h->array[idx]))
+      return 0;
+    else if (h->atype == 0)
+      return 1;
+    else if (h->atype == LUA_TNUMINT || h->atype == LUA_TNUMFLT)
+      return h->atype;
+    else
+      return 0;
+  }
+}
+
+
+/*
+** Value of 't[key]' if it is in table 't' or in its '__index' table,
+** found without running any code; NULL otherwise.
+*/
+static const TValue *peek (lua_State *L, const TValue *t,
+                           const TValue *key) {
+  const TValue *tm;
+  if (t == NULL || key == NULL) return NULL;
+  if (ttistable(t)) {
+    const TValue *v = luaH_get(hvalue(t), key);
+    if (!ttisnil(v)) return v;
+    tm = fasttm(L, hvalue(t)->metatable, TM_INDEX);
+  }
+  else
+    tm = luaT_gettmbyobj(L, t, TM_INDEX);
+  if (tm != NULL && ttistable(tm)) {
+    const TValue *v = luaH_get(hvalue(tm), key);
+    if (!ttisnil(v)) return v;
+  }
+  return NULL;
+}
+
+
+/*
+** Record instruction 'pc' with the types of its operands. The second
+** part of a superinstruction runs without the interpreter calling
+** 'luaJ_record', so it is recorded here too, with the value that the
+** first part loads into R(A) as far as it can be known.
+*/
+static void observe (lua_State *L, JitRecorder *R, CallInfo *ci, int pc) {
+  const Proto *p = R->p;
+  StkId base = ci->u.l.base;
+  OpCode op = GET_OPCODE(p->code[pc]);  /* (may be a superinstruction) */
+  Instruction i = basicinst(p->code[pc]);
+  const TValue *ra = operand(p, base, GETARG_A(i), OpArgR);
+  const TValue *rb = operand(p, base, GETARG_B(i), getBMode(GET_OPCODE(i)));
+  const TValue *rc = operand(p, base, GETARG_C(i), getCMode(GET_OPCODE(i)));
+  TValue key;
+  TraceIns *ti = &R->ins[R->n++];
+  ti->pc = pc;
+  ti->ta = tagof(ra);
+  ti->tb = tagof(rb);
+  ti->tc = tagof(rc);
+  switch (GET_OPCODE(i)) {
+    case OP_GETTABLE: ti->aux = arrayhit(rb, rc); break;
+    case OP_GETINT:
+      setivalue(L, &key, GETARG_C(i));
+      ti->aux = arrayhit(rb, &key);
+      break;
+    case OP_SETTABLE:
+      ti->aux = arrayhit(ra, rb);
+      if (ti->aux > 1 && (rc == NULL || ttype(rc) != ti->aux))
+        ti->aux = 0;  /* store will clear the mark of a homogeneous part */
+      break;
+    case OP_FORLOOP: ti->aux = ttisinteger(ra + 2) && ivalue(ra + 2) > 0; break;
+    default: ti->aux = 0; break;
+  }
+  if (luaP_isfused(op)) {
+    const TValue *t = (op == OP_GETTABUPCALL)
+                    ? clLvalue(ci->func)->upvals[GETARG_B(i)]->v : rb;
+    const TValue *v = peek(L, t, rc);
+    int a = GETARG_A(i);
+    Instruction i2 = basicinst(p->code[pc + 1]);
+    OpCode op2 = GET_OPCODE(i2);
+    ti = &R->ins[R->n++];
+    ti->pc = pc + 1;
+    ti->ta = (GETARG_A(i2) == a) ? tagof(v)
+           : tagof(operand(p, base, GETARG_A(i2), OpArgR));
+    ti->tb = (getBMode(op2) != OpArgN && GETARG_B(i2) == a) ? tagof(v)
+           : tagof(operand(p, base, GETARG_B(i2), getBMode(op2)));
+    ti->tc = (getCMode(op2) != OpArgN && GETARG_C(i2) == a) ? tagof(v)
+           : tagof(operand(p, base, GETARG_C(i2), getCMode(op2)));
+    ti->aux = 0;
+  }
+}
+
+
+/* whether recorded instruction 'ti' can be part of a trace */
+static int recordable (const JitRecorder *R, const TraceIns *ti) {
+  Instruction i = basicinst(R->p->code[ti->pc]);
+  switch (GET_OPCODE(i)) {
+    case OP_LOADKX: case OP_TAILCALL: case OP_RETURN: case OP_FORPREP:
+    case OP_TFORLOOP: case OP_SETLIST: case OP_CLOSURE: case OP_VARARG:
+    case OP_EXTRAARG:
+      return 0;
+    case OP_LOADNIL:
+      return (GETARG_B(i) < 16);  /* (see 'compileinst') */
+    case OP_JMP:
+      return (GETARG_sBx(i) >= 0);  /* no inner loops */
+    case OP_CALL:  /* only C functions run inside a trace */
+      return (ti->ta == LUA_TLCF || ti->ta == ctb(LUA_TCCL));
+    case OP_FORLOOP: case OP_TFORCALL:
+      return (ti->pc == R->tail);
+    default:
+      return 1;
+  }
+}
+
+
+/*
+** Called by the interpreter before each instruction while a recording
+** is on. Return true if the instruction was recorded, and so must be
+** run by the interpreter.
+*/
+int luaJ_record (lua_State *L, CallInfo *ci) {
+  JitRecorder *R = G(L)->jitrec;
+  int pc, n;
+  if (L != R->L || ci != R->ci || clLvalue(ci->func)->p != R->p) {
+    if (++R->foreign > MAXFOREIGN)  /* recorded frame seems gone? */
+      stoprecord(L, 0);
+    return 0;
+  }
+  pc = pcRel(ci->u.l.savedpc, R->p) + 1;
+  n = R->n;
+  if (n > MAXTRACE - 2 || pc > R->tail ||
+      (n == 0 ? pc != R->start : pc <= R->ins[n - 1].pc)) {
+    stoprecord(L, 0);  /* trace too long or not going through the loop */
+    return 0;
+  }
+  observe(L, R, ci, pc);
+  for (; n < R->n; n++) {
+    if (!recordable(R, &R->ins[n])) {
+      stoprecord(L, 0);
+      return 0;
+    }
+  }
+  if (pc == R->tail)
+    stoprecord(L, 1);
+  return 1;
+}
+
+/* }====================================================== */
+
+#endif
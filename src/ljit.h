@@ -0,0 +1,67 @@
+/*
+** $Id: ljit.h $
+** Baseline JIT compiler for x86-64
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ljit_h
+#define ljit_h
+
+
+#include "lobject.h"
+#include "lstate.h"
+
+
+#if defined(LUA_USE_JIT)
+
+/*
+** number of calls plus loop iterations after which a function is
+** compiled
+*/
+#if !defined(LUAI_JITHOT)
+#define LUAI_JITHOT	100
+#endif
+
+/*
+** number of iterations of a loop in compiled code after which it is
+** traced (see 'luaJ_record')
+*/
+#if !defined(LUAI_TRACEHOT)
+#define LUAI_TRACEHOT	50
+#endif
+
+
+/*
+** Machine code for a function. The code and this header live in a
+** single block of executable memory allocated outside the Lua
+** allocator.
+*/
+typedef struct JitCode {
+  size_t size;  /* size of the whole block */
+  lu_byte *mcode;  /* machine code; it starts with the entry routine */
+  unsigned int epilogue;  /* offset of the exit routine */
+  unsigned int addr[1];  /* offset of each instruction (0 if not compiled) */
+} JitCode;
+
+
+/* offset in 'jc->mcode' of the code for instruction 'pc' (or 0) */
+#define luaJ_addr(jc,pc)	((jc)->addr[pc])
+
+
+/* count a call or a loop iteration of 'p'; compile it when it gets hot */
+#define luaJ_count(L,p)  \
+	{ if ((p)->jitcount > 0 && --(p)->jitcount == 0) luaJ_compile(L, p); }
+
+
+LUAI_FUNC void luaJ_compile (lua_State *L, Proto *p);
+LUAI_FUNC void luaJ_run (lua_State *L, CallInfo *ci, unsigned int addr);
+LUAI_FUNC int luaJ_record (lua_State *L, CallInfo *ci);
+LUAI_FUNC void luaJ_free (lua_State *L, Proto *p);
+
+#else
+
+#define luaJ_count(L,p)		((void)0)
+
+#endif
+
+#endif
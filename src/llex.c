@@ -136,7 +136,9 @@ TString *luaX_newstring (LexState *ls, const char *str, size_t l) {
     setbvalue(o, 1);  /* t[string] = true */
     luaC_checkGC(L);
   }
-  else {  /* string already present */
+  else if (ts->tt == LUA_TLNGSTR) {  /* long string already present? */
+    /* (short strings are internalized; long ones are always in the
+       table's hash part, as they cannot be shaped keys) */
     ts = tsvalue(keyfromval(o));  /* re-use value previously stored */
   }
   L->top--;  /* remove string from stack */
@@ -208,11 +210,11 @@ static int check_next2 (LexState *ls, const char *set) {
 
 /* LUA_NUMBER */
 /*
-** this function is quite liberal in what it accepts, as 'luaO_str2num'
+** this function is quite liberal in what it accepts, as 'luaO_readnum'
 ** will reject ill-formed numerals.
 */
 static int read_numeral (LexState *ls, SemInfo *seminfo) {
-  TValue obj;
+  lua_Integer i; lua_Number n; int isint;
   const char *expo = "Ee";
   int first = ls->current;
   lua_assert(lisdigit(ls->current));
@@ -229,15 +231,14 @@ static int read_numeral (LexState *ls, SemInfo *seminfo) {
     else break;
   }
   save(ls, '\0');
-  if (luaO_str2num(luaZ_buffer(ls->buff), &obj) == 0)  /* format error? */
-    lexerror(ls, "malformed number", TK_FLT);
-  if (ttisinteger(&obj)) {
-    seminfo->i = ivalue(&obj);
+  if (luaO_readnum(luaZ_buffer(ls->buff), &isint, &i, &n) == 0)
+    lexerror(ls, "malformed number", TK_FLT);  /* format error */
+  if (isint) {
+    seminfo->i = i;
     return TK_INT;
   }
   else {
-    lua_assert(ttisfloat(&obj));
-    seminfo->r = fltvalue(&obj);
+    seminfo->r = n;
     return TK_FLT;
   }
 }
@@ -211,8 +211,24 @@ typedef unsigned long Instruction;
 ** ('lua_lock') and leaves the core ('lua_unlock')
 */
 #if !defined(lua_lock)
-#define lua_lock(L)	((void) 0)
-#define lua_unlock(L)	((void) 0)
+#define lua_lock(L)	luai_marklock(L)
+#define lua_unlock(L)	luai_markunlock(L)
+#endif
+
+/*
+** with an idle-time marker, the core is a critical section shared
+** with the marker thread, which marks while the program is out of the
+** core (see 'lgc.c'); a user definition of 'lua_lock' and 'lua_unlock'
+** must call these macros too
+*/
+#if defined(LUA_USE_GCTHREAD)
+LUAI_FUNC void luaC_lockcore (lua_State *L);
+LUAI_FUNC void luaC_unlockcore (lua_State *L);
+#define luai_marklock(L)	luaC_lockcore(L)
+#define luai_markunlock(L)	luaC_unlockcore(L)
+#else
+#define luai_marklock(L)	((void) 0)
+#define luai_markunlock(L)	((void) 0)
 #endif
 
 /*
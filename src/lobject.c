@@ -22,6 +22,7 @@
 #include "lctype.h"
 #include "ldebug.h"
 #include "ldo.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -33,6 +34,51 @@
 LUAI_DDEF const TValue luaO_nilobject_ = {NILCONSTANT};
 
 
+#if defined(LUA_NANBOXING)
+
+/* raw type tag of each box (indexed by its 4 low bits) */
+LUAI_DDEF const lu_byte luaO_nbtag[16] = {
+  0, LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA,
+  LUA_TLCF, LUA_TDEADKEY, LUA_TNUMINT, LUA_TNUMINT,
+  ctb(LUA_TSHRSTR), ctb(LUA_TLNGSTR), ctb(LUA_TTABLE), ctb(LUA_TUSERDATA),
+  ctb(LUA_TLCL), ctb(LUA_TCCL), ctb(LUA_TTHREAD), ctb(LUA_TSHAPE)
+};
+
+
+/*
+** box for a collectable object with (variant) tag 'tt'
+*/
+int luaO_nbbox (int tt) {
+  switch (tt) {
+    case LUA_TSHRSTR: return NB_SHRSTR;
+    case LUA_TLNGSTR: return NB_LNGSTR;
+    case LUA_TTABLE: return NB_TABLE;
+    case LUA_TUSERDATA: return NB_USERDATA;
+    case LUA_TLCL: return NB_LCL;
+    case LUA_TCCL: return NB_CCL;
+    case LUA_TTHREAD: return NB_THREAD;
+    case LUA_TNUMINT: return NB_BIGINT;
+    default: lua_assert(tt == LUA_TSHAPE); return NB_OTHER;
+  }
+}
+
+
+/*
+** Put integer 'i', which does not fit in a payload, in a new box. The
+** box is a collectable object like any other, so 'o' must go where the
+** collector can see it before the next collection step. (Emergency
+** collections, which can run while a box is held only by a C variable,
+** do not free boxes.)
+*/
+void luaO_setbigint (lua_State *L, TValue *o, lua_Integer i) {
+  GCObject *b = luaC_newobj(L, LUA_TNUMINT, sizeof(BoxedInt));
+  cast(BoxedInt *, b)->i = i;
+  val_(o).u = nbobj(NB_BIGINT, b);
+}
+
+#endif
+
+
 /*
 ** converts an integer to a "floating point byte", represented as
 ** (eeeeexxx), where the real value is (1xxx) * 2^(eeeee - 1) if
@@ -128,7 +174,7 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
     case LUA_OPBNOT: {  /* operate only on integers */
       lua_Integer i1; lua_Integer i2;
       if (tointeger(p1, &i1) && tointeger(p2, &i2)) {
-        setivalue(res, intarith(L, op, i1, i2));
+        setivalue(L, res, intarith(L, op, i1, i2));
         return;
       }
       else break;  /* go to the end */
@@ -144,7 +190,7 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
     default: {  /* other operations */
       lua_Number n1; lua_Number n2;
       if (ttisinteger(p1) && ttisinteger(p2)) {
-        setivalue(res, intarith(L, op, ivalue(p1), ivalue(p2)));
+        setivalue(L, res, intarith(L, op, ivalue(p1), ivalue(p2)));
         return;
       }
       else if (tonumber(p1, &n1) && tonumber(p2, &n2)) {
@@ -328,21 +374,40 @@ static const char *l_str2int (const char *s, lua_Integer *result) {
 }
 
 
-size_t luaO_str2num (const char *s, TValue *o) {
-  lua_Integer i; lua_Number n;
+/*
+** Convert string 's' to a number, giving an integer in '*i' (with
+** '*isint' true) or a float in '*n'. Returns the size of the string
+** plus one, or 0 if 's' is not a numeral. It makes no Lua value, so
+** callers that only look at the number need no state.
+*/
+size_t luaO_readnum (const char *s, int *isint, lua_Integer *i,
+                                    lua_Number *n) {
   const char *e;
-  if ((e = l_str2int(s, &i)) != NULL) {  /* try as an integer */
-    setivalue(o, i);
-  }
-  else if ((e = l_str2d(s, &n)) != NULL) {  /* else try as a float */
-    setfltvalue(o, n);
-  }
+  if ((e = l_str2int(s, i)) != NULL)  /* try as an integer */
+    *isint = 1;
+  else if ((e = l_str2d(s, n)) != NULL)  /* else try as a float */
+    *isint = 0;
   else
     return 0;  /* conversion failed */
   return (e - s) + 1;  /* success; return string size */
 }
 
 
+size_t luaO_str2num (lua_State *L, const char *s, TValue *o) {
+  lua_Integer i; lua_Number n; int isint;
+  size_t sz = luaO_readnum(s, &isint, &i, &n);
+  if (sz == 0)
+    return 0;  /* conversion failed */
+  else if (isint) {
+    setivalue(L, o, i);
+  }
+  else {
+    setfltvalue(o, n);
+  }
+  return sz;
+}
+
+
 int luaO_utf8esc (char *buff, unsigned long x) {
   int n = 1;  /* number of bytes put in buffer (backwards) */
   lua_assert(x <= 0x10FFFF);
@@ -419,11 +484,11 @@ const char *luaO_pushvfstring (lua_State *L, const char *fmt, va_list argp) {
         break;
       }
       case 'd': {  /* an 'int' */
-        setivalue(L->top, va_arg(argp, int));
+        setivalue(L, L->top, va_arg(argp, int));
         goto top2str;
       }
       case 'I': {  /* a 'lua_Integer' */
-        setivalue(L->top, cast(lua_Integer, va_arg(argp, l_uacInt)));
+        setivalue(L, L->top, cast(lua_Integer, va_arg(argp, l_uacInt)));
         goto top2str;
       }
       case 'f': {  /* a 'lua_Number' */
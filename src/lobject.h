@@ -20,12 +20,13 @@
 ** Extra tags for non-values
 */
 #define LUA_TPROTO	LUA_NUMTAGS		/* function prototypes */
-#define LUA_TDEADKEY	(LUA_NUMTAGS+1)		/* removed keys in tables */
+#define LUA_TSHAPE	(LUA_NUMTAGS+1)		/* table shapes */
+#define LUA_TDEADKEY	(LUA_NUMTAGS+2)		/* removed keys in tables */
 
 /*
 ** number of all possible tags (including LUA_TNONE but excluding DEADKEY)
 */
-#define LUA_TOTALTAGS	(LUA_TPROTO + 2)
+#define LUA_TOTALTAGS	(LUA_TSHAPE + 2)
 
 
 /*
@@ -94,6 +95,8 @@ struct GCObject {
 ** an actual value plus a tag with its type.
 */
 
+#if !defined(LUA_NANBOXING)	/* { */
+
 /*
 ** Union of all Lua values
 */
@@ -158,6 +161,9 @@ typedef struct lua_TValue {
 #define ttisthread(o)		checktag((o), ctb(LUA_TTHREAD))
 #define ttisdeadkey(o)		checktag((o), LUA_TDEADKEY)
 
+/* all integers fit in a value */
+#define isbigint(o)		0
+
 
 /* Macros to access values */
 #define ivalue(o)	check_exp(ttisinteger(o), val_(o).i)
@@ -201,11 +207,11 @@ typedef struct lua_TValue {
 #define chgfltvalue(obj,x) \
   { TValue *io=(obj); lua_assert(ttisfloat(io)); val_(io).n=(x); }
 
-#define setivalue(obj,x) \
-  { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_TNUMINT); }
+#define setivalue(L,obj,x) \
+  { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_TNUMINT); (void)L; }
 
-#define chgivalue(obj,x) \
-  { TValue *io=(obj); lua_assert(ttisinteger(io)); val_(io).i=(x); }
+#define chgivalue(L,obj,x) \
+  { TValue *io=(obj); lua_assert(ttisinteger(io)); val_(io).i=(x); (void)L; }
 
 #define setnilvalue(obj) settt_(obj, LUA_TNIL)
 
@@ -255,6 +261,247 @@ typedef struct lua_TValue {
 #define setdeadvalue(obj)	settt_(obj, LUA_TDEADKEY)
 
 
+/* any pointer can be a light userdata */
+#define lightudfits(p)		1
+
+#else				/* }{ */
+
+/*
+** NaN boxing (see LUA_NANBOXING in 'luaconf.h'): a value is a single
+** 64-bit word. A float is kept as it is, with all NaNs turned into one
+** canonical NaN. Other values take bit patterns of negative NaNs that
+** no float uses: their 16 high bits (the "box") tell the type, and
+** their 48 low bits hold a pointer, a boolean, or an integer. Integers
+** that do not fit in 48 bits go to a collectable 'BoxedInt' (see
+** 'luaO_setbigint'). Collectable objects have the highest boxes, and
+** both variants of integers, of strings, and of closures share all but
+** the lowest bit of their boxes.
+*/
+
+#include <stdint.h>
+
+#define NB_NIL		0xFFF1
+#define NB_BOOLEAN	0xFFF2
+#define NB_LIGHTUD	0xFFF3
+#define NB_LCF		0xFFF4
+#define NB_DEADKEY	0xFFF5
+#define NB_NUMINT	0xFFF6
+#define NB_BIGINT	0xFFF7	/* integers in a 'BoxedInt' */
+#define NB_SHRSTR	0xFFF8
+#define NB_LNGSTR	0xFFF9
+#define NB_TABLE	0xFFFA
+#define NB_USERDATA	0xFFFB
+#define NB_LCL		0xFFFC
+#define NB_CCL		0xFFFD
+#define NB_THREAD	0xFFFE
+#define NB_OTHER	0xFFFF	/* other collectable objects (table shapes) */
+
+#define NB_PAYLOAD	((uint64_t)0xFFFFFFFFFFFF)
+#define NB_NAN		((uint64_t)0x7FF8000000000000)	/* canonical NaN */
+
+/* word with box 'b' and payload 'p' */
+#define nbword(b,p)	(((uint64_t)(b) << 48) | (uint64_t)(p))
+
+/* word for object 'p' (which must have a 48-bit address) in box 'b' */
+#define nbobj(b,p)  \
+	nbword(b, check_exp(lightudfits(p), cast(size_t, (p))))
+
+/* whether pointer 'p' fits in a payload */
+#define lightudfits(p)		((cast(size_t, (p)) >> 48) == 0)
+
+/* whether integer 'i' fits in a payload */
+#define intfits(i)  \
+	(((l_castS2U(i) + (cast(lua_Unsigned, 1) << 47)) >> 48) == 0)
+
+
+/* an integer that does not fit in a payload */
+typedef struct BoxedInt {
+  CommonHeader;
+  lua_Integer i;
+} BoxedInt;
+
+
+typedef union Value {
+  uint64_t u;      /* the whole word */
+  lua_Number n;    /* float numbers */
+} Value;
+
+
+#define TValuefields	Value value_
+
+
+typedef struct lua_TValue {
+  TValuefields;
+} TValue;
+
+
+
+/* macro defining a nil value */
+#define NILCONSTANT	{nbword(NB_NIL, 0)}
+
+
+#define val_(o)		((o)->value_)
+
+/* box of a TValue */
+#define nbbox(o)	cast_int(val_(o).u >> 48)
+
+/* payload of a TValue as a pointer */
+#define nbptr(o)	cast(void *, cast(size_t, val_(o).u & NB_PAYLOAD))
+
+
+/* raw type tag of a TValue */
+#define rttype(o)  \
+	(ttisfloat(o) ? LUA_TNUMFLT : luaO_nbtag[nbbox(o) & 0x0F])
+
+/* tag with no variants (bits 0-3) */
+#define novariant(x)	((x) & 0x0F)
+
+/* type tag of a TValue (bits 0-3 for tags + variant bits 4-5) */
+#define ttype(o)	(rttype(o) & 0x3F)
+
+/* type tag of a TValue with no variants (bits 0-3) */
+#define ttnov(o)	(novariant(rttype(o)))
+
+
+/* Macros to test type */
+#define checktag(o,t)		(rttype(o) == (t))
+#define checktype(o,t)		(ttnov(o) == (t))
+#define ttisnumber(o)		(ttisfloat(o) || ttisinteger(o))
+#define ttisfloat(o)		(val_(o).u < nbword(NB_NIL, 0))
+#define ttisinteger(o)		((nbbox(o) | 1) == NB_BIGINT)
+#define ttisnil(o)		(nbbox(o) == NB_NIL)
+#define ttisboolean(o)		(nbbox(o) == NB_BOOLEAN)
+#define ttislightuserdata(o)	(nbbox(o) == NB_LIGHTUD)
+#define ttisstring(o)		((nbbox(o) | 1) == NB_LNGSTR)
+#define ttisshrstring(o)	(nbbox(o) == NB_SHRSTR)
+#define ttislngstring(o)	(nbbox(o) == NB_LNGSTR)
+#define ttistable(o)		(nbbox(o) == NB_TABLE)
+#define ttisfunction(o)		(ttisclosure(o) || ttislcf(o))
+#define ttisclosure(o)		((nbbox(o) | 1) == NB_CCL)
+#define ttisCclosure(o)		(nbbox(o) == NB_CCL)
+#define ttisLclosure(o)		(nbbox(o) == NB_LCL)
+#define ttislcf(o)		(nbbox(o) == NB_LCF)
+#define ttisfulluserdata(o)	(nbbox(o) == NB_USERDATA)
+#define ttisthread(o)		(nbbox(o) == NB_THREAD)
+#define ttisdeadkey(o)		(nbbox(o) == NB_DEADKEY)
+
+/* whether an integer is in a 'BoxedInt' */
+#define isbigint(o)		(nbbox(o) == NB_BIGINT)
+
+
+/* Macros to access values */
+#define ivalue(o)	check_exp(ttisinteger(o), \
+	(nbbox(o) == NB_NUMINT ? l_castU2S(val_(o).u << 16) >> 16 \
+                               : cast(BoxedInt *, nbptr(o))->i))
+#define fltvalue(o)	check_exp(ttisfloat(o), val_(o).n)
+#define nvalue(o)	check_exp(ttisnumber(o), \
+	(ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o)))
+#define gcvalue(o)	check_exp(iscollectable(o), cast(GCObject *, nbptr(o)))
+#define pvalue(o)	check_exp(ttislightuserdata(o), nbptr(o))
+#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(cast(GCObject *, nbptr(o))))
+#define uvalue(o)	check_exp(ttisfulluserdata(o), \
+	gco2u(cast(GCObject *, nbptr(o))))
+#define clvalue(o)	check_exp(ttisclosure(o), \
+	gco2cl(cast(GCObject *, nbptr(o))))
+#define clLvalue(o)	check_exp(ttisLclosure(o), \
+	gco2lcl(cast(GCObject *, nbptr(o))))
+#define clCvalue(o)	check_exp(ttisCclosure(o), \
+	gco2ccl(cast(GCObject *, nbptr(o))))
+#define fvalue(o)	check_exp(ttislcf(o), \
+	cast(lua_CFunction, cast(size_t, val_(o).u & NB_PAYLOAD)))
+#define hvalue(o)	check_exp(ttistable(o), gco2t(cast(GCObject *, nbptr(o))))
+#define bvalue(o)	check_exp(ttisboolean(o), \
+	cast_int(cast(unsigned int, val_(o).u)))
+#define thvalue(o)	check_exp(ttisthread(o), \
+	gco2th(cast(GCObject *, nbptr(o))))
+/* a dead value may get the 'gc' field, but cannot access its contents */
+#define deadvalue(o)	check_exp(ttisdeadkey(o), nbptr(o))
+
+#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
+
+
+#define iscollectable(o)	(val_(o).u >= nbword(NB_BIGINT, 0))
+
+
+/* Macros for internal tests */
+#define righttt(obj)		(ttype(obj) == gcvalue(obj)->tt)
+
+#define checkliveness(L,obj) \
+	lua_longassert(!iscollectable(obj) || \
+		(righttt(obj) && (L == NULL || !isdead(G(L),gcvalue(obj)))))
+
+
+/* Macros to set values */
+#define setfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); \
+    if (luai_numisnan(n_)) val_(io).u = NB_NAN; else val_(io).n = n_; }
+
+#define chgfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); lua_assert(ttisfloat(io)); \
+    if (luai_numisnan(n_)) val_(io).u = NB_NAN; else val_(io).n = n_; }
+
+#define setivalue(L,obj,x) \
+  { TValue *io=(obj); lua_Integer i_=(x); \
+    if (intfits(i_)) \
+      val_(io).u=nbword(NB_NUMINT, l_castS2U(i_) & NB_PAYLOAD); \
+    else luaO_setbigint(L, io, i_); }
+
+#define chgivalue(L,obj,x) \
+  { lua_assert(ttisinteger(obj)); setivalue(L,obj,x); }
+
+#define setnilvalue(obj) (val_(obj).u=nbword(NB_NIL, 0))
+
+#define setfvalue(obj,x) \
+  { TValue *io=(obj); val_(io).u=nbobj(NB_LCF, (x)); }
+
+/* (the parser also keeps integers as light userdata; see 'luaK_intK') */
+#define setpvalue(obj,x) \
+  { TValue *io=(obj); \
+    val_(io).u=nbword(NB_LIGHTUD, cast(size_t, (x)) & NB_PAYLOAD); }
+
+#define setbvalue(obj,x) \
+  { TValue *io=(obj); val_(io).u=nbword(NB_BOOLEAN, cast(unsigned int, (x))); }
+
+#define setgcovalue(L,obj,x) \
+  { TValue *io = (obj); GCObject *i_g=(x); \
+    val_(io).u = nbobj(luaO_nbbox(i_g->tt), i_g); }
+
+#define setsvalue(L,obj,x) \
+  { TValue *io = (obj); TString *x_ = (x); \
+    val_(io).u = nbobj(x_->tt == LUA_TSHRSTR ? NB_SHRSTR : NB_LNGSTR, x_); \
+    checkliveness(L,io); }
+
+#define setuvalue(L,obj,x) \
+  { TValue *io = (obj); Udata *x_ = (x); \
+    val_(io).u = nbobj(NB_USERDATA, x_); \
+    checkliveness(L,io); }
+
+#define setthvalue(L,obj,x) \
+  { TValue *io = (obj); lua_State *x_ = (x); \
+    val_(io).u = nbobj(NB_THREAD, x_); \
+    checkliveness(L,io); }
+
+#define setclLvalue(L,obj,x) \
+  { TValue *io = (obj); LClosure *x_ = (x); \
+    val_(io).u = nbobj(NB_LCL, x_); \
+    checkliveness(L,io); }
+
+#define setclCvalue(L,obj,x) \
+  { TValue *io = (obj); CClosure *x_ = (x); \
+    val_(io).u = nbobj(NB_CCL, x_); \
+    checkliveness(L,io); }
+
+#define sethvalue(L,obj,x) \
+  { TValue *io = (obj); Table *x_ = (x); \
+    val_(io).u = nbobj(NB_TABLE, x_); \
+    checkliveness(L,io); }
+
+#define setdeadvalue(obj)  \
+	(val_(obj).u = nbword(NB_DEADKEY, val_(obj).u & NB_PAYLOAD))
+
+#endif				/* } */
+
+
 
 #define setobj(L,obj1,obj2) \
 	{ TValue *io1=(obj1); *io1 = *(obj2); \
@@ -374,10 +621,17 @@ typedef union UUdata {
 	  checkliveness(L,io); }
 
 
+#if !defined(LUA_NANBOXING)
 #define getuservalue(L,u,o) \
 	{ TValue *io=(o); const Udata *iu = (u); \
 	  io->value_ = iu->user_; settt_(io, iu->ttuv_); \
 	  checkliveness(L,io); }
+#else
+/* a boxed value carries its own tag */
+#define getuservalue(L,u,o) \
+	{ TValue *io=(o); const Udata *iu = (u); \
+	  io->value_ = iu->user_; checkliveness(L,io); }
+#endif
 
 
 /*
@@ -423,6 +677,12 @@ typedef struct Proto {
   int *lineinfo;  /* map from opcodes to source lines (debug information) */
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
+  unsigned int *icache;  /* inline caches (one for each instruction) */
+#if defined(LUA_USE_JIT)
+  struct JitCode *jit;  /* machine code for this function (see 'ljit.c') */
+  struct JitTrace *traces;  /* machine code for its hot loops */
+  int jitcount;  /* countdown to compilation (see 'luaJ_count') */
+#endif
   struct LClosure *cache;  /* last-created closure with this prototype */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
@@ -482,10 +742,17 @@ typedef union TKey {
 
 
 /* copy a value into a key without messing up field 'next' */
+#if !defined(LUA_NANBOXING)
 #define setnodekey(L,key,obj) \
 	{ TKey *k_=(key); const TValue *io_=(obj); \
 	  k_->nk.value_ = io_->value_; k_->nk.tt_ = io_->tt_; \
 	  (void)L; checkliveness(L,io_); }
+#else
+#define setnodekey(L,key,obj) \
+	{ TKey *k_=(key); const TValue *io_=(obj); \
+	  k_->nk.value_ = io_->value_; \
+	  (void)L; checkliveness(L,io_); }
+#endif
 
 
 typedef struct Node {
@@ -494,19 +761,87 @@ typedef struct Node {
 } Node;
 
 
+/* maximum number of keys in a shape */
+#define MAXSHAPEKEYS	16
+
+
+/*
+** Shapes (hidden classes): key layouts shared by all tables that got
+** the same short-string keys in the same order. Shapes form a tree
+** rooted at the empty shapes; 'children' lists the transitions from a
+** shape (that list does not keep them alive).
+*/
+typedef struct Shape {
+  CommonHeader;
+  lu_byte nkeys;  /* number of keys */
+  lu_byte size;  /* size of 'svals' in tables with this shape */
+  struct Shape *parent;  /* shape without the last key */
+  struct Shape *children;  /* shapes with one more key */
+  struct Shape *sibling;  /* next shape in the 'children' list of parent */
+  TString *keys[1];  /* keys, in insertion order */
+} Shape;
+
+#define sizeshape(n)	(offsetof(Shape, keys) + sizeof(TString *) * (n))
+
+
+/*
+** Cards of a big table: the array part and the hash part, taken as one
+** sequence of slots, are divided in cards of CARDSIZE slots, each with
+** a dirty flag (see 'luaC_barrierback_')
+*/
+typedef struct Cards {
+  unsigned int n;  /* number of cards */
+  lu_byte listed;  /* true if table is in 'grayagain' for its cards */
+  lu_byte dirty[1];  /* one flag for each card */
+} Cards;
+
+#define sizecards(n)	(offsetof(Cards, dirty) + (n) * sizeof(lu_byte))
+
+
 typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   lu_byte lsizenode;  /* log2 of size of 'node' array */
   unsigned int sizearray;  /* size of 'array' array */
+  unsigned int lenhint;  /* last border found by 'luaH_getn' (a hint) */
+  lu_byte atype;  /* type of the values in a homogeneous array part, or 0 */
+  lu_byte sizeinline;  /* room for values in the table block itself */
   TValue *array;  /* array part */
   Node *node;
   Node *lastfree;  /* any free position is before this position */
+  Shape *shape;  /* key layout of a shaped table (NULL if not shaped) */
+  TValue *svals;  /* values of the keys in 'shape' */
   struct Table *metatable;
   GCObject *gclist;
+  Cards *cards;  /* cards for the barrier (only in big tables) */
+  struct Rehash *rehash;  /* old hash part, while it is being moved */
 } Table;
 
 
+/*
+** Old hash part of a big table that grows incrementally (see
+** 'luaH_resize'). 'old' describes the old nodes (only its hash fields
+** are used); its entries move to the new hash part a few at a time,
+** from the last node down, so that nodes from 'left' on are empty.
+*/
+typedef struct Rehash {
+  Table old;
+  int left;  /* number of old nodes not moved yet */
+} Rehash;
+
+
+/*
+** Block of a table with room for the values of a small shaped part (see
+** 'luaH_newinline'); the table has room for 'sizeinline' values in 'v'.
+*/
+typedef struct InlineTable {
+  Table t;
+  TValue v[1];
+} InlineTable;
+
+#define sizetable(n)	(offsetof(InlineTable, v) + (n) * sizeof(TValue))
+
+
 
 /*
 ** 'module' operation for hashing (size is always a power of 2)
@@ -527,6 +862,12 @@ typedef struct Table {
 
 LUAI_DDEC const TValue luaO_nilobject_;
 
+#if defined(LUA_NANBOXING)
+LUAI_DDEC const lu_byte luaO_nbtag[16];
+LUAI_FUNC int luaO_nbbox (int tt);
+LUAI_FUNC void luaO_setbigint (lua_State *L, TValue *o, lua_Integer i);
+#endif
+
 /* size of buffer for 'luaO_utf8esc' function */
 #define UTF8BUFFSZ	8
 
@@ -536,7 +877,9 @@ LUAI_FUNC int luaO_utf8esc (char *buff, unsigned long x);
 LUAI_FUNC int luaO_ceillog2 (unsigned int x);
 LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
-LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
+LUAI_FUNC size_t luaO_readnum (const char *s, int *isint, lua_Integer *i,
+                                                  lua_Number *n);
+LUAI_FUNC size_t luaO_str2num (lua_State *L, const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
@@ -65,6 +65,21 @@ LUAI_DDEF const char *const luaP_opnames[NUM_OPCODES+1] = {
   "CLOSURE",
   "VARARG",
   "EXTRAARG",
+  "ADDI",
+  "EQK",
+  "GETFIELD",
+  "GETINT",
+  "GETTABUPCALL",
+  "SELFCALL",
+  "GETTABLEARITH",
+  "ADDII",
+  "ADDFF",
+  "SUBII",
+  "SUBFF",
+  "MULII",
+  "MULFF",
+  "LTII",
+  "LEII",
   NULL
 };
 
@@ -120,5 +135,77 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
  ,opmode(0, 0, OpArgU, OpArgU, iAx)		/* OP_EXTRAARG */
+ ,opmode(0, 1, OpArgR, OpArgU, iABC)		/* OP_ADDI */
+ ,opmode(1, 0, OpArgR, OpArgU, iABC)		/* OP_EQK */
+ ,opmode(0, 1, OpArgR, OpArgU, iABC)		/* OP_GETFIELD */
+ ,opmode(0, 1, OpArgR, OpArgU, iABC)		/* OP_GETINT */
+ ,opmode(0, 1, OpArgU, OpArgK, iABC)		/* OP_GETTABUPCALL */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_SELFCALL */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_GETTABLEARITH */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_ADDII */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_ADDFF */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_SUBII */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_SUBFF */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_MULII */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_MULFF */
+ ,opmode(1, 0, OpArgK, OpArgK, iABC)		/* OP_LTII */
+ ,opmode(1, 0, OpArgK, OpArgK, iABC)		/* OP_LEII */
 };
 
+
+/*
+** Return the basic opcode of 'op', that is, 'op' itself for regular
+** instructions, the opcode whose work a superinstruction does before
+** going on to the following instruction, or the generic form of a
+** quickened instruction.
+*/
+OpCode luaP_basicop (OpCode op) {
+  switch (op) {
+    case OP_GETTABUPCALL: return OP_GETTABUP;
+    case OP_SELFCALL: return OP_SELF;
+    case OP_GETTABLEARITH: return OP_GETFIELD;
+    case OP_ADDII: case OP_ADDFF: return OP_ADD;
+    case OP_SUBII: case OP_SUBFF: return OP_SUB;
+    case OP_MULII: case OP_MULFF: return OP_MUL;
+    case OP_LTII: return OP_LT;
+    case OP_LEII: return OP_LE;
+    default: return op;
+  }
+}
+
+
+/*
+** Peephole pass that rewrites instructions frequently followed by a
+** given other instruction into superinstructions. Only the first
+** instruction of each pair is changed; the second one stays in place
+** (see notes in 'lopcodes.h'), so this pass needs no information about
+** jumps and can be applied to any valid code, both fresh from the
+** parser and loaded from a binary chunk.
+*/
+void luaP_fuse (Instruction *code, int n) {
+  int pc;
+  for (pc = 0; pc < n - 1; pc++) {
+    Instruction *i = &code[pc];
+    OpCode next = GET_OPCODE(*(i + 1));
+    switch (GET_OPCODE(*i)) {
+      case OP_GETTABUP: {  /* global function call */
+        if (next == OP_CALL)
+          SET_OPCODE(*i, OP_GETTABUPCALL);
+        break;
+      }
+      case OP_SELF: {  /* method call */
+        if (next == OP_CALL)
+          SET_OPCODE(*i, OP_SELFCALL);
+        break;
+      }
+      case OP_GETFIELD: {  /* field used in arithmetic */
+        if (next == OP_ADD || next == OP_SUB || next == OP_MUL ||
+            next == OP_ADDI)
+          SET_OPCODE(*i, OP_GETTABLEARITH);
+        break;
+      }
+      default: break;
+    }
+  }
+}
+
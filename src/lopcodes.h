@@ -112,6 +112,9 @@ enum OpMode {iABC, iABx, iAsBx, iAx};  /* basic instruction format */
 #define GETARG_sBx(i)	(GETARG_Bx(i)-MAXARG_sBx)
 #define SETARG_sBx(i,b)	SETARG_Bx((i),cast(unsigned int, (b)+MAXARG_sBx))
 
+#define MAXARG_sC	(MAXARG_C>>1)	/* 'sC' is signed (OP_ADDI) */
+#define GETARG_sC(i)	(GETARG_C(i)-MAXARG_sC)
+
 
 #define CREATE_ABC(o,a,b,c)	((cast(Instruction, o)<<POS_OP) \
 			| (cast(Instruction, a)<<POS_A) \
@@ -230,11 +233,35 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+/* instructions with immediate operands */
+
+OP_ADDI,/*	A B sC	R(A) := R(B) + sC				*/
+OP_EQK,/*	A B C	if ((R(B) == Kst(C)) ~= A) then pc++		*/
+OP_GETFIELD,/*	A B C	R(A) := R(B)[Kst(C)]	(short string key)	*/
+OP_GETINT,/*	A B C	R(A) := R(B)[C]					*/
+
+/* superinstructions (see 'luaP_fuse') */
+
+OP_GETTABUPCALL,/* A B C	R(A) := UpValue[B][RK(C)]; then OP_CALL	*/
+OP_SELFCALL,/*	A B C	R(A+1) := R(B); R(A) := R(B)[RK(C)]; then OP_CALL */
+OP_GETTABLEARITH,/* A B C	R(A) := R(B)[Kst(C)]; then OP_ADD/SUB/MUL/ADDI */
+
+/* quickened instructions (see 'luaV_execute') */
+
+OP_ADDII,/*	A B C	R(A) := RK(B) + RK(C)	(integers)		*/
+OP_ADDFF,/*	A B C	R(A) := RK(B) + RK(C)	(floats)		*/
+OP_SUBII,/*	A B C	R(A) := RK(B) - RK(C)	(integers)		*/
+OP_SUBFF,/*	A B C	R(A) := RK(B) - RK(C)	(floats)		*/
+OP_MULII,/*	A B C	R(A) := RK(B) * RK(C)	(integers)		*/
+OP_MULFF,/*	A B C	R(A) := RK(B) * RK(C)	(floats)		*/
+OP_LTII,/*	A B C	if ((RK(B) <  RK(C)) ~= A) then pc++	(integers) */
+OP_LEII/*	A B C	if ((RK(B) <= RK(C)) ~= A) then pc++	(integers) */
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_EXTRAARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_LEII) + 1)
 
 
 
@@ -257,8 +284,24 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
   (*) For comparisons, A specifies what condition the test should accept
   (true or false).
 
+  (*) The code generator uses OP_EQK and OP_GETFIELD only with constant
+  indices that fit in an RK operand, so that they are equivalent to
+  OP_EQ and OP_GETTABLE with RK(C) = Kst(C).
+
   (*) All 'skips' (pc++) assume that next instruction is a jump.
 
+  (*) A superinstruction executes its own basic opcode (e.g., OP_GETTABUP
+  for OP_GETTABUPCALL) and then, in the same dispatch, the instruction
+  that follows it. That next instruction is kept unchanged in the code,
+  so it is still valid as a jump target, as a yield/hook resume point,
+  and for debug information.
+
+  (*) A quickened instruction is a version of an arithmetic or order
+  instruction specialized for the operand types it has been seeing.
+  The interpreter rewrites instructions into these forms (and back)
+  while running, so they never appear in code produced by the parser
+  or in binary chunks; 'luaP_basicop' maps them to the generic forms.
+
 ===========================================================================*/
 
 
@@ -290,6 +333,13 @@ LUAI_DDEC const lu_byte luaP_opmodes[NUM_OPCODES];
 LUAI_DDEC const char *const luaP_opnames[NUM_OPCODES+1];  /* opcode names */
 
 
+/* whether 'op' is a superinstruction */
+#define luaP_isfused(op)  (OP_GETTABUPCALL <= (op) && (op) <= OP_GETTABLEARITH)
+
+LUAI_FUNC OpCode luaP_basicop (OpCode op);
+LUAI_FUNC void luaP_fuse (Instruction *code, int n);
+
+
 /* number of list items to accumulate before a SETLIST instruction */
 #define LFIELDS_PER_FLUSH	50
 
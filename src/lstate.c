@@ -36,6 +36,14 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GENMINORMUL)
+#define LUAI_GENMINORMUL	20  /* minor collection after 20% growth */
+#endif
+
+#if !defined(LUAI_GENMAJORMUL)
+#define LUAI_GENMAJORMUL	100  /* major collection after 100% growth */
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -317,18 +325,43 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->panic = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
-  g->gckind = KGC_NORMAL;
+  g->gckind = KGC_INC;
+  g->gcemergency = 0;
+  g->gcfreezing = 0;
   g->allgc = g->finobj = g->tobefnz = g->fixedgc = NULL;
+  g->deadshapes = NULL;
+  g->frozengc = NULL;
+  g->thawed = NULL;
+  g->nthawed = g->sizethawed = 0;
+  g->survival = g->old1 = g->reallyold = g->firstold1 = NULL;
+  g->finobjsur = g->finobjold1 = g->finobjrold = NULL;
   g->sweepgc = NULL;
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
+  g->ephindex = NULL;
   g->twups = NULL;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->gcsteptime = 0;
+  g->gcbacklog = 0;
+  g->genminormul = LUAI_GENMINORMUL;
+  g->genmajormul = LUAI_GENMAJORMUL;
+  g->gcregions = 0;
+  memset(&g->gcstats, 0, sizeof(g->gcstats));
+  memset(&g->gcpacer, 0, sizeof(g->gcpacer));
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
+  for (i=0; i <= MAXSHAPEKEYS; i++) g->shaperoot[i] = NULL;
+#if defined(LUA_USE_JIT)
+  g->jitrec = NULL;
+#endif
+#if defined(LUA_USE_GCTHREAD)
+  g->gcthread = NULL;
+  g->gcpool = NULL;
+  g->gcworker = 0;
+#endif
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
     close_state(L);
@@ -25,7 +25,25 @@
 ** 'finobj': all objects marked for finalization;
 ** 'tobefnz': all objects ready to be finalized;
 ** 'fixedgc': all objects that are not to be collected (currently
-** only small strings, such as reserved words).
+** only small strings, such as reserved words, and the empty shapes).
+** 'frozengc': all objects frozen by 'luaC_freeze', which the collector
+** neither marks nor sweeps.
+**
+** For the generational collector, lists 'allgc' and 'finobj' are split
+** by marks into generations; each mark points to the first element of
+** its generation, which goes until the next mark:
+**
+** 'allgc' -> 'survival': new objects;
+** 'survival' -> 'old1': objects that survived one collection;
+** 'old1' -> 'reallyold': objects that became old in last collection;
+** 'reallyold' -> NULL: objects old for more than one cycle.
+**
+** ('finobjsur', 'finobjold1', and 'finobjrold' do the same for 'finobj'.)
+** A list may contain objects older than its generation, because
+** barriers age young objects and because 'luaC_checkfinalizer' and
+** 'udata2finalize' move objects between lists, but never younger ones.
+** 'firstold1' points to the first OLD1 object in 'allgc' (if any), to
+** spare 'markold' from going through the younger part of the list.
 **
 ** Moreover, there is another set of lists that control gray objects.
 ** These lists are linked by fields 'gclist'. (All objects that
@@ -69,8 +87,8 @@ struct lua_longjmp;  /* defined in ldo.c */
 
 
 /* kinds of Garbage Collection */
-#define KGC_NORMAL	0
-#define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
+#define KGC_INC		0	/* incremental gc */
+#define KGC_GEN		1	/* generational gc */
 
 
 typedef struct stringtable {
@@ -131,6 +149,43 @@ typedef struct CallInfo {
 #define getoah(st)	((st) & CIST_OAH)
 
 
+/*
+** Collector statistics (see 'lua_gcstats'); times are in microseconds
+*/
+typedef struct GCStats {
+  l_mem time[4];  /* time in phases propagate, atomic, sweep, and callfin */
+  l_mem maxstep;  /* longest step */
+  l_mem maxpause;  /* longest atomic pause */
+  lu_mem marked;  /* bytes marked by current cycle */
+  lu_mem swept;  /* bytes freed by current cycle */
+  lu_mem lastmarked;  /* bytes marked by last complete cycle */
+  lu_mem lastswept;  /* bytes freed by last complete cycle */
+  lu_mem cycles;  /* complete cycles */
+  lu_mem minors;  /* minor collections */
+  lu_mem steps;  /* number of steps */
+  lu_mem finalizers;  /* finalizers called */
+  lu_mem stephist[LUA_GCHISTSIZE];  /* histogram of step durations */
+  lu_mem pausehist[LUA_GCHISTSIZE];  /* histogram of atomic pauses */
+} GCStats;
+
+
+/*
+** State of the automatic pacer (see 'autopace' in 'lgc.c'); times are
+** in microseconds
+*/
+typedef struct GCPacer {
+  lu_byte kind;  /* kind of target (LUA_GCAUTOHEAP, LUA_GCAUTOCPU, or 0) */
+  int target;  /* target (a percentage) */
+  l_mem time;  /* clock at the end of last cycle */
+  l_mem gctime;  /* total collector time at the end of last cycle */
+  lu_mem bytes;  /* total bytes at the end of last cycle */
+  lu_mem cyclework;  /* work done by steps in current cycle */
+  lu_mem work;  /* (smoothed) work of a cycle */
+  l_mem cost;  /* (smoothed) collector time of a cycle */
+  l_mem rate;  /* (smoothed) bytes allocated per millisecond of program */
+} GCPacer;
+
+
 /*
 ** 'global state', shared by all threads of this state
 */
@@ -147,6 +202,8 @@ typedef struct global_State {
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
+  lu_byte gcemergency;  /* true if this is an emergency collection */
+  lu_byte gcfreezing;  /* true if the atomic phase must freeze objects */
   lu_byte gcrunning;  /* true if GC is running */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
@@ -156,18 +213,48 @@ typedef struct global_State {
   GCObject *weak;  /* list of tables with weak values */
   GCObject *ephemeron;  /* list of ephemeron tables (weak keys) */
   GCObject *allweak;  /* list of all-weak tables */
+  struct EphIndex *ephindex;  /* pending ephemeron entries (see 'lgc.c') */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
+  GCObject *frozengc;  /* list of frozen objects (see 'luaC_freeze') */
+  GCObject **thawed;  /* frozen objects visited by the collector */
+  int nthawed;  /* number of elements in 'thawed' */
+  int sizethawed;  /* size of 'thawed' */
+  GCObject *deadshapes;  /* shapes to be freed at the end of the sweep */
+  /* fields for generational collector */
+  GCObject *survival;  /* start of objects that survived one GC cycle */
+  GCObject *old1;  /* start of old1 objects */
+  GCObject *reallyold;  /* objects more than one cycle old ("really old") */
+  GCObject *firstold1;  /* first OLD1 object in the list (if any) */
+  GCObject *finobjsur;  /* list of survival objects with finalizers */
+  GCObject *finobjold1;  /* list of old1 objects with finalizers */
+  GCObject *finobjrold;  /* list of really old objects with finalizers */
   struct lua_State *twups;  /* list of threads with open upvalues */
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gcsteptime;  /* time limit of a step (in microseconds; 0 = none) */
+  l_mem gcbacklog;  /* work left by steps that ran out of time */
+  int genminormul;  /* growth (%) that triggers a minor collection */
+  int genmajormul;  /* growth (%) that triggers a major collection */
+  int gcregions;  /* number of open regions (see 'luaC_openregion') */
+  GCStats gcstats;  /* collector statistics */
+  GCPacer gcpacer;  /* automatic pacing */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
+  struct Shape *shaperoot[MAXSHAPEKEYS + 1];  /* empty shapes, by size */
+#if defined(LUA_USE_JIT)
+  struct JitRecorder *jitrec;  /* trace being recorded (see 'ljit.c') */
+#endif
+#if defined(LUA_USE_GCTHREAD)
+  struct GCThread *gcthread;  /* idle-time marker (see 'lgc.c') */
+  struct GCPool *gcpool;  /* workers for parallel marks (see 'lgc.c') */
+  lu_byte gcworker;  /* kind of collector thread using this state */
+#endif
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
 } global_State;
 
@@ -215,6 +302,7 @@ union GCUnion {
   union Closure cl;
   struct Table h;
   struct Proto p;
+  struct Shape sh;
   struct lua_State th;  /* thread */
 };
 
@@ -232,6 +320,7 @@ union GCUnion {
 #define gco2t(o)  check_exp((o)->tt == LUA_TTABLE, &((cast_u(o))->h))
 #define gco2p(o)  check_exp((o)->tt == LUA_TPROTO, &((cast_u(o))->p))
 #define gco2th(o)  check_exp((o)->tt == LUA_TTHREAD, &((cast_u(o))->th))
+#define gco2sh(o)  check_exp((o)->tt == LUA_TSHAPE, &((cast_u(o))->sh))
 
 
 /* macro to convert a Lua object into a GCObject */
@@ -21,10 +21,41 @@
 ** in its main position (i.e. the 'original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+**
+** With LUA_USE_SWISSTABLE, the hash part uses open addressing instead:
+** besides its nodes it has a vector of control bytes, one per node,
+** with a 7-bit tag from the hash of the node's key (or a mark of a free
+** node). A search compares the tag of the key with a whole group of
+** control bytes at once and only looks at the nodes that match.
+**
+** A big hash part grows incrementally: the table keeps its old hash
+** part beside the new one, and each new key moves a few old entries
+** to the new part. Searches look in the new part and then in the old
+** one; traversals go through the new part and then the old one. (As
+** only new keys move entries, no entry moves during a traversal.)
+**
+** With LUA_USE_HOMOARRAYS, a big array part whose values all have one
+** type (integers, floats or booleans), followed only by nils, may be
+** marked 'homogeneous': the table keeps that type ('atype'), so that
+** the collector does not traverse the part and traces can trust the
+** types of its values. This is only a tag; the storage does not change
+** (the slots are regular 'TValue's, and memory use is the same). A
+** store of another type, or one that would leave a hole, just clears
+** the tag.
+**
+** A table with only short-string keys outside its array part (a record)
+** may instead be 'shaped': its keys are kept in a 'Shape' shared by all
+** tables that got the same keys in the same order, and the table itself
+** keeps only a dense vector with their values. A shaped table moves to
+** a regular hash part when it gets any other key or too many keys.
+** Small records built by constructors keep the values of their shaped
+** part in the table block itself (with no separate vector) until they
+** outgrow that room.
 */
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -55,6 +86,35 @@
 #define MAXHBITS	(MAXABITS - 1)
 
 
+/*
+** A hash part with at least LUAI_MINREHASH nodes grows incrementally
+** (see 'luaH_resize'); each new key moves REHASHSTEP old nodes.
+*/
+#if !defined(LUAI_MINREHASH)
+#define LUAI_MINREHASH	(1 << 16)
+#endif
+
+#define REHASHSTEP	4
+
+
+/*
+** Constructors with up to LUAI_INLINEVALS record fields build tables with
+** room for their values in the table block (see 'luaH_newinline').
+*/
+#if !defined(LUAI_INLINEVALS)
+#define LUAI_INLINEVALS	4
+#endif
+
+
+/*
+** Array parts with less than LUAI_MINHOMO slots are never marked
+** homogeneous.
+*/
+#if !defined(LUAI_MINHOMO)
+#define LUAI_MINHOMO	64
+#endif
+
+
 #define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
 
 #define hashstr(t,str)		hashpow2(t, (str)->hash)
@@ -72,13 +132,180 @@
 #define hashpointer(t,p)	hashmod(t, point2uint(p))
 
 
+#if !defined(LUA_USE_SWISSTABLE)
+
 #define dummynode		(&dummynode_)
 
+/* maximum number of keys in a hash part with 'n' nodes */
+#define hashcap(n)	(n)
+
 static const Node dummynode_ = {
   {NILCONSTANT},  /* value */
   {{NILCONSTANT, 0}}  /* key */
 };
 
+#else
+
+/*
+** {=============================================================
+** Control bytes (open addressing)
+** ==============================================================
+*/
+
+/*
+** The hash part of size 'n' is divided in groups of GROUP nodes (or is
+** a single group, when 'n' is smaller). Each node has a control byte,
+** which is either CTRL_EMPTY (a node never used) or the tag of its key;
+** tables smaller than a group pad their control bytes with CTRL_PAD
+** up to a group. Nodes are never freed: a key removed from the table
+** keeps its node, with a nil value, until the next rehash. A search
+** goes through the groups in the probe sequence of its hash, until it
+** finds the key or a group with an empty node. (Search and insertion
+** agree on that sequence, so a key is never after such a group.)
+*/
+#define CTRL_EMPTY	0x80
+#define CTRL_PAD	0xff
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define LOGGROUP	4
+typedef unsigned int Gmask;
+
+/* mask with one bit for each control byte in group 'c' equal to 'b' */
+#define gmatch(c,b) \
+	cast(Gmask, _mm_movemask_epi8(_mm_cmpeq_epi8( \
+	  _mm_loadu_si128(cast(const __m128i *, (c))), \
+	  _mm_set1_epi8(cast(char, (b))))))
+
+#define firstslot(m)	firstbit(m)
+
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) && \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+#include <arm_neon.h>
+
+#define LOGGROUP	3
+typedef uint64_t Gmask;
+
+/* mask with bit 7 of each byte set where group 'c' is equal to 'b' */
+#define gmatch(c,b) \
+	(vget_lane_u64(vreinterpret_u64_u8(vceq_u8(vld1_u8(c), \
+	                                           vdup_n_u8(b))), 0) & \
+	 0x8080808080808080ull)
+
+#define firstslot(m)	(__builtin_ctzll(m) >> 3)
+
+#else
+
+#define LOGGROUP	3
+typedef unsigned int Gmask;
+
+static Gmask gmatch (const lu_byte *c, int b) {
+  Gmask m = 0;
+  int i;
+  for (i = 0; i < (1 << LOGGROUP); i++)
+    m |= cast(Gmask, c[i] == b) << i;
+  return m;
+}
+
+#define firstslot(m)	firstbit(m)
+
+#endif
+
+#define GROUP		(1 << LOGGROUP)
+
+
+/* index of the lowest 1 bit of 'm' (which is not zero) */
+#if defined(__GNUC__)
+#define firstbit(m)	__builtin_ctz(m)
+#else
+static int firstbit (unsigned int m) {
+  int i = 0;
+  while (!(m & 1)) { m >>= 1; i++; }
+  return i;
+}
+#endif
+
+
+/* control bytes of a hash part (they come right after its nodes) */
+#define gctrl(t)	cast(lu_byte *, gnode(t, sizenode(t)))
+
+/* number of control bytes of a hash part with 'n' nodes */
+#define sizectrl(n)	((n) < GROUP ? GROUP : (n))
+
+/* size of the block with the nodes and control bytes of a hash part */
+#define sizenodes(n)	((n) * sizeof(Node) + sizectrl(n))
+
+/* mask for the index of a group in table 't' */
+#define gmask(t)	(cast(unsigned int, sizenode(t) - 1) >> LOGGROUP)
+
+/*
+** Maximum number of keys in a hash part with 'n' nodes. A single group
+** can be full, as searches stop after the last group anyway; larger
+** parts keep 1/8 of their nodes empty, so that most searches stop in
+** their first group.
+*/
+#define hashcap(n)	((n) <= GROUP ? (n) : (n) - ((n) >> 3))
+
+/*
+** For tables with a hash part, 'lastfree' is not needed (there are no
+** collisions to solve), so it counts how many keys can still be added
+** to the table without a rehash.
+*/
+#define growleft(t)	cast_int((t)->lastfree - (t)->node)
+
+
+/*
+** Hashes of some keys (integers, pointers) have poor low or high bits.
+** A multiplication spreads them to the higher bits, which give the tag
+** (7 bits); folding these back gives the group index (lower bits).
+*/
+#define mixhash(h)	((h) *= 0x9e3779b1u, (h) ^= (h) >> 15)
+
+#define hashtag(h)	cast_byte(((h) >> 25) & 0x7f)
+
+
+/*
+** Go through the nodes of table 't' with the tag of hash 'h', in the
+** order of its probe sequence (triangular, over groups), until 'cond'
+** is true for node 'n' or there is an empty node in the group. Leave
+** in 'n' the node found, or NULL.
+*/
+#define probe(t,h,n,cond) { \
+  unsigned int gm_ = gmask(t), g_ = (h) & gm_, s_ = 0; \
+  lu_byte tag_ = hashtag(h); \
+  for (;;) { \
+    const lu_byte *c_ = gctrl(t) + (g_ << LOGGROUP); \
+    Gmask m_; \
+    for (m_ = gmatch(c_, tag_); m_ != 0; m_ &= m_ - 1) { \
+      n = gnode(t, (g_ << LOGGROUP) + firstslot(m_)); \
+      if (cond) break; \
+    } \
+    if (m_ != 0) break;  /* found it */ \
+    if (gmatch(c_, CTRL_EMPTY) != 0 || s_ == gm_) { n = NULL; break; } \
+    g_ = (g_ + ++s_) & gm_; \
+  } }
+
+
+#define dummynode		(&dummy_.n)
+
+/* the dummy node has only empty and padding control bytes after it */
+static const struct {
+  Node n;
+  lu_byte ctrl[16];
+} dummy_ = {
+  {{NILCONSTANT}, {{NILCONSTANT, 0}}},
+  {CTRL_EMPTY, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD,
+   CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD,
+   CTRL_PAD, CTRL_PAD}
+};
+
+/* }============================================================= */
+
+#endif
+
 
 /*
 ** Hash for floating-point numbers.
@@ -110,6 +337,8 @@ static int l_hashfloat (lua_Number n) {
 #endif
 
 
+#if !defined(LUA_USE_SWISSTABLE)
+
 /*
 ** returns the 'main' position of an element in a table (that is, the index
 ** of its hash value)
@@ -136,6 +365,76 @@ static Node *mainposition (const Table *t, const TValue *key) {
   }
 }
 
+#else
+
+/* hash for integer 'i' (with all its bits) */
+#define inthash(i) \
+	(cast(unsigned int, l_castS2U(i)) ^ 0x9e3779b1u * \
+	 cast(unsigned int, l_castS2U(i) >> (sizeof(i) * CHAR_BIT / 2)))
+
+
+/*
+** returns the (mixed) hash of a key, which selects the first group of
+** its probe sequence and its tag
+*/
+static unsigned int hashkey (const TValue *key) {
+  unsigned int h;
+  switch (ttype(key)) {
+    case LUA_TNUMINT: h = inthash(ivalue(key)); break;
+    case LUA_TNUMFLT:
+      h = cast(unsigned int, l_hashfloat(fltvalue(key)));
+      break;
+    case LUA_TSHRSTR: h = tsvalue(key)->hash; break;
+    case LUA_TLNGSTR: h = luaS_hashlongstr(tsvalue(key)); break;
+    case LUA_TBOOLEAN: h = cast(unsigned int, bvalue(key)); break;
+    case LUA_TLIGHTUSERDATA: h = point2uint(pvalue(key)); break;
+    case LUA_TLCF: h = point2uint(fvalue(key)); break;
+    default:
+      lua_assert(!ttisdeadkey(key));
+      h = point2uint(gcvalue(key));
+      break;
+  }
+  mixhash(h);
+  return h;
+}
+
+
+/*
+** returns a node for a new key with hash 'h' (the first empty node in
+** its probe sequence), after setting its control byte
+*/
+static Node *freenode (Table *t, unsigned int h) {
+  unsigned int gm = gmask(t), g = h & gm, s = 0;
+  lua_assert(!isdummy(t) && growleft(t) > 0);
+  for (;;) {
+    lu_byte *c = gctrl(t) + (g << LOGGROUP);
+    Gmask m = gmatch(c, CTRL_EMPTY);
+    if (m != 0) {
+      int i = firstslot(m);
+      c[i] = hashtag(h);
+      t->lastfree--;  /* one less key to go */
+      return gnode(t, (g << LOGGROUP) + i);
+    }
+    lua_assert(s < gm);
+    g = (g + ++s) & gm;
+  }
+}
+
+#endif
+
+
+/*
+** returns the index of 'key' in shape 's', or -1 if it is not there
+*/
+static int shapeindex (const Shape *s, const TString *key) {
+  int i;
+  for (i = 0; i < s->nkeys; i++) {
+    if (s->keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
 
 /*
 ** returns the index for 'key' if 'key' is an appropriate key to live in
@@ -151,35 +450,167 @@ static unsigned int arrayindex (const TValue *key) {
 }
 
 
+#if !defined(LUA_USE_SWISSTABLE)
+
+/*
+** returns the node of 'key' in the hash part of table 't', or NULL if
+** it is not there. (Key may be dead already, but it is ok to use it in
+** 'next'.)
+*/
+static Node *findnode (const Table *t, const TValue *key) {
+  Node *n = mainposition(t, key);
+  for (;;) {  /* check whether 'key' is somewhere in the chain */
+    int nx;
+    if (luaV_rawequalobj(gkey(n), key) ||
+          (ttisdeadkey(gkey(n)) && iscollectable(key) &&
+           deadvalue(gkey(n)) == gcvalue(key)))
+      return n;
+    nx = gnext(n);
+    if (nx == 0)
+      return NULL;  /* key not found */
+    n += nx;
+  }
+}
+
+#else
+
+static Node *findnode (const Table *t, const TValue *key) {
+  Node *n;
+  unsigned int h = hashkey(key);
+  probe(t, h, n, luaV_rawequalobj(gkey(n), key));
+  /* key may be dead already, but it is ok to use it in 'next' (a dead
+     string can be reused, and then another node may have it alive) */
+  if (n == NULL && iscollectable(key))
+    probe(t, h, n, ttisdeadkey(gkey(n)) &&
+                   deadvalue(gkey(n)) == gcvalue(key));
+  return n;
+}
+
+#endif
+
+
+/*
+** {=============================================================
+** Homogeneous array parts
+** ==============================================================
+*/
+
+/*
+** type of 'o' for a homogeneous array part: a boxed integer (see
+** 'isbigint') is an object, so it never goes there
+*/
+#define homott(o)	(isbigint(o) ? LUA_TNONE : ttype(o))
+
+
+/* true if 'slot' is in the array part of 't' */
+#define inarray(t,slot) \
+	((t)->array <= (slot) && (slot) < (t)->array + (t)->sizearray)
+
+
+/*
+** Mark the array part of table 't' as homogeneous, if it is big enough
+** and all its values have one of the allowed types, with no nils
+** among them. The slots keep their values: the mark only tells that
+** its values are a prefix of that type, followed by nils.
+*/
+static void homoarray (Table *t) {
+#if defined(LUA_USE_HOMOARRAYS)
+  unsigned int size = t->sizearray;
+  unsigned int n = 0;
+  TValue *array = t->array;
+  int tt;
+  if (t->atype != 0 || size < LUAI_MINHOMO)
+    return;
+  tt = homott(&array[0]);
+  if (tt != LUA_TNUMINT && tt != LUA_TNUMFLT && tt != LUA_TBOOLEAN)
+    return;
+  while (n < size && homott(&array[n]) == tt)
+    n++;
+  for (; n < size; n++) {
+    if (!ttisnil(&array[n]))  /* another type, or a value after a nil? */
+      return;
+  }
+  t->atype = cast_byte(tt);
+#else
+  UNUSED(t);
+#endif
+}
+
+
+/*
+** Check a store of 'v' into 'slot' of table 't', with a homogeneous
+** array part. A value of its type may replace a value or go right
+** after the last one, and nil may remove the last value; other stores
+** into the array part clear the mark.
+*/
+void luaH_checkhomo (Table *t, const TValue *slot, const TValue *v) {
+  lua_assert(t->atype != 0);
+  if (inarray(t, slot)) {
+    const TValue *last = t->array + t->sizearray - 1;
+    if (ttisnil(v)) {
+      if (ttisnil(slot) || slot == last || ttisnil(slot + 1))
+        return;  /* no value removed, or the last one */
+    }
+    else if (homott(v) == t->atype &&
+             (!ttisnil(slot) || slot == t->array || !ttisnil(slot - 1)))
+      return;  /* a value replaced, or a new last value */
+    t->atype = 0;
+  }
+}
+
+
+/*
+** true if the hash part of 't' has integer keys that would go to an
+** array part with 'n' slots
+*/
+static int hasarraykeys (const Table *t, unsigned int n) {
+  int j;
+  for (j = allocsizenode(t) - 1; j >= 0; j--) {
+    const Node *nd = gnode(t, j);
+    if (!ttisnil(gval(nd)) && ttisinteger(gkey(nd)) &&
+        l_castS2U(ivalue(gkey(nd))) - 1 < n)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+** }=============================================================
+*/
+
+
 /*
 ** returns the index of a 'key' for table traversals. First goes all
-** elements in the array part, then elements in the hash part. The
-** beginning of a traversal is signaled by 0.
+** elements in the array part, then elements in the hash part (and then
+** those in its old hash part). The beginning of a traversal is signaled
+** by 0.
 */
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
+  Node *n;
   if (ttisnil(key)) return 0;  /* first iteration */
   i = arrayindex(key);
   if (i != 0 && i <= t->sizearray)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
-  else {
-    int nx;
-    Node *n = mainposition(t, key);
-    for (;;) {  /* check whether 'key' is somewhere in the chain */
-      /* key may be dead already, but it is ok to use it in 'next' */
-      if (luaV_rawequalobj(gkey(n), key) ||
-            (ttisdeadkey(gkey(n)) && iscollectable(key) &&
-             deadvalue(gkey(n)) == gcvalue(key))) {
-        i = cast_int(n - gnode(t, 0));  /* key index in hash table */
-        /* hash elements are numbered after array ones */
-        return (i + 1) + t->sizearray;
-      }
-      nx = gnext(n);
-      if (nx == 0)
-        luaG_runerror(L, "invalid key to 'next'");  /* key not found */
-      else n += nx;
-    }
+  else if (t->shape != NULL) {  /* shaped table? */
+    int si = ttisshrstring(key) ? shapeindex(t->shape, tsvalue(key)) : -1;
+    if (si < 0)
+      luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+    /* shaped elements are numbered after array ones */
+    return cast(unsigned int, si + 1) + t->sizearray;
+  }
+  else if ((n = findnode(t, key)) != NULL) {
+    i = cast_int(n - gnode(t, 0));  /* key index in hash table */
+    /* hash elements are numbered after array ones */
+    return (i + 1) + t->sizearray;
   }
+  else if (t->rehash != NULL && (n = findnode(oldpart(t), key)) != NULL) {
+    i = cast_int(n - gnode(oldpart(t), 0));  /* key index in old part */
+    /* old elements are numbered after the new ones */
+    return (i + 1) + t->sizearray + sizenode(t);
+  }
+  luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+  return 0;  /* to avoid warnings */
 }
 
 
@@ -187,22 +618,168 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   unsigned int i = findindex(L, t, key);  /* find original element */
   for (; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setivalue(key, i + 1);
+      setivalue(L, key, i + 1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
   }
-  for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
+  i -= t->sizearray;
+  if (t->shape != NULL) {  /* shaped part */
+    for (; cast_int(i) < t->shape->nkeys; i++) {
+      if (!ttisnil(&t->svals[i])) {  /* a non-nil value? */
+        setsvalue2s(L, key, t->shape->keys[i]);
+        setobj2s(L, key+1, &t->svals[i]);
+        return 1;
+      }
+    }
+    return 0;  /* no more elements */
+  }
+  for (; cast_int(i) < sizenode(t); i++) {  /* hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
       setobj2s(L, key, gkey(gnode(t, i)));
       setobj2s(L, key+1, gval(gnode(t, i)));
       return 1;
     }
   }
+  if (t->rehash != NULL) {  /* old hash part (nodes not moved yet) */
+    Table *old = oldpart(t);
+    for (i -= sizenode(t); cast_int(i) < t->rehash->left; i++) {
+      if (!ttisnil(gval(gnode(old, i)))) {  /* a non-nil value? */
+        setobj2s(L, key, gkey(gnode(old, i)));
+        setobj2s(L, key+1, gval(gnode(old, i)));
+        return 1;
+      }
+    }
+  }
   return 0;  /* no more elements */
 }
 
 
+/*
+** {=============================================================
+** Shapes
+** ==============================================================
+*/
+
+static Shape *newshape (lua_State *L, int nkeys, int size) {
+  GCObject *o = luaC_newobj(L, LUA_TSHAPE, sizeshape(nkeys));
+  Shape *s = gco2sh(o);
+  s->nkeys = cast_byte(nkeys);
+  s->size = cast_byte(size);
+  s->parent = s->children = s->sibling = NULL;
+  return s;
+}
+
+
+/*
+** Empty shape for tables with room for 'size' keys. These shapes are
+** the roots of the shape tree and are never collected.
+*/
+static Shape *emptyshape (lua_State *L, unsigned int size) {
+  global_State *g = G(L);
+  lua_assert(size <= MAXSHAPEKEYS);
+  if (g->shaperoot[size] == NULL) {
+    Shape *s = newshape(L, 0, size);
+    luaC_fix(L, obj2gco(s));
+    g->shaperoot[size] = s;
+  }
+  return g->shaperoot[size];
+}
+
+
+/*
+** Shape with all keys from 's' plus 'key' (a transition). A dead shape
+** that was not swept yet cannot be reused, as its keys may be already
+** collected; it stays in the list until the collector removes it.
+*/
+static Shape *addkey (lua_State *L, Shape *s, TString *key) {
+  int n = s->nkeys;
+  Shape *ns;
+  lua_assert(n < MAXSHAPEKEYS);
+  for (ns = s->children; ns != NULL; ns = ns->sibling) {
+    if (ns->keys[n] == key && !isdead(G(L), ns))
+      return ns;  /* transition already exists */
+  }
+  if (n < s->size)  /* still room for the new value? */
+    ns = newshape(L, n + 1, s->size);
+  else  /* grow the value vector like a hash part */
+    ns = newshape(L, n + 1, (s->size == 0) ? 1
+                          : (2 * s->size > MAXSHAPEKEYS) ? MAXSHAPEKEYS
+                          : 2 * s->size);
+  memcpy(ns->keys, s->keys, n * sizeof(TString *));
+  ns->keys[n] = key;
+  ns->parent = s;
+  ns->sibling = s->children;
+  s->children = ns;
+  return ns;
+}
+
+
+/*
+** Change the shape of table 't' to 's', adjusting its value vector (only
+** the values of the old keys are kept). The values stay in the table
+** block while they fit there. 's' may be a new shape, so it is anchored
+** in the stack while the vector is reallocated (an emergency collection
+** could free it).
+*/
+static void setshape (lua_State *L, Table *t, Shape *s) {
+  int oldsize = t->shape->size;
+  int inl = t->sizeinline;
+  if (s->size != oldsize && (s->size > inl || oldsize > inl)) {
+    TValue *old = t->svals;
+    size_t n = sizeof(TValue) * t->shape->nkeys;
+    setgcovalue(L, L->top, obj2gco(s));
+    L->top++;
+    if (oldsize <= inl) {  /* values leave the table block? */
+      t->svals = luaM_newvector(L, s->size, TValue);
+      memcpy(t->svals, old, n);
+    }
+    else if (s->size <= inl) {  /* values go back to the table block? */
+      memcpy(inlinevals(t), old, n);
+      t->svals = inlinevals(t);
+      luaM_freearray(L, old, oldsize);
+    }
+    else
+      luaM_reallocvector(L, t->svals, oldsize, s->size, TValue);
+    L->top--;
+  }
+  t->shape = s;
+  luaC_objbarrier(L, t, s);
+}
+
+
+/*
+** number of non-nil values in shaped table 't'
+*/
+static unsigned int numuseshape (const Table *t) {
+  unsigned int n = 0;
+  int i;
+  for (i = 0; i < t->shape->nkeys; i++) {
+    if (!ttisnil(&t->svals[i]))
+      n++;
+  }
+  return n;
+}
+
+
+/*
+** Remove shape 's' from the transitions of its parent. (Called by the
+** collector when freeing 's'.)
+*/
+void luaH_unlinkshape (Shape *s) {
+  if (s->parent != NULL) {
+    Shape **p = &s->parent->children;
+    while (*p != s)
+      p = &(*p)->sibling;
+    *p = s->sibling;
+  }
+}
+
+/*
+** }=============================================================
+*/
+
+
 /*
 ** {=============================================================
 ** Rehash
@@ -307,6 +884,20 @@ static void setarrayvector (lua_State *L, Table *t, unsigned int size) {
 }
 
 
+/*
+** log2 of the size of a hash part with room for 'size' keys
+*/
+static int lsizehash (unsigned int size) {
+  int lsize = luaO_ceillog2(size);
+#if defined(LUA_USE_SWISSTABLE)
+  if (lsize <= MAXHBITS &&
+      cast(unsigned int, hashcap(twoto(lsize))) < size)  /* too full? */
+    lsize++;
+#endif
+  return lsize;
+}
+
+
 static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   if (size == 0) {  /* no elements to hash part? */
     t->node = cast(Node *, dummynode);  /* use common 'dummynode' */
@@ -315,11 +906,15 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   }
   else {
     int i;
-    int lsize = luaO_ceillog2(size);
+    int lsize = lsizehash(size);
     if (lsize > MAXHBITS)
       luaG_runerror(L, "table overflow");
     size = twoto(lsize);
+#if !defined(LUA_USE_SWISSTABLE)
     t->node = luaM_newvector(L, size, Node);
+#else
+    t->node = cast(Node *, luaM_malloc(L, sizenodes(size)));
+#endif
     for (i = 0; i < (int)size; i++) {
       Node *n = gnode(t, i);
       gnext(n) = 0;
@@ -327,11 +922,24 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
       setnilvalue(gval(n));
     }
     t->lsizenode = cast_byte(lsize);
+#if !defined(LUA_USE_SWISSTABLE)
     t->lastfree = gnode(t, size);  /* all positions are free */
+#else
+    memset(gctrl(t), CTRL_EMPTY, size);
+    memset(gctrl(t) + size, CTRL_PAD, sizectrl(size) - size);
+    t->lastfree = gnode(t, hashcap(size));  /* room for 'hashcap' keys */
+#endif
   }
 }
 
 
+#if !defined(LUA_USE_SWISSTABLE)
+#define freenodes(L,n,size)	luaM_freearray(L, n, cast(size_t, size))
+#else
+#define freenodes(L,n,size)	luaM_freemem(L, n, sizenodes(cast(size_t, size)))
+#endif
+
+
 typedef struct {
   Table *t;
   unsigned int nhsize;
@@ -344,23 +952,239 @@ static void auxsetnode (lua_State *L, void *ud) {
 }
 
 
+/*
+** Give cards to a big table (see 'luaC_barrierback_') after a change in
+** its sizes. Entries may have left their cards, so a table with dirty
+** cards turns gray, to be traversed as a whole.
+*/
+static void setcards (lua_State *L, Table *t) {
+  Cards *c = t->cards;
+  unsigned int size = t->sizearray + allocsizenode(t);
+  unsigned int n = (size >= CARDMIN) ? (size + CARDSIZE - 1) / CARDSIZE : 0;
+  lu_byte listed = 0;
+  if (c != NULL) {
+    listed = c->listed;
+    if (listed && isblack(t))
+      black2gray(t);  /* it is in 'grayagain' already */
+    if (c->n == n) {  /* keep these cards? */
+      memset(c->dirty, 0, n);
+      return;
+    }
+    t->cards = NULL;
+    luaM_freemem(L, c, sizecards(c->n));
+  }
+  if (n > 0) {
+    c = cast(Cards *, luaM_malloc(L, sizecards(n)));
+    c->n = n;
+    c->listed = listed;
+    memset(c->dirty, 0, n);
+    t->cards = c;
+  }
+}
+
+
+/*
+** Move the entries of shaped table 't' into a new hash part with room
+** for 'size' entries (at least the number of non-nil entries); after
+** that, 't' is not shaped anymore.
+*/
+static void unshape (lua_State *L, Table *t, unsigned int size) {
+  Shape *s = t->shape;
+  TValue *svals = t->svals;
+  int i;
+  lua_assert(isdummy(t) && size >= numuseshape(t));
+  setnodevector(L, t, size);
+  t->shape = NULL;
+  t->svals = NULL;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&svals[i])) {
+      TValue k;
+      setsvalue(L, &k, s->keys[i]);
+      /* there is room for all entries, so no rehash (and no errors) */
+      setobjt2t(L, luaH_newkey(L, t, &k), &svals[i]);
+    }
+  }
+  if (s->size > t->sizeinline)  /* values were not in the table block? */
+    luaM_freearray(L, svals, s->size);
+}
+
+
+#if !defined(LUA_USE_SWISSTABLE)
+
+static Node *getfreepos (Table *t) {
+  if (!isdummy(t)) {
+    while (t->lastfree > t->node) {
+      t->lastfree--;
+      if (ttisnil(gkey(t->lastfree)))
+        return t->lastfree;
+    }
+  }
+  return NULL;  /* could not find a free place */
+}
+
+#endif
+
+
+/*
+** inserts a new key into the hash part of table 't' and returns its
+** value, or NULL if there is no room for it. With chained scatter,
+** first check whether key's main position is free. If not, check
+** whether colliding node is in its main position or not: if it is not,
+** move colliding node to an empty place and put new key in its main
+** position; otherwise (colliding node is in its main position), new key
+** goes to an empty position.
+*/
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key) {
+  Node *mp;
+#if !defined(LUA_USE_SWISSTABLE)
+  mp = mainposition(t, key);
+  if (!ttisnil(gval(mp)) || isdummy(t)) {  /* main position is taken? */
+    Node *othern;
+    Node *f = getfreepos(t);  /* get a free place */
+    if (f == NULL)  /* cannot find a free place? */
+      return NULL;
+    lua_assert(!isdummy(t));
+    othern = mainposition(t, gkey(mp));
+    if (othern != mp) {  /* is colliding node out of its main position? */
+      /* yes; move colliding node into free position */
+      while (othern + gnext(othern) != mp)  /* find previous */
+        othern += gnext(othern);
+      gnext(othern) = cast_int(f - othern);  /* rechain to point to 'f' */
+      *f = *mp;  /* copy colliding node into free pos. (mp->next also goes) */
+      if (gnext(mp) != 0) {
+        gnext(f) += cast_int(mp - f);  /* correct 'next' */
+        gnext(mp) = 0;  /* now 'mp' is free */
+      }
+      setnilvalue(gval(mp));
+      if (cardlisted(t) && isblack(t))  /* maybe moved from a dirty card? */
+        luaC_barrierback_(L, t, gval(f));
+    }
+    else {  /* colliding node is in its own main position */
+      /* new node will go into free position */
+      if (gnext(mp) != 0)
+        gnext(f) = cast_int((mp + gnext(mp)) - f);  /* chain new position */
+      else lua_assert(gnext(f) == 0);
+      gnext(mp) = cast_int(f - mp);
+      mp = f;
+    }
+  }
+#else
+  if (isdummy(t) || growleft(t) == 0)  /* no room for a new key? */
+    return NULL;
+  mp = freenode(t, hashkey(key));
+#endif
+  setnodekey(L, &mp->i_key, key);
+  luaC_barrierslot(L, t, gval(mp), key);
+  lua_assert(ttisnil(gval(mp)));
+  return gval(mp);
+}
+
+
+/*
+** Move up to 'n' nodes of the old hash part of 't' (see 'luaH_resize')
+** to its new hash part, which has room for them; free the old part when
+** all its nodes were moved. No key is in both parts, so there is no need
+** to search for the keys. (No barrier either, as the entries were
+** already in the table, outside its cards.) Keys of moved nodes are
+** erased, as a search that misses the new part must not find them: the
+** new part may reuse the node of a removed entry for another key.
+*/
+static void rehashstep (lua_State *L, Table *t, int n) {
+  Rehash *r = t->rehash;
+  Table *old = &r->old;
+  for (; n > 0 && r->left > 0; n--) {
+    Node *o = gnode(old, --r->left);
+    if (!ttisnil(gval(o))) {
+      TValue *v = insertkey(L, t, gkey(o));
+      lua_assert(v != NULL);
+      setobjt2t(L, v, gval(o));
+      setnilvalue(gval(o));
+    }
+    setnilvalue(wgkey(o));  /* no search can find this node anymore */
+  }
+  if (r->left == 0) {  /* old part is empty? */
+    t->rehash = NULL;
+    freenodes(L, old->node, sizenode(old));
+    luaM_free(L, r);
+  }
+}
+
+
+/* move what is left of the old hash part of 't', if there is one */
+#define finishrehash(L,t) \
+	{ if ((t)->rehash != NULL) rehashstep(L, t, (t)->rehash->left); }
+
+
+/*
+** Check whether table 't' may keep its hash part as an old part, while
+** it moves to a new part for 'nhsize' keys: only big parts that grow
+** (with the array part keeping its size) do that. The new part must
+** have room for all old entries plus the keys added while they move.
+*/
+static int incrementalrehash (Table *t, unsigned int nasize,
+                                        unsigned int nhsize) {
+  int oldhsize = allocsizenode(t);
+  int lsize;
+  if (nasize != t->sizearray || oldhsize < LUAI_MINREHASH)
+    return 0;
+  lsize = lsizehash(nhsize);
+  return (lsize <= MAXHBITS &&
+          hashcap(twoto(lsize)) >=
+            hashcap(oldhsize) + oldhsize / REHASHSTEP + 1);
+}
+
+
+/*
+** Resize table 't' to 'nasize' slots in its array part and room for
+** 'nhsize' keys in its hash part. Entries of a big hash part that
+** grows are not moved here; its nodes stay in the table as an old part,
+** to be moved by 'rehashstep' as new keys come.
+*/
 void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                           unsigned int nhsize) {
   unsigned int i;
   int j;
   AuxsetnodeT asn;
   unsigned int oldasize = t->sizearray;
-  int oldhsize = allocsizenode(t);
-  Node *nold = t->node;  /* save old hash ... */
+  int oldhsize;
+  Node *nold;
+  Rehash *r = NULL;
+  if (t->shape != NULL) {  /* shaped table? */
+    if (nhsize <= MAXSHAPEKEYS && nasize >= oldasize) {  /* keep it so? */
+      if (t->shape->nkeys == 0)  /* no keys yet? */
+        setshape(L, t, emptyshape(L, nhsize));  /* resize it */
+      if (nasize > oldasize) {
+        setarrayvector(L, t, nasize);
+        homoarray(t);
+        setcards(L, t);
+      }
+      return;
+    }
+    unshape(L, t, numuseshape(t));  /* else use a regular hash part */
+  }
+  finishrehash(L, t);
+  if (t->atype != 0 && (nasize < oldasize || hasarraykeys(t, nasize)))
+    t->atype = 0;  /* array part will get other entries */
+  if (incrementalrehash(t, nasize, nhsize)) {
+    r = luaM_new(L, Rehash);
+    r->old = *t;  /* keep fields of old hash part */
+    r->old.sizearray = 0;
+    r->old.cards = NULL;
+    r->old.rehash = NULL;
+  }
+  oldhsize = allocsizenode(t);
+  nold = t->node;  /* save old hash ... */
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
   asn.t = t; asn.nhsize = nhsize;
   if (luaD_rawrunprotected(L, auxsetnode, &asn) != LUA_OK) {  /* mem. error? */
     setarrayvector(L, t, oldasize);  /* array back to its original size */
+    if (r != NULL) luaM_free(L, r);
     luaD_throw(L, LUA_ERRMEM);  /* rethrow memory error */
   }
   if (nasize < oldasize) {  /* array part must shrink? */
+    lua_assert(t->atype == 0);
     t->sizearray = nasize;
     /* re-insert elements from vanishing slice */
     for (i=nasize; i<oldasize; i++) {
@@ -370,22 +1194,38 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     /* shrink array */
     luaM_reallocvector(L, t->array, oldasize, nasize, TValue);
   }
-  /* re-insert elements from hash part */
-  for (j = oldhsize - 1; j >= 0; j--) {
-    Node *old = nold + j;
-    if (!ttisnil(gval(old))) {
-      /* doesn't need barrier/invalidate cache, as entry was
-         already present in the table */
-      setobjt2t(L, luaH_set(L, t, gkey(old)), gval(old));
+  if (r != NULL) {  /* old entries move later? */
+    r->left = oldhsize;
+    t->rehash = r;
+  }
+  else {
+    /* re-insert elements from hash part */
+    for (j = oldhsize - 1; j >= 0; j--) {
+      Node *old = nold + j;
+      if (!ttisnil(gval(old))) {
+        /* doesn't need barrier/invalidate cache, as entry was
+           already present in the table */
+        const TValue *k = gkey(old);
+        TValue *v;
+        if (ttisinteger(k) && l_castS2U(ivalue(k)) - 1 < t->sizearray) {
+          lua_assert(t->atype == 0);
+          v = &t->array[ivalue(k) - 1];
+        }
+        else if ((v = insertkey(L, t, k)) == NULL)  /* no room? */
+          v = luaH_set(L, t, k);
+        setobjt2t(L, v, gval(old));
+      }
     }
+    if (oldhsize > 0)  /* not the dummy node? */
+      freenodes(L, nold, oldhsize);  /* free old hash */
   }
-  if (oldhsize > 0)  /* not the dummy node? */
-    luaM_freearray(L, nold, cast(size_t, oldhsize)); /* free old hash */
+  homoarray(t);
+  setcards(L, t);
 }
 
 
 void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
-  int nsize = allocsizenode(t);
+  int nsize = (t->shape != NULL) ? t->shape->size : hashcap(allocsizenode(t));
   luaH_resize(L, t, nasize, nsize);
 }
 
@@ -398,6 +1238,7 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   unsigned int nums[MAXABITS + 1];
   int i;
   int totaluse;
+  finishrehash(L, t);  /* all entries must be in one hash part */
   for (i = 0; i <= MAXABITS; i++) nums[i] = 0;  /* reset counts */
   na = numusearray(t, nums);  /* count keys in array part */
   totaluse = na;  /* all those keys are integer keys */
@@ -412,104 +1253,150 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
 }
 
 
+/*
+** A shaped table has no integer keys outside its array part, so it can
+** grow that part to take the new integer key 'ek' without a full rehash.
+** Returns false if 'ek' would not go to the array part.
+*/
+static int growarray (lua_State *L, Table *t, const TValue *ek) {
+  unsigned int asize;
+  unsigned int na;
+  unsigned int nums[MAXABITS + 1];
+  int i;
+  for (i = 0; i <= MAXABITS; i++) nums[i] = 0;  /* reset counts */
+  na = numusearray(t, nums);  /* count keys in array part */
+  na += countint(ek, nums);  /* count extra key */
+  asize = computesizes(nums, &na);
+  if (l_castS2U(ivalue(ek)) - 1 < asize) {  /* does 'ek' go to the array? */
+    setarrayvector(L, t, asize);
+    homoarray(t);
+    setcards(L, t);
+    return 1;
+  }
+  return 0;
+}
+
+
 
 /*
 ** }=============================================================
 */
 
 
-Table *luaH_new (lua_State *L) {
-  GCObject *o = luaC_newobj(L, LUA_TTABLE, sizeof(Table));
+/*
+** New table with room for 'ninline' values in its own block
+*/
+static Table *newtable (lua_State *L, int ninline) {
+  GCObject *o = luaC_newobj(L, LUA_TTABLE, sizetable(ninline));
   Table *t = gco2t(o);
   t->metatable = NULL;
   t->flags = cast_byte(~0);
   t->array = NULL;
   t->sizearray = 0;
+  t->lenhint = 0;
+  t->atype = 0;
+  t->sizeinline = cast_byte(ninline);
   setnodevector(L, t, 0);
+  t->shape = NULL;
+  t->svals = inlinevals(t);
+  t->cards = NULL;
+  t->rehash = NULL;
+  t->shape = emptyshape(L, 0);  /* new tables start shaped */
   return t;
 }
 
 
-void luaH_free (lua_State *L, Table *t) {
-  if (!isdummy(t))
-    luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
-  luaM_freearray(L, t->array, t->sizearray);
-  luaM_free(L, t);
+Table *luaH_new (lua_State *L) {
+  return newtable(L, 0);
 }
 
 
-static Node *getfreepos (Table *t) {
-  if (!isdummy(t)) {
-    while (t->lastfree > t->node) {
-      t->lastfree--;
-      if (ttisnil(gkey(t->lastfree)))
-        return t->lastfree;
-    }
+/*
+** New table for a constructor with 'nhsize' record fields (the caller
+** still sizes it with 'luaH_resize'). Small records get room for their
+** values in the table block. Other tables (including empty ones, which
+** often become arrays) get no room, as they would not use it.
+*/
+Table *luaH_newinline (lua_State *L, int nhsize) {
+  return newtable(L, (0 < nhsize && nhsize <= LUAI_INLINEVALS) ? nhsize : 0);
+}
+
+
+void luaH_free (lua_State *L, Table *t) {
+  if (t->shape != NULL) {  /* ('t->shape' is valid until the sweep ends) */
+    if (!isinline(t))
+      luaM_freearray(L, t->svals, t->shape->size);
   }
-  return NULL;  /* could not find a free place */
+  else if (!isdummy(t))
+    freenodes(L, t->node, sizenode(t));
+  luaM_freearray(L, t->array, t->sizearray);
+  if (t->cards != NULL)
+    luaM_freemem(L, t->cards, sizecards(t->cards->n));
+  if (t->rehash != NULL) {
+    freenodes(L, t->rehash->old.node, sizenode(&t->rehash->old));
+    luaM_free(L, t->rehash);
+  }
+  luaM_freemem(L, t, sizetable(t->sizeinline));
 }
 
 
 
 /*
-** inserts a new key into a hash table; first, check whether key's main
-** position is free. If not, check whether colliding node is in its main
-** position or not: if it is not, move colliding node to an empty place and
-** put new key in its main position; otherwise (colliding node is in its main
-** position), new key goes to an empty position.
+** Creates an entry for 'key' (not present) in table 't' and returns its
+** value. Returns NULL when the table had to grow to take the key: then
+** the caller must search for the key again.
 */
-TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
-  Node *mp;
+static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
   TValue aux;
+  TValue *v;
   if (ttisnil(key)) luaG_runerror(L, "table index is nil");
   else if (ttisfloat(key)) {
     lua_Integer k;
     if (luaV_tointeger(key, &k, 0)) {  /* does index fit in an integer? */
-      setivalue(&aux, k);
+      setivalue(L, &aux, k);
       key = &aux;  /* insert it as an integer */
     }
     else if (luai_numisnan(fltvalue(key)))
       luaG_runerror(L, "table index is NaN");
   }
-  mp = mainposition(t, key);
-  if (!ttisnil(gval(mp)) || isdummy(t)) {  /* main position is taken? */
-    Node *othern;
-    Node *f = getfreepos(t);  /* get a free place */
-    if (f == NULL) {  /* cannot find a free place? */
-      rehash(L, t, key);  /* grow table */
-      /* whatever called 'newkey' takes care of TM cache */
-      return luaH_set(L, t, key);  /* insert key into grown table */
-    }
-    lua_assert(!isdummy(t));
-    othern = mainposition(t, gkey(mp));
-    if (othern != mp) {  /* is colliding node out of its main position? */
-      /* yes; move colliding node into free position */
-      while (othern + gnext(othern) != mp)  /* find previous */
-        othern += gnext(othern);
-      gnext(othern) = cast_int(f - othern);  /* rechain to point to 'f' */
-      *f = *mp;  /* copy colliding node into free pos. (mp->next also goes) */
-      if (gnext(mp) != 0) {
-        gnext(f) += cast_int(mp - f);  /* correct 'next' */
-        gnext(mp) = 0;  /* now 'mp' is free */
-      }
-      setnilvalue(gval(mp));
-    }
-    else {  /* colliding node is in its own main position */
-      /* new node will go into free position */
-      if (gnext(mp) != 0)
-        gnext(f) = cast_int((mp + gnext(mp)) - f);  /* chain new position */
-      else lua_assert(gnext(f) == 0);
-      gnext(mp) = cast_int(f - mp);
-      mp = f;
+  if (t->shape != NULL) {  /* shaped table? */
+    if (ttisshrstring(key) && t->shape->nkeys < MAXSHAPEKEYS) {
+      Shape *s = addkey(L, t->shape, tsvalue(key));
+      setshape(L, t, s);
+      v = &t->svals[s->nkeys - 1];
+      setnilvalue(v);
+      return v;
     }
+    else if (ttisinteger(key) && growarray(L, t, key))
+      return &t->array[ivalue(key) - 1];
+    unshape(L, t, numuseshape(t));  /* else use a regular hash part */
   }
-  setnodekey(L, &mp->i_key, key);
-  luaC_barrierback(L, t, key);
-  lua_assert(ttisnil(gval(mp)));
-  return gval(mp);
+  if (t->rehash != NULL)  /* still moving an old hash part? */
+    rehashstep(L, t, REHASHSTEP);
+  v = insertkey(L, t, key);
+  if (v == NULL)  /* no room for the new key? */
+    rehash(L, t, key);  /* grow table */
+  return v;
+}
+
+
+TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
+  TValue *v = newkey(L, t, key);
+  if (v == NULL)  /* table changed? */
+    /* whatever called 'newkey' takes care of TM cache */
+    v = luaH_set(L, t, key);  /* insert key into grown table */
+  return v;
 }
 
 
+/*
+** Result of a search for 'key' that did not find it in the hash part
+** of 't': while the table has an old hash part, 'key' may be there.
+*/
+#define missing(t,f,key) \
+	((t)->rehash == NULL ? luaO_nilobject : f(oldpart(t), key))
+
+
 /*
 ** search function for integers
 */
@@ -517,6 +1404,7 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
   /* (1 <= key && key <= t->sizearray) */
   if (l_castS2U(key) - 1 < t->sizearray)
     return &t->array[key - 1];
+#if !defined(LUA_USE_SWISSTABLE)
   else {
     Node *n = hashint(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
@@ -528,8 +1416,17 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
         n += nx;
       }
     }
-    return luaO_nilobject;
+    return missing(t, luaH_getint, key);
+  }
+#else
+  else {
+    Node *n;
+    unsigned int h = inthash(key);
+    mixhash(h);
+    probe(t, h, n, ttisinteger(gkey(n)) && ivalue(gkey(n)) == key);
+    return (n != NULL) ? gval(n) : missing(t, luaH_getint, key);
   }
+#endif
 }
 
 
@@ -537,8 +1434,14 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
 ** search function for short strings
 */
 const TValue *luaH_getshortstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
+  Node *n;
   lua_assert(key->tt == LUA_TSHRSTR);
+  if (t->shape != NULL) {  /* shaped table? */
+    int i = shapeindex(t->shape, key);
+    return (i >= 0) ? &t->svals[i] : luaO_nilobject;
+  }
+#if !defined(LUA_USE_SWISSTABLE)
+  n = hashstr(t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
     const TValue *k = gkey(n);
     if (ttisshrstring(k) && eqshrstr(tsvalue(k), key))
@@ -546,10 +1449,38 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
     else {
       int nx = gnext(n);
       if (nx == 0)
-        return luaO_nilobject;  /* not found */
+        return missing(t, luaH_getshortstr, key);  /* not found */
       n += nx;
     }
   }
+#else
+  {
+    unsigned int h = key->hash;
+    mixhash(h);
+    probe(t, h, n, ttisshrstring(gkey(n)) && eqshrstr(tsvalue(gkey(n)), key));
+    return (n != NULL) ? gval(n) : missing(t, luaH_getshortstr, key);
+  }
+#endif
+}
+
+
+/*
+** Inline-cache miss (see 'luaH_getcached'): do a regular search and,
+** if 'key' is present, remember its node for the next access (unless
+** it is in an old hash part, which the cache does not cover).
+*/
+const TValue *luaH_getcached_ (Table *t, TString *key, unsigned int *c) {
+  const TValue *res = luaH_getshortstr(t, key);
+  if (res == luaO_nilobject)
+    return res;  /* nothing to remember */
+  else if (t->shape != NULL)  /* shaped table? */
+    *c = cast(unsigned int, res - t->svals);
+  else {
+    Node *n = cast(Node *, cast(char *, res) - offsetof(Node, i_val));
+    if (n >= t->node && n < gnode(t, sizenode(t)))  /* in the hash part? */
+      *c = cast(unsigned int, n - t->node);
+  }
+  return res;
 }
 
 
@@ -558,6 +1489,7 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
 ** which may be in array part, nor for floats with integral values.)
 */
 static const TValue *getgeneric (Table *t, const TValue *key) {
+#if !defined(LUA_USE_SWISSTABLE)
   Node *n = mainposition(t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
     if (luaV_rawequalobj(gkey(n), key))
@@ -565,10 +1497,16 @@ static const TValue *getgeneric (Table *t, const TValue *key) {
     else {
       int nx = gnext(n);
       if (nx == 0)
-        return luaO_nilobject;  /* not found */
+        return missing(t, getgeneric, key);  /* not found */
       n += nx;
     }
   }
+#else
+  Node *n;
+  unsigned int h = hashkey(key);
+  probe(t, h, n, luaV_rawequalobj(gkey(n), key));
+  return (n != NULL) ? gval(n) : missing(t, getgeneric, key);
+#endif
 }
 
 
@@ -605,13 +1543,17 @@ const TValue *luaH_get (Table *t, const TValue *key) {
 
 /*
 ** beware: when using this function you probably need to check a GC
-** barrier and invalidate the TM cache.
+** barrier and invalidate the TM cache. (The value to be stored is not
+** known here, so a homogeneous array part with the slot loses its
+** mark; stores that know their values use 'luaH_finishset'.)
 */
 TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
   const TValue *p = luaH_get(t, key);
-  if (p != luaO_nilobject)
-    return cast(TValue *, p);
-  else return luaH_newkey(L, t, key);
+  TValue *v = (p != luaO_nilobject) ? cast(TValue *, p)
+                                    : luaH_newkey(L, t, key);
+  if (t->atype != 0 && inarray(t, v))
+    t->atype = 0;
+  return v;
 }
 
 
@@ -622,10 +1564,37 @@ void luaH_setint (lua_State *L, Table *t, lua_Integer key, TValue *value) {
     cell = cast(TValue *, p);
   else {
     TValue k;
-    setivalue(&k, key);
-    cell = luaH_newkey(L, t, &k);
+    setivalue(L, &k, key);
+    cell = newkey(L, t, &k);
+    if (cell == NULL) {  /* table changed? */
+      luaH_setint(L, t, key, value);  /* search for the key again */
+      return;
+    }
+  }
+  luaH_checkstore(t, cell, value);
+  setobj2t(L, cell, value);
+  luaH_sethint(t, key, value);
+}
+
+
+/*
+** Finish a raw assignment 't[key] = value', where 'slot' is the result
+** of a search for 'key' in 't' (see 'luaV_finishset').
+*/
+void luaH_finishset (lua_State *L, Table *t, const TValue *key,
+                     const TValue *slot, TValue *value) {
+  TValue *cell;
+  if (slot != luaO_nilobject)
+    cell = cast(TValue *, slot);
+  else if ((cell = newkey(L, t, key)) == NULL) {  /* table changed? */
+    luaH_finishset(L, t, key, luaH_get(t, key), value);  /* search again */
+    return;
   }
+  luaH_checkstore(t, cell, value);
   setobj2t(L, cell, value);
+  if (ttisinteger(key))
+    luaH_sethint(t, ivalue(key), value);
+  luaC_barrierslot(L, t, cell, value);
 }
 
 
@@ -657,7 +1626,7 @@ static lua_Unsigned unbound_search (Table *t, lua_Unsigned j) {
 ** Try to find a boundary in table 't'. A 'boundary' is an integer index
 ** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
 */
-lua_Unsigned luaH_getn (Table *t) {
+static lua_Unsigned findborder (Table *t) {
   unsigned int j = t->sizearray;
   if (j > 0 && ttisnil(&t->array[j - 1])) {
     /* there is a boundary in the array part: (binary) search for it */
@@ -676,11 +1645,49 @@ lua_Unsigned luaH_getn (Table *t) {
 }
 
 
+/* true if 'j' is a boundary in table 't' */
+#define isborder(t,j) \
+	(((j) == 0 || !ttisnil(luaH_getint(t, l_castU2S(j)))) && \
+	 ttisnil(luaH_getint(t, l_castU2S((j) + 1))))
+
+
+/*
+** Length of table 't'. The table keeps the last boundary found as a
+** hint; most lengths are that same boundary or the next or previous
+** index (appends and removals at the end), which are checked in
+** constant time before a search.
+*/
+lua_Unsigned luaH_getn (Table *t) {
+  lua_Unsigned j = t->lenhint;
+  lua_Unsigned b;
+  if (isborder(t, j))
+    return j;  /* hint is still valid */
+  else if (isborder(t, j + 1))
+    b = j + 1;  /* an element was appended */
+  else if (j > 0 && isborder(t, j - 1))
+    b = j - 1;  /* the last element was removed */
+  else
+    b = findborder(t);
+  t->lenhint = (b <= UINT_MAX) ? cast(unsigned int, b) : 0;
+  return b;
+}
+
+
 
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
+#if !defined(LUA_USE_SWISSTABLE)
   return mainposition(t, key);
+#else
+  /* first node of the first group in the probe sequence of 'key' */
+  unsigned int h = hashkey(key);
+  return gnode(t, (h & gmask(t)) << LOGGROUP);
+#endif
+}
+
+int luaH_hashsize (unsigned int n) {
+  return (n == 0) ? 0 : twoto(lsizehash(n));
 }
 
 int luaH_isdummy (const Table *t) { return isdummy(t); }
@@ -35,31 +35,108 @@
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
 
-/* returns the key, given the value of a table entry */
+/*
+** the old hash part of 't', while it moves to a new one (see
+** 'luaH_resize'), or NULL; the old part has no old part itself
+*/
+#define oldpart(t)	((t)->rehash != NULL ? &(t)->rehash->old : NULL)
+
+
+/* values kept in the block of table 't' */
+#define inlinevals(t)	(cast(InlineTable *, (t))->v)
+
+/* true if the values of shaped table 't' are in its own block */
+#define isinline(t)	((t)->shape->size <= (t)->sizeinline)
+
+/*
+** number of slots in the array part of 't' that the collector must
+** traverse (none if it is homogeneous, as numbers and booleans are no
+** objects)
+*/
+#define tvarraysize(t)	((t)->atype == 0 ? (t)->sizearray : 0)
+
+
+/*
+** Keep the homogeneous array part of 't' (see 'ltable.c') valid for a store
+** of 'v' into 'slot', which must come right after this. Replacing a
+** value by another of the type of the part is always valid.
+*/
+#if defined(LUA_USE_HOMOARRAYS)
+#define luaH_checkstore(t,slot,v) \
+	((t)->atype == 0 || \
+	 ((t)->atype == ttype(v) && !isbigint(v) && !ttisnil(slot)) \
+	 ? (void)0 : luaH_checkhomo(t, slot, v))
+#else
+#define luaH_checkstore(t,slot,v)	((void)0)
+#endif
+
+
+/*
+** Keep the length hint of table 't' (see 'luaH_getn') after a store of
+** 'v' into integer key 'k': a non-nil value right after the border
+** moves it up. (Other stores are checked when the hint is used.)
+*/
+#define luaH_sethint(t,k,v) \
+	{ if (l_castS2U(k) - 1 == (t)->lenhint && !ttisnil(v)) (t)->lenhint++; }
+
+
+/* returns the key, given the value of a table entry (in the hash part) */
 #define keyfromval(v) \
   (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
 
 
+/*
+** Inline caches: '*c' is the index of the node (or of the shape slot, for
+** shaped tables) where short string 'key' was last found, in this or in
+** any other table. The cache hits only if that position of 't' still
+** holds 'key'; so, it never has to be invalidated (a resize, a new shape,
+** or a node reused for another key just makes it miss).
+*/
+#define luaH_ichit(t,c,key) \
+	((c) < cast(unsigned int, sizenode(t)) && \
+	 ttisshrstring(gkey(gnode(t, c))) && tsvalue(gkey(gnode(t, c))) == (key))
+
+#define luaH_icshapehit(t,c,key) \
+	((c) < cast(unsigned int, (t)->shape->nkeys) && \
+	 (t)->shape->keys[c] == (key))
+
+#define luaH_getcached(t,key,c) \
+	((t)->shape != NULL \
+	 ? (luaH_icshapehit(t, *(c), key) ? &(t)->svals[*(c)] \
+	                                  : luaH_getcached_(t, key, c)) \
+	 : (luaH_ichit(t, *(c), key) ? gval(gnode(t, *(c))) \
+	                             : luaH_getcached_(t, key, c)))
+
+
 LUAI_FUNC const TValue *luaH_getint (Table *t, lua_Integer key);
 LUAI_FUNC void luaH_setint (lua_State *L, Table *t, lua_Integer key,
                                                     TValue *value);
 LUAI_FUNC const TValue *luaH_getshortstr (Table *t, TString *key);
+LUAI_FUNC const TValue *luaH_getcached_ (Table *t, TString *key,
+                                                      unsigned int *c);
 LUAI_FUNC const TValue *luaH_getstr (Table *t, TString *key);
 LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
+LUAI_FUNC void luaH_finishset (lua_State *L, Table *t, const TValue *key,
+                               const TValue *slot, TValue *value);
+LUAI_FUNC void luaH_checkhomo (Table *t, const TValue *slot,
+                                const TValue *v);
 LUAI_FUNC Table *luaH_new (lua_State *L);
+LUAI_FUNC Table *luaH_newinline (lua_State *L, int nhsize);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC lua_Unsigned luaH_getn (Table *t);
+LUAI_FUNC void luaH_unlinkshape (Shape *s);
 
 
 #if defined(LUA_DEBUG)
 LUAI_FUNC Node *luaH_mainposition (const Table *t, const TValue *key);
 LUAI_FUNC int luaH_isdummy (const Table *t);
+LUAI_FUNC int luaH_hashsize (unsigned int n);
 #endif
 
 
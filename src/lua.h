@@ -123,6 +123,13 @@ typedef int (*lua_Writer) (lua_State *L, const void *p, size_t sz, void *ud);
 */
 typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
+/*
+** 'osize' of the call (with a NULL block and 'nsize' 0, so a no-op for
+** any allocator) that Lua makes after a full collection, as a hint for
+** allocators that keep free memory
+*/
+#define LUA_ALLOCTRIM	(~(size_t)0)
+
 
 
 /*
@@ -308,10 +315,48 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCGEN		10
+#define LUA_GCINC		11
+#define LUA_GCSETMINORMUL	12
+#define LUA_GCSETMAJORMUL	13
+#define LUA_GCSTEPTIME		14
+#define LUA_GCAUTOHEAP		15
+#define LUA_GCAUTOCPU		16
+#define LUA_GCFREEZE		17
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** collector statistics (see 'lua_gcstats'); bucket 'i' of a histogram
+** counts durations below 2^i microseconds (and not in a lower bucket);
+** the last bucket counts all longer ones
+*/
+#define LUA_GCHISTSIZE		16
+
+typedef struct lua_GCStats {
+  size_t cycles;  /* complete cycles (including major collections) */
+  size_t minors;  /* minor collections (generational mode) */
+  size_t steps;  /* collector steps */
+  size_t finalizers;  /* finalizers called */
+  size_t marked;  /* bytes marked by the last cycle */
+  size_t swept;  /* bytes freed by the last cycle */
+  lua_Number propagate;  /* time (in seconds) spent in each phase */
+  lua_Number atomic;
+  lua_Number sweep;
+  lua_Number callfin;
+  lua_Number maxstep;  /* longest step */
+  lua_Number maxpause;  /* longest atomic pause */
+  size_t stephist[LUA_GCHISTSIZE];  /* durations of steps */
+  size_t pausehist[LUA_GCHISTSIZE];  /* durations of atomic pauses */
+} lua_GCStats;
+
+LUA_API void (lua_gcstats) (lua_State *L, lua_GCStats *s);
+
+LUA_API int  (lua_openregion) (lua_State *L);
+LUA_API void (lua_closeregion) (lua_State *L);
+
+
 /*
 ** miscellaneous functions
 */
@@ -307,8 +307,11 @@ static void PrintCode(const Proto* f)
   {
    case iABC:
     printf("%d",a);
-    if (getBMode(o)!=OpArgN) printf(" %d",ISK(b) ? (MYK(INDEXK(b))) : b);
-    if (getCMode(o)!=OpArgN) printf(" %d",ISK(c) ? (MYK(INDEXK(c))) : c);
+    if (getBMode(o)!=OpArgN)
+     printf(" %d",getBMode(o)==OpArgK && ISK(b) ? (MYK(INDEXK(b))) : b);
+    if (o==OP_ADDI) printf(" %d",GETARG_sC(i));
+    else if (getCMode(o)!=OpArgN)
+     printf(" %d",getCMode(o)==OpArgK && ISK(c) ? (MYK(INDEXK(c))) : c);
     break;
    case iABx:
     printf("%d",a);
@@ -332,6 +335,7 @@ static void PrintCode(const Proto* f)
     printf("\t; %s",UPVALNAME(b));
     break;
    case OP_GETTABUP:
+   case OP_GETTABUPCALL:
     printf("\t; %s",UPVALNAME(b));
     if (ISK(c)) { printf(" "); PrintConstant(f,INDEXK(c)); }
     break;
@@ -342,8 +346,14 @@ static void PrintCode(const Proto* f)
     break;
    case OP_GETTABLE:
    case OP_SELF:
+   case OP_SELFCALL:
     if (ISK(c)) { printf("\t; "); PrintConstant(f,INDEXK(c)); }
     break;
+   case OP_GETFIELD:
+   case OP_GETTABLEARITH:
+   case OP_EQK:
+    printf("\t; "); PrintConstant(f,c);
+    break;
    case OP_SETTABLE:
    case OP_ADD:
    case OP_SUB:
@@ -360,6 +370,14 @@ static void PrintCode(const Proto* f)
    case OP_EQ:
    case OP_LT:
    case OP_LE:
+   case OP_ADDII:
+   case OP_ADDFF:
+   case OP_SUBII:
+   case OP_SUBFF:
+   case OP_MULII:
+   case OP_MULFF:
+   case OP_LTII:
+   case OP_LEII:
     if (ISK(b) || ISK(c))
     {
      printf("\t; ");
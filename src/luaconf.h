@@ -36,6 +36,23 @@
 /* #define LUA_32BITS */
 
 
+/*
+@@ LUA_NANBOXING packs each Lua value in a single 64-bit word, with
+** non-float values hidden in the unused NaN bit patterns of a 'double'
+** (see 'lobject.h'). That halves the size of values and table entries.
+** Integers keep their 64 bits; those that do not fit in 48 bits go to
+** boxes in the heap. It needs 'long long' integers and 'double' and a
+** 64-bit platform whose addresses fit in 48 bits (x86-64 or AArch64),
+** and it disables the JIT; otherwise it is ignored.
+*/
+/* #define LUA_NANBOXING */
+
+#if defined(LUA_NANBOXING) && \
+    (defined(LUA_32BITS) || !(defined(__x86_64__) || defined(__aarch64__)))
+#undef LUA_NANBOXING
+#endif
+
+
 /*
 @@ LUA_USE_C89 controls the use of non-ISO-C89 features.
 ** Define it if you want Lua to avoid the use of a few C99 features
@@ -147,6 +164,71 @@
 #define LUA_FLOAT_TYPE	LUA_FLOAT_DOUBLE
 #endif
 
+#if defined(LUA_NANBOXING) && \
+    !(LUA_INT_TYPE == LUA_INT_LONGLONG && LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE)
+#undef LUA_NANBOXING
+#endif
+
+
+/*
+@@ LUA_USE_JIT turns on a baseline JIT compiler that translates hot Lua
+** functions into machine code (see 'ljit.c'). It needs an x86-64 POSIX
+** system, 64-bit integers and 'double', and Lua compiled as C (errors
+** must be raised with 'longjmp'); otherwise it is ignored.
+*/
+/* #define LUA_USE_JIT */
+
+#if defined(LUA_USE_JIT) && \
+    !(defined(__x86_64__) && defined(LUA_USE_POSIX) && \
+      !defined(__cplusplus) && LUA_INT_TYPE == LUA_INT_LONGLONG && \
+      LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE && !defined(LUA_NANBOXING))
+#undef LUA_USE_JIT
+#endif
+
+
+/*
+@@ LUA_USE_GCTHREAD turns on threads in the collector: one that marks
+** objects for the incremental collector during host idle time (while
+** the program runs outside the Lua core, never together with Lua code),
+** and a pool that marks objects in parallel during full collections
+** (see 'lgc.c'). It needs POSIX threads (link with
+** '-pthread') and the atomic builtins of GCC; otherwise it is ignored.
+*/
+/* #define LUA_USE_GCTHREAD */
+
+#if defined(LUA_USE_GCTHREAD) && \
+    !(defined(LUA_USE_POSIX) && defined(__GNUC__))
+#undef LUA_USE_GCTHREAD
+#endif
+
+
+/*
+@@ LUA_USE_SLABALLOC makes 'luaL_newstate' use the slab allocator of the
+** auxiliary library (see 'luaL_newslabstate' in 'lauxlib.c'), which keeps
+** per-state free lists for small blocks.
+*/
+/* #define LUA_USE_SLABALLOC */
+
+
+/*
+@@ LUA_USE_SWISSTABLE makes the hash part of tables use open addressing,
+** with a vector of control bytes that is searched a group of nodes at a
+** time (with SSE2 or NEON instructions, when available), instead of
+** chained scatter (see 'ltable.c').
+*/
+/* #define LUA_USE_SWISSTABLE */
+
+
+/*
+@@ LUA_USE_HOMOARRAYS marks big array parts whose values are all
+** integers, all floats or all booleans with that type, so that the
+** collector skips them and traces read them without type checks (see
+** 'ltable.c'). The values keep their regular representation, so this
+** saves no memory. Stores into array parts pay for a check of that
+** type.
+*/
+/* #define LUA_USE_HOMOARRAYS */
+
 /* }================================================================== */
 
 
@@ -17,8 +17,10 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstring.h"
 #include "lundump.h"
 #include "lzio.h"
@@ -109,6 +111,8 @@ static void LoadCode (LoadState *S, Proto *f) {
   f->code = luaM_newvector(S->L, n, Instruction);
   f->sizecode = n;
   LoadVector(S, f->code, n);
+  luaP_fuse(f->code, n);  /* code is dumped without superinstructions */
+  luaF_newicache(S->L, f);
 }
 
 
@@ -136,7 +140,7 @@ static void LoadConstants (LoadState *S, Proto *f) {
       setfltvalue(o, LoadNumber(S));
       break;
     case LUA_TNUMINT:
-      setivalue(o, LoadInteger(S));
+      setivalue(S->L, o, LoadInteger(S));
       break;
     case LUA_TSHRSTR:
     case LUA_TLNGSTR:
@@ -145,6 +149,7 @@ static void LoadConstants (LoadState *S, Proto *f) {
     default:
       lua_assert(0);
     }
+    luaC_barrier(S->L, f, o);  /* an emergency collection may age 'f' */
   }
 }
 
@@ -237,8 +242,10 @@ static void checkHeader (LoadState *S) {
   checkliteral(S, LUA_SIGNATURE + 1, "not a");  /* 1st char already checked */
   if (LoadByte(S) != LUAC_VERSION)
     error(S, "version mismatch in");
-  if (LoadByte(S) != LUAC_FORMAT)
-    error(S, "format mismatch in");
+  switch (LoadByte(S)) {
+    case LUAC_FORMAT: case LUAC_OFFICIAL: break;  /* official is a subset */
+    default: error(S, "format mismatch in");
+  }
   checkliteral(S, LUAC_DATA, "corrupted");
   checksize(S, int);
   checksize(S, size_t);
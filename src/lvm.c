@@ -22,6 +22,7 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -35,6 +36,21 @@
 #define MAXTAGLOOP	2000
 
 
+/*
+** 'LUA_USE_JUMPTABLE' controls whether 'luaV_execute' dispatches
+** through a table of label addresses (threaded code) or through a
+** 'switch'. The jump table needs the "labels as values" extension
+** from GCC/Clang; other compilers always use the 'switch'.
+*/
+#if !defined(LUA_USE_JUMPTABLE)
+#if defined(__GNUC__)
+#define LUA_USE_JUMPTABLE	1
+#else
+#define LUA_USE_JUMPTABLE	0
+#endif
+#endif
+
+
 
 /*
 ** 'l_intfitsf' checks whether a given integer can be converted to a
@@ -70,14 +86,15 @@
 ** by the macro 'tonumber'.
 */
 int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
-  TValue v;
+  lua_Integer i; int isint;
   if (ttisinteger(obj)) {
     *n = cast_num(ivalue(obj));
     return 1;
   }
   else if (cvt2num(obj) &&  /* string convertible to number? */
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
-    *n = nvalue(&v);  /* convert result of 'luaO_str2num' to a float */
+            luaO_readnum(svalue(obj), &isint, &i, n) == vslen(obj) + 1) {
+    if (isint)
+      *n = cast_num(i);  /* convert result of 'luaO_readnum' to a float */
     return 1;
   }
   else
@@ -86,33 +103,37 @@ int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
 
 
 /*
-** try to convert a value to an integer, rounding according to 'mode':
+** try to convert a float to an integer, rounding according to 'mode':
 ** mode == 0: accepts only integral values
 ** mode == 1: takes the floor of the number
 ** mode == 2: takes the ceil of the number
 */
-int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
-  TValue v;
- again:
-  if (ttisfloat(obj)) {
-    lua_Number n = fltvalue(obj);
-    lua_Number f = l_floor(n);
-    if (n != f) {  /* not an integral value? */
-      if (mode == 0) return 0;  /* fails if mode demands integral value */
-      else if (mode > 1)  /* needs ceil? */
-        f += 1;  /* convert floor to ceil (remember: n != f) */
-    }
-    return lua_numbertointeger(f, p);
+static int flttointeger (lua_Number n, lua_Integer *p, int mode) {
+  lua_Number f = l_floor(n);
+  if (n != f) {  /* not an integral value? */
+    if (mode == 0) return 0;  /* fails if mode demands integral value */
+    else if (mode > 1)  /* needs ceil? */
+      f += 1;  /* convert floor to ceil (remember: n != f) */
   }
+  return lua_numbertointeger(f, p);
+}
+
+
+/*
+** try to convert a value to an integer, rounding according to 'mode'
+** (see 'flttointeger')
+*/
+int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
+  lua_Number n; int isint;
+  if (ttisfloat(obj))
+    return flttointeger(fltvalue(obj), p, mode);
   else if (ttisinteger(obj)) {
     *p = ivalue(obj);
     return 1;
   }
   else if (cvt2num(obj) &&
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
-    obj = &v;
-    goto again;  /* convert result from 'luaO_str2num' to an integer */
-  }
+            luaO_readnum(svalue(obj), &isint, p, &n) == vslen(obj) + 1)
+    return isint || flttointeger(n, p, mode);
   return 0;  /* conversion failed */
 }
 
@@ -210,12 +231,8 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
       lua_assert(ttisnil(slot));  /* old value must be nil */
       tm = fasttm(L, h->metatable, TM_NEWINDEX);  /* get metamethod */
       if (tm == NULL) {  /* no metamethod? */
-        if (slot == luaO_nilobject)  /* no previous entry? */
-          slot = luaH_newkey(L, h, key);  /* create one */
-        /* no metamethod and (now) there is an entry with given key */
-        setobj2t(L, cast(TValue *, slot), val);  /* set its new value */
+        luaH_finishset(L, h, key, slot, val);
         invalidateTMcache(h);
-        luaC_barrierback(L, h, val);
         return;
       }
       /* else will try the metamethod */
@@ -521,15 +538,15 @@ void luaV_objlen (lua_State *L, StkId ra, const TValue *rb) {
       Table *h = hvalue(rb);
       tm = fasttm(L, h->metatable, TM_LEN);
       if (tm) break;  /* metamethod? break switch to call it */
-      setivalue(ra, luaH_getn(h));  /* else primitive len */
+      setivalue(L, ra, luaH_getn(h));  /* else primitive len */
       return;
     }
     case LUA_TSHRSTR: {
-      setivalue(ra, tsvalue(rb)->shrlen);
+      setivalue(L, ra, tsvalue(rb)->shrlen);
       return;
     }
     case LUA_TLNGSTR: {
-      setivalue(ra, tsvalue(rb)->u.lnglen);
+      setivalue(L, ra, tsvalue(rb)->u.lnglen);
       return;
     }
     default: {  /* try metamethod */
@@ -602,6 +619,31 @@ lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y) {
 }
 
 
+/*
+** Finish a table access that missed the fast track. When 't' is a
+** table whose '__index' metamethod is also a table (the usual layout of
+** classes), look for a short-string key there through inline cache 'c'
+** too, so that method and inherited-field accesses also skip the hash
+** search. (An inline cache only keeps nodes where the key was found, so
+** it keeps pointing to the entry in the metatable.)
+*/
+void luaV_finishgeticache (lua_State *L, const TValue *t, TValue *key,
+                           StkId val, const TValue *slot, unsigned int *c) {
+  const TValue *tm;
+  if (slot != NULL && ttisshrstring(key) &&
+      (tm = fasttm(L, hvalue(t)->metatable, TM_INDEX)) != NULL &&
+      ttistable(tm)) {
+    slot = luaH_getcached(hvalue(tm), tsvalue(key), c);
+    if (!ttisnil(slot)) {
+      setobj2s(L, val, slot);
+      return;
+    }
+    t = tm;  /* else go on with the usual protocol from 'tm' */
+  }
+  luaV_finishget(L, t, key, val, slot);
+}
+
+
 /*
 ** check whether cached closure in prototype 'p' may be reused, that is,
 ** whether there is a cached closure with the same upvalues needed by
@@ -663,15 +705,19 @@ void luaV_finishOp (lua_State *L) {
     case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
     case OP_MOD: case OP_POW:
     case OP_UNM: case OP_BNOT: case OP_LEN:
-    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF: {
+    case OP_ADDII: case OP_ADDFF: case OP_SUBII: case OP_SUBFF:
+    case OP_MULII: case OP_MULFF:
+    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF:
+    case OP_GETTABUPCALL: case OP_SELFCALL: case OP_GETTABLEARITH:
+    case OP_ADDI: case OP_GETFIELD: case OP_GETINT: {
       setobjs2s(L, base + GETARG_A(inst), --L->top);
       break;
     }
-    case OP_LE: case OP_LT: case OP_EQ: {
+    case OP_LE: case OP_LT: case OP_EQ: case OP_LTII: case OP_LEII: {
       int res = !l_isfalse(L->top - 1);
       L->top--;
       if (ci->callstatus & CIST_LEQ) {  /* "<=" using "<" instead? */
-        lua_assert(op == OP_LE);
+        lua_assert(luaP_basicop(op) == OP_LE);
         ci->callstatus ^= CIST_LEQ;  /* clear mark */
         res = !res;  /* negate result */
       }
@@ -734,10 +780,14 @@ void luaV_finishOp (lua_State *L) {
 	ISK(GETARG_C(i)) ? k+INDEXK(GETARG_C(i)) : base+GETARG_C(i))
 
 
+/* count a backward jump (a loop iteration) for the JIT compiler */
+#define jitloop(i)	{ if (GETARG_sBx(i) < 0) luaJ_count(L, cl->p); }
+
 /* execute a jump instruction */
 #define dojump(ci,i,e) \
   { int a = GETARG_A(i); \
     if (a != 0) luaF_close(L, ci->u.l.base + a - 1); \
+    jitloop(i); \
     ci->u.l.savedpc += GETARG_sBx(i) + e; }
 
 /* for test instructions, execute the jump instruction that follows it */
@@ -751,6 +801,16 @@ void luaV_finishOp (lua_State *L) {
                          Protect(L->top = ci->top));  /* restore top */ \
            luai_threadyield(L); }
 
+/*
+** With NaN boxing, an integer that does not fit in a value needs a box
+** (see 'luaO_setbigint'); an instruction that makes one must then give
+** the collector its chance to run, keeping the whole frame alive.
+*/
+#define checkbigint(o)	{ if (isbigint(o)) checkGC(L, ci->top); }
+
+/* set register 'o' to integer 'x' */
+#define setiresult(o,x)	{ setivalue(L, o, x); checkbigint(o); }
+
 
 /* fetch an instruction and prepare its execution */
 #define vmfetch()	{ \
@@ -762,32 +822,98 @@ void luaV_finishOp (lua_State *L) {
   lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
 }
 
+/*
+** run the compiled code of the current function (if any) from the
+** current instruction; it returns at the next instruction that it
+** leaves to the interpreter, or after entering a Lua function.
+** Instructions being recorded for a trace are always interpreted.
+*/
+#if defined(LUA_USE_JIT)
+#define jitenter()	{ struct JitCode *jc_; \
+  while ((jc_ = cl->p->jit) != NULL && \
+         !(L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT))) { \
+    unsigned int addr_ = luaJ_addr(jc_, ci->u.l.savedpc - cl->p->code); \
+    if ((G(L)->jitrec != NULL && luaJ_record(L, ci)) || addr_ == 0) \
+      break; \
+    Protect(luaJ_run(L, ci, addr_)); \
+    if (L->ci != ci) { ci = L->ci; goto newframe; }  /* called Lua? */ \
+  } }
+#else
+#define jitenter()	((void)0)
+#endif
+
 #define vmdispatch(o)	switch(o)
 #define vmcase(l)	case l:
 #define vmbreak		break
 
 
+/* inline cache of the current instruction (see 'luaH_getcached') */
+#define icache()	(cl->p->icache + pcRel(ci->u.l.savedpc, cl->p))
+
+/* raw access to a short-string key through the inline cache */
+#define geticache(t,k)	luaH_getcached(t, tsvalue(k), icache())
+
+
 /*
 ** copy of 'luaV_gettable', but protecting the call to potential
-** metamethod (which can reallocate the stack)
+** metamethod (which can reallocate the stack) and using inline caches
+** for short-string keys
 */
 #define gettableProtected(L,t,k,v)  { const TValue *slot; \
-  if (luaV_fastget(L,t,k,slot,luaH_get)) { setobj2s(L, v, slot); } \
-  else Protect(luaV_finishget(L,t,k,v,slot)); }
+  if (ttisshrstring(k) ? luaV_fastget(L,t,k,slot,geticache) \
+                       : luaV_fastget(L,t,k,slot,luaH_get)) \
+    { setobj2s(L, v, slot); } \
+  else Protect(luaV_finishgeticache(L,t,k,v,slot,icache())); }
+
+
+/* 'gettableProtected' for a constant key known to be a short string */
+#define getfieldProtected(L,t,k,v)  { const TValue *slot; \
+  if (luaV_fastget(L,t,k,slot,geticache)) { setobj2s(L, v, slot); } \
+  else Protect(luaV_finishgeticache(L,t,k,v,slot,icache())); }
+
+
+/*
+** Quickening: an arithmetic or order instruction that keeps seeing
+** operands of the same numeric types is rewritten in place into a
+** variant specialized for them (see notes in 'lopcodes.h'). The inline
+** cache of a generic instruction counts the executions in a row that
+** suited variant 'q', keeping 'q' in its low byte. A quickened
+** instruction that gets other operands rewrites itself back into
+** generic 'op' (and restarts its count) before doing the operation.
+*/
+#define quicken(q)  { unsigned int *c_ = icache(); \
+  if ((*c_ & 0xff) != (q)) *c_ = (q);  /* start a new count */ \
+  else if ((*c_ += 0x100) >> 8 >= LUAI_QUICKEN) \
+    SET_OPCODE(*cast(Instruction *, ci->u.l.savedpc - 1), q); }
+
+#define dequicken(op)  { *icache() = 0; \
+  SET_OPCODE(*cast(Instruction *, ci->u.l.savedpc - 1), op); }
 
 
 /* same for 'luaV_settable' */
 #define settableProtected(L,t,k,v) { const TValue *slot; \
-  if (!luaV_fastset(L,t,k,slot,luaH_get,v)) \
+  if (!(ttisshrstring(k) ? luaV_fastset(L,t,k,slot,geticache,v) \
+                         : luaV_fastset(L,t,k,slot,luaH_get,v))) \
     Protect(luaV_finishset(L,t,k,v,slot)); }
 
 
+/* 'gettableProtected' for the string key of OP_SELF */
+#define selfProtected(L,t,k,v)  { const TValue *slot; \
+  if (ttisshrstring(k) ? luaV_fastget(L,t,k,slot,geticache) \
+                       : luaV_fastget(L,t,tsvalue(k),slot,luaH_getstr)) \
+    { setobj2s(L, v, slot); } \
+  else Protect(luaV_finishgeticache(L,t,k,v,slot,icache())); }
+
+
 
 void luaV_execute (lua_State *L) {
   CallInfo *ci = L->ci;
   LClosure *cl;
   TValue *k;
   StkId base;
+#if LUA_USE_JUMPTABLE
+#include "ljumptab.h"
+#endif
   ci->callstatus |= CIST_FRESH;  /* fresh invocation of 'luaV_execute" */
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
@@ -798,6 +924,7 @@ void luaV_execute (lua_State *L) {
   for (;;) {
     Instruction i;
     StkId ra;
+    jitenter();
     vmfetch();
     vmdispatch (GET_OPCODE(i)) {
       vmcase(OP_MOVE) {
@@ -865,65 +992,66 @@ void luaV_execute (lua_State *L) {
         vmbreak;
       }
       vmcase(OP_NEWTABLE) {
-        int b = GETARG_B(i);
-        int c = GETARG_C(i);
-        Table *t = luaH_new(L);
+        int b = luaO_fb2int(GETARG_B(i));
+        int c = luaO_fb2int(GETARG_C(i));
+        Table *t = luaH_newinline(L, c);
         sethvalue(L, ra, t);
         if (b != 0 || c != 0)
-          luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
+          luaH_resize(L, t, b, c);
         checkGC(L, ra + 1);
         vmbreak;
       }
       vmcase(OP_SELF) {
-        const TValue *aux;
         StkId rb = RB(i);
-        TValue *rc = RKC(i);
-        TString *key = tsvalue(rc);  /* key must be a string */
+        TValue *rc = RKC(i);  /* key must be a string */
         setobjs2s(L, ra + 1, rb);
-        if (luaV_fastget(L, rb, key, aux, luaH_getstr)) {
-          setobj2s(L, ra, aux);
-        }
-        else Protect(luaV_finishget(L, rb, rc, ra, aux));
+        selfProtected(L, rb, rc, ra);
         vmbreak;
       }
-      vmcase(OP_ADD) {
+      vmcase(OP_ADD) l_add: {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         lua_Number nb; lua_Number nc;
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
-          setivalue(ra, intop(+, ib, ic));
+          setiresult(ra, intop(+, ib, ic));
+          quicken(OP_ADDII);
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
           setfltvalue(ra, luai_numadd(L, nb, nc));
+          if (ttisfloat(rb) && ttisfloat(rc)) quicken(OP_ADDFF);
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_ADD)); }
         vmbreak;
       }
-      vmcase(OP_SUB) {
+      vmcase(OP_SUB) l_sub: {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         lua_Number nb; lua_Number nc;
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
-          setivalue(ra, intop(-, ib, ic));
+          setiresult(ra, intop(-, ib, ic));
+          quicken(OP_SUBII);
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
           setfltvalue(ra, luai_numsub(L, nb, nc));
+          if (ttisfloat(rb) && ttisfloat(rc)) quicken(OP_SUBFF);
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SUB)); }
         vmbreak;
       }
-      vmcase(OP_MUL) {
+      vmcase(OP_MUL) l_mul: {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         lua_Number nb; lua_Number nc;
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
-          setivalue(ra, intop(*, ib, ic));
+          setiresult(ra, intop(*, ib, ic));
+          quicken(OP_MULII);
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
           setfltvalue(ra, luai_nummul(L, nb, nc));
+          if (ttisfloat(rb) && ttisfloat(rc)) quicken(OP_MULFF);
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_MUL)); }
         vmbreak;
@@ -943,7 +1071,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Integer ib; lua_Integer ic;
         if (tointeger(rb, &ib) && tointeger(rc, &ic)) {
-          setivalue(ra, intop(&, ib, ic));
+          setiresult(ra, intop(&, ib, ic));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_BAND)); }
         vmbreak;
@@ -953,7 +1081,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Integer ib; lua_Integer ic;
         if (tointeger(rb, &ib) && tointeger(rc, &ic)) {
-          setivalue(ra, intop(|, ib, ic));
+          setiresult(ra, intop(|, ib, ic));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_BOR)); }
         vmbreak;
@@ -963,7 +1091,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Integer ib; lua_Integer ic;
         if (tointeger(rb, &ib) && tointeger(rc, &ic)) {
-          setivalue(ra, intop(^, ib, ic));
+          setiresult(ra, intop(^, ib, ic));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_BXOR)); }
         vmbreak;
@@ -973,7 +1101,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Integer ib; lua_Integer ic;
         if (tointeger(rb, &ib) && tointeger(rc, &ic)) {
-          setivalue(ra, luaV_shiftl(ib, ic));
+          setiresult(ra, luaV_shiftl(ib, ic));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SHL)); }
         vmbreak;
@@ -983,7 +1111,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Integer ib; lua_Integer ic;
         if (tointeger(rb, &ib) && tointeger(rc, &ic)) {
-          setivalue(ra, luaV_shiftl(ib, -ic));
+          setiresult(ra, luaV_shiftl(ib, -ic));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SHR)); }
         vmbreak;
@@ -994,7 +1122,7 @@ void luaV_execute (lua_State *L) {
         lua_Number nb; lua_Number nc;
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
-          setivalue(ra, luaV_mod(L, ib, ic));
+          setiresult(ra, luaV_mod(L, ib, ic));
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
           lua_Number m;
@@ -1010,7 +1138,7 @@ void luaV_execute (lua_State *L) {
         lua_Number nb; lua_Number nc;
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
-          setivalue(ra, luaV_div(L, ib, ic));
+          setiresult(ra, luaV_div(L, ib, ic));
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
           setfltvalue(ra, luai_numidiv(L, nb, nc));
@@ -1033,7 +1161,7 @@ void luaV_execute (lua_State *L) {
         lua_Number nb;
         if (ttisinteger(rb)) {
           lua_Integer ib = ivalue(rb);
-          setivalue(ra, intop(-, 0, ib));
+          setiresult(ra, intop(-, 0, ib));
         }
         else if (tonumber(rb, &nb)) {
           setfltvalue(ra, luai_numunm(L, nb));
@@ -1047,7 +1175,7 @@ void luaV_execute (lua_State *L) {
         TValue *rb = RB(i);
         lua_Integer ib;
         if (tointeger(rb, &ib)) {
-          setivalue(ra, intop(^, ~l_castS2U(0), ib));
+          setiresult(ra, intop(^, ~l_castS2U(0), ib));
         }
         else {
           Protect(luaT_trybinTM(L, rb, rb, ra, TM_BNOT));
@@ -1092,18 +1220,24 @@ void luaV_execute (lua_State *L) {
         )
         vmbreak;
       }
-      vmcase(OP_LT) {
+      vmcase(OP_LT) l_lt: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) quicken(OP_LTII);
         Protect(
-          if (luaV_lessthan(L, RKB(i), RKC(i)) != GETARG_A(i))
+          if (luaV_lessthan(L, rb, rc) != GETARG_A(i))
             ci->u.l.savedpc++;
           else
             donextjump(ci);
         )
         vmbreak;
       }
-      vmcase(OP_LE) {
+      vmcase(OP_LE) l_le: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) quicken(OP_LEII);
         Protect(
-          if (luaV_lessequal(L, RKB(i), RKC(i)) != GETARG_A(i))
+          if (luaV_lessequal(L, rb, rc) != GETARG_A(i))
             ci->u.l.savedpc++;
           else
             donextjump(ci);
@@ -1127,7 +1261,7 @@ void luaV_execute (lua_State *L) {
         }
         vmbreak;
       }
-      vmcase(OP_CALL) {
+      vmcase(OP_CALL) l_call: {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -1194,8 +1328,10 @@ void luaV_execute (lua_State *L) {
           lua_Integer limit = ivalue(ra + 1);
           if ((0 < step) ? (idx <= limit) : (limit <= idx)) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
-            chgivalue(ra, idx);  /* update internal index... */
-            setivalue(ra + 3, idx);  /* ...and external index */
+            luaJ_count(L, cl->p);
+            chgivalue(L, ra, idx);  /* update internal index... */
+            setobjs2s(L, ra + 3, ra);  /* ...and external index */
+            checkbigint(ra);
           }
         }
         else {  /* floating loop */
@@ -1205,6 +1341,7 @@ void luaV_execute (lua_State *L) {
           if (luai_numlt(0, step) ? luai_numle(idx, limit)
                                   : luai_numle(limit, idx)) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
+            luaJ_count(L, cl->p);
             chgfltvalue(ra, idx);  /* update internal index... */
             setfltvalue(ra + 3, idx);  /* ...and external index */
           }
@@ -1221,8 +1358,8 @@ void luaV_execute (lua_State *L) {
             forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {
           /* all values are integer */
           lua_Integer initv = (stopnow ? 0 : ivalue(init));
-          setivalue(plimit, ilimit);
-          setivalue(init, intop(-, initv, ivalue(pstep)));
+          setivalue(L, plimit, ilimit);
+          setiresult(init, intop(-, initv, ivalue(pstep)));
         }
         else {  /* try making all values floats */
           lua_Number ninit; lua_Number nlimit; lua_Number nstep;
@@ -1257,6 +1394,7 @@ void luaV_execute (lua_State *L) {
         if (!ttisnil(ra + 1)) {  /* continue loop? */
           setobjs2s(L, ra, ra + 1);  /* save control variable */
            ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
+           luaJ_count(L, cl->p);
         }
         vmbreak;
       }
@@ -1274,6 +1412,7 @@ void luaV_execute (lua_State *L) {
         last = ((c-1)*LFIELDS_PER_FLUSH) + n;
         if (last > h->sizearray)  /* needs more space? */
           luaH_resizearray(L, h, last);  /* preallocate it at once */
+        h->lenhint = last;  /* probably the new length */
         for (; n > 0; n--) {
           TValue *val = ra+n;
           luaH_setint(L, h, last--, val);
@@ -1314,6 +1453,176 @@ void luaV_execute (lua_State *L) {
         lua_assert(0);
         vmbreak;
       }
+      vmcase(OP_ADDI) l_addi: {
+        TValue *rb = RB(i);
+        lua_Integer ic = GETARG_sC(i);
+        lua_Number nb;
+        if (ttisinteger(rb)) {
+          setiresult(ra, intop(+, ivalue(rb), ic));
+        }
+        else if (tonumber(rb, &nb)) {
+          setfltvalue(ra, luai_numadd(L, nb, cast_num(ic)));
+        }
+        else {
+          TValue rc;
+          setivalue(L, &rc, ic);
+          Protect(luaT_trybinTM(L, rb, &rc, ra, TM_ADD));
+        }
+        vmbreak;
+      }
+      vmcase(OP_EQK) {
+        TValue *rb = RB(i);
+        TValue *rc = k + GETARG_C(i);
+        int res = ttisshrstring(rc)  /* common case: a short string? */
+                  ? (ttisshrstring(rb) && eqshrstr(tsvalue(rb), tsvalue(rc)))
+                  : luaV_rawequalobj(rb, rc);  /* no metamethods */
+        if (res != GETARG_A(i))
+          ci->u.l.savedpc++;
+        else
+          donextjump(ci);
+        vmbreak;
+      }
+      vmcase(OP_GETFIELD) {
+        StkId rb = RB(i);
+        TValue *rc = k + GETARG_C(i);
+        getfieldProtected(L, rb, rc, ra);
+        vmbreak;
+      }
+      vmcase(OP_GETINT) {
+        StkId rb = RB(i);
+        int c = GETARG_C(i);
+        const TValue *slot;
+        if (luaV_fastget(L, rb, c, slot, luaH_getint)) {
+          setobj2s(L, ra, slot);
+        }
+        else {
+          TValue rc;
+          setivalue(L, &rc, c);
+          Protect(luaV_finishget(L, rb, &rc, ra, slot));
+        }
+        vmbreak;
+      }
+      vmcase(OP_GETTABUPCALL) {
+        TValue *upval = cl->upvals[GETARG_B(i)]->v;
+        TValue *rc = RKC(i);
+        gettableProtected(L, upval, rc, ra);
+        vmfetch();  /* go on to the fused OP_CALL */
+        lua_assert(GET_OPCODE(i) == OP_CALL);
+        goto l_call;
+      }
+      vmcase(OP_SELFCALL) {
+        StkId rb = RB(i);
+        TValue *rc = RKC(i);  /* key must be a string */
+        setobjs2s(L, ra + 1, rb);
+        selfProtected(L, rb, rc, ra);
+        vmfetch();  /* go on to the fused OP_CALL */
+        lua_assert(GET_OPCODE(i) == OP_CALL);
+        goto l_call;
+      }
+      vmcase(OP_GETTABLEARITH) {
+        StkId rb = RB(i);
+        TValue *rc = k + GETARG_C(i);
+        getfieldProtected(L, rb, rc, ra);
+        vmfetch();  /* go on to the fused arithmetic operation */
+        switch (GET_OPCODE(i)) {
+          case OP_ADD: goto l_add;
+          case OP_ADDI: goto l_addi;
+          case OP_SUB: goto l_sub;
+          case OP_MUL: goto l_mul;
+          case OP_ADDII: goto l_addii;
+          case OP_ADDFF: goto l_addff;
+          case OP_SUBII: goto l_subii;
+          case OP_SUBFF: goto l_subff;
+          case OP_MULII: goto l_mulii;
+          default: lua_assert(GET_OPCODE(i) == OP_MULFF); goto l_mulff;
+        }
+      }
+      vmcase(OP_ADDII) l_addii: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          setiresult(ra, intop(+, ivalue(rb), ivalue(rc)));
+          vmbreak;
+        }
+        dequicken(OP_ADD);
+        goto l_add;
+      }
+      vmcase(OP_ADDFF) l_addff: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisfloat(rb) && ttisfloat(rc)) {
+          setfltvalue(ra, luai_numadd(L, fltvalue(rb), fltvalue(rc)));
+          vmbreak;
+        }
+        dequicken(OP_ADD);
+        goto l_add;
+      }
+      vmcase(OP_SUBII) l_subii: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          setiresult(ra, intop(-, ivalue(rb), ivalue(rc)));
+          vmbreak;
+        }
+        dequicken(OP_SUB);
+        goto l_sub;
+      }
+      vmcase(OP_SUBFF) l_subff: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisfloat(rb) && ttisfloat(rc)) {
+          setfltvalue(ra, luai_numsub(L, fltvalue(rb), fltvalue(rc)));
+          vmbreak;
+        }
+        dequicken(OP_SUB);
+        goto l_sub;
+      }
+      vmcase(OP_MULII) l_mulii: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          setiresult(ra, intop(*, ivalue(rb), ivalue(rc)));
+          vmbreak;
+        }
+        dequicken(OP_MUL);
+        goto l_mul;
+      }
+      vmcase(OP_MULFF) l_mulff: {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisfloat(rb) && ttisfloat(rc)) {
+          setfltvalue(ra, luai_nummul(L, fltvalue(rb), fltvalue(rc)));
+          vmbreak;
+        }
+        dequicken(OP_MUL);
+        goto l_mul;
+      }
+      vmcase(OP_LTII) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          if ((ivalue(rb) < ivalue(rc)) != GETARG_A(i))
+            ci->u.l.savedpc++;
+          else
+            donextjump(ci);
+          vmbreak;
+        }
+        dequicken(OP_LT);
+        goto l_lt;
+      }
+      vmcase(OP_LEII) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          if ((ivalue(rb) <= ivalue(rc)) != GETARG_A(i))
+            ci->u.l.savedpc++;
+          else
+            donextjump(ci);
+          vmbreak;
+        }
+        dequicken(OP_LE);
+        goto l_le;
+      }
     }
   }
 }
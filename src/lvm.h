@@ -37,6 +37,15 @@
 #endif
 
 
+/*
+** number of executions in a row with the same operand types after
+** which an arithmetic or order instruction is quickened
+*/
+#if !defined(LUAI_QUICKEN)
+#define LUAI_QUICKEN		8
+#endif
+
+
 #define tonumber(o,n) \
 	(ttisfloat(o) ? (*(n) = fltvalue(o), 1) : luaV_tonumber_(o,n))
 
@@ -82,7 +91,8 @@
    ? (slot = NULL, 0) \
    : (slot = f(hvalue(t), k), \
      ttisnil(slot) ? 0 \
-     : (luaC_barrierback(L, hvalue(t), v), \
+     : (luaC_barrierslot(L, hvalue(t), slot, v), \
+        luaH_checkstore(hvalue(t), slot, v), \
         setobj2t(L, cast(TValue *,slot), v), \
         1)))
 
@@ -102,6 +112,9 @@ LUAI_FUNC void luaV_finishget (lua_State *L, const TValue *t, TValue *key,
                                StkId val, const TValue *slot);
 LUAI_FUNC void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                                StkId val, const TValue *slot);
+LUAI_FUNC void luaV_finishgeticache (lua_State *L, const TValue *t,
+                                     TValue *key, StkId val,
+                                     const TValue *slot, unsigned int *c);
 LUAI_FUNC void luaV_finishOp (lua_State *L);
 LUAI_FUNC void luaV_execute (lua_State *L);
 LUAI_FUNC void luaV_concat (lua_State *L, int total);
@@ -946,6 +946,36 @@ assert(T.doremote(L1, "return a.x") == "1")
 
 T.closestate(L1)
 
+-- a state with the slab allocator
+L1 = T.newslabstate()
+T.loadlib(L1)
+a, b = T.doremote(L1, [[
+  require'_G'; local string = require'string'
+  local t = {}
+  for i = 1, 20000 do   -- blocks of all size classes (and bigger ones)
+    t[i] = {string.rep("x", i % 300), i, {}}
+    if i % 3 == 0 then t[i - 1] = nil end
+  end
+  collectgarbage()   -- frees many blocks and trims the slabs
+  local s = 0
+  for i = 1, 20000 do
+    if t[i] then s = s + t[i][2]; assert(#t[i][1] == i % 300) end
+  end
+  t = nil
+  collectgarbage()
+  local u = {}
+  for i = 1, 1000 do u[i] = string.rep("y", i) end   -- growing blocks
+  for i = 1000, 1, -1 do u[i] = nil end   -- shrinking table
+  collectgarbage()
+  return s, #u
+]])
+local s = 0
+for i = 1, 20000 do
+  if i % 3 ~= 2 or i == 20000 then s = s + i end
+end
+assert(tonumber(a) == s and b == "0")
+T.closestate(L1)
+
 L1 = nil
 
 print('+')
@@ -366,7 +366,7 @@ do
   local header = string.pack("c4BBc6BBBBBj",
     "\27Lua",                -- signature
     5*16 + 3,                -- version 5.3
-    0,                       -- format
+    1,                       -- format (0 is also accepted)
     "\x19\x93\r\n\x1a\n",    -- data
     string.packsize("i"),    -- sizeof(int)
     string.packsize("T"),    -- sizeof(size_t)
@@ -397,5 +397,240 @@ do
   assert(assert(load(c))() == 10)
 end
 
+
+-- testing hot functions (compiled to machine code when the JIT is on)
+do
+  local function sum (t, n)
+    local s = 0
+    for i = 1, n do s = s + t[i] * 2 - i % 3 end
+    return s
+  end
+  local ti, tf = {}, {}
+  for i = 1, 100 do ti[i] = i; tf[i] = i + 0.5 end
+  for _ = 1, 300 do assert(sum(ti, 100) == 10000) end
+  assert(sum(tf, 100) == 10100)   -- types change in a hot loop
+  local ts = setmetatable({}, {__index = function (_, i) return "1" end})
+  assert(sum(ts, 100) == 100)   -- coercions and metamethods
+  assert(math.type(sum(ts, 100)) == "float")
+
+  local function divs (a, b)
+    local q, r = 0, 0
+    for _ = 1, 3 do q = a // b; r = a % b end
+    return q, r
+  end
+  for _ = 1, 300 do
+    assert(select(2, divs(7, -3)) == -2 and divs(-7, 3) == -3)
+  end
+  assert(divs(math.mininteger, -1) == math.mininteger)
+  assert(select(2, divs(math.mininteger, -1)) == 0)
+  assert(select(2, divs(7.5, 2)) == 1.5)
+  assert(not pcall(divs, 1, 0))
+  assert(string.find(select(2, pcall(divs, 1, 0)), "divide by zero"))
+
+  local function cmp (a, b)
+    local n = 0
+    for _ = 1, 10 do
+      if a < b then n = n + 1 end
+      if a <= b then n = n + 10 end
+      if a == b then n = n + 100 end
+    end
+    return n
+  end
+  for _ = 1, 300 do assert(cmp(1, 2) == 110 and cmp(2.5, 2.5) == 1100) end
+  assert(cmp(0/0, 0/0) == 0 and cmp(1, 1.0) == 1100 and cmp("a", "b") == 110)
+
+  -- fields, methods, and globals
+  local C = {}; C.__index = C
+  function C:inc (d) self.x = self.x + d; return self end
+  local o = setmetatable({x = 0, y = 1}, C)
+  for i = 1, 1000 do o:inc(1); o.y = o.y + o.x end
+  assert(o.x == 1000 and o.y == 500501)
+  GLOB1 = 0
+  for i = 1, 1000 do GLOB1 = GLOB1 + 1 end
+  assert(GLOB1 == 1000); GLOB1 = nil
+
+  -- errors from compiled code keep their positions and variable names
+  local function idx (t, n)
+    local s = 0
+    for i = 1, n do s = s + t.x[i] end
+    return s
+  end
+  for _ = 1, 300 do idx({x = {1}}, 1) end
+  local st, msg = pcall(idx, {}, 1)
+  assert(not st and string.find(msg, ":" .. debug.getinfo(idx).linedefined
+                                      + 2 .. ":.*field 'x'"))
+
+  -- hooks set while running compiled code
+  local c = 0
+  local function hook () c = c + 1 end
+  local function loop (n, f)
+    local s = 0
+    for i = 1, n do s = s + i; if i == f then debug.sethook(hook, "", 1) end end
+    return s
+  end
+  for _ = 1, 300 do loop(10, 0) end
+  assert(loop(100, 50) == 5050)
+  debug.sethook()
+  assert(c > 50)
+
+  -- yields from metamethods in compiled code
+  local mt = {__add = function (a, b) return coroutine.yield(b) end}
+  local function addall (n)
+    local s = setmetatable({}, mt)
+    local r = 0
+    for i = 1, n do r = r + (s + i) end
+    return r
+  end
+  for _ = 1, 3 do
+    local co = coroutine.wrap(addall)
+    local v = co(100)
+    while v ~= 5050 do v = co(v) end
+  end
+end
+
+
+-- testing hot loops (traced when the JIT is on)
+do
+  -- array accesses; misses go through the metamethods
+  local function sum (t, n)
+    local s = 0
+    for i = 1, n do s = s + t[i] end
+    return s
+  end
+  local a = {}
+  for i = 1, 300 do a[i] = i end
+  for _ = 1, 20 do assert(sum(a, 300) == 45150) end
+  a[150] = 0.5
+  assert(sum(a, 300) == 45150 - 150 + 0.5)
+  a[150] = 150
+  setmetatable(a, {__index = function (_, i) return -1 end})
+  assert(sum(a, 310) == 45150 - 10)
+  a[20] = nil
+  assert(sum(a, 300) == 45150 - 21)
+  a[20] = 20
+  assert(not pcall(sum, {1, 2, 3}, 4))
+
+  local function fill (t, n, v)
+    for i = 1, n do t[i] = v end
+    return t
+  end
+  for _ = 1, 20 do fill(a, 300, 1) end
+  assert(sum(a, 300) == 300)
+  local log = {}
+  setmetatable(a, {__newindex = function (t, k, v) log[#log + 1] = k end})
+  a[10] = nil
+  fill(a, 300, {})
+  assert(#log == 1 and log[1] == 10 and type(a[300]) == "table")
+  for _ = 1, 50 do   -- store new tables while 'a' may be black
+    collectgarbage("step", 1)
+    fill(a, 300, {})
+  end
+  collectgarbage()
+  for i = 1, 300 do assert(a[i] == a[300] or i == 10) end
+
+  -- branches that change direction, and types that change
+  local function count (t, n)
+    local odd, big, neg = 0, 0, 0
+    for i = 1, n do
+      local v = t[i]
+      if v % 2 == 1 then odd = odd + 1 end
+      if v > 100 then big = big + 1 elseif v < 0 then neg = neg + 1 end
+    end
+    return odd, big, neg
+  end
+  local b = {}
+  for i = 1, 100 do b[i] = i end
+  for _ = 1, 20 do
+    local o, g, n = count(b, 100)
+    assert(o == 50 and g == 0 and n == 0)
+  end
+  b[1] = 101; b[2] = -2; b[3] = 3.0; b[4] = 200.5; b[5] = -0.0
+  local o, g, n = count(b, 100)
+  assert(o == 49 and g == 2 and n == 1)
+  b[6] = setmetatable({}, {__mod = function () return 1 end,
+                           __lt = function () return true end})
+  o, g, n = count(b, 6)
+  assert(o == 3 and g == 3 and n == 1)
+
+  -- steps that change their sign; float loops
+  local function range (a, b, c)
+    local s, n = 0, 0
+    for i = a, b, c do s = s + i; n = n + 1 end
+    return s, n
+  end
+  for _ = 1, 20 do assert(range(1, 100, 1) == 5050) end
+  assert(select(2, range(100, 1, -1)) == 100)
+  assert(range(100, 1, -1) == 5050)
+  assert(range(1, 0, 1) == 0)
+  assert(range(1, 50.5, 0.5) == 2575 and math.type(range(1, 3, 0.5)) == "float")
+
+  -- strings and calls to C functions
+  local function words (s)
+    local n, len, sp = 0, 0, 0
+    for i = 1, #s do
+      local c = s:sub(i, i)
+      if c == " " then sp = sp + 1 else len = len + #c end
+    end
+    for w in string.gmatch(s, "%a+") do n = n + 1; len = len + #w end
+    return n, len, sp
+  end
+  local s = string.rep("ab cde ", 20)
+  for _ = 1, 20 do
+    local n, l, p = words(s)
+    assert(n == 40 and l == 200 and p == 40)
+  end
+  local n, l, p = words(s .. string.rep("x", 50))
+  assert(n == 41 and l == 300 and p == 40)
+
+  -- generic loops with C and Lua iterators
+  local function walk (t, iter)
+    local s = 0
+    for k, v in iter(t) do s = s + k * v end
+    return s
+  end
+  local function myipairs (t)
+    return function (t, i)
+      i = i + 1
+      if t[i] then return i, t[i] end
+    end, t, 0
+  end
+  local c = {}
+  for i = 1, 100 do c[i] = 2 end
+  for _ = 1, 20 do
+    assert(walk(c, ipairs) == 10100 and walk(c, myipairs) == 10100)
+  end
+  c[50] = 2.5
+  assert(walk(c, ipairs) == 10125 and walk(c, pairs) == 10125)
+  c[50] = nil
+  assert(walk(c, ipairs) == 49 * 50 and walk(c, myipairs) == 49 * 50)
+
+  -- hooks and debug functions called from the loop body
+  local function loop (n, f)
+    local x = 0
+    for i = 1, n do
+      x = x + 1
+      if i == f then f = debug.setlocal(1, 3, 0.5) end
+    end
+    return x
+  end
+  for _ = 1, 20 do assert(loop(100, 0) == 100) end
+  local x = loop(100, 50)
+  assert(x == 50.5 and math.type(x) == "float")
+  local hits = 0
+  local function hook () hits = hits + 1 end
+  local function hooked (n, f)
+    local x = 0
+    for i = 1, n do
+      x = x + i
+      if i == f then debug.sethook(hook, "", 1) end
+    end
+    return x
+  end
+  for _ = 1, 20 do hooked(100, 0) end
+  assert(hooked(1000, 500) == 500500)
+  debug.sethook()
+  assert(hits >= 500)
+end
+
 print('OK')
 return deep
@@ -65,7 +65,8 @@ end
 -- some basic instructions
 check(function ()
   (function () end){f()}
-end, 'CLOSURE', 'NEWTABLE', 'GETTABUP', 'CALL', 'SETLIST', 'CALL', 'RETURN')
+end, 'CLOSURE', 'NEWTABLE', 'GETTABUPCALL', 'CALL', 'SETLIST', 'CALL',
+  'RETURN')
 
 
 -- sequence of LOADNILs
@@ -121,7 +122,7 @@ check(function ()
 end,
   'LOADNIL',
   'MUL',
-  'DIV', 'ADD', 'GETTABLE', 'SUB', 'GETTABLE', 'POW',
+  'DIV', 'ADD', 'GETTABLE', 'SUB', 'GETFIELD', 'POW',
     'UNM', 'SETTABLE', 'SETTABLE', 'RETURN')
 
 
@@ -202,7 +203,7 @@ checkequal(function () if (a==nil) then a=1 end; if a~=nil then a=1 end end,
            function () if (a==9) then a=1 end; if a~=9 then a=1 end end)
 
 check(function () if a==nil then a='a' end end,
-'GETTABUP', 'EQ', 'JMP', 'SETTABUP', 'RETURN')
+'GETTABUP', 'EQK', 'JMP', 'SETTABUP', 'RETURN')
 
 -- de morgan
 checkequal(function () local a; if not (a or b) then b=a end end,
@@ -235,5 +236,111 @@ function (a) while a < 10 do a = a + 1 end end,
 function (a) while true do if not(a < 10) then break end; a = a + 1; end end
 )
 
+
+-- superinstructions
+check(function () f() end, 'GETTABUPCALL', 'CALL', 'RETURN')
+check(function (a) a:m() end, 'SELFCALL', 'CALL', 'RETURN')
+check(function (a) return a.x + 1 end, 'GETTABLEARITH', 'ADDI', 'RETURN')
+check(function (a) return a.y * a.z end,
+  'GETFIELD', 'GETTABLEARITH', 'MUL', 'RETURN')
+check(function (a, b) return a[b] - 1 end, 'GETTABLE', 'SUB', 'RETURN')
+check(function (a) return a.x / 2 end, 'GETFIELD', 'DIV', 'RETURN')
+
+do   -- fused instructions keep their semantics
+  local t = setmetatable({}, {__index = function (_, k) return k end})
+  assert(t.x ~= nil and t[10] + 1 == 11 and t[3] * 3 == 9)
+  local o = {m = function (self, a) return self, a end}
+  local s, a = o:m(10)
+  assert(s == o and a == 10)
+  local a = {x = 10}
+  local v = false
+  -- jumping into the second instruction of a pair
+  if v then v = a.x end; v = a.x - 1
+  assert(v == 9)
+  -- a binary chunk keeps the basic opcodes and is fused again when loaded
+  local f = load(string.dump(function (t) return t.x + 1 end))
+  check(f, 'GETTABLEARITH', 'ADDI', 'RETURN')
+  assert(f{x = 1} == 2)
+end
+
+
+-- immediate operands
+check(function (a) return a + 1 end, 'ADDI', 'RETURN')
+check(function (a) return a + -1 end, 'ADDI', 'RETURN')
+check(function (a) return 1 + a end, 'ADD', 'RETURN')
+check(function (a) return a - 1 end, 'SUB', 'RETURN')
+check(function (a) return a + 1.0 end, 'ADD', 'RETURN')
+check(function (a) return a[1] end, 'GETINT', 'RETURN')
+check(function (a) return a[0] end, 'GETINT', 'RETURN')
+check(function (a) return a[-1] end, 'GETTABLE', 'RETURN')
+check(function (a) return a[1.0] end, 'GETTABLE', 'RETURN')
+check(function (a) a[1] = a.x end, 'GETFIELD', 'SETTABLE', 'RETURN')
+check(function (a) if a == 'x' then a = nil end end,
+  'EQK', 'JMP', 'LOADNIL', 'RETURN')
+check(function (a) if 'x' ~= a then a = nil end end,
+  'EQK', 'JMP', 'LOADNIL', 'RETURN')
+check(function (a, b) if a == b then a = nil end end,
+  'EQ', 'JMP', 'LOADNIL', 'RETURN')
+
+do   -- immediate operands keep their semantics
+  local function f (a) return a + 256, a + -255, a + 257 end
+  local x, y, z = f(1)
+  assert(x == 257 and y == -254 and z == 258 and math.type(x) == "integer")
+  x = f(0.5); assert(x == 256.5)
+  x = f("10"); assert(x == 266 and math.type(x) == "float")
+  x = f(math.maxinteger); assert(x == math.mininteger + 255)
+  local t = setmetatable({}, {__add = function (a, b) return b end,
+                              __index = function (_, k) return k end})
+  assert(f(t) == 256 and t[0] == 0 and t[2] == 2 and t.x == "x")
+  assert(not pcall(f, {}) and not pcall(function () return t.x.y.z end))
+  local a = {[0] = 'z', 'a', 'b', [511] = 'e'}
+  assert(a[0] == 'z' and a[1] == 'a' and a[2] == 'b' and a[3] == nil and
+         a[511] == 'e')
+  local function eq (v) return v == 'x', v ~= 1, v == 1.0, v == nil end
+  local r1, r2, r3, r4 = eq('x')
+  assert(r1 and r2 and not r3 and not r4)
+  r1, r2, r3, r4 = eq(1)
+  assert(not r1 and not r2 and r3 and not r4)
+  -- no '__eq' for comparisons with constants
+  r1, r2, r3, r4 = eq(setmetatable({}, {__eq = function () return true end}))
+  assert(not r1 and r2 and not r3 and not r4)
+end
+
+
+-- quickening (under a hook, so that the code is always interpreted)
+do
+  local debug = require "debug"
+  local function f (a, b, c)
+    local x = a + b
+    if a < b then x = x * c end
+    return x - c
+  end
+  local generic = {'ADD', 'LT', 'JMP', 'MUL', 'SUB', 'RETURN', 'RETURN'}
+  check(f, table.unpack(generic))
+  debug.sethook(function () end, "", 1e6)
+  for i = 1, 20 do
+    assert(f(i, 10, 2) == (i < 10 and (i + 10) * 2 or i + 10) - 2)
+  end
+  check(f, 'ADDII', 'LTII', 'JMP', 'MULII', 'SUBII', 'RETURN', 'RETURN')
+  -- a binary chunk has only generic instructions
+  check(load(string.dump(f)), table.unpack(generic))
+  -- other types turn the instructions back into generic ones
+  assert(f(1.5, 2.5, 2.0) == 6.0)
+  check(f, table.unpack(generic))
+  for i = 1, 20 do f(i + 0.5, 10.0, 2.0) end
+  check(f, 'ADDFF', 'LT', 'JMP', 'MULFF', 'SUBFF', 'RETURN', 'RETURN')
+  assert(f(1, 2, 3) == 6 and f(1, 2.0, 3) == 6.0 and f(2^53, 1, 0) == 2^53)
+  -- quickened again while a metamethod of the instruction is suspended
+  local t = setmetatable({}, {
+    __add = function () coroutine.yield(); return 1 end,
+    __lt = function () return true end})
+  local co = coroutine.wrap(f)
+  co(t, 1, 2)
+  for i = 1, 20 do f(i, 10, 2) end
+  check(f, 'ADDII', 'LTII', 'JMP', 'MULII', 'SUBII', 'RETURN', 'RETURN')
+  assert(co() == 0)
+  debug.sethook()
+end
+
 print 'OK'
 
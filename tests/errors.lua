@@ -98,6 +98,9 @@ checkmessage("local a,b,cc; (function () a.x = 1 end)()", "upvalue 'a'")
 checkmessage("local _ENV = {x={}}; a = a + 1", "global 'a'")
 
 checkmessage("b=1; local aaa='a'; x=aaa+b", "local 'aaa'")
+checkmessage("local aaa={}; x=aaa+1", "local 'aaa'")
+checkmessage("local a={{}}; a[1].bbbb.x = 1", "field 'bbbb'")
+checkmessage("local a={}; a[1](3)", "field '?'")
 checkmessage("aaa={}; x=3/aaa", "global 'aaa'")
 checkmessage("aaa='2'; b=nil;x=aaa*b", "global 'b'")
 checkmessage("aaa={}; x=-aaa", "global 'aaa'")
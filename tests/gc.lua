@@ -592,6 +592,428 @@ if T then
   assert(T.totalmem("thread") == t + 1)
 end
 
+-- full collection of a large heap (which may be marked in parallel)
+do
+  local n = _soft and 20000 or 100000
+  local t = {}
+  local wv = setmetatable({}, {__mode = "v"})
+  local wk = setmetatable({}, {__mode = "k"})
+  for i = 1, n do
+    t[i] = {i, tostring(i), {x = i}}
+    if i % 10 == 0 then
+      wv[i] = t[i]; wk[t[i]] = i
+      wv[-i] = {}; wk[{}] = -i   -- garbage
+    end
+  end
+  local co = coroutine.wrap(function (a) coroutine.yield(); return a[1] end)
+  co(t[1])
+  collectgarbage()
+  for i = 1, n do assert(t[i][1] == i and t[i][3].x == i) end
+  local c = 0
+  for k, v in pairs(wv) do assert(v == t[k]); c = c + 1 end
+  assert(c == n // 10)
+  c = 0
+  for k, v in pairs(wk) do assert(t[v] == k); c = c + 1 end
+  assert(c == n // 10)
+  assert(co() == 1)
+end
+
+
+-- change old objects while C functions run (an idle-time marker may be
+-- traversing them meanwhile)
+do
+  local t = {}
+  for i = 1, 1000 do t[i] = {i, tostring(i)} end
+  for r = 1, 20 do
+    for i = 1, 200 do
+      local k = math.random(#t)
+      t[k] = {k, tostring(k)}
+      assert(#(string.rep("ab", 500) .. i) > 1000)
+    end
+    if T then T.checkmemory() end
+  end
+  for i = 1, #t do assert(t[i][1] == i and t[i][2] == tostring(i)) end
+end
+
+
+print("generational mode")
+do
+  assert(collectgarbage("generational") == "incremental")
+  assert(collectgarbage("generational") == "generational")
+
+  -- old table pointing to young objects
+  local old = {}
+  collectgarbage()   -- a full collection makes 'old' old
+  for i = 1, 100 do old[i] = {i} end
+  for i = 1, 10 do collectgarbage("step") end   -- minor collections
+  for i = 1, 100 do assert(old[i][1] == i) end
+
+  -- old weak table with young entries
+  local weak = setmetatable({}, {__mode = "v"})
+  collectgarbage()
+  weak[1] = {}; weak[2] = old
+  collectgarbage("step")
+  assert(weak[1] == nil and weak[2] == old)
+
+  -- young values stored in upvalues of old closures
+  local function newbox ()
+    local v
+    return function (x) if x then v = x end; return v end
+  end
+  local box = newbox()
+  collectgarbage()
+  box({10})
+  for i = 1, 10 do local a = {}; collectgarbage("step") end
+  assert(box()[1] == 10)
+
+  if T then
+    local t = {}
+    assert(T.gcage(t) == "new")
+    collectgarbage("step")
+    assert(T.gcage(t) == "survival")
+    collectgarbage("step")
+    assert(T.gcage(t) == "old1")
+    collectgarbage("step")
+    assert(T.gcage(t) == "old")
+    t[1] = {}   -- back barrier
+    assert(T.gcage(t) == "touched1")
+    collectgarbage("step")
+    assert(T.gcage(t) == "touched2" and T.gcage(t[1]) == "survival")
+    collectgarbage("step")
+    assert(T.gcage(t) == "old" and T.gcage(t[1]) == "old1")
+  end
+
+  assert(collectgarbage("incremental") == "generational")
+  assert(collectgarbage("incremental") == "incremental")
+end
+
+
+print("time-limited steps")
+do
+  assert(collectgarbage("setsteptime", 1) == 0)
+  assert(collectgarbage("setsteptime", 1) == 1)
+  -- steps cut short by the clock must still keep up with allocation,
+  -- even when cycles take many steps (many live objects) and big
+  -- blocks come between steps: the heap cannot keep growing
+  local live = {}
+  for i = 1, 20000 do live[i] = {i} end
+  collectgarbage()
+  local base = collectgarbage("count")
+  local s = string.rep("x", 100000)
+  local t = {}
+  local max = 0
+  for i = 1, 2000 do
+    t[i % 10 + 1] = s .. i
+    max = math.max(max, collectgarbage("count"))
+  end
+  assert(max < 10 * base)
+
+  -- the same with no pause between cycles
+  local pause = collectgarbage("setpause", 100)
+  max = 0
+  for i = 1, 2000 do
+    t[i % 10 + 1] = s .. i
+    max = math.max(max, collectgarbage("count"))
+  end
+  assert(max < 10 * base)
+  assert(collectgarbage("setpause", pause) == 100)
+
+  if T then   -- time limit in a new state, before its first estimate
+    local L1 = T.newstate()
+    T.testC(L1, "gc 14 1")   -- LUA_GCSTEPTIME
+    T.loadlib(L1)
+    assert(T.doremote(L1, [[
+      local collectgarbage = require'_G'.collectgarbage
+      collectgarbage("setsteptime", 1)
+      local t = {}
+      for i = 1, 200000 do t[i % 100 + 1] = {} end
+      return collectgarbage("setsteptime", 0)
+    ]]) == "1")
+    T.closestate(L1)
+  end
+  assert(collectgarbage("setsteptime", 0) == 1)
+  if T then T.checkmemory() end
+end
+
+
+print("statistics")
+do
+  local s0 = collectgarbage("stats")
+  setmetatable({}, {__gc = function () end})
+  collectgarbage()
+  local s = collectgarbage("stats")
+  assert(s.cycles > s0.cycles and s.finalizers > s0.finalizers)
+  assert(s.marked > 0 and s.swept > 0 and s.atomic >= s0.atomic)
+  for i = 1, 10 do collectgarbage("step") end
+  s = collectgarbage("stats")
+  assert(s.steps >= s0.steps + 10)
+  assert(#s.stephist == #s.pausehist)
+  local n = 0
+  for i = 1, #s.stephist do n = n + s.stephist[i] end
+  assert(n == s.steps)
+  collectgarbage("generational")
+  collectgarbage("step")
+  assert(collectgarbage("stats").minors == s.minors + 1)
+  collectgarbage("incremental")
+end
+
+
+print("automatic pacing")
+do
+  local pause = collectgarbage("setpause", 200)
+  local stepmul = collectgarbage("setstepmul", 200)
+  local live = {}
+  for i = 1, 20000 do live[i] = {i} end
+  collectgarbage()
+  assert(collectgarbage("auto", 50) == 0)
+  assert(collectgarbage("auto", 50, "heap") == 50)
+  local base = collectgarbage("count")
+  local peak = 0
+  local t = {}
+  for i = 1, 400000 do
+    t[i % 100] = {i}
+    if i > 200000 and i % 100 == 0 then
+      peak = math.max(peak, collectgarbage("count"))
+    end
+  end
+  assert(peak < base * 2)   -- target is 1.5
+  assert(collectgarbage("auto", 20, "cpu") == 50)
+  for i = 1, 100000 do t[i % 100] = {i} end
+  -- setting a parameter goes back to manual pacing
+  collectgarbage("setpause", pause)
+  assert(collectgarbage("auto", 0) == 0)
+  collectgarbage("setstepmul", stepmul)
+end
+
+
+print("card marking")
+do
+  local N = 3000
+  local big = {}
+  local last = {}
+  for i = 1, N do big[i] = {0}; big["k" .. i] = {0}; last[i] = 0 end
+  collectgarbage()
+  -- write young objects in all parts of 'big' along several cycles
+  local n, cycles = 0, 0
+  repeat
+    for i = 1, 20 do
+      n = n + 1
+      local k = (n * 7919) % N + 1
+      big[k] = {n}; big["k" .. k] = {n}; last[k] = n
+      if n % 37 == 0 then big["new" .. n] = {n} end  -- may rehash 'big'
+      if n % 41 == 0 then big[N + n] = {n} end
+    end
+    if n == 1000 then collectgarbage() end  -- finish a cycle halfway
+    if T and n % 200 == 0 then T.checkmemory() end
+    if collectgarbage("step", 0) then cycles = cycles + 1 end
+  until cycles == 3
+  collectgarbage()
+  for k = 1, N do
+    assert(big[k][1] == last[k] and big["k" .. k][1] == last[k])
+  end
+  for i = 37, n, 37 do assert(big["new" .. i][1] == i) end
+  for i = 41, n, 41 do assert(big[N + i][1] == i) end
+end
+
+
+print("chained ephemerons")
+do
+  -- a chain of keys, each one reachable only through the value of the
+  -- previous one in another ephemeron table, in random order
+  local N = 4000
+  local caches, keys, order = {}, {}, {}
+  for i = 1, N do
+    caches[i] = setmetatable({}, {__mode = "k"})
+    keys[i] = {i}
+    order[i] = i
+  end
+  for i = N, 2, -1 do
+    local j = math.random(i)
+    order[i], order[j] = order[j], order[i]
+  end
+  for i = 1, N - 1 do caches[order[i]][keys[i]] = keys[i + 1] end
+  local root = keys[1]
+  keys = nil
+
+  local function check (n)   -- check chain and count entries
+    local k, i = root, 1
+    while caches[order[i]][k] do
+      k = caches[order[i]][k]; i = i + 1
+      assert(k[1] == i)
+    end
+    assert(i == N)
+    local c = 0
+    for i = 1, N do c = c + (next(caches[i]) and 1 or 0) end
+    assert(c == n)
+  end
+
+  collectgarbage()
+  local s0 = collectgarbage("stats")
+  collectgarbage()
+  local s = collectgarbage("stats")
+  print(string.format("atomic phase with %d chained ephemerons in %.2f msec.",
+        N, (s.atomic - s0.atomic) * 1000))
+  check(N - 1)
+  if T then   -- without memory for the index
+    T.totalmem(T.totalmem() + 1000)
+    collectgarbage()
+    T.totalmem(0)
+    check(N - 1)
+  end
+  root = nil
+  collectgarbage()
+  for i = 1, N do assert(next(caches[i]) == nil) end
+end
+
+
+print("allocation")
+do
+  -- small objects of the usual sizes (compare builds with and without
+  -- LUA_USE_SLABALLOC)
+  local N = 200000
+  local keep = {}
+  local t0 = os.clock()
+  for i = 1, N do
+    local t = {i, x = i}   -- table, array part and node vector
+    t.s = "s" .. i   -- short string
+    t.f = function () return t end   -- closure and upvalue
+    keep[i % 1000 + 1] = t
+  end
+  local t1 = os.clock()
+  local grow = {}
+  for i = 1, N // 10 do grow[i] = {}; for j = 1, 8 do grow[i][j] = j end end
+  grow = nil
+  collectgarbage()
+  print(string.format("%d small allocations in %.2f msec.; growing tables in %.2f msec.",
+        N * 5, (t1 - t0) * 1000, (os.clock() - t1) * 1000))
+  assert(keep[1].f() == keep[1] and keep[1].s == "s" .. keep[1][1])
+end
+
+
+print("regions")
+do
+  local mode = collectgarbage("incremental")
+  -- regions need the generational mode (and do not change the mode)
+  local st, msg = pcall(collectgarbage, "region", print)
+  assert(not st and string.find(msg, "generational mode"))
+  assert(collectgarbage("incremental") == "incremental")
+  collectgarbage("generational")
+  local old = setmetatable({}, {__mode = "k"})
+  local co = coroutine.wrap(function ()
+    local x = coroutine.yield()   -- keeps 'x' only in its stack
+    coroutine.yield()
+    return x
+  end)
+  co()
+  local escaped, fin = {}, 0
+  local r1, r2 = collectgarbage("region", function (n)
+    for i = 1, n do
+      local t = {i, "x" .. i}
+      if i % 100 == 0 then escaped[#escaped + 1] = t end
+      setmetatable({}, {__gc = function () fin = fin + 1 end})
+    end
+    old[{}] = true   -- dies with the region
+    co({n})
+    assert(collectgarbage("region", function () return "inner" end) ==
+           "inner")
+    if T then T.checkmemory() end
+    return {n}, "s" .. n
+  end, 1000)
+  if T then T.checkmemory() end
+  assert(r1[1] == 1000 and r2 == "s1000")
+  assert(#escaped == 10 and escaped[10][2] == "x1000")
+  assert(fin == 1000 and next(old) == nil)
+  assert(co()[1] == 1000)
+  -- an error also closes the region
+  st, msg = pcall(collectgarbage, "region", error, "oops")
+  assert(not st and msg == "oops")
+  -- the collector is still in the mode it had before the regions
+  assert(collectgarbage("incremental") == "generational")
+  collectgarbage(mode)
+end
+
+
+print("frozen objects")
+do
+  local mode = collectgarbage("incremental")
+  -- a "module" built at startup
+  local M = {names = {}}
+  for i = 1, 20000 do
+    M.names[i] = "name" .. i
+    M[i] = {i}
+  end
+  local up = {}
+  function M.get () return up end
+  function M.set (x) up = x end
+  local weak = setmetatable({}, {__mode = "k"})
+  local co = coroutine.wrap(function ()
+    local x = coroutine.yield()   -- keeps 'x' only in its stack
+    coroutine.yield()
+    return x
+  end)
+  co()
+  local u = T and T.newuserdata(0)
+  collectgarbage()
+  local before = collectgarbage("stats").marked
+  local t0 = os.clock()
+  collectgarbage()
+  t0 = os.clock() - t0
+  collectgarbage("freeze")
+  if T then
+    assert(T.gcage(M) == "frozen" and T.gcage(M[1]) == "frozen")
+    assert(T.gcage(M.names[1]) == "frozen")
+    T.checkmemory()
+  end
+  local t1 = os.clock()
+  collectgarbage()
+  t1 = os.clock() - t1
+  print(string.format("full collection in %.2f msec. (%.2f before freezing)",
+                      t1 * 1000, t0 * 1000))
+  assert(collectgarbage("stats").marked < before / 2)
+  -- new objects stored into frozen ones must survive
+  M.new = {"new"}
+  M.names[1] = {"one"}
+  M.set({"up"})
+  weak[{}] = 1; weak[M] = 2
+  co({"stack"})
+  if u then debug.setuservalue(u, {"uv"}) end
+  if T then
+    T.gcstate("propagate")   -- in the middle of a marking
+    M.names[2] = {"two"}
+    T.checkmemory()
+    T.gcstate("sweepallgc")   -- in the middle of a sweep
+    M.names[3] = {"three"}
+    T.checkmemory()
+    T.gcstate("pause")
+    T.checkmemory()
+  end
+  for i = 1, 3 do collectgarbage() end
+  assert(M.new[1] == "new" and M.names[1][1] == "one" and M.get()[1] == "up")
+  assert(next(weak) == M and next(weak, M) == nil)
+  assert(co()[1] == "stack")
+  if u then assert(debug.getuservalue(u)[1] == "uv") end
+  if T then assert(M.names[2][1] == "two" and M.names[3][1] == "three") end
+  -- frozen objects are finalized only when the state closes
+  local fin = false
+  setmetatable(M.names, {__gc = function () fin = true end})
+  M.names = nil
+  collectgarbage()
+  assert(not fin)
+  -- freezing in generational mode
+  collectgarbage("generational")
+  local g = {list = {}}
+  collectgarbage("freeze")
+  for i = 1, 100 do
+    g.list[i] = {i}
+    collectgarbage("step")   -- a minor collection
+  end
+  if T then T.checkmemory() end
+  for i = 1, 100 do assert(g.list[i][1] == i) end
+  assert(collectgarbage("incremental") == "generational")
+  collectgarbage(mode)
+end
+
+
 -- create an object to be collected when state is closed
 do
   local setmetatable,assert,type,print,getmetatable =
@@ -186,11 +186,26 @@ void *debug_realloc (void *ud, void *b, size_t oldsize, size_t size) {
 */
 
 
+/* fixed objects are always gray (other strings and shapes never are) */
+#define isfixed(o)  \
+	(((o)->tt == LUA_TSHRSTR || (o)->tt == LUA_TSHAPE) && isgray(o))
+
 static int testobjref1 (global_State *g, GCObject *f, GCObject *t) {
   if (isdead(g,t)) return 0;
-  if (!issweepphase(g))
-    return !(isblack(f) && iswhite(t));
-  else return 1;
+  if (isfrozen(f) && isblack(f))  /* frozen and not thawed? */
+    return (isfrozen(t) || isfixed(t) || t == obj2gco(g->mainthread));
+  if (issweepphase(g))
+    return 1;  /* no invariants */
+  else if (g->gckind == KGC_INC)
+    return !(isblack(f) && iswhite(t));  /* basic incremental invariant */
+  else {  /* generational mode */
+    if ((getage(f) == G_OLD && isblack(f)) && !isold(t))
+      return 0;
+    if (((getage(f) == G_OLD1 || getage(f) == G_TOUCHED2) && isblack(f)) &&
+          getage(t) == G_NEW)
+      return 0;
+    return 1;
+  }
 }
 
 
@@ -223,20 +238,74 @@ static void checkvalref (global_State *g, GCObject *f, const TValue *t) {
 }
 
 
+/* slot 'i' of a table in a dirty card may point to white objects */
+static int dirtyslot (Table *h, unsigned int i) {
+  return (cardlisted(h) && i / CARDSIZE < h->cards->n &&
+          h->cards->dirty[i / CARDSIZE]);
+}
+
+
 static void checktable (global_State *g, Table *h) {
   unsigned int i;
   Node *n, *limit = gnode(h, sizenode(h));
   GCObject *hgc = obj2gco(h);
   checkobjref(g, hgc, h->metatable);
-  for (i = 0; i < h->sizearray; i++)
-    checkvalref(g, hgc, &h->array[i]);
+  if (h->cards != NULL) {
+    unsigned int size = h->sizearray + allocsizenode(h);
+    lua_assert(h->cards->n == (size + CARDSIZE - 1) / CARDSIZE);
+  }
+  if (h->atype != 0) {  /* homogeneous array part? */
+    lua_assert(h->atype == LUA_TNUMINT || h->atype == LUA_TNUMFLT ||
+               h->atype == LUA_TBOOLEAN);
+    for (i = 0; i < h->sizearray && ttype(&h->array[i]) == h->atype; i++)
+      lua_assert(!isbigint(&h->array[i]));
+    for (; i < h->sizearray; i++)  /* only nils after the values */
+      lua_assert(ttisnil(&h->array[i]));
+  }
+  for (i = 0; i < tvarraysize(h); i++) {
+    if (!dirtyslot(h, i))
+      checkvalref(g, hgc, &h->array[i]);
+  }
+  if (h->shape != NULL) {
+    lua_assert(isdummy(h));
+    lua_assert((h->svals == inlinevals(h)) == isinline(h));
+    checkobjref(g, hgc, h->shape);
+    for (i = 0; i < h->shape->nkeys; i++)
+      checkvalref(g, hgc, &h->svals[i]);
+  }
   for (n = gnode(h, 0); n < limit; n++) {
-    if (!ttisnil(gval(n))) {
+    if (!ttisnil(gval(n)) &&
+        !dirtyslot(h, h->sizearray + cast(unsigned int, n - gnode(h, 0)))) {
       lua_assert(!ttisnil(gkey(n)));
+      lua_assert(luaH_get(h, gkey(n)) == gval(n));  /* can be found */
       checkvalref(g, hgc, gkey(n));
       checkvalref(g, hgc, gval(n));
     }
   }
+  if (h->rehash != NULL) {  /* old hash part? */
+    Table *old = oldpart(h);
+    lua_assert(h->shape == NULL && !isdummy(h) && oldpart(old) == NULL);
+    lua_assert(0 < h->rehash->left && h->rehash->left <= sizenode(old));
+    for (i = 0; i < cast(unsigned int, sizenode(old)); i++) {
+      n = gnode(old, i);
+      if (!ttisnil(gval(n))) {
+        lua_assert(cast_int(i) < h->rehash->left);  /* not moved yet */
+        lua_assert(luaH_get(h, gkey(n)) == gval(n));  /* can be found */
+        checkvalref(g, hgc, gkey(n));
+        checkvalref(g, hgc, gval(n));
+      }
+    }
+  }
+}
+
+
+static void checkshape (global_State *g, Shape *s) {
+  int i;
+  GCObject *sgc = obj2gco(s);
+  lua_assert(s->nkeys <= s->size && s->size <= MAXSHAPEKEYS);
+  checkobjref(g, sgc, s->parent);
+  for (i = 0; i < s->nkeys; i++)
+    checkobjref(g, sgc, s->keys[i]);
 }
 
 
@@ -323,7 +392,7 @@ static void checkobject (global_State *g, GCObject *o, int maybedead) {
   if (isdead(g, o))
     lua_assert(maybedead);
   else {
-    lua_assert(g->gcstate != GCSpause || iswhite(o));
+    lua_assert(g->gcstate != GCSpause || iswhite(o) || isfrozen(o));
     switch (o->tt) {
       case LUA_TUSERDATA: {
         TValue uservalue;
@@ -353,9 +422,15 @@ static void checkobject (global_State *g, GCObject *o, int maybedead) {
         checkproto(g, gco2p(o));
         break;
       }
+      case LUA_TSHAPE: {
+        lua_assert(!isgray(o));  /* shapes are never gray */
+        checkshape(g, gco2sh(o));
+        break;
+      }
       case LUA_TSHRSTR:
-      case LUA_TLNGSTR: {
-        lua_assert(!isgray(o));  /* strings are never gray */
+      case LUA_TLNGSTR:
+      case LUA_TNUMINT: {  /* (a boxed integer) */
+        lua_assert(!isgray(o));  /* strings and boxes are never gray */
         break;
       }
       default: lua_assert(0);
@@ -366,10 +441,14 @@ static void checkobject (global_State *g, GCObject *o, int maybedead) {
 
 #define TESTGRAYBIT		7
 
+/* black objects that can be in a gray list */
+#define blackingray(o)	(getage(o) == G_TOUCHED2 || \
+	((o)->tt == LUA_TTABLE && isblack(o) && cardlisted(gco2t(o))))
+
 static void checkgraylist (global_State *g, GCObject *o) {
   ((void)g);  /* better to keep it available if we need to print an object */
   while (o) {
-    lua_assert(isgray(o));
+    lua_assert(!!isgray(o) ^ blackingray(o));
     lua_assert(!testbit(o->marked, TESTGRAYBIT));
     l_setbit(o->marked, TESTGRAYBIT);
     switch (o->tt) {
@@ -400,7 +479,7 @@ static void markgrays (global_State *g) {
 
 static void checkgray (global_State *g, GCObject *o) {
   for (; o != NULL; o = o->next) {
-    if (isgray(o)) {
+    if (isgray(o) || blackingray(o)) {
       lua_assert(!keepinvariant(g) || testbit(o->marked, TESTGRAYBIT));
       resetbit(o->marked, TESTGRAYBIT);
     }
@@ -413,6 +492,7 @@ int lua_checkmemory (lua_State *L) {
   global_State *g = G(L);
   GCObject *o;
   int maybedead;
+  lua_lock(L);  /* keep an idle-time marker out */
   if (keepinvariant(g)) {
     lua_assert(!iswhite(g->mainthread));
     lua_assert(!iswhite(gcvalue(&g->l_registry)));
@@ -424,7 +504,7 @@ int lua_checkmemory (lua_State *L) {
   markgrays(g);
   /* check 'fixedgc' list */
   for (o = g->fixedgc; o != NULL; o = o->next) {
-    lua_assert(o->tt == LUA_TSHRSTR && isgray(o));
+    lua_assert((o->tt == LUA_TSHRSTR || o->tt == LUA_TSHAPE) && isgray(o));
   }
   /* check 'allgc' list */
   checkgray(g, g->allgc);
@@ -440,6 +520,17 @@ int lua_checkmemory (lua_State *L) {
     lua_assert(tofinalize(o));
     lua_assert(o->tt == LUA_TUSERDATA || o->tt == LUA_TTABLE);
   }
+  /* check 'frozengc' list (thawed userdata are in no gray list) */
+  for (o = g->frozengc; o != NULL; o = o->next) {
+    lua_assert(isfrozen(o) && !iswhite(o));
+    if (isgray(o)) {
+      lua_assert(!keepinvariant(g) || o->tt == LUA_TUSERDATA ||
+                 testbit(o->marked, TESTGRAYBIT));
+      resetbit(o->marked, TESTGRAYBIT);
+    }
+    lua_assert(!testbit(o->marked, TESTGRAYBIT));
+    checkobject(g, o, 0);
+  }
   /* check 'tobefnz' list */
   checkgray(g, g->tobefnz);
   for (o = g->tobefnz; o != NULL; o = o->next) {
@@ -447,6 +538,7 @@ int lua_checkmemory (lua_State *L) {
     lua_assert(tofinalize(o));
     lua_assert(o->tt == LUA_TUSERDATA || o->tt == LUA_TTABLE);
   }
+  lua_unlock(L);
   return 0;
 }
 
@@ -631,6 +723,20 @@ static int gc_color (lua_State *L) {
 }
 
 
+static int gc_age (lua_State *L) {
+  static const char *gennames[] = {"new", "survival", "old0", "old1",
+                                   "old", "touched1", "touched2", "frozen"};
+  TValue *o;
+  luaL_checkany(L, 1);
+  o = obj_at(L, 1);
+  if (!iscollectable(o))
+    lua_pushstring(L, "no collectable");
+  else
+    lua_pushstring(L, gennames[getage(gcvalue(o))]);
+  return 1;
+}
+
+
 static int gc_state (lua_State *L) {
   static const char *statenames[] = {"propagate", "atomic", "sweepallgc",
       "sweepfinobj", "sweeptobefnz", "sweepend", "pause", ""};
@@ -643,6 +749,8 @@ static int gc_state (lua_State *L) {
   }
   else {
     global_State *g = G(L);
+    if (g->gckind == KGC_GEN)
+      luaL_error(L, "cannot change states in generational mode");
     lua_lock(L);
     if (option < g->gcstate) {  /* must cross 'pause'? */
       luaC_runtilstate(L, bitmask(GCSpause));  /* run until pause */
@@ -671,6 +779,31 @@ static int hash_query (lua_State *L) {
 }
 
 
+static int hash_size (lua_State *L) {
+  lua_Integer n = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= n && n <= INT_MAX / 4, 1, "invalid size");
+  lua_pushinteger(L, luaH_hashsize(cast(unsigned int, n)));
+  return 1;
+}
+
+
+#if defined(LUA_USE_HOMOARRAYS)
+/* type of the values in the homogeneous array part of a table (or nil) */
+static int array_type (lua_State *L) {
+  const Table *t;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  t = hvalue(obj_at(L, 1));
+  switch (t->atype) {
+    case LUA_TNUMINT: lua_pushliteral(L, "integer"); break;
+    case LUA_TNUMFLT: lua_pushliteral(L, "float"); break;
+    case LUA_TBOOLEAN: lua_pushliteral(L, "boolean"); break;
+    default: lua_pushnil(L); break;
+  }
+  return 1;
+}
+#endif
+
+
 static int stacklevel (lua_State *L) {
   unsigned long a = 0;
   lua_pushinteger(L, (L->top - L->stack));
@@ -689,10 +822,20 @@ static int table_query (lua_State *L) {
     lua_pushinteger(L, t->sizearray);
     lua_pushinteger(L, allocsizenode(t));
     lua_pushinteger(L, isdummy(t) ? 0 : t->lastfree - t->node);
+    if (t->shape != NULL) {  /* shaped table? */
+      lua_pushinteger(L, t->shape->size);
+      lua_pushinteger(L, t->sizeinline);  /* room in the table block */
+      return 5;
+    }
+    else if (t->rehash != NULL) {  /* old hash part still moving? */
+      lua_pushnil(L);
+      lua_pushinteger(L, t->rehash->left);  /* nodes not moved yet */
+      return 5;
+    }
   }
   else if ((unsigned int)i < t->sizearray) {
     lua_pushinteger(L, i);
-    pushobject(L, &t->array[i]);
+    pushobject(L, luaH_getint(cast(Table *, t), i + 1));
     lua_pushnil(L);
   }
   else if ((i -= t->sizearray) < sizenode(t)) {
@@ -842,6 +985,18 @@ static int newstate (lua_State *L) {
 }
 
 
+static int newslabstate (lua_State *L) {
+  lua_State *L1 = luaL_newslabstate();
+  if (L1) {
+    lua_atpanic(L1, tpanic);
+    lua_pushlightuserdata(L, L1);
+  }
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
 static lua_State *getstate (lua_State *L) {
   lua_State *L1 = cast(lua_State *, lua_touserdata(L, 1));
   luaL_argcheck(L, L1 != NULL, 1, "state expected");
@@ -1128,6 +1283,10 @@ static int runC (lua_State *L, lua_State *L1, const char *pc) {
       int f = getindex;
       lua_copy(L1, f, getindex);
     }
+    else if EQ("gc") {
+      int what = getnum;
+      lua_pushinteger(L1, lua_gc(L1, what, getnum));
+    }
     else if EQ("func2num") {
       lua_CFunction func = lua_tocfunction(L1, getindex);
       lua_pushnumber(L1, cast(size_t, func));
@@ -1510,15 +1669,20 @@ static int coresume (lua_State *L) {
 
 
 static const struct luaL_Reg tests_funcs[] = {
+#if defined(LUA_USE_HOMOARRAYS)
+  {"arraytype", array_type},
+#endif
   {"checkmemory", lua_checkmemory},
   {"closestate", closestate},
   {"d2s", d2s},
   {"doonnewstack", doonnewstack},
   {"doremote", doremote},
   {"gccolor", gc_color},
+  {"gcage", gc_age},
   {"gcstate", gc_state},
   {"getref", getref},
   {"hash", hash_query},
+  {"hashsize", hash_size},
   {"int2fb", int2fb_aux},
   {"log2", log2_aux},
   {"limits", get_limits},
@@ -1528,6 +1692,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"loadlib", loadlib},
   {"checkpanic", checkpanic},
   {"newstate", newstate},
+  {"newslabstate", newslabstate},
   {"newuserdata", newuserdata},
   {"num2int", num2int},
   {"pushuserdata", pushuserdata},
@@ -85,8 +85,10 @@ struct L_EXTRA { int lock; int *plock; };
   lua_assert(getlock(l1)->plock == getlock(l)->plock)
 #define luai_userstatefree(l,l1) \
   lua_assert(getlock(l)->plock == getlock(l1)->plock)
-#define lua_lock(l)     lua_assert((*getlock(l)->plock)++ == 0)
-#define lua_unlock(l)   lua_assert(--(*getlock(l)->plock) == 0)
+#define lua_lock(l)  \
+  (lua_assert((*getlock(l)->plock)++ == 0), luai_marklock(l))
+#define lua_unlock(l)  \
+  (lua_assert(--(*getlock(l)->plock) == 0), luai_markunlock(l))
 
 
 
@@ -821,4 +821,35 @@ assert(not pcall(math.random, -1, maxint))
 assert(not pcall(math.random, minint // 2, maxint // 2 + 1))
 
 
+do   print("testing large integers")
+  -- (with NaN boxing, integers that need more than 48 bits live in boxes)
+  local big = maxint >> 2
+  assert(big + 1 > big and (big + 1) - 1 == big and -(-big) == big)
+  assert(big // 3 * 3 + big % 3 == big and big & big == big)
+  assert(tostring(big) == string.format("%d", big))
+  assert(math.tointeger(tostring(minint)) == minint)
+  assert(tostring(big) | 0 == big and tostring(big) + 0 == big + 0.0)
+  local t = {}
+  for i = 1, 100 do t[big + i] = i end
+  collectgarbage()
+  for i = 1, 100 do assert(t[big + i] == i) end
+  t[2.0^60] = 1    -- float keys with integer values are integers
+  assert(t[1 << 60] == 1 and math.type(next({[2.0^60] = 1})) == "integer")
+  -- large integers are values: weak tables never lose them
+  t = setmetatable({[big] = minint}, {__mode = "kv"})
+  t[1] = maxint
+  collectgarbage()
+  assert(t[big] == minint and t[1] == maxint)
+  local n = 0
+  for i = maxint - 10, maxint - 1 do n = n + i - maxint end
+  assert(n == -55)
+  -- making large integers in a loop does not grow memory
+  collectgarbage()
+  local m = collectgarbage("count")
+  local x = big
+  for i = 1, 1000000 do x = x + 1 end
+  assert(x == big + 1000000 and collectgarbage("count") < 3 * m + 1024)
+end
+
+
 print('OK')
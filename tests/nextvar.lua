@@ -57,6 +57,18 @@ local function mp2 (n)   -- minimum power of 2 >= n
   return mp
 end
 
+local function hsize (n)   -- size of a hash part for 'n' keys
+  local h = T.hashsize(n)
+  assert(n <= h and (h == mp2(n) or h == 2 * mp2(n)))
+  return h
+end
+
+-- size for 'n' string keys: shaped tables (up to 16 keys) grow their
+-- value vectors like chained hash parts
+local function ssize (n)
+  return (n <= 16) and mp2(n) or hsize(n)
+end
+
 local function fb (n)
   local r, nn = T.int2fb(n)
   assert(r < 256)
@@ -78,7 +90,11 @@ end
 
  
 local function check (t, na, nh)
-  local a, h = T.querytab(t)
+  local a, h, _, s = T.querytab(t)
+  if s then   -- shaped table? its values grow like a hash part
+    assert(h == 0)
+    h = mp2(s)
+  end
   if a ~= na or h ~= nh then
     print(na, nh, a, h)
     assert(nil)
@@ -90,7 +106,7 @@ end
 do
   local s = 0
   for _ in pairs(math) do s = s + 1 end
-  check(math, 0, mp2(s))
+  check(math, 0, ssize(s))
 end
 
 
@@ -103,7 +119,7 @@ for i=1,lim do
   for k=0,lim do 
     local t = load(s..'}', '')()
     assert(#t == i)
-    check(t, fb(i), mp2(k))
+    check(t, fb(i), ssize(k))
     s = string.format('%sa%d=%d,', s, k, k)
   end
 end
@@ -138,7 +154,7 @@ a = {}
 for i = 1,lim do
   a['a'..i] = 1
   assert(#a == 0)
-  check(a, 0, mp2(i))
+  check(a, 0, ssize(i))
 end
 
 a = {}
@@ -160,7 +176,14 @@ end
 for i=1,lim do
   local a = {}
   for i=i,1,-1 do a[i] = i end   -- fill in reverse
-  check(a, mp2(i), 0)
+  if hsize(32) == 32 then
+    check(a, mp2(i), 0)
+  else   -- hash parts with free nodes rehash before they are full, so
+         -- the last keys may stay there
+    local na = T.querytab(a)
+    assert(na <= mp2(i))
+    for j = 1, i do assert(a[j] == j) end
+  end
 end
 
 -- size tests for vararg
@@ -177,9 +200,94 @@ end
 local a = {}
 for i=1,lim do a[i] = true; foo(i, table.unpack(a)) end
 
+-- shaped tables
+local function shaped (t) return select(4, T.querytab(t)) end
+a = {x = 1, y = 2, z = 3}
+assert(shaped(a) == 3)
+a.w = 4; assert(shaped(a) == 6)
+a.x = nil; assert(shaped(a) == 6)   -- removing a key keeps the shape
+a[1] = 10; a[2] = 20; assert(shaped(a) == 6)   -- array part grows
+check(a, 2, mp2(6))
+a[10] = 1; assert(not shaped(a)); check(a, 2, 4)   -- not an array key
+assert(a.y == 2 and a.z == 3 and a.w == 4 and a.x == nil)
+a = {}; a[true] = 1; assert(not shaped(a))
+a = {}; a["a long string key" .. string.rep("x", 40)] = 1; assert(not shaped(a))
+a = {}
+for i = 1, 16 do a["k" .. i] = i end
+assert(shaped(a) == 16)
+a.k17 = 17; assert(not shaped(a)); check(a, 0, 32)
+for i = 1, 17 do assert(a["k" .. i] == i) end
+
+-- small records keep their values in the table block
+local function inline (t)
+  local _, _, _, s, n = T.querytab(t)
+  return s <= n
+end
+a = {x = 1, y = 2}; assert(inline(a))
+a.z = 3; assert(not inline(a) and shaped(a) == 4)   -- outgrew its room
+assert(a.x == 1 and a.y == 2 and a.z == 3)
+a = {k1 = 1, k2 = 2, k3 = 3, k4 = 4}
+for i = 5, 8 do a["k" .. i] = i; assert(not inline(a)) end
+assert(shaped(a) == 8)
+for i = 1, 8 do assert(a["k" .. i] == i) end
+a = {}; a.x = 1; assert(not inline(a))   -- empty tables get no room
+a = {1, 2, 3}; a.x = 1; assert(not inline(a))
+a = {x = 1}; a[1.5] = 2; assert(not shaped(a))   -- values leave the block
+assert(a.x == 1 and a[1.5] == 2)
+
 end  --]
 
 
+-- testing tables with string keys only (which may be shaped)
+do
+  local function keys (t)
+    local r = {}
+    for k, v in pairs(t) do r[#r + 1] = k .. "=" .. v end
+    return table.concat(r, ",")
+  end
+  local a = {x = 1, y = 2}
+  local b = {x = 10, y = 20}
+  b.z = 30; a.z = 3; a.w = 4
+  assert(keys(a) == "x=1,y=2,z=3,w=4" and keys(b) == "x=10,y=20,z=30")
+  a.y = nil; assert(keys(a) == "x=1,z=3,w=4")
+  for k in pairs(a) do a[k] = nil end   -- clearing while traversing
+  assert(next(a) == nil)
+  a.y = 5; assert(keys(a) == "y=5")
+  assert(not pcall(next, a, "nokey"))
+  -- weak values in shaped tables
+  a = setmetatable({}, {__mode = "v"})
+  a.x = {}; a.y = "str"; a.z = {}
+  local keep = a.z
+  collectgarbage()
+  assert(a.x == nil and a.y == "str" and a.z == keep)
+  -- many short-lived shapes
+  for i = 1, 2000 do
+    local t = {}
+    t["f" .. i] = i; t["g" .. i % 7] = i
+    assert(t["f" .. i] == i)
+    if i % 100 == 0 then collectgarbage() end
+  end
+  -- many small records (with values in their own blocks)
+  local N = 200000
+  local t0 = os.clock()
+  a = {}
+  for i = 1, N do a[i] = {x = i, y = -i} end
+  local tc = os.clock() - t0
+  t0 = os.clock()
+  b = {}
+  for i = 1, N do local p = {}; p.x = i; p.y = -i; p.z = 0; b[i] = p end
+  local tf = os.clock() - t0
+  collectgarbage()
+  for i = 1, N, 1000 do
+    assert(a[i].x == i and a[i].y == -i and b[i].x + b[i].y + b[i].z == 0)
+  end
+  if T then T.checkmemory() end
+  print(string.format("%d small records from constructors in %.2f msec., " ..
+                      "filled one by one in %.2f msec.",
+                      N, tc * 1000, tf * 1000))
+end
+
+
 -- test size operation on empty tables
 assert(#{} == 0)
 assert(#{nil} == 0)
@@ -628,4 +736,300 @@ for k,v in ipairs(a) do
 end
 assert(i == a.n)
 
+
+-- testing field accesses through inline caches
+do
+  local function get (t) return t.x end
+  local function set (t, v) t.x = v end
+  local function call (t) return t:m() end
+  local a = {x = 1, m = function () return "a" end}
+  local b = {y = 0, x = 2}
+  assert(get(a) == 1 and get(b) == 2 and get(a) == 1)
+  for i = 1, 100 do a[i] = i; a["k" .. i] = i end   -- rehash 'a'
+  assert(get(a) == 1 and call(a) == "a")
+  set(a, 10); assert(get(a) == 10 and a.x == 10)
+  a.x = nil   -- key still in its node, but with a nil value
+  assert(get(a) == nil)
+  set(a, 20); assert(get(a) == 20)
+  a.x = nil
+  setmetatable(a, {__index = function (_, k) return k end,
+                   __newindex = function (t, k, v) rawset(t, k, v * 2) end})
+  assert(get(a) == "x")
+  set(a, 3); assert(rawget(a, "x") == 6 and get(a) == 6)
+  set(a, 4); assert(rawget(a, "x") == 4)   -- existing key: no metamethod
+  -- same node reused by another key
+  local c = {}
+  for i = 1, 4 do c["f" .. i] = i end
+  c.x = true; assert(get(c) == true)
+  c.x = nil; collectgarbage()
+  for i = 1, 10 do c["g" .. i] = i end
+  assert(get(c) == nil and get(b) == 2)
+  -- non-table values
+  assert(get("abc") == nil and not pcall(get, 1))
+  local mt = getmetatable("")
+  mt.__index.m = function (s) return s .. "!" end
+  assert(call("abc") == "abc!")
+  mt.__index.m = nil
+  -- fields found in '__index' tables
+  local C = {m = function () return "C" end}
+  C.__index = C
+  local D = setmetatable({}, C)
+  D.__index = D
+  local o1, o2 = setmetatable({}, C), setmetatable({}, D)
+  for i = 1, 3 do assert(call(o1) == "C" and call(o2) == "C") end
+  D.m = function () return "D" end
+  assert(call(o1) == "C" and call(o2) == "D")
+  o1.m = function () return "o1" end
+  C.m = nil
+  assert(call(o1) == "o1" and call(o2) == "D")
+  assert(get(o1) == nil and get(o2) == nil)
+end
+
+
+-- big hash parts, with keys of all kinds
+do
+  local N = 100000
+  local keys, absent = {}, {}
+  for i = 1, N do
+    local r = i % 5
+    keys[i] = (r == 0) and ("k" .. i) or (r == 1) and -i or
+              (r == 2) and (i + 0.5) or (r == 3) and {} or (i << 32 | i)
+    absent[i] = (r == 0) and ("x" .. i) or (i + 0.25)
+  end
+  local t = {}
+  local t0 = os.clock()
+  for i = 1, N do t[keys[i]] = i end
+  local tins = os.clock() - t0
+  t0 = os.clock()
+  for i = 1, N do assert(t[keys[i]] == i) end
+  for i = 1, N do assert(t[absent[i]] == nil) end
+  local tget = os.clock() - t0
+  t0 = os.clock()
+  local n, sum = 0, 0
+  for k, v in pairs(t) do n = n + 1; sum = sum + v end
+  local tnext = os.clock() - t0
+  assert(n == N and sum == N * (N + 1) // 2)
+  print(string.format("hash part with %d keys: insert %.2f, lookup %.2f, " ..
+                      "traverse %.2f msec.", N, tins * 1000, tget * 1000,
+                      tnext * 1000))
+  -- remove half of the keys while traversing the table
+  for k, v in pairs(t) do
+    if v % 2 == 0 then t[k] = nil end
+  end
+  n = 0
+  for k, v in pairs(t) do n = n + 1; assert(v % 2 == 1 and keys[v] == k) end
+  assert(n == N // 2)
+  for i = 1, N, 2 do assert(t[keys[i]] == i and t[keys[i + 1]] == nil) end
+  -- reinsert them (reusing removed nodes or after a rehash)
+  for i = 2, N, 2 do t[keys[i]] = -i end
+  for i = 1, N do assert(t[keys[i]] == (i % 2 == 1 and i or -i)) end
+  for i = 1, N do t[keys[i]] = nil end
+  assert(next(t) == nil)
+end
+
+
+-- big hash parts grow incrementally: the old part stays in the table
+-- while new keys move its entries to the new part
+do
+  -- nodes of the old part of 't' not moved yet (nil if there is none)
+  local function left (t) return T and select(5, T.querytab(t)) end
+  local function key (i) return (i % 2 == 0) and -i or (i + 0.5) end
+  local t = setmetatable({}, {__mode = "v"})
+  local N = 1 << 16   -- fills a hash part
+  local tabs = {}   -- keeps the tables while the part grows
+  for i = 1, N do
+    if i % 3 == 0 then tabs[i] = {} end
+    t[key(i)] = tabs[i] or i
+  end
+  N = N + 1
+  local t0 = os.clock()
+  t[key(N)] = N   -- grows the hash part
+  t0 = os.clock() - t0
+  print(string.format("growing a hash part with %d keys in %.2f msec.",
+                      N - 1, t0 * 1000))
+  N = N + 1
+  if T then
+    assert(left(t) > 0 and select(2, T.querytab(t)) >= 1 << 17)
+    T.checkmemory()
+  end
+  local strong, ns = {}, 0   -- keep some values of the weak table
+  for i = 15, N - 1, 15 do strong[i] = tabs[i]; ns = ns + 1 end
+  tabs = nil
+  collectgarbage()   -- during migration (other tables are collected)
+  assert(not T or left(t))
+  -- lookups, changes, and removals of entries in both parts
+  for i = 1, N - 1 do
+    local v = t[key(i)]
+    if i % 3 ~= 0 then assert(v == i)
+    else assert(v == strong[i]) end
+    assert(t[i + 0.25] == nil and t["x" .. i] == nil)
+  end
+  local n, nt = 0, 0
+  for k, v in pairs(t) do
+    if type(v) == "number" then
+      n = n + 1
+      assert(k == key(v))
+      if v % 4 == 0 then t[k] = nil else t[k] = -v end
+    else
+      nt = nt + 1   -- (a table may be kept by the stack)
+    end
+  end
+  assert(n == N - 1 - (N - 1) // 3 and nt >= ns)
+  for k, v in pairs(t) do
+    assert(type(v) == "table" or (v < 0 and k == key(-v)))
+  end
+  -- new keys finish the migration
+  local M = N
+  while T and left(t) do
+    t[key(M)] = M; M = M + 1
+  end
+  for i = 1, N - 1 do
+    local v = t[key(i)]
+    if i % 3 == 0 then assert(v == strong[i])
+    elseif i % 4 == 0 then assert(v == nil)
+    else assert(v == -i) end
+  end
+  for i = N, M - 1 do assert(t[key(i)] == i) end
+  if T then T.checkmemory() end
+end
+
+
+-- length of tables (with the cached border)
+do
+  local function isborder (t, n)
+    return (n == 0 or t[n] ~= nil) and t[n + 1] == nil
+  end
+  local t = {}
+  for i = 1, 100 do t[#t + 1] = i; assert(#t == i) end
+  for i = 100, 1, -1 do assert(#t == i); t[#t] = nil end
+  assert(#t == 0)
+  t = {1, 2, 3, nil, 5, nil}
+  assert(isborder(t, #t))
+  t[4] = 4; assert(isborder(t, #t))
+  t[6] = 6; t[7] = 7; assert(#t == 7)
+  t[3] = nil; assert(isborder(t, #t))
+  t[7] = nil; assert(isborder(t, #t))
+  -- borders in the hash part
+  t = {x = 1}
+  for i = 1, 10 do t[i] = i end
+  t[12] = 12; t[13] = 13
+  assert(isborder(t, #t))
+  t[11] = 11; assert(#t == 13)
+  t[13] = nil; t[12] = nil; assert(#t == 11)
+  t[5] = nil; assert(isborder(t, #t))
+  collectgarbage()   -- may shrink the table
+  assert(isborder(t, #t))
+  -- raw and API stores
+  t = {}
+  for i = 1, 20 do rawset(t, #t + 1, i); table.insert(t, -i) end
+  assert(#t == 40 and t[39] == 20 and t[40] == -20)
+  for i = 1, 40 do table.remove(t) end
+  assert(#t == 0 and next(t) == nil)
+  -- appends with table constructors and 'setlist'
+  t = {1, 2, 3, table.unpack({4, 5, 6})}
+  assert(#t == 6)
+  t[#t + 1] = 7; assert(#t == 7)
+
+  local N = 1000000
+  local t0 = os.clock()
+  t = {}
+  for i = 1, N do t[#t + 1] = i end
+  local tapp = os.clock() - t0
+  t0 = os.clock()
+  local u = {}
+  for i = 1, N do table.insert(u, i) end
+  local tins = os.clock() - t0
+  t0 = os.clock()
+  for i = 1, N do t[#t] = nil end
+  local tpop = os.clock() - t0
+  assert(#t == 0 and #u == N)
+  print(string.format("%d appends with 't[#t + 1]' in %.2f msec., with " ..
+                      "'table.insert' in %.2f msec.; %d removals in %.2f msec.",
+                      N, tapp * 1000, tins * 1000, N, tpop * 1000))
+end
+
+
+-- homogeneous array parts: arrays of numbers or booleans keep the type
+-- of their values, which the collector skips (with LUA_USE_HOMOARRAYS)
+do
+  local atype = T and T.arraytype
+  local N = 1000
+  local t = {}
+  for i = 1, N do t[#t + 1] = i * 0.5 end
+  assert(not atype or atype(t) == "float")
+  local s = 0
+  for i = 1, N do s = s + t[i] end
+  assert(s == N * (N + 1) / 4)
+  for i = 1, N do t[i] = t[i] * 2 end
+  assert(t[N] == N and math.type(t[N]) == "float" and #t == N)
+  t[N] = nil; assert(#t == N - 1 and t[N] == nil)
+  t[N] = 1.0; assert(#t == N)
+  assert(not atype or atype(t) == "float")
+  t[3] = 7   -- an integer turns it into a regular array
+  assert(not atype or atype(t) == nil)
+  assert(math.type(t[3]) == "integer" and t[3] == 7 and t[4] == 4.0)
+  local n = 0
+  for k, v in pairs(t) do n = n + 1; assert(t[k] == v) end
+  assert(n == N)
+
+  local b = {}
+  for i = 1, 200 do b[i] = (i % 2 == 0) end
+  assert(not atype or atype(b) == "boolean")
+  for i = 1, 200 do assert(b[i] == (i % 2 == 0)) end
+  b[5] = "x"; assert(b[5] == "x" and b[6] == true and #b == 200)
+
+  local u = {}
+  for i = 1, 300 do u[i] = i end
+  assert(not atype or atype(u) == "integer")
+  rawset(u, 1, 10); assert(u[1] == 10)
+  assert(not atype or atype(u) == "integer")   -- stored in place
+  local x, y = u[1], u[2]; assert(x == 10 and y == 2 and u[2] < u[1] - 5)
+  u[10] = nil   -- a hole
+  assert(u[10] == nil and u[11] == 11 and u[300] == 300)
+  u[10] = 10
+  table.insert(u, 1, 0); assert(u[1] == 0 and u[2] == 10 and #u == 301)
+  table.sort(u, function (a, b) return a > b end)
+  assert(u[1] == 300 and u[301] == 0)
+  u[#u + 2] = 5; assert(u[#u] ~= nil)
+  for i = 1, 20 do table.remove(u) end
+  assert(u[#u] ~= nil and u[#u + 1] == nil)
+
+  -- floats with integer values are still floats (and keys are still keys)
+  u = {}
+  for i = 1, 100 do u[i] = i end
+  u[2.0] = 20; u[100.0] = -1.5
+  assert(u[2] == 20 and u[100] == -1.5 and math.type(u[100]) == "float")
+  u = setmetatable({}, {__mode = "v"})
+  for i = 1, 100 do u[i] = -i end
+  collectgarbage()
+  for i = 1, 100 do assert(u[i] == -i) end
+  u = setmetatable({}, {__newindex = function () error"no" end})
+  for i = 1, 100 do rawset(u, i, 1.5) end
+  for i = 1, 100 do u[i] = nil end   -- existing keys: no '__newindex'
+  assert(next(u) == nil)
+  if T then T.checkmemory() end
+
+  N = 2000000
+  local function fill ()
+    local a = {}
+    for i = 1, N do a[i] = i + 0.5 end
+    return a
+  end
+  collectgarbage(); collectgarbage("stop")
+  local m0 = collectgarbage("count")
+  local a = fill()
+  local m = collectgarbage("count") - m0
+  collectgarbage("restart")
+  local t0 = os.clock()
+  for i = 1, 10 do collectgarbage() end
+  local tgc = os.clock() - t0
+  t0 = os.clock()
+  s = 0
+  for i = 1, N do s = s + a[i] end
+  assert(s == N * (N + 1.0) / 2 + N / 2)
+  print(string.format("array of %d floats with %.1f MB; 10 full " ..
+                      "collections in %.2f msec., sum in %.2f msec.",
+                      N, m / 1024, tgc * 1000, (os.clock() - t0) * 1000))
+end
+
 print"OK"